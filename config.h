@@ -0,0 +1,6 @@
+#define IOV_MAX UIO_MAXIOV
+#define HAVE_REALLOCARRAY 1
+#define SPT_TYPE SPT_REUSEARGV
+#define HAVE_STRSEP 1
+#define HAVE_VA_COPY 1
+#include "compat.h"
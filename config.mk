@@ -0,0 +1,8 @@
+SRCS += ${COMPATDIR}/asprintf.c
+SRCS += ${COMPATDIR}/imsg-buffer.c
+SRCS += ${COMPATDIR}/imsg.c
+SRCS += ${COMPATDIR}/pledge.c
+SRCS += ${COMPATDIR}/setproctitle.c
+SRCS += ${COMPATDIR}/strlcat.c
+SRCS += ${COMPATDIR}/strlcpy.c
+SRCS += ${COMPATDIR}/strtonum.c
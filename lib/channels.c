@@ -0,0 +1,156 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+
+#include "channels.h"
+
+/* Set note n of cs on with velocity, or off if on is not set. */
+void
+_mdl_channel_set_note(struct channel_state *cs, int n, int on, int velocity)
+{
+	if (on) {
+		cs->notes_on[ NOTE_WORD(n) ] |= NOTE_BIT(n);
+		cs->velocities[n] = velocity;
+	} else {
+		cs->notes_on[ NOTE_WORD(n) ] &= ~NOTE_BIT(n);
+		cs->velocities[n] = 0;
+	}
+}
+
+int
+_mdl_channel_note_is_on(const struct channel_state *cs, int n)
+{
+	return (cs->notes_on[ NOTE_WORD(n) ] & NOTE_BIT(n)) != 0;
+}
+
+/*
+ * Apply an instrument change, a note or a volume change to channels, which
+ * has a state for each midi channel.
+ */
+void
+_mdl_channels_apply(struct channel_state *channels,
+    const struct midievent *midiev)
+{
+	switch (midiev->evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+		channels[ midiev->u.instr_change.channel ].instrument =
+		    midiev->u.instr_change.code;
+		break;
+	case MIDIEV_NOTEOFF:
+	case MIDIEV_NOTEON:
+		_mdl_channel_set_note(
+		    &channels[ midiev->u.midinote.channel ],
+		    midiev->u.midinote.note,
+		    (midiev->evtype == MIDIEV_NOTEON),
+		    midiev->u.midinote.velocity);
+		break;
+	case MIDIEV_VOLUMECHANGE:
+		channels[ midiev->u.volumechange.channel ].volume =
+		    midiev->u.volumechange.volume;
+		break;
+	default:
+		assert(0);
+	}
+}
+
+/* Set channels to the state they have at the start of a song. */
+void
+_mdl_channels_clear(struct channel_state *channels)
+{
+	memset(channels, 0, MIDI_CHANNEL_COUNT * sizeof(struct channel_state));
+}
+
+/*
+ * Write the midi events that take channels from old_cs to new_cs to
+ * events, which must have room for CHANNELS_DIFF_EVENTS_MAX events, and
+ * return their number.  A note that plays in both is retriggered if its
+ * velocity or instrument changes.
+ */
+size_t
+_mdl_channels_diff(const struct channel_state *old_cs,
+    const struct channel_state *new_cs, struct midievent *events)
+{
+	u_int32_t bit, bits, held, off, on;
+	struct midievent *me;
+	size_t count;
+	int instr_changed, retrigger, c, n, w;
+
+	count = 0;
+
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+		instr_changed =
+		    (old_cs[c].instrument != new_cs[c].instrument);
+
+		if (instr_changed) {
+			me = &events[count++];
+			me->evtype = MIDIEV_INSTRUMENT_CHANGE;
+			me->u.instr_change.channel = c;
+			me->u.instr_change.code = new_cs[c].instrument;
+		}
+
+		if (old_cs[c].volume != new_cs[c].volume) {
+			me = &events[count++];
+			me->evtype = MIDIEV_VOLUMECHANGE;
+			me->u.volumechange.channel = c;
+			me->u.volumechange.volume = new_cs[c].volume;
+		}
+
+		for (w = 0; w < NOTE_WORDS; w++) {
+			off = old_cs[c].notes_on[w] & ~new_cs[c].notes_on[w];
+			on = new_cs[c].notes_on[w] & ~old_cs[c].notes_on[w];
+			held = old_cs[c].notes_on[w] & new_cs[c].notes_on[w];
+
+			/* Go through the notes that are on in either. */
+			for (bits = off | on | held; bits != 0;
+			    bits &= bits - 1) {
+				n = w * NOTE_WORD_BITS + ffs((int) bits) - 1;
+				bit = NOTE_BIT(n);
+
+				retrigger = (held & bit) && (instr_changed ||
+				    old_cs[c].velocities[n] !=
+				    new_cs[c].velocities[n]);
+
+				if ((off & bit) || retrigger) {
+					me = &events[count++];
+					me->evtype = MIDIEV_NOTEOFF;
+					me->u.midinote.channel = c;
+					me->u.midinote.joining = 0;
+					me->u.midinote.note = n;
+					me->u.midinote.velocity = 0;
+				}
+
+				if ((on & bit) || retrigger) {
+					me = &events[count++];
+					me->evtype = MIDIEV_NOTEON;
+					me->u.midinote.channel = c;
+					me->u.midinote.joining = 0;
+					me->u.midinote.note = n;
+					me->u.midinote.velocity =
+					    new_cs[c].velocities[n];
+				}
+			}
+		}
+	}
+
+	assert(count <= CHANNELS_DIFF_EVENTS_MAX);
+
+	return count;
+}
@@ -0,0 +1,57 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_CHANNELS_H
+#define MDL_CHANNELS_H
+
+#include "midi.h"
+
+/* Notes of a channel are kept in a bitmap of NOTE_WORDS words. */
+#define NOTE_WORD_BITS		32
+#define NOTE_WORDS		(MIDI_NOTE_COUNT / NOTE_WORD_BITS)
+#define NOTE_WORD(n)		((n) / NOTE_WORD_BITS)
+#define NOTE_BIT(n)		((u_int32_t) 1 << ((n) % NOTE_WORD_BITS))
+
+/* Channel and note changes, and a retrigger for each note at most. */
+#define CHANNELS_DIFF_EVENTS_MAX \
+	(MIDI_CHANNEL_COUNT * (2 + 2 * MIDI_NOTE_COUNT))
+
+/*
+ * Midi state of a channel.  Notes that are on are set in notes_on, so that
+ * channel states can be compared a word at a time, and only the notes that
+ * are on need to be looked at.  The sequencer and the playback engine both
+ * switch songs by going from one state of all channels to another with
+ * _mdl_channels_diff().
+ */
+struct channel_state {
+	u_int32_t		notes_on[NOTE_WORDS];
+	u_int8_t		velocities[MIDI_NOTE_COUNT];
+	u_int8_t		instrument;
+	u_int8_t		volume;
+};
+
+__BEGIN_DECLS
+void	_mdl_channel_set_note(struct channel_state *, int, int, int);
+int	_mdl_channel_note_is_on(const struct channel_state *, int);
+void	_mdl_channels_apply(struct channel_state *, const struct midievent *);
+void	_mdl_channels_clear(struct channel_state *);
+size_t	_mdl_channels_diff(const struct channel_state *,
+    const struct channel_state *, struct midievent *);
+__END_DECLS
+
+#endif /* !MDL_CHANNELS_H */
@@ -0,0 +1,194 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compile.h"
+#include "midistream.h"
+#include "musicexpr.h"
+#include "parse.h"
+#include "score.h"
+#include "util.h"
+
+static int	compile_stream(struct mdl_ctx *, FILE *,
+    struct mdl_compiled *);
+
+/*
+ * Compile music from a memory buffer without forking an interpreter.
+ * Returns 0 on success, and 1 on failure, in which case diagnostics may
+ * tell what went wrong with the music.
+ */
+int
+_mdl_compile_buffer(struct mdl_ctx *ctx, const char *buf, size_t size,
+    struct mdl_compiled *result)
+{
+	FILE *input;
+	int ret;
+
+	if ((input = fmemopen((void *)buf, size, "r")) == NULL) {
+		warn("fmemopen in _mdl_compile_buffer");
+		return 1;
+	}
+
+	ret = compile_stream(ctx, input, result);
+
+	if (fclose(input) == EOF)
+		warn("error closing music buffer");
+
+	return ret;
+}
+
+/* Like _mdl_compile_buffer(), but read music from fd.  fd is not closed. */
+int
+_mdl_compile_fd(struct mdl_ctx *ctx, int fd, struct mdl_compiled *result)
+{
+	FILE *input;
+	int input_fd, ret;
+
+	if ((input_fd = dup(fd)) == -1) {
+		warn("dup in _mdl_compile_fd");
+		return 1;
+	}
+
+	if ((input = fdopen(input_fd, "r")) == NULL) {
+		warn("fdopen in _mdl_compile_fd");
+		if (close(input_fd) == -1)
+			warn("error closing music file");
+		return 1;
+	}
+
+	ret = compile_stream(ctx, input, result);
+
+	if (fclose(input) == EOF)
+		warn("error closing music file");
+
+	return ret;
+}
+
+void
+_mdl_compiled_free(struct mdl_compiled *result)
+{
+	if (result->score != NULL) {
+		_mdl_score_close(result->score);
+	} else {
+		free(result->events);
+	}
+	free(result->diagnostics);
+
+	result->events = NULL;
+	result->eventcount = 0;
+	result->diagnostics = NULL;
+	result->score = NULL;
+}
+
+static int
+compile_stream(struct mdl_ctx *ctx, FILE *input, struct mdl_compiled *result)
+{
+	struct mdl_ctx *old_ctx;
+	struct mdl_stream *midi_es;
+	struct musicexpr *parsed_expr;
+	struct timed_midievent *events;
+	int ret;
+
+	result->events = NULL;
+	result->eventcount = 0;
+	result->song_length = 0.0;
+	result->diagnostics = NULL;
+	result->score = NULL;
+	result->start_position = 0.0;
+
+	if (ctx == NULL) {
+		warnx("no library context for compiling");
+		return 1;
+	}
+
+	/* Another compile would free the musicexprs of this one. */
+	if ((ret = pthread_mutex_trylock(&ctx->compile_mtx)) != 0) {
+		if (ret == EBUSY)
+			warnx("library context is already compiling");
+		else
+			warnx("pthread_mutex_trylock: %s", strerror(ret));
+		return 1;
+	}
+
+	old_ctx = _mdl_ctx_get();
+	if (_mdl_ctx_set(ctx) != 0) {
+		(void) pthread_mutex_unlock(&ctx->compile_mtx);
+		return 1;
+	}
+
+	assert(ctx->diagnostics == NULL);
+	ctx->collect_diagnostics = 1;
+
+	midi_es = NULL;
+	ret = 1;
+
+	if ((parsed_expr = _mdl_parse(ctx, input)) == NULL)
+		goto finish;
+
+	midi_es = _mdl_musicexpr_to_midievents(ctx, parsed_expr, 0);
+	_mdl_musicexpr_free(parsed_expr, 0);
+	if (midi_es == NULL) {
+		_mdl_warnx("could not compile music to midi events");
+		goto finish;
+	}
+
+	assert(midi_es->count > 0);
+	assert(midi_es->u.timed_midievents[ midi_es->count - 1 ].midiev.evtype
+	    == MIDIEV_SONG_END);
+
+	/* Hand the event array over to the caller, with no unused slots. */
+	events = reallocarray(midi_es->u.timed_midievents, midi_es->count,
+	    sizeof(struct timed_midievent));
+	if (events == NULL) {
+		warn("reallocarray in compile_stream");
+		goto finish;
+	}
+	midi_es->u.timed_midievents = NULL;
+
+	result->events = events;
+	result->eventcount = midi_es->count;
+	result->song_length =
+	    events[ result->eventcount - 1 ].time_as_measures;
+
+	ret = 0;
+
+finish:
+	if (midi_es != NULL)
+		_mdl_stream_free(midi_es);
+
+	/* Musicexprs only live within one compile. */
+	_mdl_musicexpr_arena_reset(ctx);
+
+	ctx->collect_diagnostics = 0;
+	result->diagnostics = ctx->diagnostics;
+	ctx->diagnostics = NULL;
+	ctx->diagnostics_length = 0;
+
+	(void) _mdl_ctx_set(old_ctx);
+	(void) pthread_mutex_unlock(&ctx->compile_mtx);
+
+	return ret;
+}
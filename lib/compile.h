@@ -0,0 +1,51 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_COMPILE_H
+#define MDL_COMPILE_H
+
+#include "context.h"
+#include "midi.h"
+
+struct mdl_score;
+
+/*
+ * Result of compiling music in-process.  Events are sorted by time and
+ * end with a MIDIEV_SONG_END event at song_length.  All memory belongs to
+ * the caller, see _mdl_compiled_free().  If score is set, events are in
+ * a mapped score file (see score.h) and playback should start from
+ * start_position, otherwise start_position is zero.  A context compiles one
+ * song at a time, use a context for each thread that compiles.
+ */
+struct mdl_compiled {
+	struct timed_midievent *events;
+	size_t			eventcount;
+	float			song_length;
+	char		       *diagnostics;
+	struct mdl_score       *score;
+	float			start_position;
+};
+
+__BEGIN_DECLS
+int	_mdl_compile_buffer(struct mdl_ctx *, const char *, size_t,
+    struct mdl_compiled *);
+int	_mdl_compile_fd(struct mdl_ctx *, int, struct mdl_compiled *);
+void	_mdl_compiled_free(struct mdl_compiled *);
+__END_DECLS
+
+#endif /* !MDL_COMPILE_H */
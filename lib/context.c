@@ -0,0 +1,263 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "context.h"
+#include "musicexpr.h"
+
+static pthread_once_t	ctx_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	ctx_key;
+static int		ctx_key_error = 0;
+
+static void	ctx_key_create(void);
+
+static void
+ctx_key_create(void)
+{
+	int ret;
+
+	if ((ret = pthread_key_create(&ctx_key, NULL)) != 0) {
+		warnx("pthread_key_create: %s", strerror(ret));
+		ctx_key_error = 1;
+	}
+}
+
+struct mdl_ctx *
+_mdl_ctx_new(const char *process_type)
+{
+	struct mdl_ctx *ctx;
+	int i, ret;
+
+	if ((ctx = malloc(sizeof(struct mdl_ctx))) == NULL) {
+		warn("malloc in _mdl_ctx_new");
+		return NULL;
+	}
+
+	ctx->process_type = process_type;
+	ctx->compile_threads = 1;
+	ctx->parent = NULL;
+
+	ctx->logstate.opts = 0;
+	for (i = 0; i < INDENTLEVELS; i++)
+		ctx->logstate.messages[i].msg = NULL;
+
+	ctx->logfile = NULL;
+	ctx->logbuf = NULL;
+	ctx->logbuf_size = 0;
+
+	ctx->collect_diagnostics = 0;
+	ctx->diagnostics = NULL;
+	ctx->diagnostics_length = 0;
+
+	ctx->mididev.mididev_type = MIDIDEV_NONE;
+	ctx->mididev.write_to_device = NULL;
+	ctx->mididev.close_device = NULL;
+
+	ctx->musicexpr_slabs = NULL;
+	ctx->musicexpr_freelist = NULL;
+	ctx->musicexpr_id_counter = 0;
+	ctx->musicexpr_id_step = 1;
+
+	if ((ret = pthread_mutex_init(&ctx->log_mtx, NULL)) != 0) {
+		warnx("pthread_mutex_init: %s", strerror(ret));
+		free(ctx);
+		return NULL;
+	}
+
+	if ((ret = pthread_mutex_init(&ctx->compile_mtx, NULL)) != 0) {
+		warnx("pthread_mutex_init: %s", strerror(ret));
+		(void) pthread_mutex_destroy(&ctx->log_mtx);
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/*
+ * Make a new context with the settings of ctx, for threads that should
+ * log as a different process type.
+ */
+struct mdl_ctx *
+_mdl_ctx_clone(const struct mdl_ctx *ctx, const char *process_type)
+{
+	struct mdl_ctx *new_ctx;
+
+	if ((new_ctx = _mdl_ctx_new(process_type)) == NULL)
+		return NULL;
+
+	new_ctx->compile_threads = ctx->compile_threads;
+	new_ctx->logstate.opts = ctx->logstate.opts;
+
+	return new_ctx;
+}
+
+void
+_mdl_ctx_free(struct mdl_ctx *ctx)
+{
+	int ret;
+
+	assert(ctx->mididev.mididev_type == MIDIDEV_NONE);
+
+	_mdl_logging_clear(ctx);
+
+	if (ctx->logfile != NULL && fclose(ctx->logfile) == EOF)
+		warn("fclose in _mdl_ctx_free");
+	free(ctx->logbuf);
+
+	if ((ret = pthread_mutex_destroy(&ctx->log_mtx)) != 0)
+		warnx("pthread_mutex_destroy: %s", strerror(ret));
+	if ((ret = pthread_mutex_destroy(&ctx->compile_mtx)) != 0)
+		warnx("pthread_mutex_destroy: %s", strerror(ret));
+
+	free(ctx->diagnostics);
+	_mdl_musicexpr_arena_reset(ctx);
+
+	if (_mdl_ctx_get() == ctx)
+		(void) _mdl_ctx_set(NULL);
+
+	free(ctx);
+}
+
+struct mdl_ctx *
+_mdl_ctx_get(void)
+{
+	if (pthread_once(&ctx_key_once, ctx_key_create) != 0 ||
+	    ctx_key_error)
+		return NULL;
+
+	return pthread_getspecific(ctx_key);
+}
+
+/*
+ * Make a context for compiling a branch of a song in a compile thread.  It
+ * logs to a buffer, collects diagnostics and allocates musicexprs of its
+ * own, so that compile threads do not wait for each other on parent locks.
+ * Branches take turns in musicexpr ids, so those stay unique.
+ */
+struct mdl_ctx *
+_mdl_ctx_new_branch(struct mdl_ctx *parent, size_t branch,
+    size_t branchcount)
+{
+	struct mdl_ctx *ctx;
+
+	if ((ctx = _mdl_ctx_clone(parent, parent->process_type)) == NULL)
+		return NULL;
+
+	ctx->parent = parent;
+	ctx->collect_diagnostics = parent->collect_diagnostics;
+	ctx->musicexpr_id_counter = parent->musicexpr_id_counter +
+	    branch * parent->musicexpr_id_step;
+	ctx->musicexpr_id_step = branchcount * parent->musicexpr_id_step;
+
+	if (ctx->logstate.opts != 0) {
+		ctx->logfile = open_memstream(&ctx->logbuf,
+		    &ctx->logbuf_size);
+		if (ctx->logfile == NULL) {
+			warn("open_memstream in _mdl_ctx_new_branch");
+			_mdl_ctx_free(ctx);
+			return NULL;
+		}
+	}
+
+	return ctx;
+}
+
+/*
+ * Write out the log of a branch context made with _mdl_ctx_new_branch(),
+ * hand its diagnostics and musicexprs over to parent and free it.  Branches
+ * should be joined in order, so that logs do not depend on thread
+ * scheduling.
+ */
+int
+_mdl_ctx_join_branch(struct mdl_ctx *parent, struct mdl_ctx *ctx)
+{
+	char *new_diagnostics;
+	FILE *out;
+	int ret;
+
+	assert(ctx->parent == parent);
+
+	ret = 0;
+
+	if (ctx->logfile != NULL) {
+		if (fclose(ctx->logfile) == EOF) {
+			warn("fclose in _mdl_ctx_join_branch");
+			ret = 1;
+		}
+		ctx->logfile = NULL;
+
+		out = (parent->logfile != NULL) ? parent->logfile : stdout;
+		pthread_mutex_lock(&parent->log_mtx);
+		if (ctx->logbuf_size > 0 &&
+		    fwrite(ctx->logbuf, ctx->logbuf_size, 1, out) != 1) {
+			warnx("fwrite error in _mdl_ctx_join_branch");
+			ret = 1;
+		}
+		pthread_mutex_unlock(&parent->log_mtx);
+	}
+
+	if (ctx->diagnostics_length > 0) {
+		pthread_mutex_lock(&parent->log_mtx);
+		new_diagnostics = realloc(parent->diagnostics,
+		    parent->diagnostics_length + ctx->diagnostics_length + 1);
+		if (new_diagnostics == NULL) {
+			warn("realloc in _mdl_ctx_join_branch");
+			ret = 1;
+		} else {
+			memcpy(new_diagnostics + parent->diagnostics_length,
+			    ctx->diagnostics, ctx->diagnostics_length + 1);
+			parent->diagnostics_length += ctx->diagnostics_length;
+			parent->diagnostics = new_diagnostics;
+		}
+		pthread_mutex_unlock(&parent->log_mtx);
+	}
+
+	_mdl_musicexpr_arena_join(parent, ctx);
+
+	_mdl_ctx_free(ctx);
+
+	return ret;
+}
+
+int
+_mdl_ctx_set(struct mdl_ctx *ctx)
+{
+	int ret;
+
+	if ((ret = pthread_once(&ctx_key_once, ctx_key_create)) != 0) {
+		warnx("pthread_once: %s", strerror(ret));
+		return 1;
+	}
+
+	if (ctx_key_error)
+		return 1;
+
+	if ((ret = pthread_setspecific(ctx_key, ctx)) != 0) {
+		warnx("pthread_setspecific: %s", strerror(ret));
+		return 1;
+	}
+
+	return 0;
+}
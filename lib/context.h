@@ -0,0 +1,82 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_CONTEXT_H
+#define MDL_CONTEXT_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "midi.h"
+#include "textloc.h"
+#include "util.h"
+
+struct musicexpr;
+struct musicexpr_slab;
+
+/*
+ * Library state that used to be global.  Each thread calling into libmdl
+ * works for one context, which entry points taking a context set with
+ * _mdl_ctx_set(), so that several contexts can be used in one process.
+ */
+struct mdl_ctx {
+	const char		*process_type;
+	int			 compile_threads;
+
+	/* Set for branch contexts of compile threads. */
+	struct mdl_ctx		*parent;
+
+	struct logstate		 logstate;
+	pthread_mutex_t		 log_mtx;
+
+	/* Log output goes here if set, otherwise to stdout. */
+	FILE			*logfile;
+	char			*logbuf;
+	size_t			 logbuf_size;
+
+	/* If set, _mdl_warnx() collects diagnostics here instead. */
+	int			 collect_diagnostics;
+	char			*diagnostics;
+	size_t			 diagnostics_length;
+
+	struct mididevice	 mididev;
+
+	/*
+	 * Held by _mdl_compile_*() for a whole compile, because compiles
+	 * free all musicexprs of the context when they finish.
+	 */
+	pthread_mutex_t		 compile_mtx;
+
+	/* Musicexpr slabs and ids, see musicexpr.c. */
+	struct musicexpr_slab	*musicexpr_slabs;
+	struct musicexpr	*musicexpr_freelist;
+	int			 musicexpr_id_counter;
+	int			 musicexpr_id_step;
+};
+
+__BEGIN_DECLS
+struct mdl_ctx *_mdl_ctx_new(const char *);
+struct mdl_ctx *_mdl_ctx_clone(const struct mdl_ctx *, const char *);
+void		_mdl_ctx_free(struct mdl_ctx *);
+struct mdl_ctx *_mdl_ctx_get(void);
+int		_mdl_ctx_join_branch(struct mdl_ctx *, struct mdl_ctx *);
+struct mdl_ctx *_mdl_ctx_new_branch(struct mdl_ctx *, size_t, size_t);
+int		_mdl_ctx_set(struct mdl_ctx *);
+__END_DECLS
+
+#endif /* !MDL_CONTEXT_H */
@@ -0,0 +1,386 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+
+static void	engine_queue_midievent(struct mdl_engine *,
+    const struct midievent *, double);
+static int	engine_reserve_pending(struct mdl_engine *);
+static void	engine_sync_channels(struct mdl_engine *, double);
+static void	engine_start(struct mdl_engine *,
+    const struct timed_midievent *, size_t,
+    const struct mdl_engine_checkpoint *, float, double);
+static double	engine_time_for_event(const struct mdl_engine *,
+    const struct timed_midievent *);
+
+struct mdl_engine *
+_mdl_engine_new(void)
+{
+	struct mdl_engine *engine;
+
+	if ((engine = malloc(sizeof(struct mdl_engine))) == NULL) {
+		warn("malloc in _mdl_engine_new");
+		return NULL;
+	}
+
+	engine->events = NULL;
+	engine->eventcount = 0;
+	engine->current_event = 0;
+	engine->playing = 0;
+
+	engine->tempo = 120;
+	engine->latest_tempo_change_as_measures = 0.0;
+	engine->latest_tempo_change_as_time = 0.0;
+
+	_mdl_channels_clear(engine->channels);
+
+	engine->pending_count = 0;
+	engine->pending_next = 0;
+
+	return engine;
+}
+
+void
+_mdl_engine_free(struct mdl_engine *engine)
+{
+	free(engine);
+}
+
+/*
+ * Start playing events at now.  This works like song switches in the
+ * sequencer: the midi state of the new song at the starting position is
+ * found by going through earlier events, and notes, instruments and
+ * volumes are changed to match it.  The song starts from the beginning,
+ * or from the current position of the previous song if keep_position is
+ * set.  Events must stay valid while they are played.  Returns 1 if the
+ * events that previous calls produced have not been pulled.
+ */
+int
+_mdl_engine_start_song(struct mdl_engine *engine,
+    const struct timed_midievent *events, size_t eventcount,
+    int keep_position, double now)
+{
+	float position;
+
+	assert(eventcount > 0);
+	assert(events[ eventcount - 1 ].midiev.evtype == MIDIEV_SONG_END);
+
+	if (engine_reserve_pending(engine) != 0)
+		return 1;
+
+	position = keep_position ? _mdl_engine_position(engine, now) : 0.0;
+
+	engine_start(engine, events, eventcount, NULL, position, now);
+
+	return 0;
+}
+
+/*
+ * Like _mdl_engine_start_song(), but start from position (in measures).
+ * If checkpoint is not NULL, the midi state at position is found starting
+ * from the checkpoint instead of from the beginning of the song, so it
+ * should be the latest known checkpoint at or before position.
+ */
+int
+_mdl_engine_start_song_at(struct mdl_engine *engine,
+    const struct timed_midievent *events, size_t eventcount,
+    const struct mdl_engine_checkpoint *checkpoint, float position,
+    double now)
+{
+	assert(eventcount > 0);
+	assert(events[ eventcount - 1 ].midiev.evtype == MIDIEV_SONG_END);
+	assert(checkpoint == NULL || checkpoint->event < eventcount);
+
+	if (engine_reserve_pending(engine) != 0)
+		return 1;
+
+	if (position < 0.0)
+		position = 0.0;
+
+	engine_start(engine, events, eventcount, checkpoint, position, now);
+
+	return 0;
+}
+
+/*
+ * Stop playback at now, turning off all notes that are playing.  Returns
+ * 1 if the events that previous calls produced have not been pulled.
+ */
+int
+_mdl_engine_stop(struct mdl_engine *engine, double now)
+{
+	struct channel_state *cs;
+	int c;
+
+	if (engine_reserve_pending(engine) != 0)
+		return 1;
+
+	memcpy(engine->shadow_channels, engine->channels,
+	    sizeof(engine->shadow_channels));
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+		cs = &engine->shadow_channels[c];
+		memset(cs->notes_on, 0, sizeof(cs->notes_on));
+		memset(cs->velocities, 0, sizeof(cs->velocities));
+	}
+
+	engine_sync_channels(engine, now);
+
+	engine->playing = 0;
+
+	return 0;
+}
+
+/*
+ * Put at most maxcount events that are due at or before until to events,
+ * and return their count.  If maxcount events were returned, there may be
+ * more events due.  Tempo changes are handled by the engine and markers
+ * are skipped, so only events that should be sent to a midi device are
+ * returned.
+ */
+size_t
+_mdl_engine_pull(struct mdl_engine *engine, double until,
+    struct mdl_engine_event *events, size_t maxcount)
+{
+	const struct timed_midievent *tmidiev;
+	const struct midievent *midiev;
+	double eventtime;
+	size_t count;
+
+	count = 0;
+
+	while (count < maxcount &&
+	    engine->pending_next < engine->pending_count)
+		events[count++] = engine->pending[ engine->pending_next++ ];
+
+	while (engine->playing && count < maxcount) {
+		assert(engine->current_event < engine->eventcount);
+
+		tmidiev = &engine->events[ engine->current_event ];
+		midiev = &tmidiev->midiev;
+
+		eventtime = engine_time_for_event(engine, tmidiev);
+		if (eventtime > until)
+			break;
+
+		engine->current_event++;
+
+		switch (midiev->evtype) {
+		case MIDIEV_SONG_END:
+			engine->playing = 0;
+			continue;
+		case MIDIEV_TEMPOCHANGE:
+			engine->latest_tempo_change_as_measures =
+			    tmidiev->time_as_measures;
+			engine->latest_tempo_change_as_time = eventtime;
+			engine->tempo = midiev->u.bpm;
+			continue;
+		case MIDIEV_MARKER:
+			continue;
+		case MIDIEV_NOTEOFF:
+		case MIDIEV_NOTEON:
+		case MIDIEV_INSTRUMENT_CHANGE:
+		case MIDIEV_VOLUMECHANGE:
+			break;
+		default:
+			assert(0);
+		}
+
+		_mdl_channels_apply(engine->channels, midiev);
+		events[count].midiev = *midiev;
+		events[count].time = eventtime;
+		count++;
+	}
+
+	return count;
+}
+
+/* Return the song position in measures at now. */
+float
+_mdl_engine_position(const struct mdl_engine *engine, double now)
+{
+	double position, song_length;
+
+	if (engine->events == NULL)
+		return 0.0;
+
+	position = engine->latest_tempo_change_as_measures +
+	    (now - engine->latest_tempo_change_as_time) * engine->tempo
+	    / (60.0 * 4);
+
+	song_length =
+	    engine->events[ engine->eventcount - 1 ].time_as_measures;
+
+	if (position < engine->latest_tempo_change_as_measures)
+		position = engine->latest_tempo_change_as_measures;
+	if (position > song_length)
+		position = song_length;
+
+	return position;
+}
+
+/*
+ * Tell the time of the next event that can be pulled.  Returns 0 if there
+ * is no such event.
+ */
+int
+_mdl_engine_next_time(const struct mdl_engine *engine, double *time)
+{
+	if (engine->pending_next < engine->pending_count) {
+		*time = engine->pending[ engine->pending_next ].time;
+		return 1;
+	}
+
+	if (!engine->playing)
+		return 0;
+
+	*time = engine_time_for_event(engine,
+	    &engine->events[ engine->current_event ]);
+
+	return 1;
+}
+
+static void
+engine_queue_midievent(struct mdl_engine *engine,
+    const struct midievent *midiev, double now)
+{
+	struct mdl_engine_event *event;
+
+	assert(engine->pending_count < 2 * ENGINE_SYNC_EVENTS_MAX);
+
+	_mdl_channels_apply(engine->channels, midiev);
+
+	event = &engine->pending[ engine->pending_count++ ];
+	event->midiev = *midiev;
+	event->time = now;
+}
+
+/* Make room for the events of one song switch or stop. */
+static int
+engine_reserve_pending(struct mdl_engine *engine)
+{
+	size_t left;
+
+	left = engine->pending_count - engine->pending_next;
+
+	if (engine->pending_next > 0) {
+		memmove(engine->pending,
+		    &engine->pending[ engine->pending_next ],
+		    left * sizeof(struct mdl_engine_event));
+		engine->pending_count = left;
+		engine->pending_next = 0;
+	}
+
+	if (left > ENGINE_SYNC_EVENTS_MAX)
+		return 1;
+
+	return 0;
+}
+
+static void
+engine_start(struct mdl_engine *engine, const struct timed_midievent *events,
+    size_t eventcount, const struct mdl_engine_checkpoint *checkpoint,
+    float position, double now)
+{
+	const struct midievent *midiev;
+	float tempo;
+	size_t i;
+
+	/*
+	 * Do a "shadow playback" of the new song up to position to find
+	 * what the midi state should be.
+	 */
+	if (checkpoint != NULL) {
+		memcpy(engine->shadow_channels, checkpoint->channels,
+		    sizeof(engine->shadow_channels));
+		tempo = checkpoint->tempo;
+		i = checkpoint->event;
+	} else {
+		_mdl_channels_clear(engine->shadow_channels);
+		tempo = 120;
+		i = 0;
+	}
+
+	for (; i < eventcount; i++) {
+		midiev = &events[i].midiev;
+
+		if (midiev->evtype == MIDIEV_SONG_END) {
+			/* Do not go past the end of a shorter song. */
+			if (position > events[i].time_as_measures)
+				position = events[i].time_as_measures;
+			break;
+		}
+		if (events[i].time_as_measures >= position)
+			break;
+
+		switch (midiev->evtype) {
+		case MIDIEV_INSTRUMENT_CHANGE:
+		case MIDIEV_NOTEOFF:
+		case MIDIEV_NOTEON:
+		case MIDIEV_VOLUMECHANGE:
+			_mdl_channels_apply(engine->shadow_channels,
+			    midiev);
+			break;
+		case MIDIEV_MARKER:
+			break;
+		case MIDIEV_TEMPOCHANGE:
+			tempo = midiev->u.bpm;
+			break;
+		default:
+			assert(0);
+		}
+	}
+
+	engine_sync_channels(engine, now);
+
+	engine->events = events;
+	engine->eventcount = eventcount;
+	engine->current_event = i;
+	engine->playing = 1;
+
+	engine->tempo = tempo;
+	engine->latest_tempo_change_as_measures = position;
+	engine->latest_tempo_change_as_time = now;
+}
+
+static double
+engine_time_for_event(const struct mdl_engine *engine,
+    const struct timed_midievent *tmidiev)
+{
+	return engine->latest_tempo_change_as_time +
+	    (tmidiev->time_as_measures -
+	    engine->latest_tempo_change_as_measures) * (60.0 * 4)
+	    / engine->tempo;
+}
+
+/* Queue the midi events that take channels to shadow_channels at now. */
+static void
+engine_sync_channels(struct mdl_engine *engine, double now)
+{
+	size_t count, i;
+
+	count = _mdl_channels_diff(engine->channels, engine->shadow_channels,
+	    engine->sync_events);
+
+	for (i = 0; i < count; i++)
+		engine_queue_midievent(engine, &engine->sync_events[i], now);
+}
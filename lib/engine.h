@@ -0,0 +1,90 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_ENGINE_H
+#define MDL_ENGINE_H
+
+#include "channels.h"
+#include "midi.h"
+
+/*
+ * A playback engine driven by the clock of the caller.  The caller gives
+ * the engine a compiled song (see compile.h) and regularly pulls the midi
+ * events that are due up to some time with _mdl_engine_pull().  Times are
+ * in seconds on the caller clock.  Apart from _mdl_engine_new() and
+ * _mdl_engine_free(), engine functions do no system calls and allocate no
+ * memory, so those can be called from an audio thread.
+ */
+
+/* Song switches can cause a change for every note in every channel. */
+#define ENGINE_SYNC_EVENTS_MAX	CHANNELS_DIFF_EVENTS_MAX
+
+struct mdl_engine_event {
+	struct midievent	midiev;
+	double			time;
+};
+
+/*
+ * Midi state of a song just before some event, so that playback can be
+ * started there without going through the earlier events of the song.
+ * The events before it must be earlier than the event itself.
+ */
+struct mdl_engine_checkpoint {
+	size_t				event;
+	float				tempo;
+	struct channel_state		channels[MIDI_CHANNEL_COUNT];
+};
+
+struct mdl_engine {
+	const struct timed_midievent   *events;
+	size_t				eventcount;
+	size_t				current_event;
+	int				playing;
+
+	float				tempo;
+	float				latest_tempo_change_as_measures;
+	double				latest_tempo_change_as_time;
+
+	struct channel_state		channels[MIDI_CHANNEL_COUNT];
+	struct channel_state		shadow_channels[MIDI_CHANNEL_COUNT];
+	struct midievent		sync_events[ENGINE_SYNC_EVENTS_MAX];
+
+	/* Events caused by song switches and stops, not yet pulled. */
+	struct mdl_engine_event		pending[2 * ENGINE_SYNC_EVENTS_MAX];
+	size_t				pending_count;
+	size_t				pending_next;
+};
+
+__BEGIN_DECLS
+struct mdl_engine      *_mdl_engine_new(void);
+void			_mdl_engine_free(struct mdl_engine *);
+int			_mdl_engine_start_song(struct mdl_engine *,
+    const struct timed_midievent *, size_t, int, double);
+int			_mdl_engine_start_song_at(struct mdl_engine *,
+    const struct timed_midievent *, size_t,
+    const struct mdl_engine_checkpoint *, float, double);
+int			_mdl_engine_stop(struct mdl_engine *, double);
+size_t			_mdl_engine_pull(struct mdl_engine *, double,
+    struct mdl_engine_event *, size_t);
+float			_mdl_engine_position(const struct mdl_engine *,
+    double);
+int			_mdl_engine_next_time(const struct mdl_engine *,
+    double *);
+__END_DECLS
+
+#endif /* !MDL_ENGINE_H */
@@ -59,13 +59,17 @@ _mdl_functions_free(struct musicexpr *me)
 
 	assert(me->me_type == ME_TYPE_FUNCTION);
 
-	func = &me->u.function;
+	func = me->u.function;
 
 	TAILQ_FOREACH_SAFE(p, &func->args, tq, q) {
 		TAILQ_REMOVE(&func->args, p, tq);
+		free(p->arg);
 		free(p);
 	}
 	free(func->name);
+	free(func);
+
+	me->u.function = NULL;
 }
 
 static int
@@ -74,14 +78,15 @@ apply_function(struct musicexpr *me, int level)
 	assert(me->me_type == ME_TYPE_FUNCTION);
 
 	_mdl_log(MDLLOG_FUNC, level, "applying function \"%s\"\n",
-	    me->u.function.name);
+	    me->u.function->name);
 
-	if (strcmp(me->u.function.name, "tempo") == 0) {
+	if (strcmp(me->u.function->name, "tempo") == 0) {
 		return apply_tempo(me, level);
-	} else if (strcmp(me->u.function.name, "volume") == 0) {
+	} else if (strcmp(me->u.function->name, "volume") == 0) {
 		return apply_volume(me, level);
 	} else {
-		warnx("function '%s' is not defined", me->u.function.name);
+		_mdl_warnx("function '%s' is not defined",
+		    me->u.function->name);
 		return 1;
 	}
 }
@@ -98,20 +103,21 @@ apply_tempo(struct musicexpr *me, int level)
 
 	assert(me->me_type == ME_TYPE_FUNCTION);
 
-	funcarg = TAILQ_FIRST(&me->u.function.args);
+	funcarg = TAILQ_FIRST(&me->u.function->args);
 	if (funcarg == NULL || TAILQ_NEXT(funcarg, tq) != NULL) {
-		warnx("wrong number of arguments to tempo function");
+		_mdl_warnx("wrong number of arguments to tempo function");
 		return 1;
 	}
 
 	bpm = strtonum(funcarg->arg, 1, LLONG_MAX, &errstr);
 	if (errstr != NULL) {
-		warnx("invalid argument for tempo: %s (should be 1-%lld)",
+		_mdl_warnx("invalid argument for tempo: %s (should be 1-%lld)",
 		    errstr, LLONG_MAX);
 		return 1;
 	}
 
-	new = _mdl_musicexpr_new(ME_TYPE_TEMPOCHANGE, me->id.textloc, level);
+	new = _mdl_musicexpr_new(ME_TYPE_TEMPOCHANGE,
+	    _mdl_musicexpr_textloc(me), level);
 	if (new == NULL) {
 		warnx("could not create a new tempo change expression");
 		return 1;
@@ -135,20 +141,21 @@ apply_volume(struct musicexpr *me, int level)
 
 	assert(me->me_type == ME_TYPE_FUNCTION);
 
-	funcarg = TAILQ_FIRST(&me->u.function.args);
+	funcarg = TAILQ_FIRST(&me->u.function->args);
 	if (funcarg == NULL || TAILQ_NEXT(funcarg, tq) != NULL) {
-		warnx("wrong number of arguments to volume function");
+		_mdl_warnx("wrong number of arguments to volume function");
 		return 1;
 	}
 
 	volume = strtonum(funcarg->arg, 0, 127, &errstr);
 	if (errstr != NULL) {
-		warnx("invalid argument for volume: %s (should be 0-127)",
+		_mdl_warnx("invalid argument for volume: %s (should be 0-127)",
 		    errstr);
 		return 1;
 	}
 
-	new = _mdl_musicexpr_new(ME_TYPE_VOLUMECHANGE, me->id.textloc, level);
+	new = _mdl_musicexpr_new(ME_TYPE_VOLUMECHANGE,
+	    _mdl_musicexpr_textloc(me), level);
 	if (new == NULL) {
 		warnx("could not create a new volume change expression");
 		return 1;
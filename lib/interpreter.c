@@ -16,30 +16,82 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <imsg.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "context.h"
 #include "interpreter.h"
+#include "ipc.h"
+#include "midipack.h"
 #include "midistream.h"
 #include "musicexpr.h"
+#include "parse.h"
 #include "util.h"
 
-extern FILE		*yyin;
-extern struct musicexpr	*parsed_expr;
-extern unsigned int	 parse_errors;
-extern const char	*_mdl_process_type;
+static int	interpreter_copy_tracks(const char *, size_t, char **,
+    size_t *);
+static int	interpreter_do_musicfile(struct mdl_ctx *, int, int, int,
+    const char *, size_t, const u_int8_t *, size_t);
+static int	interpreter_return_stream(int, const u_int8_t *, size_t);
+static int	interpreter_wait_musicfile(int, int *, int *, char **,
+    size_t *, u_int8_t **, size_t *);
 
+/*
+ * Start an interpreter process for mdlfile_fd.  mdlfile_fd is not closed,
+ * the interpreter gets a copy of it.
+ */
+int
+_mdl_interpreter_start_process(struct mdl_ctx *ctx,
+    struct interpreter_process *interp, int mdlfile_fd, int sequencer_socket)
+{
+	int status;
+
+	if (_mdl_interpreter_start_worker(ctx, interp, sequencer_socket) != 0)
+		return 1;
+
+	if (_mdl_interpreter_send_musicfile(interp, mdlfile_fd, 0, NULL, 0,
+	    NULL, 0) != 0) {
+		if (close(interp->sequencer_read_pipe) == -1)
+			warn("error closing read end of is_pipe");
+		if (kill(interp->pid, SIGTERM) == -1 && errno != ESRCH)
+			warn("error killing interpreter process");
+		if (waitpid(interp->pid, &status, 0) == -1)
+			warn("waiting for interpreter process");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start an interpreter process that waits for a music file from
+ * _mdl_interpreter_send_musicfile() before doing anything else.  This way
+ * interpreters can be forked in advance, so that forking is not done when
+ * music should be interpreted as soon as possible.
+ */
 int
-_mdl_interpreter_start_process(struct interpreter_process *interp,
-    int mdlfile_fd, int sequencer_socket)
+_mdl_interpreter_start_worker(struct mdl_ctx *ctx,
+    struct interpreter_process *interp, int sequencer_socket)
 {
 	int is_pipe[2];	/* interpreter-sequencer pipe */
-	int ret;
+	int control_sp[2];
+	int mdlfile_fd, result_fd, return_stream, ret;
+	char *tracks;
+	u_int8_t *base;
+	size_t base_size, tracks_size;
 	pid_t interpreter_pid;
 
 	/* Setup pipe for interpreter --> sequencer communication. */
@@ -48,11 +100,25 @@ _mdl_interpreter_start_process(struct interpreter_process *interp,
 		return 1;
 	}
 
+	/* Music file descriptor is passed through control socket. */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, control_sp) == -1) {
+		warn("could not setup interpreter control socketpair");
+		if (close(is_pipe[1]) == -1)
+			warn("error closing write end of is_pipe");
+		if (close(is_pipe[0]) == -1)
+			warn("error closing read end of is_pipe");
+		return 1;
+	}
+
 	if (fflush(NULL) == EOF)
 		warn("error flushing streams before interpreter fork");
 
 	if ((interpreter_pid = fork()) == -1) {
 		warn("could not fork interpreter pid");
+		if (close(control_sp[1]) == -1)
+			warn("error closing interpreter control socket");
+		if (close(control_sp[0]) == -1)
+			warn("error closing interpreter control socket");
 		if (close(is_pipe[1]) == -1)
 			warn("error closing write end of is_pipe");
 		if (close(is_pipe[0]) == -1)
@@ -65,15 +131,15 @@ _mdl_interpreter_start_process(struct interpreter_process *interp,
 		 * We are in the interpreter process.
 		 */
 
-		if (pledge("stdio", NULL) == -1) {
+		if (pledge("recvfd stdio", NULL) == -1) {
 			warn("pledge");
 			_exit(1);
 		}
 
 		setproctitle("interpreter");
 
-		_mdl_logging_clear();
-		_mdl_process_type = "interp";
+		_mdl_logging_clear(ctx);
+		ctx->process_type = "interp";
 		_mdl_log(MDLLOG_PROCESS, 0,
 		    "new interpreter process, pid %d\n", getpid());
 
@@ -95,12 +161,37 @@ _mdl_interpreter_start_process(struct interpreter_process *interp,
 			ret = 1;
 			goto interpreter_out;
 		}
+		if (close(control_sp[0]) == -1) {
+			warn("error closing interpreter control socket");
+			ret = 1;
+			goto interpreter_out;
+		}
+
+		ret = interpreter_wait_musicfile(control_sp[1], &mdlfile_fd,
+		    &return_stream, &tracks, &tracks_size, &base, &base_size);
+		result_fd = return_stream ? control_sp[1] : -1;
+		if (!return_stream && close(control_sp[1]) == -1)
+			warn("error closing interpreter control socket");
+		if (ret != 0 || mdlfile_fd == -1)
+			goto interpreter_out;
+
+		if (pledge("stdio", NULL) == -1) {
+			warn("pledge");
+			_exit(1);
+		}
 
-		ret = _mdl_interpreter_do_musicfile(mdlfile_fd, is_pipe[1]);
+		ret = _mdl_interpreter_do_musicfile(ctx, mdlfile_fd,
+		    is_pipe[1], result_fd, tracks, tracks_size, base,
+		    base_size);
+		free(tracks);
+		free(base);
 
-		if (mdlfile_fd != fileno(stdin) && close(mdlfile_fd) == -1)
+		if (close(mdlfile_fd) == -1)
 			warn("error closing music file");
 
+		if (result_fd >= 0 && close(result_fd) == -1)
+			warn("error closing interpreter control socket");
+
 		if (close(is_pipe[1]) == -1)
 			warn("error closing write end of is_pipe");
 
@@ -110,69 +201,370 @@ interpreter_out:
 			    " before exit");
 		}
 
-		_mdl_logging_close();
+		_mdl_ctx_free(ctx);
 
 		_exit(ret);
 	}
 
 	if (close(is_pipe[1]) == -1)
 		warn("error closing write end of is_pipe");
+	if (close(control_sp[1]) == -1)
+		warn("error closing interpreter control socket");
 
+	interp->control_socket = control_sp[0];
 	interp->pid = interpreter_pid;
 	interp->sequencer_read_pipe = is_pipe[0];
 
 	return 0;
 }
 
+/*
+ * Pass a copy of mdlfile_fd to an interpreter started with
+ * _mdl_interpreter_start_worker(), which starts interpreting it.
+ * mdlfile_fd is not closed.  If return_stream is set, interpreter also
+ * writes the midi stream of the whole song to its control socket, which
+ * is then left open for reading.  If tracks (of tracks_size bytes, each
+ * name terminated by NUL) is not NULL, only those tracks are sent to
+ * sequencer.  Otherwise, if base (of base_size bytes) is not NULL, the
+ * song is sent to sequencer as a patch against it (see
+ * _mdl_midipack_patch()), unless base does not fit in the message.
+ */
 int
-_mdl_interpreter_do_musicfile(int mdlfile_fd, int sequencer_read_pipe)
+_mdl_interpreter_send_musicfile(struct interpreter_process *interp,
+    int mdlfile_fd, int return_stream, const char *tracks,
+    size_t tracks_size, const u_int8_t *base, size_t base_size)
 {
-	struct mdl_stream *eventstream;
+	struct imsgbuf ibuf;
+	u_int8_t *data;
+	size_t header_size;
+	int fd, ret;
+
+	assert(interp->control_socket >= 0);
+	assert(tracks != NULL || tracks_size == 0);
+	assert(base != NULL || base_size == 0);
+
+	header_size = sizeof(return_stream) + sizeof(tracks_size);
+
+	if (tracks != NULL || base_size > MAX_IMSGSIZE - IMSG_HEADER_SIZE -
+	    header_size - tracks_size)
+		base_size = 0;
+
+	data = malloc(header_size + tracks_size + base_size);
+	if (data == NULL) {
+		warn("malloc in _mdl_interpreter_send_musicfile");
+		return 1;
+	}
+	memcpy(data, &return_stream, sizeof(return_stream));
+	memcpy(data + sizeof(return_stream), &tracks_size,
+	    sizeof(tracks_size));
+	if (tracks_size > 0)
+		memcpy(data + header_size, tracks, tracks_size);
+	if (base_size > 0)
+		memcpy(data + header_size + tracks_size, base, base_size);
+
+	if ((fd = dup(mdlfile_fd)) == -1) {
+		warn("could not duplicate music file descriptor");
+		free(data);
+		return 1;
+	}
+
+	imsg_init(&ibuf, interp->control_socket);
+
+	ret = 0;
+	if (imsg_compose(&ibuf, CLIENTEVENT_NEW_MUSICFD, 0, 0, fd,
+	    data, header_size + tracks_size + base_size) == -1) {
+		warnx("could not compose music file message to interpreter");
+		if (close(fd) == -1)
+			warn("closing music file descriptor");
+		ret = 1;
+	} else if (imsg_flush(&ibuf) == -1) {
+		warnx("could not send music file to interpreter");
+		ret = 1;
+	}
+
+	imsg_clear(&ibuf);
+	free(data);
+
+	if (ret == 0 && return_stream)
+		return 0;
+
+	/* Interpreter needs only one music file, so we are done with it. */
+	if (close(interp->control_socket) == -1)
+		warn("error closing interpreter control socket");
+	interp->control_socket = -1;
+
+	return ret;
+}
+
+/*
+ * Wait for a music file descriptor from the process that started us.
+ * *mdlfile_fd is set to -1 if the control socket was closed instead.
+ * *tracks is set to a newly allocated copy of the names of the tracks
+ * to send, or NULL if the whole song should be sent.  *base is set to a
+ * newly allocated copy of the song tracks that sequencer has, or NULL if
+ * the song should not be sent as a patch.
+ */
+static int
+interpreter_wait_musicfile(int control_socket, int *mdlfile_fd,
+    int *return_stream, char **tracks, size_t *tracks_size, u_int8_t **base,
+    size_t *base_size)
+{
+	struct imsgbuf ibuf;
+	struct imsg imsg;
+	const u_int8_t *data;
+	size_t datalen, header_size, size;
+	ssize_t nr;
+	int ret;
+
+	*mdlfile_fd = -1;
+	*return_stream = 0;
+	*tracks = NULL;
+	*tracks_size = 0;
+	*base = NULL;
+	*base_size = 0;
+	header_size = sizeof(*return_stream) + sizeof(*tracks_size);
+	ret = 0;
+
+	imsg_init(&ibuf, control_socket);
+
+	for (;;) {
+		if ((nr = imsg_get(&ibuf, &imsg)) == -1) {
+			warnx("error in reading interpreter control socket");
+			ret = 1;
+			break;
+		}
+		if (nr > 0) {
+			if (imsg.hdr.type != CLIENTEVENT_NEW_MUSICFD ||
+			    imsg.fd == -1) {
+				warnx("interpreter did not receive a music"
+				    " file when expected");
+				ret = 1;
+			}
+			*mdlfile_fd = imsg.fd;
+			data = imsg.data;
+			datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+			size = 0;
+			if (ret == 0 && datalen >= header_size) {
+				memcpy(return_stream, data,
+				    sizeof(*return_stream));
+				memcpy(&size, data + sizeof(*return_stream),
+				    sizeof(size));
+				datalen -= header_size;
+				data += header_size;
+			} else if (ret == 0) {
+				warnx("interpreter received an invalid music"
+				    " file message");
+				ret = 1;
+			}
+			if (ret == 0 && size > datalen) {
+				warnx("interpreter received invalid track"
+				    " names");
+				ret = 1;
+			}
+			if (ret == 0 && size > 0)
+				ret = interpreter_copy_tracks(
+				    (const char *) data, size, tracks,
+				    tracks_size);
+			if (ret == 0 && datalen > size) {
+				*base_size = datalen - size;
+				if ((*base = malloc(*base_size)) == NULL) {
+					warn("malloc in"
+					    " interpreter_wait_musicfile");
+					ret = 1;
+				} else {
+					memcpy(*base, data + size,
+					    *base_size);
+				}
+			}
+			imsg_free(&imsg);
+			break;
+		}
+
+		if ((nr = imsg_read(&ibuf)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warnx("error in reading interpreter control socket");
+			ret = 1;
+			break;
+		}
+		if (nr == 0) {
+			_mdl_log(MDLLOG_IPC, 0,
+			    "interpreter control socket was closed\n");
+			break;
+		}
+	}
+
+	imsg_clear(&ibuf);
+
+	return ret;
+}
+
+/*
+ * Interpret music from mdlfile_fd and write it to sequencer_read_pipe.
+ * If result_fd is not -1, the midi stream of the whole song is written
+ * there as well.  If tracks is not NULL, only the tracks named in it
+ * (see _mdl_songstreams_select_tracks()) are written to sequencer.
+ * Otherwise, if base is not NULL, the song is written to sequencer as a
+ * patch against the tracks in base.
+ */
+int
+_mdl_interpreter_do_musicfile(struct mdl_ctx *ctx, int mdlfile_fd,
+    int sequencer_read_pipe, int result_fd, const char *tracks,
+    size_t tracks_size, const u_int8_t *base, size_t base_size)
+{
+	struct mdl_ctx *old_ctx;
+	int ret;
+
+	if (ctx == NULL) {
+		warnx("no library context for interpreting music");
+		return 1;
+	}
+
+	old_ctx = _mdl_ctx_get();
+	if (_mdl_ctx_set(ctx) != 0)
+		return 1;
+
+	ret = interpreter_do_musicfile(ctx, mdlfile_fd, sequencer_read_pipe,
+	    result_fd, tracks, tracks_size, base, base_size);
+
+	(void) _mdl_ctx_set(old_ctx);
+
+	return ret;
+}
+
+static int
+interpreter_do_musicfile(struct mdl_ctx *ctx, int mdlfile_fd,
+    int sequencer_read_pipe, int result_fd, const char *tracks,
+    size_t tracks_size, const u_int8_t *base, size_t base_size)
+{
+	struct songstreams songstreams;
+	struct musicexpr *parsed_expr;
+	FILE *input;
+	u_int8_t *packed, *selected;
+	size_t packed_size, selected_size;
 	ssize_t wcount;
 	int level, ret;
 
 	assert(mdlfile_fd >= 0);
 	assert(sequencer_read_pipe >= 0);
 
-	eventstream = NULL;
+	songstreams.tracks = NULL;
+	songstreams.trackcount = 0;
+	songstreams.conductor_es = NULL;
+	packed = NULL;
+	packed_size = 0;
+	selected = NULL;
+	selected_size = 0;
 	level = 0;
 	ret = 0;
 
-	if ((yyin = fdopen(mdlfile_fd, "r")) == NULL) {
+	if ((input = fdopen(mdlfile_fd, "r")) == NULL) {
 		warn("could not setup input stream for lex");
 		return 1;
 	}
 
-	if (yyparse() != 0 || parse_errors > 0) {
-		warnx("parsing failed with %d errors", parse_errors);
+	if ((parsed_expr = _mdl_parse(ctx, input)) == NULL)
 		return 1;
-	}
-
-	/*
-	 * If yyparse() returned ok with no parse_errors, we should have
-	 * parsed_expr != NULL and available for us now.
-	 */
 
 	_mdl_log(MDLLOG_PARSING, level, "parse ok, result:\n");
 	_mdl_musicexpr_log(parsed_expr, MDLLOG_PARSING, level+1, NULL);
 
-	eventstream = _mdl_musicexpr_to_midievents(parsed_expr, level);
-	if (eventstream == NULL) {
+	if (_mdl_musicexpr_to_songstreams(ctx, parsed_expr, &songstreams,
+	    level) != 0) {
 		warnx("error converting music expression to midi stream");
 		ret = 1;
 		goto finish;
 	}
 
-	wcount = _mdl_midi_write_midistream(sequencer_read_pipe, eventstream,
-	    level);
-	if (wcount == -1)
+	if (tracks == NULL || result_fd >= 0) {
+		packed = _mdl_midipack_stream(&songstreams, &packed_size);
+		if (packed == NULL) {
+			warnx("error packing midi stream");
+			ret = 1;
+			goto finish;
+		}
+		selected = packed;
+		selected_size = packed_size;
+	}
+
+	if (tracks != NULL) {
+		_mdl_songstreams_select_tracks(&songstreams, tracks,
+		    tracks_size, level);
+		selected = _mdl_midipack_stream(&songstreams, &selected_size);
+		if (selected == NULL) {
+			warnx("error packing selected tracks");
+			ret = 1;
+			goto finish;
+		}
+	} else if (base != NULL) {
+		/* The whole song does just as well if this fails. */
+		selected = _mdl_midipack_patch(packed, packed_size, base,
+		    base_size, &selected_size, level);
+		if (selected == NULL) {
+			selected = packed;
+			selected_size = packed_size;
+		}
+	}
+
+	wcount = _mdl_midi_write_midistream(sequencer_read_pipe, &songstreams,
+	    selected, selected_size, level);
+	if (wcount == -1) {
 		ret = 1;
+		goto finish;
+	}
+
+	/* Sequencer has the stream, so this is not urgent. */
+	if (result_fd >= 0)
+		ret = interpreter_return_stream(result_fd, packed,
+		    packed_size);
 
 finish:
-	if (eventstream)
-		_mdl_stream_free(eventstream);
+	if (selected != packed)
+		free(selected);
+	free(packed);
+	_mdl_songstreams_free(&songstreams);
 	if (parsed_expr)
 		_mdl_musicexpr_free(parsed_expr, level);
 
 	return ret;
 }
+
+static int
+interpreter_return_stream(int result_fd, const u_int8_t *buf, size_t size)
+{
+	ssize_t nw;
+
+	_mdl_log(MDLLOG_IPC, 0, "returning midi stream of %zu bytes\n",
+	    size);
+
+	while (size > 0) {
+		if ((nw = write(result_fd, buf, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("error returning midi stream");
+			return 1;
+		}
+		buf += nw;
+		size -= nw;
+	}
+
+	return 0;
+}
+
+static int
+interpreter_copy_tracks(const char *data, size_t size, char **tracks,
+    size_t *tracks_size)
+{
+	if (_mdl_check_tracknames(data, size) != 0)
+		return 1;
+
+	if ((*tracks = malloc(size)) == NULL) {
+		warn("malloc in interpreter_copy_tracks");
+		return 1;
+	}
+
+	memcpy(*tracks, data, size);
+	*tracks_size = size;
+
+	return 0;
+}
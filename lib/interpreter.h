@@ -20,6 +20,7 @@
 #define MDL_MUSICINTERP_H
 
 struct interpreter_process {
+	int	control_socket;
 	int	sequencer_read_pipe;
 	pid_t	pid;
 };
@@ -32,9 +33,14 @@ struct interpreter_handler {
 };
 
 __BEGIN_DECLS
-int	_mdl_interpreter_do_musicfile(int, int);
-int	_mdl_interpreter_start_process(struct interpreter_process *, int, int);
-int	yyparse(void);
+int	_mdl_interpreter_do_musicfile(struct mdl_ctx *, int, int, int,
+    const char *, size_t, const u_int8_t *, size_t);
+int	_mdl_interpreter_send_musicfile(struct interpreter_process *, int,
+    int, const char *, size_t, const u_int8_t *, size_t);
+int	_mdl_interpreter_start_process(struct mdl_ctx *,
+    struct interpreter_process *, int, int);
+int	_mdl_interpreter_start_worker(struct mdl_ctx *,
+    struct interpreter_process *, int);
 __END_DECLS
 
 #endif /* !MDL_MUSICINTERP_H */
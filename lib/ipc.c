@@ -20,9 +20,36 @@
 
 #include <err.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "ipc.h"
+#include "midipack.h"
+
+/*
+ * Check that names (of size bytes) holds one or more track names, each
+ * terminated by NUL.
+ */
+int
+_mdl_check_tracknames(const char *names, size_t size)
+{
+	size_t len;
+
+	if (size == 0 || names[size - 1] != '\0') {
+		warnx("received invalid track names");
+		return 1;
+	}
+
+	for (; size > 0; names += len + 1, size -= len + 1) {
+		len = strlen(names);
+		if (len == 0 || len > MIDIPACK_TRACKNAME_MAX) {
+			warnx("received an invalid track name");
+			return 1;
+		}
+	}
+
+	return 0;
+}
 
 const char *
 _mdl_get_socketpath(void)
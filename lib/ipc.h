@@ -21,16 +21,48 @@
 
 #define MDL_SOCKETPATH_LEN	104
 
+/*
+ * Track mode events carry the track name, terminated by NUL, as their
+ * data.  Clients that play no music send those to server, which passes
+ * them to sequencer.  CLIENTEVENT_REPLACE_TRACKS carries the names of
+ * the tracks to replace, each terminated by NUL, and so may
+ * CLIENTEVENT_NEW_MUSICFD when only those tracks should be sent to
+ * sequencer.  Clients send CLIENTEVENT_REPLACE_TRACKS to server as well.
+ * Sent to server, CLIENTEVENT_QUEUE_SONG carries a music file
+ * for the song after the current one, and server answers it as it does
+ * CLIENTEVENT_NEW_MUSICFD.
+ * SEQEVENT_SONG_TRACKS carries the headers of unchanged tracks (see
+ * midipack.h) for the tracks of the song that sequencer plays, so that
+ * the next song can refer to them instead of carrying their events.
+ */
 enum mdl_event {
 	CLIENTEVENT_NEW_MUSICFD,
 	CLIENTEVENT_NEW_SONG,
+	CLIENTEVENT_QUEUE_SONG,
 	CLIENTEVENT_REPLACE_SONG,
+	CLIENTEVENT_REPLACE_TRACKS,
+	CLIENTEVENT_MUTE_TRACK,
+	CLIENTEVENT_SOLO_TRACK,
+	CLIENTEVENT_UNMUTE_TRACK,
 	SEQEVENT_SONG_END,
+	SEQEVENT_SONG_TRACKS,
 	SERVEREVENT_NEW_CLIENT,
 	SERVEREVENT_NEW_INTERPRETER,
 };
 
+/*
+ * Where a new song replaces the one that is playing, sent as the data of
+ * CLIENTEVENT_NEW_SONG and CLIENTEVENT_REPLACE_SONG.  Without data the
+ * song is switched to when it has been read.
+ */
+enum song_switch {
+	SONG_SWITCH_NOW,
+	SONG_SWITCH_MEASURE,
+	SONG_SWITCH_MARKER,
+};
+
 __BEGIN_DECLS
+int		 _mdl_check_tracknames(const char *, size_t);
 const char	*_mdl_get_socketpath(void);
 __END_DECLS
 
@@ -28,58 +28,49 @@
 #include <sndio.h>
 #endif /* HAVE_SNDIO */
 
+#include "context.h"
 #include "midi.h"
 #include "util.h"
 
-#define MIDI_EVENT_MAXSIZE		3
 #define MIDI_CONTROLCHANGE_BASE		0xb0
 #define MIDI_INSTRUMENT_CHANGE_BASE	0xc0
-#define MIDI_INSTRUMENT_MAX		127
 #define MIDI_NOTEOFF_BASE		0x80
 #define MIDI_NOTEON_BASE		0x90
-#define MIDI_VELOCITY_MAX		127
-#define MIDI_VOLUME_MAX			127
 
 #define MIDICC_CHANNEL_VOLUME		7
-
-struct mididevice {
-	enum mididev_type mididev_type;
-	union {
-		int		raw_fd;
-		struct mio_hdl *sndio_mio;
-	} u;
-	size_t	(*write_to_device)(u_int8_t *, size_t);
-	void	(*close_device)(void);
-};
-
-struct mididevice mididev = { MIDIDEV_NONE, { 0 }, NULL, NULL };
+#define MIDICC_ALL_NOTES_OFF		123
 
 static int midi_check_range(u_int8_t, u_int8_t, u_int8_t);
+static int midi_write(struct mdl_ctx *, u_int8_t *, size_t, int);
+static int midi_compare_midievents(const struct midievent *,
+    const struct midievent *);
 
-static int	raw_open_device(const char *);
-static size_t	raw_write_to_device(u_int8_t *, size_t);
-static void	raw_close_device(void);
+static int	raw_open_device(struct mididevice *, const char *);
+static size_t	raw_write_to_device(struct mididevice *, u_int8_t *, size_t);
+static void	raw_close_device(struct mididevice *);
 
 #ifdef HAVE_SNDIO
-static int	sndio_open_device(const char *);
-static size_t	sndio_write_to_device(u_int8_t *, size_t);
-static void	sndio_close_device(void);
+static int	sndio_open_device(struct mididevice *, const char *);
+static size_t	sndio_write_to_device(struct mididevice *, u_int8_t *,
+    size_t);
+static void	sndio_close_device(struct mididevice *);
 #endif
 
 static void	maybe_log_the_clock(int);
 
 int
-_mdl_midi_open_device(enum mididev_type mididev_type, const char *device)
+_mdl_midi_open_device(struct mdl_ctx *ctx, enum mididev_type mididev_type,
+    const char *device)
 {
 	switch (mididev_type) {
 	case MIDIDEV_NONE:
 		assert(0);
 		break;
 	case MIDIDEV_RAW:
-		return raw_open_device(device);
+		return raw_open_device(&ctx->mididev, device);
 	case MIDIDEV_SNDIO:
 #ifdef HAVE_SNDIO
-		return sndio_open_device(device);
+		return sndio_open_device(&ctx->mididev, device);
 #else
 		warnx("sndio support not compiled in");
 		return 1;
@@ -92,19 +83,19 @@ _mdl_midi_open_device(enum mididev_type mididev_type, const char *device)
 }
 
 void
-_mdl_midi_close_device(void)
+_mdl_midi_close_device(struct mdl_ctx *ctx)
 {
-	mididev.close_device();
-	mididev.mididev_type = MIDIDEV_NONE;
+	ctx->mididev.close_device(&ctx->mididev);
+	ctx->mididev.mididev_type = MIDIDEV_NONE;
 }
 
 static int
-raw_open_device(const char *device)
+raw_open_device(struct mididevice *mididev, const char *device)
 {
 	int fd;
 	const char *devpath;
 
-	assert(mididev.mididev_type == MIDIDEV_NONE);
+	assert(mididev->mididev_type == MIDIDEV_NONE);
 
 	devpath = (device != NULL) ? device : "/dev/rmidi0";
 
@@ -113,27 +104,28 @@ raw_open_device(const char *device)
 		return 1;
 	}
 
-	mididev.mididev_type = MIDIDEV_RAW;
-	mididev.u.raw_fd = fd;
-	mididev.write_to_device = raw_write_to_device;
-	mididev.close_device = raw_close_device;
+	mididev->mididev_type = MIDIDEV_RAW;
+	mididev->u.raw_fd = fd;
+	mididev->write_to_device = raw_write_to_device;
+	mididev->close_device = raw_close_device;
 
 	return 0;
 }
 
 static size_t
-raw_write_to_device(u_int8_t *midievent, size_t midievent_size)
+raw_write_to_device(struct mididevice *mididev, u_int8_t *midievent,
+    size_t midievent_size)
 {
 	size_t total_wcount;
 	ssize_t nw;
 
-	assert(mididev.mididev_type == MIDIDEV_RAW);
+	assert(mididev->mididev_type == MIDIDEV_RAW);
 
 	total_wcount = 0;
 
 	while (total_wcount < midievent_size) {
 		/* XXX what if nw == 0 (continuously)?  can that happen? */
-		nw = write(mididev.u.raw_fd, midievent,
+		nw = write(mididev->u.raw_fd, midievent,
 		    midievent_size-total_wcount);
 		if (nw == -1) {
 			if (errno == EAGAIN)
@@ -148,23 +140,23 @@ raw_write_to_device(u_int8_t *midievent, size_t midievent_size)
 }
 
 static void
-raw_close_device(void)
+raw_close_device(struct mididevice *mididev)
 {
-	assert(mididev.mididev_type == MIDIDEV_RAW);
+	assert(mididev->mididev_type == MIDIDEV_RAW);
 
-	if (close(mididev.u.raw_fd) == -1)
+	if (close(mididev->u.raw_fd) == -1)
 		warn("error closing raw midi device");
 }
 
 #ifdef HAVE_SNDIO
 
 static int
-sndio_open_device(const char *device)
+sndio_open_device(struct mididevice *mididev, const char *device)
 {
 	struct mio_hdl *mio;
 	const char *sndio_device;
 
-	assert(mididev.mididev_type == MIDIDEV_NONE);
+	assert(mididev->mididev_type == MIDIDEV_NONE);
 
 	sndio_device = (device != NULL) ? device : MIO_PORTANY;
 
@@ -173,28 +165,29 @@ sndio_open_device(const char *device)
 		return 1;
 	}
 
-	mididev.mididev_type = MIDIDEV_SNDIO;
-	mididev.u.sndio_mio = mio;
-	mididev.write_to_device = sndio_write_to_device;
-	mididev.close_device = sndio_close_device;
+	mididev->mididev_type = MIDIDEV_SNDIO;
+	mididev->u.sndio_mio = mio;
+	mididev->write_to_device = sndio_write_to_device;
+	mididev->close_device = sndio_close_device;
 
 	return 0;
 }
 
 static size_t
-sndio_write_to_device(u_int8_t *midievent, size_t midievent_size)
+sndio_write_to_device(struct mididevice *mididev, u_int8_t *midievent,
+    size_t midievent_size)
 {
-	assert(mididev.mididev_type == MIDIDEV_SNDIO);
+	assert(mididev->mididev_type == MIDIDEV_SNDIO);
 
-	return mio_write(mididev.u.sndio_mio, midievent, midievent_size);
+	return mio_write(mididev->u.sndio_mio, midievent, midievent_size);
 }
 
 static void
-sndio_close_device(void)
+sndio_close_device(struct mididevice *mididev)
 {
-	assert(mididev.mididev_type == MIDIDEV_SNDIO);
+	assert(mididev->mididev_type == MIDIDEV_SNDIO);
 
-	mio_close(mididev.u.sndio_mio);
+	mio_close(mididev->u.sndio_mio);
 }
 
 #endif /* HAVE_SNDIO */
@@ -316,66 +309,73 @@ _mdl_midi_check_timed_midievent(struct timed_midievent tme,
 }
 
 int
-_mdl_midi_play_midievent(struct midievent *me, int level, int dry_run)
+_mdl_midi_play_midievent(struct mdl_ctx *ctx, struct midievent *me, int level,
+    int dry_run)
 {
 	u_int8_t midievent[MIDI_EVENT_MAXSIZE];
-	size_t midievent_size, wsize;
-	u_int8_t eventbase, velocity;
-
-	midievent_size = 0;
+	size_t midievent_size;
+	u_int8_t velocity;
 
 	switch (me->evtype) {
 	case MIDIEV_INSTRUMENT_CHANGE:
 		_mdl_log(MDLLOG_MIDI, level,
 		    "playing instrumentchange: channel=%d code=%d\n",
 		    me->u.instr_change.channel, me->u.instr_change.code);
-		maybe_log_the_clock(level+1);
-
-		midievent_size = 2;
-		midievent[0] = (u_int8_t) (MIDI_INSTRUMENT_CHANGE_BASE +
-		    me->u.instr_change.channel);
-		midievent[1] = me->u.instr_change.code;
 		break;
 	case MIDIEV_NOTEON:
 	case MIDIEV_NOTEOFF:
-		midievent_size = 3;
-		eventbase = (me->evtype == MIDIEV_NOTEON)
-			        ? MIDI_NOTEON_BASE
-				: MIDI_NOTEOFF_BASE;
 		velocity = (me->evtype == MIDIEV_NOTEON)
 		    ? me->u.midinote.velocity : 0;
-
 		_mdl_log(MDLLOG_MIDI, level,
 		    "playing %s: notevalue=%d channel=%d velocity=%d\n",
 		    (me->evtype == MIDIEV_NOTEON ? "noteon" : "noteoff"),
 		    me->u.midinote.note, me->u.midinote.channel, velocity);
-		maybe_log_the_clock(level+1);
-
-		midievent[0] = (u_int8_t) (eventbase + me->u.midinote.channel);
-		midievent[1] = me->u.midinote.note;
-		midievent[2] = velocity;
 		break;
 	case MIDIEV_VOLUMECHANGE:
 		_mdl_log(MDLLOG_MIDI, level,
 		    "playing volumechange: channel=%d volume=%d\n",
 		    me->u.volumechange.channel, me->u.volumechange.volume);
-		maybe_log_the_clock(level+1);
-
-		midievent_size = 3;
-		midievent[0] = (u_int8_t) (MIDI_CONTROLCHANGE_BASE +
-		    me->u.volumechange.channel);
-		midievent[1] = MIDICC_CHANNEL_VOLUME;
-		midievent[2] = me->u.volumechange.volume;
 		break;
 	default:
 		assert(0);
 	}
+	maybe_log_the_clock(level+1);
+
+	midievent_size = _mdl_midi_encode_midievent(me, midievent);
+
+	return midi_write(ctx, midievent, midievent_size, dry_run);
+}
+
+/* Turn off all notes on channel with a single control change. */
+int
+_mdl_midi_all_notes_off(struct mdl_ctx *ctx, u_int8_t channel, int level,
+    int dry_run)
+{
+	u_int8_t midievent[MIDI_EVENT_MAXSIZE];
+
+	_mdl_log(MDLLOG_MIDI, level, "playing all notes off: channel=%d\n",
+	    channel);
+	maybe_log_the_clock(level+1);
+
+	midievent[0] = (u_int8_t) (MIDI_CONTROLCHANGE_BASE + channel);
+	midievent[1] = MIDICC_ALL_NOTES_OFF;
+	midievent[2] = 0;
+
+	return midi_write(ctx, midievent, 3, dry_run);
+}
+
+static int
+midi_write(struct mdl_ctx *ctx, u_int8_t *midievent, size_t midievent_size,
+    int dry_run)
+{
+	size_t wsize;
 
 	/* Do not actually send any midi event when dry_run is set. */
 	if (dry_run)
 		return 0;
 
-	wsize = mididev.write_to_device(midievent, midievent_size);
+	wsize = ctx->mididev.write_to_device(&ctx->mididev, midievent,
+	    midievent_size);
 	if (wsize != midievent_size) {
 		warnx("midi error, tried to write exactly %ld bytes,"
 		    " wrote %ld", midievent_size, wsize);
@@ -385,6 +385,122 @@ _mdl_midi_play_midievent(struct midievent *me, int level, int dry_run)
 	return 0;
 }
 
+/*
+ * Compare timed midievents first by time, then by type and contents, so
+ * that sorting and merging event streams gives a deterministic order.
+ * This has the qsort(3) signature.
+ */
+int
+_mdl_midi_compare_timed_midievents(const void *va, const void *vb)
+{
+	const struct timed_midievent *a, *b;
+
+	a = va;
+	b = vb;
+
+	return
+	    (a->time_as_measures < b->time_as_measures) ? -1 :
+	    (a->time_as_measures > b->time_as_measures) ?  1 :
+	    midi_compare_midievents(&a->midiev, &b->midiev);
+}
+
+static int
+midi_compare_midievents(const struct midievent *a, const struct midievent *b)
+{
+	const struct instrument_change *ic_a, *ic_b;
+	const struct midi_volumechange *vc_a, *vc_b;
+
+	assert(a->evtype < MIDIEV_TYPECOUNT);
+
+	if (a->evtype < b->evtype)
+		return -1;
+	if (a->evtype > b->evtype)
+		return 1;
+
+	assert(a->evtype == b->evtype);
+
+	switch (a->evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+		ic_a = &a->u.instr_change;
+		ic_b = &b->u.instr_change;
+		return
+		    (ic_a->channel < ic_b->channel) ? -1 :
+		    (ic_a->channel > ic_b->channel) ?  1 :
+		    (ic_a->code    < ic_b->code)    ? -1 :
+		    (ic_a->code    > ic_b->code)    ?  1 : 0;
+	case MIDIEV_MARKER:
+		/*
+		 * XXX Just order these randomly.  With textual locations
+		 * XXX one might be able to do a more rational choice.
+		 */
+		return 1;
+	case MIDIEV_NOTEOFF:
+	case MIDIEV_NOTEON:
+		return
+		    (a->u.midinote.channel  < b->u.midinote.channel)  ? -1 :
+		    (a->u.midinote.channel  > b->u.midinote.channel)  ?  1 :
+		    (a->u.midinote.note     < b->u.midinote.note)     ? -1 :
+		    (a->u.midinote.note     > b->u.midinote.note)     ?  1 :
+		    (a->u.midinote.velocity < b->u.midinote.velocity) ? -1 :
+		    (a->u.midinote.velocity > b->u.midinote.velocity) ?  1 : 0;
+	case MIDIEV_SONG_END:
+		return 0;
+	case MIDIEV_TEMPOCHANGE:
+		return (a->u.bpm < b->u.bpm) ? -1 :
+		       (a->u.bpm > b->u.bpm) ?  1 : 0;
+	case MIDIEV_VOLUMECHANGE:
+		vc_a = &a->u.volumechange;
+		vc_b = &b->u.volumechange;
+		return (vc_a->channel < vc_b->channel) ? -1 :
+		       (vc_a->channel > vc_b->channel) ?  1 :
+		       (vc_a->volume  < vc_b->volume)  ? -1 :
+		       (vc_a->volume  > vc_b->volume)  ?  1 : 0;
+	default:
+		assert(0);
+	}
+
+	return 0;
+}
+
+/*
+ * Put the bytes of the midi message for me to midievent, which must have
+ * room for MIDI_EVENT_MAXSIZE bytes, and return their count.  me must be
+ * an event that is sent to midi devices.
+ */
+size_t
+_mdl_midi_encode_midievent(const struct midievent *me, u_int8_t *midievent)
+{
+	switch (me->evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+		midievent[0] = (u_int8_t) (MIDI_INSTRUMENT_CHANGE_BASE +
+		    me->u.instr_change.channel);
+		midievent[1] = me->u.instr_change.code;
+		return 2;
+	case MIDIEV_NOTEON:
+		midievent[0] = (u_int8_t) (MIDI_NOTEON_BASE +
+		    me->u.midinote.channel);
+		midievent[1] = me->u.midinote.note;
+		midievent[2] = me->u.midinote.velocity;
+		return 3;
+	case MIDIEV_NOTEOFF:
+		midievent[0] = (u_int8_t) (MIDI_NOTEOFF_BASE +
+		    me->u.midinote.channel);
+		midievent[1] = me->u.midinote.note;
+		midievent[2] = 0;
+		return 3;
+	case MIDIEV_VOLUMECHANGE:
+		midievent[0] = (u_int8_t) (MIDI_CONTROLCHANGE_BASE +
+		    me->u.volumechange.channel);
+		midievent[1] = MIDICC_CHANNEL_VOLUME;
+		midievent[2] = me->u.volumechange.volume;
+		return 3;
+	default:
+		assert(0);
+	}
+
+	return 0;
+}
+
 static void
 maybe_log_the_clock(int level)
 {
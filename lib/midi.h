@@ -26,6 +26,11 @@
 #define MIDI_DEFAULTCHANNEL	0
 #define MIDI_DRUMCHANNEL	9
 #define MIDI_NOTE_COUNT		128
+#define MIDI_EVENT_MAXSIZE	3
+
+#define MIDI_INSTRUMENT_MAX	127
+#define MIDI_VELOCITY_MAX	127
+#define MIDI_VOLUME_MAX		127
 
 enum midievent_type {
 	/*
@@ -79,11 +84,26 @@ struct timed_midievent {
 
 enum mididev_type { MIDIDEV_NONE, MIDIDEV_RAW, MIDIDEV_SNDIO };
 
+struct mididevice {
+	enum mididev_type mididev_type;
+	union {
+		int		raw_fd;
+		struct mio_hdl *sndio_mio;
+	} u;
+	size_t	(*write_to_device)(struct mididevice *, u_int8_t *, size_t);
+	void	(*close_device)(struct mididevice *);
+};
+
 __BEGIN_DECLS
-int	_mdl_midi_open_device(enum mididev_type, const char *);
+int	_mdl_midi_open_device(struct mdl_ctx *, enum mididev_type,
+    const char *);
 int	_mdl_midi_check_timed_midievent(struct timed_midievent, float);
-int	_mdl_midi_play_midievent(struct midievent *, int, int);
-void	_mdl_midi_close_device(void);
+int	_mdl_midi_compare_timed_midievents(const void *, const void *);
+int	_mdl_midi_play_midievent(struct mdl_ctx *, struct midievent *, int,
+    int);
+int	_mdl_midi_all_notes_off(struct mdl_ctx *, u_int8_t, int, int);
+size_t	_mdl_midi_encode_midievent(const struct midievent *, u_int8_t *);
+void	_mdl_midi_close_device(struct mdl_ctx *);
 
 enum mididev_type	_mdl_midi_get_mididev_type(const char *);
 
@@ -0,0 +1,620 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midipack.h"
+#include "midistream.h"
+#include "util.h"
+
+/* Five varint bytes hold the 32 bits of a time delta. */
+#define MIDIPACK_DELTA_MAXSIZE	5
+
+#define MIDIPACK_DIGEST_PRIME	0x100000001b3ULL
+
+static int		midipack_base_has(const u_int8_t *, size_t,
+    const char *, u_int64_t);
+static ssize_t		midipack_decode_header(const u_int8_t *, size_t,
+    u_int8_t, char *);
+static u_int32_t	midipack_float_bits(float);
+static u_int32_t	midipack_get_le32(const u_int8_t *);
+static size_t		midipack_payload_size(enum midievent_type);
+static void		midipack_put_le32(u_int8_t *, u_int32_t);
+static size_t		midipack_track(const char *, const struct mdl_stream *,
+    u_int8_t *);
+static size_t		midipack_track_end(const u_int8_t *, size_t, size_t);
+
+/*
+ * Encode tme to buf, which must have room for MIDIPACK_EVENT_MAXSIZE
+ * bytes.  The time of the previous event (as returned through
+ * prev_time_bits, start from zero) is needed for the time delta.  Events
+ * are checked with _mdl_midi_check_timed_midievent() first.  Returns the
+ * number of bytes written, or 0 if the event is not valid.
+ */
+size_t
+_mdl_midipack_encode(const struct timed_midievent *tme,
+    u_int32_t *prev_time_bits, u_int8_t *buf)
+{
+	const struct midievent *midiev;
+	float prev_time;
+	u_int32_t delta, time_bits;
+	size_t size;
+	u_int8_t channel;
+
+	midiev = &tme->midiev;
+
+	memcpy(&prev_time, prev_time_bits, sizeof(prev_time));
+	if (!_mdl_midi_check_timed_midievent(*tme, prev_time))
+		return 0;
+
+	/* Times are not negative, so bit patterns are ordered as floats. */
+	time_bits = midipack_float_bits(tme->time_as_measures);
+	assert(time_bits >= *prev_time_bits);
+	delta = time_bits - *prev_time_bits;
+
+	switch (midiev->evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+		channel = midiev->u.instr_change.channel;
+		break;
+	case MIDIEV_NOTEOFF:
+	case MIDIEV_NOTEON:
+		channel = midiev->u.midinote.channel;
+		break;
+	case MIDIEV_VOLUMECHANGE:
+		channel = midiev->u.volumechange.channel;
+		break;
+	default:
+		channel = 0;
+		break;
+	}
+
+	buf[0] = (midiev->evtype << MIDIPACK_EVTYPE_SHIFT) | channel;
+	size = 1;
+
+	if (delta > 0) {
+		buf[0] |= MIDIPACK_DELTA_FLAG;
+		while (delta >= 0x80) {
+			buf[size++] = (delta & 0x7f) | 0x80;
+			delta >>= 7;
+		}
+		buf[size++] = delta;
+	}
+
+	switch (midiev->evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+		buf[size++] = midiev->u.instr_change.code;
+		break;
+	case MIDIEV_NOTEOFF:
+	case MIDIEV_NOTEON:
+		buf[size++] = midiev->u.midinote.note;
+		buf[size++] = midiev->u.midinote.velocity;
+		break;
+	case MIDIEV_TEMPOCHANGE:
+		midipack_put_le32(&buf[size],
+		    midipack_float_bits(midiev->u.bpm));
+		size += 4;
+		break;
+	case MIDIEV_VOLUMECHANGE:
+		buf[size++] = midiev->u.volumechange.volume;
+		break;
+	default:
+		break;
+	}
+
+	assert(size <= MIDIPACK_EVENT_MAXSIZE);
+
+	*prev_time_bits = time_bits;
+
+	return size;
+}
+
+/*
+ * Decode an event from buf (of size bytes) to tme, with the time of the
+ * previous event in prev_time_bits (updated on success).  Returns the
+ * number of bytes used, 0 if buf does not have a complete event, or -1
+ * if the encoding is invalid.  Decoded events still need to be checked
+ * with _mdl_midi_check_timed_midievent().
+ */
+ssize_t
+_mdl_midipack_decode(const u_int8_t *buf, size_t size,
+    u_int32_t *prev_time_bits, struct timed_midievent *tme)
+{
+	struct midievent *midiev;
+	u_int32_t bpm_bits, delta, time_bits;
+	size_t i, shift;
+	u_int8_t channel, opcode;
+
+	if (size == 0)
+		return 0;
+
+	opcode = buf[0];
+	channel = opcode & MIDIPACK_CHANNEL_MASK;
+
+	memset(tme, 0, sizeof(*tme));
+	midiev = &tme->midiev;
+	midiev->evtype = opcode >> MIDIPACK_EVTYPE_SHIFT;
+
+	if (midiev->evtype >= MIDIEV_TYPECOUNT) {
+		warnx("invalid event type in packed midi stream: %d",
+		    midiev->evtype);
+		return -1;
+	}
+
+	i = 1;
+	delta = 0;
+	if (opcode & MIDIPACK_DELTA_FLAG) {
+		for (shift = 0;; shift += 7) {
+			if (i == MIDIPACK_DELTA_MAXSIZE + 1 ||
+			    (i < size && shift == 28 &&
+			    (buf[i] & 0x70) != 0)) {
+				warnx("time delta overflow in packed midi"
+				    " stream");
+				return -1;
+			}
+			if (i == size)
+				return 0;
+			delta |= (u_int32_t)(buf[i] & 0x7f) << shift;
+			if ((buf[i++] & 0x80) == 0)
+				break;
+		}
+	}
+
+	if (delta > UINT32_MAX - *prev_time_bits) {
+		warnx("time overflow in packed midi stream");
+		return -1;
+	}
+	time_bits = *prev_time_bits + delta;
+	memcpy(&tme->time_as_measures, &time_bits, sizeof(time_bits));
+
+	if (size - i < midipack_payload_size(midiev->evtype))
+		return 0;
+
+	switch (midiev->evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+		midiev->u.instr_change.channel = channel;
+		midiev->u.instr_change.code = buf[i++];
+		break;
+	case MIDIEV_NOTEOFF:
+	case MIDIEV_NOTEON:
+		midiev->u.midinote.channel = channel;
+		midiev->u.midinote.joining = 0;
+		midiev->u.midinote.note = buf[i++];
+		midiev->u.midinote.velocity = buf[i++];
+		break;
+	case MIDIEV_VOLUMECHANGE:
+		midiev->u.volumechange.channel = channel;
+		midiev->u.volumechange.volume = buf[i++];
+		break;
+	default:
+		if (channel != 0) {
+			warnx("unexpected channel in packed midi stream");
+			return -1;
+		}
+		if (midiev->evtype == MIDIEV_TEMPOCHANGE) {
+			bpm_bits = midipack_get_le32(&buf[i]);
+			memcpy(&midiev->u.bpm, &bpm_bits, sizeof(bpm_bits));
+			i += 4;
+		}
+		break;
+	}
+
+	*prev_time_bits = time_bits;
+
+	return i;
+}
+
+/*
+ * Decode a track header from buf (of size bytes), with the track name
+ * copied to name, which must have room for MIDIPACK_TRACKNAME_MAX + 1
+ * bytes.  Returns the number of bytes used, 0 if buf does not have a
+ * complete header, or -1 if the encoding is invalid.
+ */
+ssize_t
+_mdl_midipack_decode_track(const u_int8_t *buf, size_t size, char *name)
+{
+	return midipack_decode_header(buf, size, MIDIPACK_TRACK_OPCODE, name);
+}
+
+/*
+ * Decode a header of an unchanged track from buf (of size bytes) as
+ * _mdl_midipack_decode_track() does, with the digest of the track events
+ * in digest.
+ */
+ssize_t
+_mdl_midipack_decode_same_track(const u_int8_t *buf, size_t size,
+    char *name, u_int64_t *digest)
+{
+	ssize_t n;
+
+	n = midipack_decode_header(buf, size, MIDIPACK_SAME_TRACK_OPCODE,
+	    name);
+	if (n <= 0)
+		return n;
+
+	if (size - n < MIDIPACK_DIGEST_SIZE)
+		return 0;
+
+	*digest = (u_int64_t)midipack_get_le32(&buf[n]) |
+	    (u_int64_t)midipack_get_le32(&buf[n + 4]) << 32;
+
+	return n + MIDIPACK_DIGEST_SIZE;
+}
+
+/*
+ * Encode a header of an unchanged track with name and digest to buf,
+ * which must have room for MIDIPACK_SAME_HEADER_MAXSIZE bytes.  Returns
+ * the number of bytes written.
+ */
+size_t
+_mdl_midipack_encode_same_track(const char *name, u_int64_t digest,
+    u_int8_t *buf)
+{
+	size_t namelen;
+
+	namelen = strlen(name);
+	assert(namelen <= MIDIPACK_TRACKNAME_MAX);
+
+	buf[0] = MIDIPACK_SAME_TRACK_OPCODE;
+	buf[1] = namelen;
+	memcpy(&buf[2], name, namelen);
+	midipack_put_le32(&buf[2 + namelen], digest & 0xffffffff);
+	midipack_put_le32(&buf[6 + namelen], digest >> 32);
+
+	return 2 + namelen + MIDIPACK_DIGEST_SIZE;
+}
+
+/* Add size bytes of encoded events from buf to digest. */
+u_int64_t
+_mdl_midipack_digest(u_int64_t digest, const u_int8_t *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		digest ^= buf[i];
+		digest *= MIDIPACK_DIGEST_PRIME;
+	}
+
+	return digest;
+}
+
+/*
+ * Return a newly allocated buffer with the tracks of songstreams that
+ * have events and the conductor stream encoded, and its size in size.
+ * Returns NULL on failure.
+ */
+u_int8_t *
+_mdl_midipack_stream(const struct songstreams *songstreams, size_t *size)
+{
+	const struct trackstream *track;
+	u_int8_t *buf;
+	size_t bufsize, count, i, n, namelen;
+
+	bufsize = 0;
+	for (i = 0; i <= songstreams->trackcount; i++) {
+		count = (i < songstreams->trackcount)
+		    ? songstreams->tracks[i].midi_es->count
+		    : songstreams->conductor_es->count;
+		if (bufsize > SIZE_MAX - MIDIPACK_HEADER_MAXSIZE ||
+		    count > (SIZE_MAX - MIDIPACK_HEADER_MAXSIZE - bufsize)
+		    / MIDIPACK_EVENT_MAXSIZE) {
+			warnx("midi stream is too large to pack");
+			return NULL;
+		}
+		bufsize += MIDIPACK_HEADER_MAXSIZE +
+		    count * MIDIPACK_EVENT_MAXSIZE;
+	}
+
+	if ((buf = malloc(bufsize)) == NULL) {
+		warn("malloc in _mdl_midipack_stream");
+		return NULL;
+	}
+
+	*size = 0;
+
+	for (i = 0; i < songstreams->trackcount; i++) {
+		track = &songstreams->tracks[i];
+		if (track->midi_es->count == 0)
+			continue;
+		namelen = strlen(track->name);
+		if (namelen == 0 || namelen > MIDIPACK_TRACKNAME_MAX) {
+			warnx("can not pack track with name \"%s\"",
+			    track->name);
+			goto error;
+		}
+		n = midipack_track(track->name, track->midi_es, &buf[*size]);
+		if (n == 0)
+			goto error;
+		*size += n;
+	}
+
+	n = midipack_track("", songstreams->conductor_es, &buf[*size]);
+	if (n == 0)
+		goto error;
+	*size += n;
+
+	return buf;
+
+error:
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Return a newly allocated patch of the packed song in stream (of size
+ * bytes) against base, which has the headers of unchanged tracks for all
+ * tracks of the song that sequencer has.  Tracks that are in base with
+ * the same name and digest are replaced by those headers, unless their
+ * events take less space.  The size of the patch is returned in
+ * patch_size.  Returns NULL on failure.
+ */
+u_int8_t *
+_mdl_midipack_patch(const u_int8_t *stream, size_t size,
+    const u_int8_t *base, size_t base_size, size_t *patch_size, int level)
+{
+	char name[MIDIPACK_TRACKNAME_MAX + 1];
+	u_int64_t digest;
+	u_int8_t *patch;
+	size_t changed, end, events, start;
+	ssize_t n;
+
+	/* Headers of unchanged tracks are used only when they are smaller. */
+	if ((patch = malloc(size)) == NULL) {
+		warn("malloc in _mdl_midipack_patch");
+		return NULL;
+	}
+
+	*patch_size = 0;
+	changed = 0;
+
+	for (start = 0; start < size; start = end) {
+		n = _mdl_midipack_decode_track(&stream[start], size - start,
+		    name);
+		if (n <= 0)
+			goto error;
+		if ((end = midipack_track_end(stream, size, start + n)) == 0)
+			goto error;
+
+		events = end - start - n;
+		digest = _mdl_midipack_digest(MIDIPACK_DIGEST_INIT,
+		    &stream[start + n], events);
+
+		if (events > MIDIPACK_DIGEST_SIZE &&
+		    midipack_base_has(base, base_size, name, digest)) {
+			_mdl_log(MDLLOG_MIDISTREAM, level,
+			    "track \"%s\" has not changed\n", name);
+			*patch_size += _mdl_midipack_encode_same_track(name,
+			    digest, &patch[*patch_size]);
+		} else {
+			memcpy(&patch[*patch_size], &stream[start],
+			    end - start);
+			*patch_size += end - start;
+			changed++;
+		}
+	}
+
+	if (changed == 0)
+		_mdl_log(MDLLOG_MIDISTREAM, level, "song has not changed\n");
+
+	return patch;
+
+error:
+	warnx("invalid packed midi stream for a patch");
+	free(patch);
+	return NULL;
+}
+
+/*
+ * Check that buf holds whole encoded tracks and that the last event is
+ * MIDIEV_SONG_END.
+ */
+int
+_mdl_midipack_is_complete(const u_int8_t *buf, size_t size)
+{
+	char name[MIDIPACK_TRACKNAME_MAX + 1];
+	struct timed_midievent tme;
+	u_int32_t time_bits;
+	ssize_t n;
+
+	if (size == 0 || buf[0] != MIDIPACK_TRACK_OPCODE)
+		return 0;
+
+	time_bits = 0;
+	tme.midiev.evtype = MIDIEV_TYPECOUNT;
+
+	while (size > 0) {
+		if (buf[0] == MIDIPACK_TRACK_OPCODE) {
+			n = _mdl_midipack_decode_track(buf, size, name);
+			time_bits = 0;
+			tme.midiev.evtype = MIDIEV_TYPECOUNT;
+		} else {
+			n = _mdl_midipack_decode(buf, size, &time_bits, &tme);
+		}
+		if (n <= 0)
+			return 0;
+		buf += n;
+		size -= n;
+	}
+
+	return tme.midiev.evtype == MIDIEV_SONG_END;
+}
+
+/* Check if base has an unchanged track with name and digest. */
+static int
+midipack_base_has(const u_int8_t *base, size_t base_size, const char *name,
+    u_int64_t digest)
+{
+	char base_name[MIDIPACK_TRACKNAME_MAX + 1];
+	u_int64_t base_digest;
+	ssize_t n;
+
+	for (; base_size > 0; base += n, base_size -= n) {
+		n = _mdl_midipack_decode_same_track(base, base_size,
+		    base_name, &base_digest);
+		if (n <= 0)
+			return 0;
+		if (base_digest == digest && strcmp(base_name, name) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode a header that starts with opcode from buf (of size bytes), with
+ * the track name copied to name, which must have room for
+ * MIDIPACK_TRACKNAME_MAX + 1 bytes.
+ */
+static ssize_t
+midipack_decode_header(const u_int8_t *buf, size_t size, u_int8_t opcode,
+    char *name)
+{
+	size_t namelen;
+
+	if (size == 0)
+		return 0;
+
+	if (buf[0] != opcode) {
+		warnx("expected a track header in packed midi stream");
+		return -1;
+	}
+
+	if (size < 2)
+		return 0;
+
+	namelen = buf[1];
+	if (size - 2 < namelen)
+		return 0;
+
+	if (memchr(&buf[2], '\0', namelen) != NULL) {
+		warnx("invalid track name in packed midi stream");
+		return -1;
+	}
+
+	memcpy(name, &buf[2], namelen);
+	name[namelen] = '\0';
+
+	return 2 + namelen;
+}
+
+/* Zero is always +0.0, so that its bit pattern is the smallest. */
+static u_int32_t
+midipack_float_bits(float value)
+{
+	u_int32_t bits;
+
+	if (value == 0)
+		return 0;
+
+	memcpy(&bits, &value, sizeof(bits));
+
+	return bits;
+}
+
+static u_int32_t
+midipack_get_le32(const u_int8_t *buf)
+{
+	return (u_int32_t)buf[0] | (u_int32_t)buf[1] << 8 |
+	    (u_int32_t)buf[2] << 16 | (u_int32_t)buf[3] << 24;
+}
+
+static size_t
+midipack_payload_size(enum midievent_type evtype)
+{
+	switch (evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+	case MIDIEV_VOLUMECHANGE:
+		return 1;
+	case MIDIEV_NOTEOFF:
+	case MIDIEV_NOTEON:
+		return 2;
+	case MIDIEV_TEMPOCHANGE:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static void
+midipack_put_le32(u_int8_t *buf, u_int32_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/*
+ * Encode a track header for name and the events of es to buf.  Returns
+ * the number of bytes written, or 0 if an event is not valid.
+ */
+static size_t
+midipack_track(const char *name, const struct mdl_stream *es, u_int8_t *buf)
+{
+	u_int32_t time_bits;
+	size_t i, n, namelen, size;
+
+	namelen = strlen(name);
+	assert(namelen <= MIDIPACK_TRACKNAME_MAX);
+
+	buf[0] = MIDIPACK_TRACK_OPCODE;
+	buf[1] = namelen;
+	memcpy(&buf[2], name, namelen);
+	size = 2 + namelen;
+
+	time_bits = 0;
+
+	for (i = 0; i < es->count; i++) {
+		n = _mdl_midipack_encode(&es->u.timed_midievents[i],
+		    &time_bits, &buf[size]);
+		if (n == 0)
+			return 0;
+		size += n;
+	}
+
+	return size;
+}
+
+/*
+ * Return the offset of the end of the track in stream (of size bytes)
+ * whose events start at offset, or 0 if the events are not valid.
+ */
+static size_t
+midipack_track_end(const u_int8_t *stream, size_t size, size_t offset)
+{
+	struct timed_midievent tme;
+	u_int32_t time_bits;
+	ssize_t n;
+
+	time_bits = 0;
+
+	while (offset < size && stream[offset] != MIDIPACK_TRACK_OPCODE) {
+		n = _mdl_midipack_decode(&stream[offset], size - offset,
+		    &time_bits, &tme);
+		if (n <= 0)
+			return 0;
+		offset += n;
+	}
+
+	return offset;
+}
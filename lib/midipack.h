@@ -0,0 +1,91 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_MIDIPACK_H
+#define MDL_MIDIPACK_H
+
+#include "midi.h"
+
+/*
+ * Packed encoding of timed midi events, used on the pipe from interpreter
+ * to sequencer and for streams held in memory by sequencer and mdld.
+ * Each event starts with an opcode byte that has the event type in the
+ * high three bits, a flag telling if a time delta follows, and the midi
+ * channel in the low four bits.  The time delta is an unsigned LEB128
+ * varint of the difference between the bit patterns of the event time
+ * and the previous event time (as floats), so times come out exactly as
+ * they went in.  The opcode and time are followed by the type-specific
+ * payload: note and velocity for notes, one byte for instrument and
+ * volume changes and a little-endian float for tempo changes.  Joins
+ * are resolved when compiling (see midistream.c), so packed notes carry
+ * no join marker.
+ *
+ * A packed song is a sequence of tracks, each starting with a header of
+ * MIDIPACK_TRACK_OPCODE, the length of the track name and the name
+ * itself.  Time deltas start from zero in each track.  The conductor
+ * track, with an empty name, comes last and ends with MIDIEV_SONG_END.
+ *
+ * A song may also be sent as a patch against the song sequencer has.
+ * Then a track that has not changed is sent only as a header of
+ * MIDIPACK_SAME_TRACK_OPCODE, the name length, the name and the digest
+ * of its encoded events (little-endian), and sequencer takes the events
+ * from its own copy of the track.
+ */
+
+#define MIDIPACK_CHANNEL_MASK	0x0f
+#define MIDIPACK_DELTA_FLAG	0x10
+#define MIDIPACK_EVTYPE_SHIFT	5
+
+#define MIDIPACK_TRACK_OPCODE	(MIDIEV_TYPECOUNT << MIDIPACK_EVTYPE_SHIFT)
+#define MIDIPACK_SAME_TRACK_OPCODE	(MIDIPACK_TRACK_OPCODE | 1)
+#define MIDIPACK_TRACKNAME_MAX	255
+
+/* Digests are 64-bit FNV-1a hashes. */
+#define MIDIPACK_DIGEST_INIT	0xcbf29ce484222325ULL
+#define MIDIPACK_DIGEST_SIZE	8
+
+/* Opcode, time delta of at most five bytes and a float payload. */
+#define MIDIPACK_EVENT_MAXSIZE	10
+
+/* Opcode, name length and the name. */
+#define MIDIPACK_HEADER_MAXSIZE	(2 + MIDIPACK_TRACKNAME_MAX)
+
+/* Header of an unchanged track, which has the digest as well. */
+#define MIDIPACK_SAME_HEADER_MAXSIZE	\
+    (MIDIPACK_HEADER_MAXSIZE + MIDIPACK_DIGEST_SIZE)
+
+struct songstreams;
+
+__BEGIN_DECLS
+size_t	_mdl_midipack_encode(const struct timed_midievent *, u_int32_t *,
+    u_int8_t *);
+ssize_t	_mdl_midipack_decode(const u_int8_t *, size_t, u_int32_t *,
+    struct timed_midievent *);
+ssize_t	_mdl_midipack_decode_track(const u_int8_t *, size_t, char *);
+ssize_t	_mdl_midipack_decode_same_track(const u_int8_t *, size_t, char *,
+    u_int64_t *);
+size_t	_mdl_midipack_encode_same_track(const char *, u_int64_t,
+    u_int8_t *);
+u_int64_t _mdl_midipack_digest(u_int64_t, const u_int8_t *, size_t);
+u_int8_t *_mdl_midipack_stream(const struct songstreams *, size_t *);
+u_int8_t *_mdl_midipack_patch(const u_int8_t *, size_t, const u_int8_t *,
+    size_t, size_t *, int);
+int	_mdl_midipack_is_complete(const u_int8_t *, size_t);
+__END_DECLS
+
+#endif /* !MDL_MIDIPACK_H */
@@ -22,14 +22,18 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "context.h"
 #include "functions.h"
 #include "midi.h"
 #include "midistream.h"
 #include "relative.h"
+#include "simplify.h"
+#include "song.h"
 #include "util.h"
 
 #define DEFAULT_VELOCITY	80
@@ -41,14 +45,37 @@ struct miditrack {
 	int			total_notecount;
 };
 
+/*
+ * Branches of a top-level simultence can be converted to sorted
+ * midistreams independently of each other, see compile_branches().
+ */
+struct branch {
+	struct mdl_ctx	       *ctx;
+	struct musicexpr       *me;
+	struct mdl_stream      *midistream_es;
+	float			length;
+	int			ret;
+};
+
+struct branch_compiler {
+	pthread_mutex_t		mtx;
+	struct song	       *song;
+	struct branch	       *branches;
+	size_t			branchcount;
+	size_t			next_branch;
+	int			level;
+};
+
+static int	musicexpr_to_songstreams(struct mdl_ctx *,
+    struct musicexpr *, struct songstreams *, int);
 static struct mdl_stream *midi_mdlstream_new(void);
 static struct mdl_stream *midistream_mdlstream_new(void);
-static struct mdl_stream *midistream_to_midievents(struct mdl_stream *,
-    float, int);
+static int	midistream_to_songstreams(struct song *,
+    struct mdl_stream *, float, struct songstreams *, int);
 
 static struct mdl_stream *offsetexpr_mdlstream_new(void);
-static struct mdl_stream *offsetexprstream_to_midievents(struct mdl_stream *,
-    float, int);
+static int	offsetexprstream_to_songstreams(struct song *,
+    struct mdl_stream *, float, struct songstreams *, int);
 
 static int	add_marker_to_midistream(struct mdl_stream *, float);
 static int	add_note_to_midistream(struct mdl_stream *,
@@ -62,65 +89,146 @@ static int	add_instrument_change_to_midievents(struct mdl_stream *,
     struct instrument *, int, float);
 static int	add_marker_to_midievents(struct mdl_stream *, float);
 static int	add_noteoff_to_midievents(struct mdl_stream *,
-    struct trackmidievent *, struct miditrack *, float, int);
+    const struct midistreamevent *, struct track *, struct miditrack *,
+    int);
 static int	add_noteon_to_midievents(struct mdl_stream *,
-    struct trackmidievent *, struct miditrack *, float, int);
+    const struct midistreamevent *, struct track *, struct miditrack *,
+    int);
 static int	add_volumechange_to_midievents(struct mdl_stream *,
     u_int8_t, int, float);
 
-static int	lookup_midichannel(struct trackmidievent *,
-    struct miditrack *, int);
+static int	lookup_midichannel(struct track *, struct miditrack *, int);
 
-static int	handle_midistreamevent(struct midistreamevent *,
-    struct mdl_stream *, struct miditrack *, int);
+static int	handle_midistreamevent(const struct midistreamevent *,
+    struct song *, struct songstreams *, struct miditrack *, int);
 
 static int	add_musicexpr_to_midistream(struct mdl_stream *,
     const struct musicexpr *, float, int);
-static int	compare_midievents(const struct midievent *,
-    const struct midievent *);
+static size_t	midistream_eventcount(const struct musicexpr *);
+
+static struct musicexpr *independent_branches(struct musicexpr *);
+static int	compile_branches(struct mdl_ctx *, struct song *,
+    struct musicexpr *, struct songstreams *, int);
+static void    *compile_branches_thread(void *);
+static int	compile_branch(struct song *, struct branch *, int);
+static struct mdl_stream *merge_midistreams(struct branch *, size_t);
+static void	resolve_joins(struct mdl_stream *);
+static int	join_follows(const struct mdl_stream *, size_t);
+static int	sorted_midistream_to_songstreams(struct song *,
+    struct mdl_stream *, float, struct songstreams *, int);
+static struct mdl_stream *merge_songstreams(const struct songstreams *);
+
 static int	compare_midistreamevents(const void *, const void *);
-static int	compare_timed_midievents(const void *, const void *);
+
+void
+_mdl_midistream_set_compile_threads(struct mdl_ctx *ctx, int threads)
+{
+	assert(1 <= threads && threads <= MAX_COMPILE_THREADS);
+
+	ctx->compile_threads = threads;
+}
 
 struct mdl_stream *
-_mdl_musicexpr_to_midievents(struct musicexpr *me, int level)
+_mdl_musicexpr_to_midievents(struct mdl_ctx *ctx, struct musicexpr *me,
+    int level)
 {
-	struct mdl_stream *offset_es, *midi_es;
-	struct musicexpr *flatme, *p;
+	struct songstreams songstreams;
+	struct mdl_stream *midi_es;
+
+	if (_mdl_musicexpr_to_songstreams(ctx, me, &songstreams, level) != 0)
+		return NULL;
+
+	midi_es = merge_songstreams(&songstreams);
+
+	_mdl_songstreams_free(&songstreams);
+
+	return midi_es;
+}
+
+/*
+ * Convert me to sorted midi event streams in songstreams, one for each
+ * track of the song and one for the events that belong to no track.
+ * Returns 0 on success, and on error 1 with songstreams left empty.
+ */
+int
+_mdl_musicexpr_to_songstreams(struct mdl_ctx *ctx, struct musicexpr *me,
+    struct songstreams *songstreams, int level)
+{
+	struct mdl_ctx *old_ctx;
+	int ret;
+
+	songstreams->tracks = NULL;
+	songstreams->trackcount = 0;
+	songstreams->conductor_es = NULL;
+
+	if (ctx == NULL) {
+		warnx("no library context for converting music expression");
+		return 1;
+	}
+
+	old_ctx = _mdl_ctx_get();
+	if (_mdl_ctx_set(ctx) != 0)
+		return 1;
+
+	ret = musicexpr_to_songstreams(ctx, me, songstreams, level);
+
+	(void) _mdl_ctx_set(old_ctx);
+
+	return ret;
+}
+
+static int
+musicexpr_to_songstreams(struct mdl_ctx *ctx, struct musicexpr *me,
+    struct songstreams *songstreams, int level)
+{
+	struct mdl_stream *offset_es;
+	struct musicexpr *branches, *flatme, *p;
 	struct song *song;
+	size_t count;
+	int ret;
 
 	_mdl_log(MDLLOG_MIDISTREAM, level,
 	    "converting music expression to midi stream\n");
 
-	midi_es = NULL;
+	ret = 1;
 	flatme = NULL;
 
 	if ((offset_es = offsetexpr_mdlstream_new()) == NULL) {
 		warnx("could not setup new offsetexprstream");
-		return NULL;
-	}
-
-	if (_mdl_functions_apply(me, level+1) != 0) {
-		warnx("problem applying functions");
-		_mdl_stream_free(offset_es);
-		return NULL;
+		return 1;
 	}
 
 	if ((song = _mdl_song_new()) == NULL) {
 		warnx("could not create a new song");
 		_mdl_stream_free(offset_es);
-		return NULL;
+		return 1;
 	}
 
 	if (_mdl_song_setup_tracks(song, me, level+1) != 0) {
 		warnx("could not setup tracks for a new song");
 		_mdl_stream_free(offset_es);
 		_mdl_song_free(song);
-		return NULL;
+		return 1;
 	}
 
+	/*
+	 * Once tracks are set up, branches of a top-level simultence do not
+	 * depend on each other and can be compiled in separate threads.
+	 */
+	if (ctx->compile_threads > 1 &&
+	    (branches = independent_branches(me)) != NULL) {
+		ret = compile_branches(ctx, song, branches, songstreams,
+		    level+1);
+		goto finish;
+	}
+
+	/*
+	 * Functions are applied while setting up tracks, and joins are
+	 * tagged during relative->absolute conversion.
+	 */
 	_mdl_musicexpr_relative_to_absolute(song, me, level+1);
 
-	_mdl_musicexpr_tag_expressions_for_joining(me, level);
+	_mdl_musicexpr_simplify(me, level+1);
 
 	_mdl_log(MDLLOG_MIDISTREAM, level,
 	    "converting expression to a (flat) simultence\n");
@@ -133,6 +241,11 @@ _mdl_musicexpr_to_midievents(struct musicexpr *me, int level)
 
 	_mdl_log(MDLLOG_MIDISTREAM, level,
 	    "making offset expression stream\n");
+	count = 0;
+	TAILQ_FOREACH(p, &flatme->u.flatsimultence.me->u.melist, tq)
+		count++;
+	if (_mdl_stream_reserve(offset_es, count) != 0)
+		goto finish;
 	TAILQ_FOREACH(p, &flatme->u.flatsimultence.me->u.melist, tq) {
 		assert(p->me_type == ME_TYPE_OFFSETEXPR);
 		offset_es->u.mexprs[ offset_es->count ] = p->u.offsetexpr;
@@ -140,8 +253,8 @@ _mdl_musicexpr_to_midievents(struct musicexpr *me, int level)
 			goto finish;
 	}
 
-	midi_es = offsetexprstream_to_midievents(offset_es,
-	    flatme->u.flatsimultence.length, level);
+	ret = offsetexprstream_to_songstreams(song, offset_es,
+	    flatme->u.flatsimultence.length, songstreams, level);
 
 finish:
 	_mdl_stream_free(offset_es);
@@ -149,38 +262,126 @@ finish:
 	if (flatme != NULL)
 		_mdl_musicexpr_free(flatme, level);
 
-	return midi_es;
+	return ret;
+}
+
+void
+_mdl_songstreams_free(struct songstreams *songstreams)
+{
+	size_t i;
+
+	for (i = 0; i < songstreams->trackcount; i++) {
+		free(songstreams->tracks[i].name);
+		if (songstreams->tracks[i].midi_es != NULL)
+			_mdl_stream_free(songstreams->tracks[i].midi_es);
+	}
+	free(songstreams->tracks);
+
+	if (songstreams->conductor_es != NULL)
+		_mdl_stream_free(songstreams->conductor_es);
+
+	songstreams->tracks = NULL;
+	songstreams->trackcount = 0;
+	songstreams->conductor_es = NULL;
 }
 
+/*
+ * Keep only the tracks of songstreams that are in names (of size bytes,
+ * each name terminated by NUL), and only the song end in the conductor
+ * stream, for replacing those tracks in a song that is playing.  Tracks
+ * are compiled with the whole song, so that their midi channels are as
+ * they would be if the whole song was played.
+ */
+void
+_mdl_songstreams_select_tracks(struct songstreams *songstreams,
+    const char *names, size_t size, int level)
+{
+	struct mdl_stream *conductor_es;
+	struct trackstream *track;
+	const char *p;
+	size_t i, kept;
+
+	kept = 0;
+
+	for (i = 0; i < songstreams->trackcount; i++) {
+		track = &songstreams->tracks[i];
+		for (p = names; p < names + size; p += strlen(p) + 1)
+			if (strcmp(p, track->name) == 0)
+				break;
+		if (p == names + size) {
+			free(track->name);
+			_mdl_stream_free(track->midi_es);
+			continue;
+		}
+		_mdl_log(MDLLOG_MIDISTREAM, level, "selected track \"%s\"\n",
+		    track->name);
+		songstreams->tracks[ kept++ ] = *track;
+	}
+
+	songstreams->trackcount = kept;
+
+	conductor_es = songstreams->conductor_es;
+	assert(conductor_es->count > 0);
+	conductor_es->u.timed_midievents[0] =
+	    conductor_es->u.timed_midievents[ conductor_es->count - 1 ];
+	conductor_es->count = 1;
+	assert(conductor_es->u.timed_midievents[0].midiev.evtype ==
+	    MIDIEV_SONG_END);
+}
+
+/*
+ * Write songstreams to sequencer_read_pipe, as packed to packed (of
+ * packed_size bytes) with _mdl_midipack_stream().
+ */
 ssize_t
-_mdl_midi_write_midistream(int sequencer_read_pipe, struct mdl_stream *s,
-    int level)
+_mdl_midi_write_midistream(int sequencer_read_pipe,
+    const struct songstreams *songstreams, const u_int8_t *packed,
+    size_t packed_size, int level)
 {
+	const struct trackstream *trackstream;
+	const struct mdl_stream *s;
 	ssize_t nw, total_wcount, wsize;
-	size_t i;
+	size_t i, j;
 
 	_mdl_log(MDLLOG_MIDISTREAM, level,
 	    "writing midi stream to sequencer\n");
 
 	level += 1;
 
-	if ((SSIZE_MAX / sizeof(struct timed_midievent)) < s->count) {
+	if (packed_size > SSIZE_MAX) {
 		warnx("midistream size overflow, not writing anything");
 		return -1;
 	}
 
 	total_wcount = 0;
 
+	for (i = 0; i < songstreams->trackcount; i++) {
+		trackstream = &songstreams->tracks[i];
+		s = trackstream->midi_es;
+		if (s->count == 0)
+			continue;
+		_mdl_log(MDLLOG_MIDISTREAM, level,
+		    "sending track \"%s\" to sequencer\n", trackstream->name);
+		for (j = 0; j < s->count; j++) {
+			_mdl_timed_midievent_log(MDLLOG_MIDISTREAM,
+			    "sending to sequencer", &s->u.timed_midievents[j],
+			    level+1);
+		}
+	}
+
+	_mdl_log(MDLLOG_MIDISTREAM, level,
+	    "sending conductor stream to sequencer\n");
+	s = songstreams->conductor_es;
 	for (i = 0; i < s->count; i++) {
 		_mdl_timed_midievent_log(MDLLOG_MIDISTREAM,
-		    "sending to sequencer", &s->u.timed_midievents[i], level);
+		    "sending to sequencer", &s->u.timed_midievents[i],
+		    level+1);
 	}
 
-	wsize = s->count * sizeof(struct timed_midievent);
+	wsize = packed_size;
 
 	while (total_wcount < wsize) {
-		nw = write(sequencer_read_pipe,
-		    ((char *) s->u.timed_midievents + total_wcount),
+		nw = write(sequencer_read_pipe, packed + total_wcount,
 		    (wsize - total_wcount));
 		if (nw == -1) {
 			if (errno == EINTR)
@@ -215,15 +416,16 @@ offsetexpr_mdlstream_new(void)
 	return _mdl_stream_new(OFFSETEXPRS);
 }
 
-static struct mdl_stream *
-offsetexprstream_to_midievents(struct mdl_stream *offset_es, float song_length,
-    int level)
+static int
+offsetexprstream_to_songstreams(struct song *song,
+    struct mdl_stream *offset_es, float song_length,
+    struct songstreams *songstreams, int level)
 {
-	struct mdl_stream *midi_es, *midistream_es;
+	struct mdl_stream *midistream_es;
 	struct musicexpr *me;
 	struct offsetexpr offsetexpr;
 	float timeoffset;
-	size_t i;
+	size_t count, i;
 	int ret;
 
 	assert(offset_es->s_type == OFFSETEXPRS);
@@ -231,12 +433,17 @@ offsetexprstream_to_midievents(struct mdl_stream *offset_es, float song_length,
 	_mdl_log(MDLLOG_MIDISTREAM, level+1,
 	    "offset expression stream to midi events\n");
 
-	midi_es = NULL;
 	midistream_es = NULL;
 
 	if ((midistream_es = midistream_mdlstream_new()) == NULL)
 		goto error;
 
+	count = 0;
+	for (i = 0; i < offset_es->count; i++)
+		count += midistream_eventcount(offset_es->u.mexprs[i].me);
+	if (_mdl_stream_reserve(midistream_es, count) != 0)
+		goto error;
+
 	for (i = 0; i < offset_es->count; i++) {
 		offsetexpr = offset_es->u.mexprs[i];
 		me = offsetexpr.me;
@@ -255,33 +462,513 @@ offsetexprstream_to_midievents(struct mdl_stream *offset_es, float song_length,
 	qsort(midistream_es->u.midistreamevents, midistream_es->count,
 	    sizeof(struct midistreamevent), compare_midistreamevents);
 
-	midi_es = midistream_to_midievents(midistream_es, song_length,
-	    level);
-	if (midi_es == NULL)
+	ret = sorted_midistream_to_songstreams(song, midistream_es,
+	    song_length, songstreams, level);
+	if (ret != 0)
 		goto error;
 
+	_mdl_stream_free(midistream_es);
+
+	return 0;
+
+error:
+	warnx("could not convert offset-expression-stream to midi stream");
+	if (midistream_es)
+		_mdl_stream_free(midistream_es);
+
+	return 1;
+}
+
+static int
+sorted_midistream_to_songstreams(struct song *song,
+    struct mdl_stream *midistream_es, float song_length,
+    struct songstreams *songstreams, int level)
+{
+	struct mdl_stream *midi_es;
+	size_t i;
+
+	if (midistream_to_songstreams(song, midistream_es, song_length,
+	    songstreams, level) != 0)
+		return 1;
+
 	/*
 	 * Sort again, because midi channels for notes have likely been
 	 * changed (by allocating them dynamically) and we want the midi
 	 * event order to be fully deterministic.
 	 */
+	for (i = 0; i < songstreams->trackcount; i++) {
+		midi_es = songstreams->tracks[i].midi_es;
+		qsort(midi_es->u.timed_midievents, midi_es->count,
+		    sizeof(struct timed_midievent),
+		    _mdl_midi_compare_timed_midievents);
+		resolve_joins(midi_es);
+	}
+
+	midi_es = songstreams->conductor_es;
 	qsort(midi_es->u.timed_midievents, midi_es->count,
-	    sizeof(struct timed_midievent), compare_timed_midievents);
+	    sizeof(struct timed_midievent),
+	    _mdl_midi_compare_timed_midievents);
 
-	_mdl_stream_free(midistream_es);
+	return 0;
+}
+
+/*
+ * Merge the track streams and the conductor stream of songstreams to one
+ * stream.  Tracks are few, so the next event is simply searched for from
+ * the heads of all streams.  On ties the earlier stream wins, which keeps
+ * the result deterministic.
+ */
+static struct mdl_stream *
+merge_songstreams(const struct songstreams *songstreams)
+{
+	const struct mdl_stream *es, *min_es;
+	struct mdl_stream *midi_es;
+	size_t *positions, count, i, min_i;
+
+	positions = calloc(songstreams->trackcount + 1, sizeof(size_t));
+	if (positions == NULL) {
+		warn("calloc in merge_songstreams");
+		return NULL;
+	}
+
+	if ((midi_es = midi_mdlstream_new()) == NULL) {
+		free(positions);
+		return NULL;
+	}
+
+	count = songstreams->conductor_es->count;
+	for (i = 0; i < songstreams->trackcount; i++)
+		count += songstreams->tracks[i].midi_es->count;
+	if (_mdl_stream_reserve(midi_es, count) != 0)
+		goto error;
+
+	min_i = 0;
+	for (;;) {
+		min_es = NULL;
+		for (i = 0; i <= songstreams->trackcount; i++) {
+			es = (i < songstreams->trackcount)
+			       ? songstreams->tracks[i].midi_es
+			       : songstreams->conductor_es;
+			if (positions[i] == es->count)
+				continue;
+			if (min_es != NULL &&
+			    _mdl_midi_compare_timed_midievents(
+			    &es->u.timed_midievents[ positions[i] ],
+			    &min_es->u.timed_midievents[ positions[min_i] ])
+			    >= 0)
+				continue;
+			min_es = es;
+			min_i = i;
+		}
+		if (min_es == NULL)
+			break;
+
+		midi_es->u.timed_midievents[ midi_es->count ] =
+		    min_es->u.timed_midievents[ positions[min_i]++ ];
+		if (_mdl_stream_increment(midi_es) != 0)
+			goto error;
+	}
+
+	free(positions);
 
 	return midi_es;
 
 error:
-	warnx("could not convert offset-expression-stream to midi stream");
-	if (midistream_es)
+	free(positions);
+	_mdl_stream_free(midi_es);
+	return NULL;
+}
+
+/*
+ * A noteoff that wants a join, with a noteon for the same note at the
+ * exact same time in the same track, is removed together with that
+ * noteon, so the note simply continues on.  Doing this here means
+ * players never see joins, and noteoffs that were not joined lose their
+ * join marker.
+ */
+static void
+resolve_joins(struct mdl_stream *midi_es)
+{
+	u_int8_t joined[MIDI_CHANNEL_COUNT][MIDI_NOTE_COUNT];
+	struct timed_midievent *events;
+	struct midinote *midinote;
+	size_t i, j;
+
+	memset(joined, 0, sizeof(joined));
+
+	events = midi_es->u.timed_midievents;
+
+	for (i = 0, j = 0; i < midi_es->count; i++) {
+		midinote = &events[i].midiev.u.midinote;
+
+		switch (events[i].midiev.evtype) {
+		case MIDIEV_NOTEOFF:
+			if (midinote->joining && join_follows(midi_es, i)) {
+				joined[ midinote->channel ][ midinote->note ]
+				    = 1;
+				continue;
+			}
+			midinote->joining = 0;
+			break;
+		case MIDIEV_NOTEON:
+			if (joined[ midinote->channel ][ midinote->note ]) {
+				joined[ midinote->channel ][ midinote->note ]
+				    = 0;
+				continue;
+			}
+			break;
+		default:
+			break;
+		}
+
+		if (i != j)
+			events[j] = events[i];
+		j++;
+	}
+
+	midi_es->count = j;
+}
+
+/*
+ * Check if there is a noteon for the note of the noteoff at index i of
+ * midi_es at the same time.  midi_es must be sorted.
+ */
+static int
+join_follows(const struct mdl_stream *midi_es, size_t i)
+{
+	const struct timed_midievent *noteoff, *p;
+	size_t j;
+
+	noteoff = &midi_es->u.timed_midievents[i];
+
+	for (j = i + 1; j < midi_es->count; j++) {
+		p = &midi_es->u.timed_midievents[j];
+		if (p->time_as_measures != noteoff->time_as_measures)
+			break;
+		if (p->midiev.evtype == MIDIEV_NOTEON &&
+		    p->midiev.u.midinote.channel ==
+		    noteoff->midiev.u.midinote.channel &&
+		    p->midiev.u.midinote.note ==
+		    noteoff->midiev.u.midinote.note)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the top-level simultence of me if it has more than one branch,
+ * otherwise NULL.
+ */
+static struct musicexpr *
+independent_branches(struct musicexpr *me)
+{
+	struct musicexpr *p;
+
+	while (me->me_type == ME_TYPE_SEQUENCE) {
+		p = TAILQ_FIRST(&me->u.melist);
+		if (p == NULL || TAILQ_NEXT(p, tq) != NULL)
+			return NULL;
+		me = p;
+	}
+
+	if (me->me_type != ME_TYPE_SIMULTENCE)
+		return NULL;
+
+	p = TAILQ_FIRST(&me->u.melist);
+	if (p == NULL || TAILQ_NEXT(p, tq) == NULL)
+		return NULL;
+
+	return me;
+}
+
+/*
+ * Convert each branch of simultence to a sorted midistream, using up to
+ * ctx->compile_threads threads, and then merge the branch midistreams.  Midi
+ * channels are allocated only after merging, because tracks in different
+ * branches share them.
+ */
+static int
+compile_branches(struct mdl_ctx *ctx, struct song *song,
+    struct musicexpr *simultence, struct songstreams *songstreams, int level)
+{
+	struct branch_compiler bc;
+	struct mdl_stream *midistream_es;
+	struct musicexpr *p;
+	pthread_t threads[MAX_COMPILE_THREADS];
+	size_t i, threadcount;
+	float song_length;
+	int error, ret;
+
+	assert(simultence->me_type == ME_TYPE_SIMULTENCE);
+
+	midistream_es = NULL;
+	ret = 1;
+
+	bc.song = song;
+	bc.branchcount = 0;
+	bc.next_branch = 0;
+	bc.level = level+1;
+
+	TAILQ_FOREACH(p, &simultence->u.melist, tq)
+		bc.branchcount++;
+
+	_mdl_log(MDLLOG_MIDISTREAM, level,
+	    "compiling %zu branches with %d threads\n", bc.branchcount,
+	    MIN((size_t)ctx->compile_threads, bc.branchcount));
+
+	bc.branches = calloc(bc.branchcount, sizeof(struct branch));
+	if (bc.branches == NULL) {
+		warn("calloc in compile_branches");
+		return 1;
+	}
+
+	/*
+	 * Each branch is compiled with a context of its own, so that threads
+	 * do not share log state and logs come out in branch order.
+	 */
+	i = 0;
+	TAILQ_FOREACH(p, &simultence->u.melist, tq) {
+		bc.branches[i].ctx = _mdl_ctx_new_branch(ctx, i,
+		    bc.branchcount);
+		if (bc.branches[i].ctx == NULL) {
+			while (i-- > 0)
+				_mdl_ctx_free(bc.branches[i].ctx);
+			free(bc.branches);
+			return 1;
+		}
+		bc.branches[i].me = p;
+		bc.branches[i].midistream_es = NULL;
+		bc.branches[i].ret = 1;
+		i++;
+	}
+
+	if ((ret = pthread_mutex_init(&bc.mtx, NULL)) != 0) {
+		warnx("pthread_mutex_init: %s", strerror(ret));
+		for (i = 0; i < bc.branchcount; i++)
+			_mdl_ctx_free(bc.branches[i].ctx);
+		free(bc.branches);
+		return 1;
+	}
+
+	/* This thread compiles branches as well. */
+	threadcount = MIN((size_t)ctx->compile_threads, bc.branchcount) - 1;
+	for (i = 0; i < threadcount; i++) {
+		ret = pthread_create(&threads[i], NULL,
+		    compile_branches_thread, &bc);
+		if (ret != 0) {
+			warnx("could not create a compile thread: %s",
+			    strerror(ret));
+			threadcount = i;
+			break;
+		}
+	}
+
+	(void) compile_branches_thread(&bc);
+
+	for (i = 0; i < threadcount; i++) {
+		if ((ret = pthread_join(threads[i], NULL)) != 0)
+			warnx("pthread_join: %s", strerror(ret));
+	}
+
+	ret = 0;
+	for (i = 0; i < bc.branchcount; i++) {
+		if (_mdl_ctx_join_branch(ctx, bc.branches[i].ctx) != 0)
+			ret = 1;
+		bc.branches[i].ctx = NULL;
+	}
+	if (ret != 0)
+		goto finish;
+
+	ret = 1;
+	song_length = 0.0;
+	for (i = 0; i < bc.branchcount; i++) {
+		if (bc.branches[i].ret != 0)
+			goto finish;
+		song_length = MAX(song_length, bc.branches[i].length);
+	}
+
+	_mdl_log(MDLLOG_MIDISTREAM, level, "merging branch midistreams\n");
+	if ((midistream_es = merge_midistreams(bc.branches,
+	    bc.branchcount)) == NULL)
+		goto finish;
+
+	ret = sorted_midistream_to_songstreams(song, midistream_es,
+	    song_length, songstreams, level);
+
+finish:
+	if (ret != 0)
+		warnx("could not compile simultence branches to midi stream");
+
+	if (midistream_es != NULL)
 		_mdl_stream_free(midistream_es);
-	if (midi_es)
-		_mdl_stream_free(midi_es);
+
+	for (i = 0; i < bc.branchcount; i++) {
+		if (bc.branches[i].midistream_es != NULL)
+			_mdl_stream_free(bc.branches[i].midistream_es);
+	}
+
+	if ((error = pthread_mutex_destroy(&bc.mtx)) != 0)
+		warnx("pthread_mutex_destroy: %s", strerror(error));
+
+	free(bc.branches);
+
+	return ret;
+}
+
+static void *
+compile_branches_thread(void *arg)
+{
+	struct branch_compiler *bc;
+	struct branch *branch;
+	struct mdl_ctx *old_ctx;
+	int ret;
+
+	bc = arg;
+
+	/* The calling thread runs this too, so put its context back. */
+	old_ctx = _mdl_ctx_get();
+
+	for (;;) {
+		if ((ret = pthread_mutex_lock(&bc->mtx)) != 0) {
+			warnx("pthread_mutex_lock: %s", strerror(ret));
+			break;
+		}
+		branch = (bc->next_branch < bc->branchcount)
+		    ? &bc->branches[ bc->next_branch++ ]
+		    : NULL;
+		if ((ret = pthread_mutex_unlock(&bc->mtx)) != 0)
+			warnx("pthread_mutex_unlock: %s", strerror(ret));
+
+		if (branch == NULL)
+			break;
+
+		if (_mdl_ctx_set(branch->ctx) != 0)
+			continue;
+		branch->ret = compile_branch(bc->song, branch, bc->level);
+	}
+
+	(void) _mdl_ctx_set(old_ctx);
 
 	return NULL;
 }
 
+static int
+compile_branch(struct song *song, struct branch *branch, int level)
+{
+	struct musicexpr *flatme, *p;
+	size_t count;
+	int ret;
+
+	_mdl_musicexpr_relative_to_absolute(song, branch->me, level);
+
+	_mdl_musicexpr_simplify(branch->me, level);
+
+	flatme = _mdl_musicexpr_to_flat_simultence(branch->me, level);
+	if (flatme == NULL) {
+		warnx("could not flatten simultence branch");
+		return 1;
+	}
+
+	ret = 0;
+
+	if ((branch->midistream_es = midistream_mdlstream_new()) == NULL) {
+		ret = 1;
+		goto finish;
+	}
+
+	count = 0;
+	TAILQ_FOREACH(p, &flatme->u.flatsimultence.me->u.melist, tq)
+		count += midistream_eventcount(p->u.offsetexpr.me);
+	if (_mdl_stream_reserve(branch->midistream_es, count) != 0) {
+		ret = 1;
+		goto finish;
+	}
+
+	TAILQ_FOREACH(p, &flatme->u.flatsimultence.me->u.melist, tq) {
+		assert(p->me_type == ME_TYPE_OFFSETEXPR);
+		ret = add_musicexpr_to_midistream(branch->midistream_es,
+		    p->u.offsetexpr.me, p->u.offsetexpr.offset, level);
+		if (ret != 0)
+			goto finish;
+	}
+
+	qsort(branch->midistream_es->u.midistreamevents,
+	    branch->midistream_es->count, sizeof(struct midistreamevent),
+	    compare_midistreamevents);
+
+	branch->length = flatme->u.flatsimultence.length;
+
+finish:
+	_mdl_musicexpr_free(flatme, level);
+
+	return ret;
+}
+
+/*
+ * Merge sorted branch midistreams into one sorted midistream.  On equal
+ * events the earlier branch goes first, so the result does not depend on
+ * thread scheduling.
+ */
+static struct mdl_stream *
+merge_midistreams(struct branch *branches, size_t branchcount)
+{
+	struct mdl_stream *midistream_es;
+	struct midistreamevent *mse, *min_mse;
+	size_t *positions;
+	size_t count, i, min_i;
+
+	if ((midistream_es = midistream_mdlstream_new()) == NULL)
+		return NULL;
+
+	count = 0;
+	for (i = 0; i < branchcount; i++)
+		count += branches[i].midistream_es->count;
+	if (_mdl_stream_reserve(midistream_es, count) != 0) {
+		_mdl_stream_free(midistream_es);
+		return NULL;
+	}
+
+	if ((positions = calloc(branchcount, sizeof(size_t))) == NULL) {
+		warn("calloc in merge_midistreams");
+		_mdl_stream_free(midistream_es);
+		return NULL;
+	}
+
+	for (;;) {
+		min_mse = NULL;
+		min_i = 0;
+		for (i = 0; i < branchcount; i++) {
+			if (positions[i] == branches[i].midistream_es->count)
+				continue;
+			mse = &branches[i].midistream_es->u.midistreamevents[
+			    positions[i] ];
+			if (min_mse == NULL ||
+			    compare_midistreamevents(mse, min_mse) < 0) {
+				min_mse = mse;
+				min_i = i;
+			}
+		}
+
+		if (min_mse == NULL)
+			break;
+
+		midistream_es->u.midistreamevents[ midistream_es->count ] =
+		    *min_mse;
+		positions[min_i]++;
+
+		if (_mdl_stream_increment(midistream_es) != 0) {
+			_mdl_stream_free(midistream_es);
+			midistream_es = NULL;
+			break;
+		}
+	}
+
+	free(positions);
+
+	return midistream_es;
+}
+
 static int
 add_marker_to_midievents(struct mdl_stream *midi_es, float time_as_measures)
 {
@@ -297,58 +984,60 @@ add_marker_to_midievents(struct mdl_stream *midi_es, float time_as_measures)
 
 static int
 add_noteoff_to_midievents(struct mdl_stream *midi_es,
-    struct trackmidievent *tme, struct miditrack *miditracks,
-    float time_as_measures, int level)
+    const struct midistreamevent *mse, struct track *track,
+    struct miditrack *miditracks, int level)
 {
 	struct timed_midievent *tmidiev;
 	int ch;
 
-	assert(tme->midiev.evtype == MIDIEV_NOTEOFF);
+	assert(mse->evtype == MIDISTREV_NOTEOFF);
 
-	ch = lookup_midichannel(tme, miditracks, level);
+	ch = lookup_midichannel(track, miditracks, level);
 	assert(ch >= 0);
 	assert(miditracks[ch].track != NULL);
-	assert(miditracks[ch].track == tme->track);
+	assert(miditracks[ch].track == track);
 
-	miditracks[ch].notecount[ tme->midiev.u.midinote.note ] -= 1;
+	miditracks[ch].notecount[ mse->value ] -= 1;
 	miditracks[ch].total_notecount -= 1;
 	if (miditracks[ch].total_notecount == 0)
 		miditracks[ch].track = NULL;
 
 	assert(miditracks[ch].total_notecount >= 0);
 
-	if (miditracks[ch].notecount[ tme->midiev.u.midinote.note ] > 0) {
+	if (miditracks[ch].notecount[ mse->value ] > 0) {
 		/* This note must still be play, nothing to do. */
 		assert(miditracks[ch].total_notecount > 0);
 		return 0;
 	}
 
-	tme->midiev.u.midinote.channel = ch;
-
 	tmidiev = &midi_es->u.timed_midievents[ midi_es->count ];
 	memset(tmidiev, 0, sizeof(struct timed_midievent));
-	tmidiev->time_as_measures = time_as_measures;
-	tmidiev->midiev = tme->midiev;
+	tmidiev->time_as_measures = mse->time_as_measures;
+	tmidiev->midiev.evtype = MIDIEV_NOTEOFF;
+	tmidiev->midiev.u.midinote.channel = ch;
+	tmidiev->midiev.u.midinote.joining = mse->joining;
+	tmidiev->midiev.u.midinote.note = mse->value;
+	tmidiev->midiev.u.midinote.velocity = 0;
 
 	return _mdl_stream_increment(midi_es);
 }
 
 static int
 add_noteon_to_midievents(struct mdl_stream *midi_es,
-    struct trackmidievent *tme, struct miditrack *miditracks,
-    float time_as_measures, int level)
+    const struct midistreamevent *mse, struct track *track,
+    struct miditrack *miditracks, int level)
 {
 	struct timed_midievent *tmidiev;
 	struct miditrack *miditrack;
-	struct track *track;
+	float time_as_measures;
 	int ch, ret;
 
-	assert(tme->midiev.evtype == MIDIEV_NOTEON);
+	assert(mse->evtype == MIDISTREV_NOTEON);
 
-	if ((ch = lookup_midichannel(tme, miditracks, level)) == -1)
+	if ((ch = lookup_midichannel(track, miditracks, level)) == -1)
 		return 1;
 
-	track = tme->track;
+	time_as_measures = mse->time_as_measures;
 	miditrack = &miditracks[ch];
 	miditrack->track = track;
 
@@ -368,24 +1057,26 @@ add_noteon_to_midievents(struct mdl_stream *midi_es,
 		miditrack->prev_values.volume = track->volume;
 	}
 
-	miditracks[ch].notecount[ tme->midiev.u.midinote.note ] += 1;
+	miditracks[ch].notecount[ mse->value ] += 1;
 	miditracks[ch].total_notecount += 1;
 
-	if (miditracks[ch].notecount[ tme->midiev.u.midinote.note ] > 1) {
+	if (miditracks[ch].notecount[ mse->value ] > 1) {
 		/* This note is xlready playing, go to next event. */
 		/* XXX Actually retriggering note would be better...
 		 * XXX t-play-notes-already-playing.mdl is a testcase that
 		 * XXX needs fixing.  But when fixing, consider also
-		 * XXX how sequencer is handling the joined expressions. */
+		 * XXX how resolve_joins() handles the joined expressions. */
 		return 0;
 	}
 
-	tme->midiev.u.midinote.channel = ch;
-
 	tmidiev = &midi_es->u.timed_midievents[ midi_es->count ];
 	memset(tmidiev, 0, sizeof(struct timed_midievent));
 	tmidiev->time_as_measures = time_as_measures;
-	tmidiev->midiev = tme->midiev;
+	tmidiev->midiev.evtype = MIDIEV_NOTEON;
+	tmidiev->midiev.u.midinote.channel = ch;
+	tmidiev->midiev.u.midinote.joining = mse->joining;
+	tmidiev->midiev.u.midinote.note = mse->value;
+	tmidiev->midiev.u.midinote.velocity = DEFAULT_VELOCITY;
 
 	return _mdl_stream_increment(midi_es);
 }
@@ -423,18 +1114,18 @@ add_volumechange_to_midievents(struct mdl_stream *midi_es,
 }
 
 static int
-lookup_midichannel(struct trackmidievent *tme, struct miditrack *miditracks,
+lookup_midichannel(struct track *track, struct miditrack *miditracks,
     int level)
 {
 	int ch, old_ch;
 
-	old_ch = ch = tme->track->midichannel;
+	old_ch = ch = track->midichannel;
 
 	/*
 	 * If autoallocation is not on, just provide the preferred channel of
 	 * the track.
 	 */
-	if (!tme->track->autoallocate_channel) {
+	if (!track->autoallocate_channel) {
 		assert(ch >= 0);
 		return ch;
 	}
@@ -444,7 +1135,7 @@ lookup_midichannel(struct trackmidievent *tme, struct miditrack *miditracks,
 		 * Test if the midichannel this track previously used is still
 		 * reserved by this track, and use that if it is so.
 		 */
-		if (miditracks[ch].track == tme->track)
+		if (miditracks[ch].track == track)
 			goto found;
 
 		/*
@@ -452,7 +1143,7 @@ lookup_midichannel(struct trackmidievent *tme, struct miditrack *miditracks,
 		 * and reserve it for this track if that is so.
 		 */
 		if (miditracks[ch].track == NULL) {
-			miditracks[ch].track = tme->track;
+			miditracks[ch].track = track;
 			goto found;
 		}
 	}
@@ -467,13 +1158,13 @@ lookup_midichannel(struct trackmidievent *tme, struct miditrack *miditracks,
 			 * Found an available track.  Reserve this track for
 			 * us and mark it as our preferred midichannel.
 			 */
-			miditracks[ch].track = tme->track;
-			tme->track->midichannel = ch;
+			miditracks[ch].track = track;
+			track->midichannel = ch;
 			goto found;
 		}
 	}
 
-	warnx("out of available midi tracks");
+	_mdl_warnx("out of available midi tracks");
 
 	return -1;
 
@@ -482,11 +1173,11 @@ found:
 		if (old_ch == -1) {
 			_mdl_log(MDLLOG_MIDISTREAM, level,
 			    "putting track \"%s\" to midichannel %d\n",
-			    tme->track->name, ch);
+			    track->name, ch);
 		} else {
 			_mdl_log(MDLLOG_MIDISTREAM, level,
 			    "changing track \"%s\" from midichannel %d to"
-			    " %d\n", tme->track->name, old_ch, ch);
+			    " %d\n", track->name, old_ch, ch);
 		}
 	}
 
@@ -494,25 +1185,77 @@ found:
 	return ch;
 }
 
-static struct mdl_stream *
-midistream_to_midievents(struct mdl_stream *midistream_es, float song_length,
-    int level)
+static int
+midistream_to_songstreams(struct song *song, struct mdl_stream *midistream_es,
+    float song_length, struct songstreams *songstreams, int level)
 {
 	struct mdl_stream *midi_es;
 	struct midistreamevent *mse;
 	struct timed_midievent *tmidiev;
 	struct miditrack miditracks[MIDI_CHANNEL_COUNT];
-	size_t i, j;
+	size_t *counts, i, j;
 	int ret;
 
 	assert(midistream_es->s_type == MIDISTREAMEVENTS);
 
 	mse = NULL;
 
+	songstreams->tracks = calloc(song->trackcount,
+	    sizeof(struct trackstream));
+	if (songstreams->tracks == NULL) {
+		warn("calloc in midistream_to_songstreams");
+		return 1;
+	}
+	songstreams->trackcount = song->trackcount;
+
+	/* The last count is for the conductor stream. */
+	if ((counts = calloc(song->trackcount + 1, sizeof(size_t))) == NULL) {
+		warn("calloc in midistream_to_songstreams");
+		goto error;
+	}
+
+	for (i = 0; i < midistream_es->count; i++) {
+		mse = &midistream_es->u.midistreamevents[i];
+		if (mse->evtype == MIDISTREV_MARKER ||
+		    mse->evtype == MIDISTREV_TEMPOCHANGE)
+			counts[ song->trackcount ]++;
+		else
+			counts[ mse->u.track ]++;
+	}
+	mse = NULL;
+
+	/*
+	 * Midistreamevents map to midievents one to one, except that notes
+	 * already playing are dropped, and instrument and volume changes
+	 * are added when a midi channel gets a track.  Leave room for the
+	 * song end and for setting up each channel once.
+	 */
+	for (i = 0; i < song->trackcount; i++) {
+		songstreams->tracks[i].name = strdup(song->tracks[i]->name);
+		if (songstreams->tracks[i].name == NULL) {
+			warn("strdup in midistream_to_songstreams");
+			goto error;
+		}
+		if ((midi_es = midi_mdlstream_new()) == NULL) {
+			warn("could not create new midievent stream");
+			goto error;
+		}
+		songstreams->tracks[i].midi_es = midi_es;
+		if (_mdl_stream_reserve(midi_es,
+		    counts[i] + 2 * MIDI_CHANNEL_COUNT) != 0)
+			goto error;
+	}
+
 	if ((midi_es = midi_mdlstream_new()) == NULL) {
 		warn("could not create new midievent stream");
-		return NULL;
+		goto error;
 	}
+	songstreams->conductor_es = midi_es;
+	if (_mdl_stream_reserve(midi_es, counts[ song->trackcount ] + 1) != 0)
+		goto error;
+
+	free(counts);
+	counts = NULL;
 
 	/* Init miditracks. */
 	for (i = 0; i < MIDI_CHANNEL_COUNT; i++) {
@@ -533,7 +1276,8 @@ midistream_to_midievents(struct mdl_stream *midistream_es, float song_length,
 
 	for (i = 0; i < midistream_es->count; i++) {
 		mse = &midistream_es->u.midistreamevents[i];
-		ret = handle_midistreamevent(mse, midi_es, miditracks, level);
+		ret = handle_midistreamevent(mse, song, songstreams,
+		    miditracks, level);
 		if (ret != 0)
 			goto error;
 	}
@@ -545,6 +1289,7 @@ midistream_to_midievents(struct mdl_stream *midistream_es, float song_length,
 	assert(mse == NULL || song_length >= mse->time_as_measures);
 
 	/* Add SONG_END midievent. */
+	midi_es = songstreams->conductor_es;
 	tmidiev = &midi_es->u.timed_midievents[ midi_es->count ];
 	memset(tmidiev, 0, sizeof(struct timed_midievent));
 	tmidiev->time_as_measures = song_length;
@@ -553,21 +1298,39 @@ midistream_to_midievents(struct mdl_stream *midistream_es, float song_length,
 	if ((ret = _mdl_stream_increment(midi_es)) != 0)
 		goto error;
 
-	return midi_es;
+	return 0;
 
 error:
-	_mdl_stream_free(midi_es);
-	return NULL;
+	free(counts);
+	_mdl_songstreams_free(songstreams);
+	return 1;
 }
 
+/*
+ * Notes and volume changes go to the stream of their track, tempo changes
+ * and markers to the conductor stream of songstreams.
+ */
 static int
-handle_midistreamevent(struct midistreamevent *mse, struct mdl_stream *midi_es,
-    struct miditrack *miditracks, int level)
+handle_midistreamevent(const struct midistreamevent *mse, struct song *song,
+    struct songstreams *songstreams, struct miditrack *miditracks,
+    int level)
 {
+	struct mdl_stream *midi_es;
 	struct timed_midievent *tmidiev;
+	struct track *track;
 	int ch, ret;
 
 	ret = 0;
+	track = NULL;
+	midi_es = songstreams->conductor_es;
+
+	if (mse->evtype == MIDISTREV_NOTEOFF ||
+	    mse->evtype == MIDISTREV_NOTEON ||
+	    mse->evtype == MIDISTREV_VOLUMECHANGE) {
+		assert(mse->u.track < song->trackcount);
+		track = song->tracks[ mse->u.track ];
+		midi_es = songstreams->tracks[ mse->u.track ].midi_es;
+	}
 
 	assert(midi_es->s_type == MIDIEVENTS);
 
@@ -576,12 +1339,12 @@ handle_midistreamevent(struct midistreamevent *mse, struct mdl_stream *midi_es,
 		ret = add_marker_to_midievents(midi_es, mse->time_as_measures);
 		break;
 	case MIDISTREV_NOTEOFF:
-		ret = add_noteoff_to_midievents(midi_es, &mse->u.tme,
-		    miditracks, mse->time_as_measures, level);
+		ret = add_noteoff_to_midievents(midi_es, mse, track,
+		    miditracks, level);
 		break;
 	case MIDISTREV_NOTEON:
-		ret = add_noteon_to_midievents(midi_es, &mse->u.tme,
-		    miditracks, mse->time_as_measures, level);
+		ret = add_noteon_to_midievents(midi_es, mse, track,
+		    miditracks, level);
 		break;
 	case MIDISTREV_TEMPOCHANGE:
 		tmidiev = &midi_es->u.timed_midievents[ midi_es->count ];
@@ -592,14 +1355,12 @@ handle_midistreamevent(struct midistreamevent *mse, struct mdl_stream *midi_es,
 		ret = _mdl_stream_increment(midi_es);
 		break;
 	case MIDISTREV_VOLUMECHANGE:
-		assert(mse->u.tme.midiev.evtype == MIDIEV_VOLUMECHANGE);
-		ch = lookup_midichannel(&mse->u.tme, miditracks, level);
+		ch = lookup_midichannel(track, miditracks, level);
 		if (ch == -1) {
 			ret = 1;
 			break;
 		}
-		ret = add_volumechange_to_midievents(midi_es,
-		    mse->u.tme.midiev.u.volumechange.volume, ch,
+		ret = add_volumechange_to_midievents(midi_es, mse->value, ch,
 		    mse->time_as_measures);
 		break;
 	default:
@@ -640,6 +1401,16 @@ add_musicexpr_to_midistream(struct mdl_stream *midistream_es,
 	return add_note_to_midistream(midistream_es, me, timeoffset, level);
 }
 
+/* How many midistreamevents add_musicexpr_to_midistream() adds for me. */
+static size_t
+midistream_eventcount(const struct musicexpr *me)
+{
+	if (me->me_type == ME_TYPE_ABSDRUM || me->me_type == ME_TYPE_ABSNOTE)
+		return 2;
+
+	return 1;
+}
+
 static int
 add_marker_to_midistream(struct mdl_stream *midistream_es, float timeoffset)
 {
@@ -664,7 +1435,7 @@ add_note_to_midistream(struct mdl_stream *midistream_es,
     const struct musicexpr *me, float timeoffset, int level)
 {
 	struct midistreamevent *mse;
-	struct trackmidievent *tme;
+	struct track *track;
 	int new_note, ret;
 	float length;
 
@@ -672,15 +1443,18 @@ add_note_to_midistream(struct mdl_stream *midistream_es,
 
 	length = 0.0;
 	new_note = -1;
+	track = NULL;
 
 	switch (me->me_type) {
 	case ME_TYPE_ABSDRUM:
 		new_note = me->u.absdrum.note;
 		length = me->u.absdrum.length;
+		track = me->u.absdrum.track;
 		break;
 	case ME_TYPE_ABSNOTE:
 		new_note = me->u.absnote.note;
 		length = me->u.absnote.length;
+		track = me->u.absnote.track;
 		break;
 	default:
 		assert(0);
@@ -709,22 +1483,10 @@ add_note_to_midistream(struct mdl_stream *midistream_es,
 	memset(mse, 0, sizeof(struct midistreamevent));
 	mse->evtype = MIDISTREV_NOTEON;
 	mse->time_as_measures = timeoffset;
-	tme = &mse->u.tme;
-	tme->midiev.evtype = MIDIEV_NOTEON;
-	tme->midiev.u.midinote.channel = MIDI_DEFAULTCHANNEL;
-	tme->midiev.u.midinote.joining = me->joining;
-	tme->midiev.u.midinote.note = new_note;
-	tme->midiev.u.midinote.velocity = DEFAULT_VELOCITY;
-
-	if (me->me_type == ME_TYPE_ABSDRUM) {
-		tme->instrument = me->u.absdrum.instrument;
-		tme->track = me->u.absdrum.track;
-	} else if (me->me_type == ME_TYPE_ABSNOTE) {
-		tme->instrument = me->u.absnote.instrument;
-		tme->track = me->u.absnote.track;
-	} else {
-		assert(0);
-	}
+	mse->u.track = track->index;
+	mse->channel = MIDI_DEFAULTCHANNEL;
+	mse->joining = me->joining;
+	mse->value = new_note;
 
 	ret = _mdl_stream_increment(midistream_es);
 	if (ret != 0)
@@ -733,23 +1495,11 @@ add_note_to_midistream(struct mdl_stream *midistream_es,
 	mse = &midistream_es->u.midistreamevents[ midistream_es->count ];
 	memset(mse, 0, sizeof(struct midistreamevent));
 	mse->evtype = MIDISTREV_NOTEOFF;
-	mse->time_as_measures = timeoffset + me->u.absnote.length;
-	tme = &mse->u.tme;
-	tme->midiev.evtype = MIDIEV_NOTEOFF;
-	tme->midiev.u.midinote.channel = MIDI_DEFAULTCHANNEL;
-	tme->midiev.u.midinote.joining = me->joining;
-	tme->midiev.u.midinote.note = new_note;
-	tme->midiev.u.midinote.velocity = 0;
-
-	if (me->me_type == ME_TYPE_ABSDRUM) {
-		tme->instrument = me->u.absdrum.instrument;
-		tme->track = me->u.absdrum.track;
-	} else if (me->me_type == ME_TYPE_ABSNOTE) {
-		tme->instrument = me->u.absnote.instrument;
-		tme->track = me->u.absnote.track;
-	} else {
-		assert(0);
-	}
+	mse->time_as_measures = timeoffset + length;
+	mse->u.track = track->index;
+	mse->channel = MIDI_DEFAULTCHANNEL;
+	mse->joining = me->joining;
+	mse->value = new_note;
 
 	return _mdl_stream_increment(midistream_es);
 }
@@ -776,7 +1526,6 @@ add_volumechange_to_midistream(struct mdl_stream *midistream_es,
     const struct volumechange *volumechg, float timeoffset)
 {
 	struct midistreamevent *mse;
-	struct trackmidievent *tme;
 
 	assert(midistream_es->s_type == MIDISTREAMEVENTS);
 
@@ -784,11 +1533,9 @@ add_volumechange_to_midistream(struct mdl_stream *midistream_es,
 	memset(mse, 0, sizeof(struct midistreamevent));
 	mse->evtype = MIDISTREV_VOLUMECHANGE;
 	mse->time_as_measures = timeoffset;
-	tme = &mse->u.tme;
-	tme->midiev.evtype = MIDIEV_VOLUMECHANGE;
-	tme->midiev.u.volumechange.channel = volumechg->track->midichannel;
-	tme->midiev.u.volumechange.volume = volumechg->volume;
-	tme->track = volumechg->track;
+	mse->u.track = volumechg->track->index;
+	mse->channel = volumechg->track->midichannel;
+	mse->value = volumechg->volume;
 
 	return _mdl_stream_increment(midistream_es);
 }
@@ -824,7 +1571,10 @@ compare_midistreamevents(const void *va, const void *vb)
 	case MIDISTREV_NOTEOFF:
 	case MIDISTREV_NOTEON:
 	case MIDISTREV_VOLUMECHANGE:
-		return compare_midievents(&a->u.tme.midiev, &b->u.tme.midiev);
+		return (a->channel < b->channel) ? -1 :
+		       (a->channel > b->channel) ?  1 :
+		       (a->value   < b->value)   ? -1 :
+		       (a->value   > b->value)   ?  1 : 0;
 	case MIDISTREV_TEMPOCHANGE:
 		return (a->u.bpm < b->u.bpm) ? -1 :
 		       (a->u.bpm > b->u.bpm) ?  1 : 0;
@@ -834,75 +1584,3 @@ compare_midistreamevents(const void *va, const void *vb)
 
 	return 0;
 }
-
-static int
-compare_timed_midievents(const void *va, const void *vb)
-{
-	const struct timed_midievent *a, *b;
-
-	a = va;
-	b = vb;
-
-	return
-	    (a->time_as_measures < b->time_as_measures) ? -1 :
-	    (a->time_as_measures > b->time_as_measures) ?  1 :
-	    compare_midievents(&a->midiev, &b->midiev);
-}
-
-static int
-compare_midievents(const struct midievent *a, const struct midievent *b)
-{
-	const struct instrument_change *ic_a, *ic_b;
-	const struct midi_volumechange *vc_a, *vc_b;
-
-	assert(a->evtype < MIDIEV_TYPECOUNT);
-
-	if (a->evtype < b->evtype)
-		return -1;
-	if (a->evtype > b->evtype)
-		return 1;
-
-	assert(a->evtype == b->evtype);
-
-	switch (a->evtype) {
-	case MIDIEV_INSTRUMENT_CHANGE:
-		ic_a = &a->u.instr_change;
-		ic_b = &b->u.instr_change;
-		return
-		    (ic_a->channel < ic_b->channel) ? -1 :
-		    (ic_a->channel > ic_b->channel) ?  1 :
-		    (ic_a->code    < ic_b->code)    ? -1 :
-		    (ic_a->code    > ic_b->code)    ?  1 : 0;
-	case MIDIEV_MARKER:
-		/*
-		 * XXX Just order these randomly.  With textual locations
-		 * XXX one might be able to do a more rational choice.
-		 */
-		return 1;
-	case MIDIEV_NOTEOFF:
-	case MIDIEV_NOTEON:
-		return
-		    (a->u.midinote.channel  < b->u.midinote.channel)  ? -1 :
-		    (a->u.midinote.channel  > b->u.midinote.channel)  ?  1 :
-		    (a->u.midinote.note     < b->u.midinote.note)     ? -1 :
-		    (a->u.midinote.note     > b->u.midinote.note)     ?  1 :
-		    (a->u.midinote.velocity < b->u.midinote.velocity) ? -1 :
-		    (a->u.midinote.velocity > b->u.midinote.velocity) ?  1 : 0;
-	case MIDIEV_SONG_END:
-		return 0;
-	case MIDIEV_TEMPOCHANGE:
-		return (a->u.bpm < b->u.bpm) ? -1 :
-		       (a->u.bpm > b->u.bpm) ?  1 : 0;
-	case MIDIEV_VOLUMECHANGE:
-		vc_a = &a->u.volumechange;
-		vc_b = &b->u.volumechange;
-		return (vc_a->channel < vc_b->channel) ? -1 :
-		       (vc_a->channel > vc_b->channel) ?  1 :
-		       (vc_a->volume  < vc_b->volume)  ? -1 :
-		       (vc_a->volume  > vc_b->volume)  ?  1 : 0;
-	default:
-		assert(0);
-	}
-
-	return 0;
-}
@@ -38,25 +38,55 @@ enum midistreamevent_type {
 	MIDISTREV_TYPECOUNT,	/* not a type */
 };
 
-struct trackmidievent {
-	struct instrument      *instrument;
-	struct midievent	midiev;
-	struct track	       *track;
-};
-
+/*
+ * Compile-time midi events are small fixed-width records, so that sorting
+ * and merging them moves as little memory as possible.  Notes and volume
+ * changes refer to their track with its index in song->tracks, and get
+ * their midi channel only when converted to midievents.
+ */
 struct midistreamevent {
-	enum midistreamevent_type	evtype;
-	float				time_as_measures;
+	float		time_as_measures;
 	union {
-		struct trackmidievent	tme;
-		float			bpm;
+		float		bpm;
+		u_int32_t	track;
 	} u;
+	u_int8_t	evtype;		/* enum midistreamevent_type */
+	u_int8_t	channel;	/* preferred channel, for ordering */
+	u_int8_t	joining;
+	u_int8_t	value;		/* note or volume */
+};
+
+#define MAX_COMPILE_THREADS	64
+
+/*
+ * A compiled song keeps a sorted midi event stream for each track, so
+ * that the sequencer can mute and solo tracks while playing.  Tempo
+ * changes, markers and the song end belong to no track and are in the
+ * conductor stream.
+ */
+struct trackstream {
+	char		       *name;
+	struct mdl_stream      *midi_es;
+};
+
+struct songstreams {
+	struct trackstream     *tracks;
+	size_t			trackcount;
+	struct mdl_stream      *conductor_es;
 };
 
 __BEGIN_DECLS
-struct mdl_stream      *_mdl_musicexpr_to_midievents(struct musicexpr *, int);
-ssize_t			_mdl_midi_write_midistream(int, struct mdl_stream *,
+void			_mdl_midistream_set_compile_threads(struct mdl_ctx *,
     int);
+struct mdl_stream      *_mdl_musicexpr_to_midievents(struct mdl_ctx *,
+    struct musicexpr *, int);
+int			_mdl_musicexpr_to_songstreams(struct mdl_ctx *,
+    struct musicexpr *, struct songstreams *, int);
+void			_mdl_songstreams_free(struct songstreams *);
+void			_mdl_songstreams_select_tracks(struct songstreams *,
+    const char *, size_t, int);
+ssize_t			_mdl_midi_write_midistream(int,
+    const struct songstreams *, const u_int8_t *, size_t, int);
 __END_DECLS
 
 #endif /* !MDL_MIDISTREAM_H */
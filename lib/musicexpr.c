@@ -21,16 +21,41 @@
 #include <assert.h>
 #include <err.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "context.h"
 #include "musicexpr.h"
 #include "util.h"
 
-int musicexpr_id_counter = 0;
+/*
+ * Musicexprs are allocated from slabs of the library context, which are
+ * aligned to their size, so that the slab of an expression can be found
+ * from its address.  Ids and text locations are needed only for logging and
+ * error messages, so those are not in struct musicexpr but in a table in
+ * the slab, at the index of the expression.  Compile threads allocate from
+ * branch contexts of their own, so this needs no locking.  The slabs are
+ * freed after each compile, see _mdl_musicexpr_arena_reset().
+ */
+#define MUSICEXPR_SLAB_SIZE	65536
+#define MUSICEXPR_SLAB_NODES	((MUSICEXPR_SLAB_SIZE - 64) /		\
+    (sizeof(struct musicexpr) + sizeof(struct musicexpr_info)))
+
+struct musicexpr_info {
+	int		id;
+	struct textloc	textloc;
+};
+
+struct musicexpr_slab {
+	struct musicexpr_slab  *next;
+	size_t			used;
+	struct musicexpr_info	info[MUSICEXPR_SLAB_NODES];
+	struct musicexpr	nodes[MUSICEXPR_SLAB_NODES];
+};
 
 static struct musicexpr	*musicexpr_tq(enum musicexpr_type me_type,
     int, struct musicexpr *, va_list va);
@@ -52,9 +77,10 @@ static int	add_as_offsetexpr_to_flat_simultence(struct musicexpr *,
     struct musicexpr *, float *, int);
 static int	add_musicexpr_to_flat_simultence(struct musicexpr *,
     struct musicexpr *, float *, int);
+static struct musicexpr *musicexpr_alloc(struct mdl_ctx *);
 static float	musicexpr_calc_length(struct musicexpr *);
+static struct musicexpr_info *musicexpr_info(const struct musicexpr *);
 
-static void	tag_as_joining(struct musicexpr *, int);
 
 struct musicexpr *
 _mdl_musicexpr_clone(struct musicexpr *me, int level)
@@ -63,7 +89,8 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 	int ret;
 	char *me_id1, *me_id2;
 
-	cloned = _mdl_musicexpr_new(me->me_type, me->id.textloc, level+1);
+	cloned = _mdl_musicexpr_new(me->me_type, _mdl_musicexpr_textloc(me),
+	    level+1);
 	if (cloned == NULL)
 		return NULL;
 
@@ -78,7 +105,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		cloned->u.chord.me = _mdl_musicexpr_clone(me->u.chord.me,
 		    level);
 		if (cloned->u.chord.me == NULL) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 		}
 		break;
@@ -86,7 +113,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		cloned->u.flatsimultence.me =
 		    _mdl_musicexpr_clone(me->u.flatsimultence.me, level);
 		if (cloned->u.flatsimultence.me == NULL) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 		}
 		break;
@@ -98,7 +125,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		cloned->u.joinexpr.a = _mdl_musicexpr_clone(me->u.joinexpr.a,
 		    level);
 		if (cloned->u.joinexpr.a == NULL) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 			break;
 		}
@@ -106,7 +133,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		    level);
 		if (cloned->u.joinexpr.b == NULL) {
 			_mdl_musicexpr_free(cloned->u.joinexpr.a, level+1);
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 		}
 		break;
@@ -114,7 +141,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		cloned->u.noteoffsetexpr.me =
 		    _mdl_musicexpr_clone(me->u.noteoffsetexpr.me, level);
 		if (cloned->u.noteoffsetexpr.me == NULL) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 			break;
 		}
@@ -123,7 +150,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		if (cloned->u.noteoffsetexpr.offsets == NULL) {
 			_mdl_musicexpr_free(cloned->u.noteoffsetexpr.me,
 			    level+1);
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 			break;
 		}
@@ -135,7 +162,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		cloned->u.offsetexpr.me =
 		    _mdl_musicexpr_clone(me->u.offsetexpr.me, level);
 		if (cloned->u.offsetexpr.me == NULL) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 		}
 		break;
@@ -143,7 +170,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		cloned->u.ontrack.me = _mdl_musicexpr_clone(me->u.ontrack.me,
 		    level);
 		if (cloned->u.ontrack.me == NULL) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 			break;
 		}
@@ -153,7 +180,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		cloned->u.scaledexpr.me =
 		    _mdl_musicexpr_clone(me->u.scaledexpr.me, level);
 		if (cloned->u.scaledexpr.me == NULL) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 		}
 		break;
@@ -162,7 +189,7 @@ _mdl_musicexpr_clone(struct musicexpr *me, int level)
 		ret = _mdl_musicexpr_clone_melist(&cloned->u.melist,
 		    me->u.melist, level);
 		if (ret != 0) {
-			free(cloned);
+			_mdl_musicexpr_release(cloned);
 			cloned = NULL;
 		}
 		break;
@@ -295,8 +322,8 @@ add_musicexpr_to_flat_simultence(struct musicexpr *flatme,
 		    me->u.joinexpr.a, next_offset, level);
 		if (ret != 0)
 			return ret;
-		marker = _mdl_musicexpr_new(ME_TYPE_MARKER, me->id.textloc,
-		    level+1);
+		marker = _mdl_musicexpr_new(ME_TYPE_MARKER,
+		    _mdl_musicexpr_textloc(me), level+1);
 		if (ret != 0)
 			return ret;
 		marker->u.marker.marker_type = ME_MARKER_JOINEXPR;
@@ -484,7 +511,7 @@ _mdl_musicexpr_to_flat_simultence(struct musicexpr *me, int level)
 	level += 1;
 
 	if ((simultence = musicexpr_simultence(level, NULL)) == NULL) {
-		free(flatme);
+		_mdl_musicexpr_release(flatme);
 		return NULL;
 	}
 
@@ -610,6 +637,13 @@ _mdl_musicexpr_stretch_length(struct musicexpr *me, float factor)
 		_mdl_musicexpr_stretch_length(p, factor);
 }
 
+/*
+ * Lengths are calculated when needed and not cached in expressions.
+ * Scaled expressions keep their length in u.scaledexpr.length, so the
+ * walk below stops at them, as does stretching.  Scaling nested scaled
+ * expressions thus walks each expression only for the scaled expression
+ * nearest to it, and a cache would not save any walks.
+ */
 static float
 musicexpr_calc_length(struct musicexpr *me)
 {
@@ -711,7 +745,7 @@ _mdl_musicexpr_log(const struct musicexpr *me, enum logtype logtype, int level,
 	case ME_TYPE_FUNCTION:
 		/* XXX Printing function arguments might be good? */
 		_mdl_log(logtype, level, "%s%s name=%s\n", prefix, me_id,
-		    me->u.function.name);
+		    me->u.function->name);
 		break;
 	case ME_TYPE_JOINEXPR:
 		_mdl_log(logtype, level, "%s%s joining=%d\n", prefix, me_id,
@@ -881,7 +915,7 @@ _mdl_musicexpr_free(struct musicexpr *me, int level)
 
 	_mdl_musicexpr_free_subexprs(me, level);
 
-	free(me);
+	_mdl_musicexpr_release(me);
 }
 
 void
@@ -896,13 +930,18 @@ _mdl_musicexpr_free_subexprs(struct musicexpr *me, int level)
 		return;
 	}
 
+	if (me->me_type == ME_TYPE_FUNCTION) {
+		_mdl_functions_free(me);
+		return;
+	}
+
 	/* Traverse the subexpressions. */
 	iter = _mdl_musicexpr_iter_new(me);
 	while ((p = _mdl_musicexpr_iter_next(&iter)) != NULL) {
 		switch (p->me_type) {
 		case ME_TYPE_NOTEOFFSETEXPR:
-			_mdl_musicexpr_free(p, level);
 			free(p->u.noteoffsetexpr.offsets);
+			_mdl_musicexpr_free(p, level);
 			break;
 		default:
 			_mdl_musicexpr_free(p, level);
@@ -978,7 +1017,7 @@ _mdl_chord_to_noteoffsetexpr(struct chord chord, int level)
 	    malloc(sizeof(chord_noteoffsets[chordtype].offsets));
 	if (me->u.noteoffsetexpr.offsets == NULL) {
 		warn("malloc in _mdl_chord_to_noteoffsetexpr");
-		free(me);
+		_mdl_musicexpr_release(me);
 		return NULL;
 	}
 
@@ -1026,16 +1065,18 @@ _mdl_musicexpr_id_string(const struct musicexpr *me)
 		"tempochange",		/* ME_TYPE_TEMPOCHANGE */
 		"volumechange",		/* ME_TYPE_VOLUMECHANGE */
 	};
+	struct textloc textloc;
 	char *id_string;
 	int ret;
 
 	assert(me != NULL);
 	assert(me->me_type < ME_TYPE_COUNT);
 
+	textloc = _mdl_musicexpr_textloc(me);
+
 	ret = asprintf(&id_string, "%s:%d:%d,%d:%d,%d",
-	    strings[me->me_type], me->id.id, me->id.textloc.first_line,
-	    me->id.textloc.first_column, me->id.textloc.last_line,
-	    me->id.textloc.last_column);
+	    strings[me->me_type], musicexpr_info(me)->id, textloc.first_line,
+	    textloc.first_column, textloc.last_line, textloc.last_column);
 	if (ret == -1) {
 		warnx("error in asprintf in _mdl_musicexpr_id_string()");
 		return NULL;
@@ -1048,23 +1089,31 @@ struct musicexpr *
 _mdl_musicexpr_new(enum musicexpr_type me_type, struct textloc textloc,
     int level)
 {
+	struct mdl_ctx *ctx;
 	struct musicexpr *me;
+	struct musicexpr_info *info;
 	char *me_id;
 
-	if (musicexpr_id_counter == INT_MAX) {
-		warnx("%s", "musicexpr id counter overflow");
+	if ((ctx = _mdl_ctx_get()) == NULL) {
+		warnx("no library context for a new musicexpr");
 		return NULL;
 	}
 
-	if ((me = malloc(sizeof(struct musicexpr))) == NULL) {
-		warn("%s", "malloc error in _mdl_musicexpr_new");
+	if (ctx->musicexpr_id_counter > INT_MAX - ctx->musicexpr_id_step) {
+		warnx("%s", "musicexpr id counter overflow");
 		return NULL;
 	}
 
+	if ((me = musicexpr_alloc(ctx)) == NULL)
+		return NULL;
+
+	info = musicexpr_info(me);
+	info->id = ctx->musicexpr_id_counter;
+	info->textloc = textloc;
+	ctx->musicexpr_id_counter += ctx->musicexpr_id_step;
+
 	me->me_type = me_type;
 	me->joining = 0;
-	me->id.id = musicexpr_id_counter++;
-	me->id.textloc = textloc;
 
 	if ((me_id = _mdl_musicexpr_id_string(me)) != NULL) {
 		_mdl_log(MDLLOG_MM, level, "created %s\n", me_id);
@@ -1074,6 +1123,125 @@ _mdl_musicexpr_new(enum musicexpr_type me_type, struct textloc textloc,
 	return me;
 }
 
+static struct musicexpr *
+musicexpr_alloc(struct mdl_ctx *ctx)
+{
+	struct musicexpr_slab *slab;
+	struct musicexpr *me;
+	int ret;
+
+	if ((me = ctx->musicexpr_freelist) != NULL) {
+		ctx->musicexpr_freelist = TAILQ_NEXT(me, tq);
+		return me;
+	}
+
+	slab = ctx->musicexpr_slabs;
+	if (slab == NULL || slab->used == MUSICEXPR_SLAB_NODES) {
+		assert(sizeof(struct musicexpr_slab) <= MUSICEXPR_SLAB_SIZE);
+		ret = posix_memalign((void **)&slab, MUSICEXPR_SLAB_SIZE,
+		    MUSICEXPR_SLAB_SIZE);
+		if (ret != 0) {
+			warnx("posix_memalign in musicexpr_alloc: %s",
+			    strerror(ret));
+			return NULL;
+		}
+		slab->next = ctx->musicexpr_slabs;
+		slab->used = 0;
+		ctx->musicexpr_slabs = slab;
+	}
+
+	return &slab->nodes[ slab->used++ ];
+}
+
+static struct musicexpr_info *
+musicexpr_info(const struct musicexpr *me)
+{
+	struct musicexpr_slab *slab;
+
+	slab = (struct musicexpr_slab *)
+	    ((uintptr_t)me & ~(uintptr_t)(MUSICEXPR_SLAB_SIZE - 1));
+	assert(me >= slab->nodes && me < slab->nodes + slab->used);
+
+	return &slab->info[ me - slab->nodes ];
+}
+
+/*
+ * Give the memory of me back to the context of the calling thread, without
+ * freeing its subexpressions (see _mdl_musicexpr_free() for that).
+ */
+void
+_mdl_musicexpr_release(struct musicexpr *me)
+{
+	struct mdl_ctx *ctx;
+
+	/* Without a context the slab keeps it until the context is freed. */
+	if ((ctx = _mdl_ctx_get()) == NULL)
+		return;
+
+	TAILQ_NEXT(me, tq) = ctx->musicexpr_freelist;
+	ctx->musicexpr_freelist = me;
+}
+
+/*
+ * Hand the musicexprs of a branch context over to its parent, including
+ * those of the parent that the branch has released.
+ */
+void
+_mdl_musicexpr_arena_join(struct mdl_ctx *parent, struct mdl_ctx *ctx)
+{
+	struct musicexpr_slab *slab;
+	struct musicexpr *me;
+
+	if ((slab = ctx->musicexpr_slabs) != NULL) {
+		while (slab->next != NULL)
+			slab = slab->next;
+		slab->next = parent->musicexpr_slabs;
+		parent->musicexpr_slabs = ctx->musicexpr_slabs;
+		ctx->musicexpr_slabs = NULL;
+	}
+
+	if ((me = ctx->musicexpr_freelist) != NULL) {
+		while (TAILQ_NEXT(me, tq) != NULL)
+			me = TAILQ_NEXT(me, tq);
+		TAILQ_NEXT(me, tq) = parent->musicexpr_freelist;
+		parent->musicexpr_freelist = ctx->musicexpr_freelist;
+		ctx->musicexpr_freelist = NULL;
+	}
+
+	parent->musicexpr_id_counter = MAX(parent->musicexpr_id_counter,
+	    ctx->musicexpr_id_counter);
+}
+
+/*
+ * Free the musicexpr slabs of ctx and start ids from zero again, when no
+ * musicexprs made with it are left.
+ */
+void
+_mdl_musicexpr_arena_reset(struct mdl_ctx *ctx)
+{
+	struct musicexpr_slab *slab;
+
+	while ((slab = ctx->musicexpr_slabs) != NULL) {
+		ctx->musicexpr_slabs = slab->next;
+		free(slab);
+	}
+
+	ctx->musicexpr_freelist = NULL;
+	ctx->musicexpr_id_counter = 0;
+}
+
+struct textloc
+_mdl_musicexpr_textloc(const struct musicexpr *me)
+{
+	return musicexpr_info(me)->textloc;
+}
+
+void
+_mdl_musicexpr_set_textloc(struct musicexpr *me, struct textloc textloc)
+{
+	musicexpr_info(me)->textloc = textloc;
+}
+
 struct musicexpr_iter
 _mdl_musicexpr_iter_new(struct musicexpr *me)
 {
@@ -1176,31 +1344,26 @@ _mdl_musicexpr_replace(struct musicexpr *dst, struct musicexpr *src,
 		free(dst_id);
 	}
 
-	dst->id      = src->id;
+	*musicexpr_info(dst) = *musicexpr_info(src);
 	dst->joining = src->joining;
 	dst->me_type = src->me_type;
-	dst->u       = src->u;
-}
-
-void
-_mdl_musicexpr_tag_expressions_for_joining(struct musicexpr *me, int level)
-{
-	struct musicexpr *p;
-	struct musicexpr_iter iter;
-
-	level += 1;
-
-	if (me->me_type == ME_TYPE_JOINEXPR)
-		tag_as_joining(me->u.joinexpr.a, level);
 
-	/* Traverse the subexpressions. */
-	iter = _mdl_musicexpr_iter_new(me);
-	while ((p = _mdl_musicexpr_iter_next(&iter)) != NULL)
-		_mdl_musicexpr_tag_expressions_for_joining(p, level);
+	/* List items point back to the list head, which must move too. */
+	if (src->me_type == ME_TYPE_SEQUENCE ||
+	    src->me_type == ME_TYPE_SIMULTENCE) {
+		TAILQ_INIT(&dst->u.melist);
+		TAILQ_CONCAT(&dst->u.melist, &src->u.melist, tq);
+	} else {
+		dst->u = src->u;
+	}
 }
 
-static void
-tag_as_joining(struct musicexpr *me, int level)
+/*
+ * Tag the end of the first expression of a joinexpr as joining.  Called
+ * from relative->absolute conversion once the expression has been converted.
+ */
+void
+_mdl_musicexpr_tag_as_joining(struct musicexpr *me, int level)
 {
 	struct musicexpr *p;
 
@@ -1216,29 +1379,29 @@ tag_as_joining(struct musicexpr *me, int level)
 	switch (me->me_type) {
 	case ME_TYPE_CHORD:
 		assert(me->u.chord.me->me_type == ME_TYPE_ABSNOTE);
-		tag_as_joining(me->u.chord.me, level);
+		_mdl_musicexpr_tag_as_joining(me->u.chord.me, level);
 		break;
 	case ME_TYPE_JOINEXPR:
-		tag_as_joining(me->u.joinexpr.b, level);
+		_mdl_musicexpr_tag_as_joining(me->u.joinexpr.b, level);
 		break;
 	case ME_TYPE_NOTEOFFSETEXPR:
-		tag_as_joining(me->u.noteoffsetexpr.me, level);
+		_mdl_musicexpr_tag_as_joining(me->u.noteoffsetexpr.me, level);
 		break;
 	case ME_TYPE_ONTRACK:
-		tag_as_joining(me->u.ontrack.me, level);
+		_mdl_musicexpr_tag_as_joining(me->u.ontrack.me, level);
 		break;
 	case ME_TYPE_RELSIMULTENCE:
 	case ME_TYPE_SCALEDEXPR:
-		tag_as_joining(me->u.scaledexpr.me, level);
+		_mdl_musicexpr_tag_as_joining(me->u.scaledexpr.me, level);
 		break;
 	case ME_TYPE_SEQUENCE:
 		p = TAILQ_LAST(&me->u.melist, melist);
 		if (p != NULL)
-			tag_as_joining(p, level);
+			_mdl_musicexpr_tag_as_joining(p, level);
 		break;
 	case ME_TYPE_SIMULTENCE:
 		TAILQ_FOREACH(p, &me->u.melist, tq)
-			tag_as_joining(p, level);
+			_mdl_musicexpr_tag_as_joining(p, level);
 		break;
 	default:
 		;
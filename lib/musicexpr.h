@@ -252,13 +252,11 @@ struct volumechange {
 	u_int8_t		volume;
 };
 
-struct musicexpr_id {
-	int		id;
-	struct textloc	textloc;
-};
-
+/*
+ * Ids and text locations of music expressions are kept in the slab of the
+ * expression (see _mdl_musicexpr_textloc()), to keep struct musicexpr small.
+ */
 struct musicexpr {
-	struct musicexpr_id	id;
 	enum musicexpr_type	me_type;
 	int			joining;
 	union {
@@ -266,7 +264,7 @@ struct musicexpr {
 		struct absdrum		absdrum;
 		struct chord		chord;
 		struct flatsimultence	flatsimultence;
-		struct function		function;
+		struct function	       *function;
 		struct joinexpr		joinexpr;
 		struct melist		melist;
 		struct marker		marker;
@@ -291,6 +289,9 @@ struct musicexpr_iter {
 __BEGIN_DECLS
 struct musicexpr       *_mdl_chord_to_noteoffsetexpr(struct chord, int);
 void			_mdl_free_melist(struct musicexpr *);
+void			_mdl_musicexpr_arena_join(struct mdl_ctx *,
+    struct mdl_ctx *);
+void			_mdl_musicexpr_arena_reset(struct mdl_ctx *);
 struct musicexpr       *_mdl_musicexpr_clone(struct musicexpr *, int);
 void			_mdl_musicexpr_free(struct musicexpr *, int);
 void			_mdl_musicexpr_free_melist(struct melist, int);
@@ -304,13 +305,17 @@ struct musicexpr       *_mdl_musicexpr_new(enum musicexpr_type,
     struct textloc, int);
 void			_mdl_musicexpr_replace(struct musicexpr *,
     struct musicexpr *, enum logtype, int);
+void			_mdl_musicexpr_release(struct musicexpr *);
+void			_mdl_musicexpr_set_textloc(struct musicexpr *,
+    struct textloc);
 struct musicexpr       *_mdl_musicexpr_scaledexpr_unscale(struct scaledexpr *,
     int);
 struct musicexpr       *_mdl_musicexpr_sequence(int, struct musicexpr *, ...);
+struct textloc		_mdl_musicexpr_textloc(const struct musicexpr *);
 struct musicexpr       *_mdl_musicexpr_to_flat_simultence(struct musicexpr *,
     int);
 
-void	_mdl_musicexpr_tag_expressions_for_joining(struct musicexpr *, int);
+void	_mdl_musicexpr_tag_as_joining(struct musicexpr *, int);
 __END_DECLS
 
 #endif /* !MDL_MUSICEXPR_H */
@@ -19,10 +19,32 @@
 #ifndef MDL_PARSE_H
 #define MDL_PARSE_H
 
+#include <stdio.h>
+
+#include "context.h"
+#include "musicexpr.h"
+
+/*
+ * State of a single parse, shared by the parser and the lexer, so that
+ * several music files can be parsed at the same time.
+ */
+struct parser {
+	struct musicexpr       *parsed_expr;
+	unsigned int		parse_errors;
+	int			expecting_notemodifiers;
+	int			current_line;
+	int			current_column;
+};
+
+union YYSTYPE;
+
 __BEGIN_DECLS
-void	yyerror(const char *fmt, ...);
-int	yylex(void);
-int	_mdl_parse(void);
+struct musicexpr       *_mdl_parse(struct mdl_ctx *, FILE *);
+
+void		yyerror(void *, const char *fmt, ...);
+struct parser  *yyget_extra(void *);
+int		yylex(union YYSTYPE *, void *);
+int		yyparse(void *);
 __END_DECLS
 
 #endif /* !MDL_PARSE_H */
@@ -26,15 +26,16 @@
 #include "parse.h"
 #include "track.h"
 
-struct musicexpr *parsed_expr = NULL;
-unsigned int	parse_errors = 0;
-
 static float		 countlength(int, int);
 static struct musicexpr *maybe_apply_scaling(struct musicexpr *, float,
     struct textloc);
 
 %}
 
+%pure-parser
+%lex-param	{ void *scanner }
+%parse-param	{ void *scanner }
+
 /* XXX these all(?) should pass textual location information */
 %union {
 	struct {
@@ -167,15 +168,15 @@ static struct musicexpr *maybe_apply_scaling(struct musicexpr *, float,
 %%
 
 grammar:
-	sequence_expr { parsed_expr = $1; }
+	sequence_expr { yyget_extra(scanner)->parsed_expr = $1; }
 	| /* empty */ {
-		parsed_expr = _mdl_musicexpr_new(ME_TYPE_EMPTY,
-		    _mdl_textloc_zero(), 0);
-		if (parsed_expr == NULL) {
+		$$ = _mdl_musicexpr_new(ME_TYPE_EMPTY, _mdl_textloc_zero(), 0);
+		if ($$ == NULL) {
 			/* XXX YYERROR and memory leaks?
 			 * XXX return NULL and handle on upper layer? */
 			YYERROR;
 		}
+		yyget_extra(scanner)->parsed_expr = $$;
 	  }
 	;
 
@@ -190,6 +191,8 @@ musicexpr:
 		$$->u.chord = $1.expr;
 	  }
 	| function {
+		struct funcarg *p, *q;
+
 		$$ = _mdl_musicexpr_new(ME_TYPE_FUNCTION, $1.textloc, 0);
 		if ($$ == NULL) {
 			/* XXX stuff in function should be freed */
@@ -198,7 +201,26 @@ musicexpr:
 			 * XXX return NULL and handle on upper layer? */
 			YYERROR;
 		}
-		$$->u.function = $1;
+		$$->u.function = malloc(sizeof(struct function));
+		if ($$->u.function == NULL) {
+			/* XXX stuff in function should be freed */
+			_mdl_musicexpr_release($$);
+			/* XXX YYERROR and memory leaks?
+			 * XXX return NULL and handle on upper layer? */
+			YYERROR;
+		}
+		$$->u.function->name = $1.name;
+		$$->u.function->textloc = $1.textloc;
+
+		/*
+		 * Relink the arguments, because the list head in $1 is
+		 * on the parser stack.
+		 */
+		TAILQ_INIT(&$$->u.function->args);
+		for (p = TAILQ_FIRST(&$1.args); p != NULL; p = q) {
+			q = TAILQ_NEXT(p, tq);
+			TAILQ_INSERT_TAIL(&$$->u.function->args, p, tq);
+		}
 	}
 	| joinexpr {
 		$$ = _mdl_musicexpr_new(ME_TYPE_JOINEXPR, $1.textloc, 0);
@@ -331,10 +353,11 @@ relnote:
 
 relsimultence_expr_with_enclosers_and_length:
 	RELSIMULTENCE_START simultence_expr RELSIMULTENCE_END notelength {
-		struct textloc tl;
+		struct textloc me_tl, tl;
 
-		tl = _mdl_join_textlocs(&$1.textloc, &$2->id.textloc,
-		    &$3.textloc, &$4.textloc, NULL);
+		me_tl = _mdl_musicexpr_textloc($2);
+		tl = _mdl_join_textlocs(&$1.textloc, &me_tl, &$3.textloc,
+		    &$4.textloc, NULL);
 
 		$$ = _mdl_musicexpr_new(ME_TYPE_RELSIMULTENCE, tl, 0);
 		if ($$ == NULL) {
@@ -362,7 +385,7 @@ relsimultence_expr_with_enclosers_and_length:
 		}
 		simultence = _mdl_musicexpr_new(ME_TYPE_SIMULTENCE, tl, 0);
 		if (simultence == NULL) {
-			free($$);
+			_mdl_musicexpr_release($$);
 			/* XXX YYERROR and memory leaks?
 			 * XXX return NULL and handle on upper layer? */
 			YYERROR;
@@ -394,9 +417,13 @@ sequence_expr_with_enclosers_and_length:
 	
 sequence_expr_with_enclosers:
 	SEQUENCE_START sequence_expr SEQUENCE_END {
+		struct textloc me_tl;
+
 		$$ = $2;
-		$$->id.textloc = _mdl_join_textlocs(&$1.textloc,
-		    &$2->id.textloc, &$3.textloc, NULL);
+		me_tl = _mdl_musicexpr_textloc($2);
+		_mdl_musicexpr_set_textloc($$,
+		    _mdl_join_textlocs(&$1.textloc, &me_tl, &$3.textloc,
+		    NULL));
 	  }
 	| SEQUENCE_START SEQUENCE_END {
 		/* XXX A smarter way to accept empty sequences? */
@@ -423,7 +450,8 @@ sequence_expr:
 			 * XXX return NULL and handle on upper layer? */
 			YYERROR;
 		}
-		$$->u.melist = $1.expr;
+		TAILQ_INIT(&$$->u.melist);
+		TAILQ_CONCAT(&$$->u.melist, &$1.expr, tq);
 	  }
 	;
 
@@ -440,9 +468,13 @@ simultence_expr_with_enclosers_and_length:
 
 simultence_expr_with_enclosers:
 	SIMULTENCE_START simultence_expr SIMULTENCE_END {
+		struct textloc me_tl;
+
 		$$ = $2;
-		$$->id.textloc = _mdl_join_textlocs(&$1.textloc,
-		    &$2->id.textloc, &$3.textloc, NULL);
+		me_tl = _mdl_musicexpr_textloc($2);
+		_mdl_musicexpr_set_textloc($$,
+		    _mdl_join_textlocs(&$1.textloc, &me_tl, &$3.textloc,
+		    NULL));
 	  }
 	| SIMULTENCE_START SIMULTENCE_END {
 		/* XXX A smarter way to accept empty simultences? */
@@ -469,16 +501,18 @@ simultence_expr:
 			 * XXX return NULL and handle on upper layer? */
 			YYERROR;
 		}
-		$$->u.melist = $1.expr;
+		TAILQ_INIT(&$$->u.melist);
+		TAILQ_CONCAT(&$$->u.melist, &$1.expr, tq);
 	  }
 	;
 
 track_expr:
 	QUOTED_STRING TRACK_OPERATOR musicexpr {
-		struct textloc tl;
+		struct textloc me_tl, tl;
 
-		tl = _mdl_join_textlocs(&$1.textloc, &$2.textloc,
-		    &$3->id.textloc, NULL);
+		me_tl = _mdl_musicexpr_textloc($3);
+		tl = _mdl_join_textlocs(&$1.textloc, &$2.textloc, &me_tl,
+		    NULL);
 
 		$$ = _mdl_musicexpr_new(ME_TYPE_ONTRACK, tl, 0);
 		if ($$ == NULL) {
@@ -493,7 +527,7 @@ track_expr:
 		/* XXX what about drumtracks? */
 		$$->u.ontrack.track = _mdl_track_new(INSTR_TONED, $1.expr);
 		if ($$->u.ontrack.track == NULL) {
-			free($$);
+			_mdl_musicexpr_release($$);
 			free($1.expr);
 			_mdl_musicexpr_free($3, 0);
 			/* XXX YYERROR and memory leaks?
@@ -507,12 +541,14 @@ expression_list:
 	musicexpr {
 		TAILQ_INIT(&$$.expr);
 		TAILQ_INSERT_TAIL(&$$.expr, $1, tq);
-		$$.textloc = $1->id.textloc;
+		$$.textloc = _mdl_musicexpr_textloc($1);
 	  }
 	| expression_list musicexpr {
+		struct textloc me_tl;
+
 		$$.expr = $1.expr;
-		$$.textloc = _mdl_join_textlocs(&$1.textloc, &$2->id.textloc,
-		    NULL);
+		me_tl = _mdl_musicexpr_textloc($2);
+		$$.textloc = _mdl_join_textlocs(&$1.textloc, &me_tl, NULL);
 		TAILQ_INSERT_TAIL(&$$.expr, $2, tq);
 	  }
 	;
@@ -583,13 +619,14 @@ maybe_apply_scaling(struct musicexpr *me, float length,
     struct textloc extending_tl)
 {
 	struct musicexpr *scaled_expr;
-	struct textloc tl;
+	struct textloc me_tl, tl;
 
 	/* Length is zero so no scaling applied to music expression. */
 	if (length == 0.0)
 		return me;
 
-	tl = _mdl_join_textlocs(&me->id.textloc, &extending_tl, NULL);
+	me_tl = _mdl_musicexpr_textloc(me);
+	tl = _mdl_join_textlocs(&me_tl, &extending_tl, NULL);
 
 	scaled_expr = _mdl_musicexpr_new(ME_TYPE_SCALEDEXPR, tl, 0);
 	if (scaled_expr == NULL)
@@ -602,14 +639,16 @@ maybe_apply_scaling(struct musicexpr *me, float length,
 }
 
 void
-yyerror(const char *fmt, ...)
+yyerror(void *scanner, const char *fmt, ...)
 {
+	struct parser *parser;
 	va_list va;
 
-	if (parse_errors < UINT_MAX)
-		parse_errors += 1;
+	parser = yyget_extra(scanner);
+	if (parser->parse_errors < UINT_MAX)
+		parser->parse_errors += 1;
 
 	va_start(va, fmt);
-	vwarnx(fmt, va);
+	_mdl_vwarnx(fmt, va);
 	va_end(va);
 }
@@ -133,6 +133,7 @@ relative_to_absolute(struct musicexpr *me, struct previous_exprs *prev_exprs,
 		break;
 	case ME_TYPE_JOINEXPR:
 		relative_to_absolute(me->u.joinexpr.a, prev_exprs, level);
+		_mdl_musicexpr_tag_as_joining(me->u.joinexpr.a, level);
 		relative_to_absolute(me->u.joinexpr.b, prev_exprs, level);
 		break;
 	case ME_TYPE_MARKER:
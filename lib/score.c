@@ -0,0 +1,509 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "score.h"
+#include "util.h"
+
+#define SCORE_ALIGN(x)	(((x) + 7) & ~(u_int64_t)7)
+
+static void	score_apply_midievent(struct mdl_score_checkpoint *,
+    const struct midievent *);
+static int	score_check(struct mdl_score *);
+static int	score_check_section(size_t, u_int64_t, size_t, size_t);
+static const struct mdl_score_checkpoint *
+		score_find_checkpoint(const struct mdl_score *, float);
+static const struct mdl_score_tempo *
+		score_find_tempo(const struct mdl_score *, float);
+static int	score_make_index(const struct timed_midievent *, size_t,
+    struct mdl_score_tempo **, size_t *, struct mdl_score_checkpoint **,
+    size_t *);
+
+/*
+ * Save events (sorted and ending with MIDIEV_SONG_END, as compiled) to a
+ * score file at path, with _mdl_save_file().  Returns 0 on success and 1
+ * on failure.
+ */
+int
+_mdl_score_save(const char *path, const struct timed_midievent *events,
+    size_t eventcount)
+{
+	static char zeroes[8];
+	struct iovec iov[7];
+	struct mdl_score_header header;
+	struct mdl_score_checkpoint *checkpoints;
+	struct mdl_score_tempo *tempos;
+	size_t checkpointcount, eventsize, tempocount;
+	int ret;
+
+	assert(eventcount > 0);
+	assert(events[ eventcount - 1 ].midiev.evtype == MIDIEV_SONG_END);
+
+	if (eventcount > UINT32_MAX) {
+		warnx("too many events for a score file");
+		return 1;
+	}
+
+	ret = score_make_index(events, eventcount, &tempos, &tempocount,
+	    &checkpoints, &checkpointcount);
+	if (ret != 0)
+		return 1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCORE_MAGIC, sizeof(header.magic));
+	header.format_version = SCORE_FORMAT_VERSION;
+	header.byteorder = SCORE_BYTEORDER;
+	header.eventsize = sizeof(struct timed_midievent);
+	header.eventcount = eventcount;
+	header.tempocount = tempocount;
+	header.checkpointcount = checkpointcount;
+	header.song_length = events[ eventcount - 1 ].time_as_measures;
+	header.events_offset = SCORE_ALIGN(sizeof(header));
+	header.tempos_offset = SCORE_ALIGN(header.events_offset +
+	    eventcount * sizeof(struct timed_midievent));
+	header.checkpoints_offset = SCORE_ALIGN(header.tempos_offset +
+	    tempocount * sizeof(struct mdl_score_tempo));
+
+	/* Sections are padded with zeroes to their aligned offsets. */
+	eventsize = eventcount * sizeof(struct timed_midievent);
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = zeroes;
+	iov[1].iov_len = header.events_offset - sizeof(header);
+	iov[2].iov_base = (void *)events;
+	iov[2].iov_len = eventsize;
+	iov[3].iov_base = zeroes;
+	iov[3].iov_len = header.tempos_offset - header.events_offset -
+	    eventsize;
+	iov[4].iov_base = tempos;
+	iov[4].iov_len = tempocount * sizeof(struct mdl_score_tempo);
+	iov[5].iov_base = zeroes;
+	iov[5].iov_len = header.checkpoints_offset - header.tempos_offset -
+	    iov[4].iov_len;
+	iov[6].iov_base = checkpoints;
+	iov[6].iov_len = checkpointcount * sizeof(struct mdl_score_checkpoint);
+
+	ret = _mdl_save_file(path, iov, 7);
+	if (ret == 0)
+		_mdl_log(MDLLOG_SONG, 0, "saved a score of %zu events to %s\n",
+		    eventcount, path);
+
+	free(checkpoints);
+	free(tempos);
+
+	return ret;
+}
+
+/*
+ * Map the score file in fd, and make result refer to it so that playback
+ * starts from start_position (in measures).  The mapping is released with
+ * _mdl_compiled_free().  fd is not closed.  Returns 0 on success, and 1
+ * if fd could not be mapped or it is not a valid score file.
+ */
+int
+_mdl_score_load(int fd, float start_position, struct mdl_compiled *result)
+{
+	struct mdl_score *score;
+	struct stat sb;
+
+	result->events = NULL;
+	result->eventcount = 0;
+	result->song_length = 0.0;
+	result->diagnostics = NULL;
+	result->score = NULL;
+	result->start_position = 0.0;
+
+	if (fstat(fd, &sb) == -1) {
+		warn("fstat in _mdl_score_load");
+		return 1;
+	}
+
+	if (!S_ISREG(sb.st_mode) ||
+	    sb.st_size < (off_t)sizeof(struct mdl_score_header) ||
+	    (uintmax_t)sb.st_size > SIZE_MAX) {
+		warnx("not a score file");
+		return 1;
+	}
+
+	if ((score = malloc(sizeof(struct mdl_score))) == NULL) {
+		warn("malloc in _mdl_score_load");
+		return 1;
+	}
+
+	score->mapsize = sb.st_size;
+	score->map = mmap(NULL, score->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	if (score->map == MAP_FAILED) {
+		warn("mmap in _mdl_score_load");
+		free(score);
+		return 1;
+	}
+
+	if (score_check(score) != 0) {
+		_mdl_score_close(score);
+		return 1;
+	}
+
+	/* Events are never written to, but mappings are read-only. */
+	result->events = (struct timed_midievent *)score->events;
+	result->eventcount = score->header->eventcount;
+	result->song_length = score->header->song_length;
+	result->score = score;
+	result->start_position = start_position;
+
+	_mdl_log(MDLLOG_SONG, 0, "mapped a score of %zu events, length"
+	    " %.3f measures (%.3f seconds)\n", result->eventcount,
+	    result->song_length,
+	    _mdl_score_time_at(score, result->song_length));
+
+	return 0;
+}
+
+void
+_mdl_score_close(struct mdl_score *score)
+{
+	if (munmap(score->map, score->mapsize) == -1)
+		warn("munmap in _mdl_score_close");
+	free(score);
+}
+
+/*
+ * Start playing score at now from position (in measures), with
+ * _mdl_engine_start_song_at() and the nearest checkpoint at or before
+ * position.
+ */
+int
+_mdl_score_start(struct mdl_engine *engine, const struct mdl_score *score,
+    float position, double now)
+{
+	struct mdl_engine_checkpoint checkpoint;
+	const struct mdl_score_checkpoint *cp;
+	int c, n;
+
+	cp = score_find_checkpoint(score, position);
+
+	checkpoint.event = cp->event;
+	checkpoint.tempo = cp->tempo;
+
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+		checkpoint.channels[c].instrument = cp->instrument[c];
+		checkpoint.channels[c].volume = cp->volume[c];
+		for (n = 0; n < MIDI_NOTE_COUNT; n++)
+			_mdl_channel_set_note(&checkpoint.channels[c], n,
+			    (cp->notes[c][n] & SCORE_NOTE_ON) != 0,
+			    cp->notes[c][n] & MIDI_VELOCITY_MAX);
+	}
+
+	_mdl_log(MDLLOG_SEQ, 0, "starting score from measure %.3f"
+	    " (%.3f seconds), checkpoint at event %u\n", position,
+	    _mdl_score_time_at(score, position), cp->event);
+
+	return _mdl_engine_start_song_at(engine, score->events,
+	    score->header->eventcount, &checkpoint, position, now);
+}
+
+/* Return the time in seconds from the song start at the given position. */
+double
+_mdl_score_time_at(const struct mdl_score *score, float time_as_measures)
+{
+	const struct mdl_score_tempo *tempo;
+
+	tempo = score_find_tempo(score, time_as_measures);
+
+	return tempo->time +
+	    (time_as_measures - tempo->time_as_measures) * (60.0 * 4)
+	    / tempo->bpm;
+}
+
+static void
+score_apply_midievent(struct mdl_score_checkpoint *cp,
+    const struct midievent *midiev)
+{
+	const struct midinote *midinote;
+
+	switch (midiev->evtype) {
+	case MIDIEV_INSTRUMENT_CHANGE:
+		cp->instrument[ midiev->u.instr_change.channel ] =
+		    midiev->u.instr_change.code;
+		break;
+	case MIDIEV_NOTEOFF:
+		midinote = &midiev->u.midinote;
+		cp->notes[ midinote->channel ][ midinote->note ] = 0;
+		break;
+	case MIDIEV_NOTEON:
+		midinote = &midiev->u.midinote;
+		cp->notes[ midinote->channel ][ midinote->note ] =
+		    SCORE_NOTE_ON | midinote->velocity;
+		break;
+	case MIDIEV_VOLUMECHANGE:
+		cp->volume[ midiev->u.volumechange.channel ] =
+		    midiev->u.volumechange.volume;
+		break;
+	case MIDIEV_MARKER:
+	case MIDIEV_SONG_END:
+		break;
+	case MIDIEV_TEMPOCHANGE:
+		cp->tempo = midiev->u.bpm;
+		break;
+	default:
+		assert(0);
+	}
+}
+
+/*
+ * Check that the mapped file is a score that can be played safely, and
+ * set the section pointers of score.
+ */
+static int
+score_check(struct mdl_score *score)
+{
+	const struct mdl_score_header *header;
+	const struct mdl_score_checkpoint *cp;
+	const struct mdl_score_tempo *tempo;
+	const struct timed_midievent *events;
+	float previous_time;
+	size_t i;
+	int c;
+
+	header = score->map;
+
+	if (memcmp(header->magic, SCORE_MAGIC, sizeof(header->magic)) != 0) {
+		warnx("not a score file");
+		return 1;
+	}
+
+	if (header->format_version != SCORE_FORMAT_VERSION) {
+		warnx("unsupported score file format version %u",
+		    header->format_version);
+		return 1;
+	}
+
+	if (header->byteorder != SCORE_BYTEORDER ||
+	    header->eventsize != sizeof(struct timed_midievent)) {
+		warnx("score file was compiled on an incompatible host");
+		return 1;
+	}
+
+	if (header->eventcount == 0 || header->tempocount == 0 ||
+	    header->checkpointcount == 0 ||
+	    !score_check_section(score->mapsize, header->events_offset,
+	    header->eventcount, sizeof(struct timed_midievent)) ||
+	    !score_check_section(score->mapsize, header->tempos_offset,
+	    header->tempocount, sizeof(struct mdl_score_tempo)) ||
+	    !score_check_section(score->mapsize, header->checkpoints_offset,
+	    header->checkpointcount, sizeof(struct mdl_score_checkpoint))) {
+		warnx("score file is truncated or corrupted");
+		return 1;
+	}
+
+	score->header = header;
+	score->events = (const void *)
+	    ((const char *)score->map + header->events_offset);
+	score->tempos = (const void *)
+	    ((const char *)score->map + header->tempos_offset);
+	score->checkpoints = (const void *)
+	    ((const char *)score->map + header->checkpoints_offset);
+
+	events = score->events;
+
+	previous_time = 0.0;
+	for (i = 0; i < header->eventcount; i++) {
+		if (!_mdl_midi_check_timed_midievent(events[i],
+		    previous_time)) {
+			warnx("score file has an invalid event");
+			return 1;
+		}
+		previous_time = events[i].time_as_measures;
+	}
+
+	if (events[ header->eventcount - 1 ].midiev.evtype !=
+	    MIDIEV_SONG_END ||
+	    header->song_length != previous_time) {
+		warnx("score file does not end properly");
+		return 1;
+	}
+
+	for (i = 0; i < header->tempocount; i++) {
+		tempo = &score->tempos[i];
+		if (i == 0 && (tempo->time_as_measures != 0.0 ||
+		    tempo->time != 0.0)) {
+			warnx("score file tempo map does not start at zero");
+			return 1;
+		}
+		if (!isfinite(tempo->bpm) || tempo->bpm <= 0.0 ||
+		    (i > 0 && !(tempo->time_as_measures >=
+		    tempo[-1].time_as_measures && tempo->time >=
+		    tempo[-1].time))) {
+			warnx("score file has an invalid tempo map");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < header->checkpointcount; i++) {
+		cp = &score->checkpoints[i];
+		if ((i == 0 && cp->event != 0) ||
+		    (i > 0 && cp->event <= cp[-1].event) ||
+		    cp->event >= header->eventcount ||
+		    cp->time_as_measures !=
+		    events[ cp->event ].time_as_measures ||
+		    (cp->event > 0 && !(events[ cp->event - 1 ]
+		    .time_as_measures < cp->time_as_measures)) ||
+		    !isfinite(cp->tempo) || cp->tempo <= 0.0) {
+			warnx("score file has an invalid checkpoint");
+			return 1;
+		}
+		for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+			if (cp->instrument[c] > MIDI_INSTRUMENT_MAX ||
+			    cp->volume[c] > MIDI_VOLUME_MAX) {
+				warnx("score file has an invalid"
+				    " checkpoint");
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int
+score_check_section(size_t mapsize, u_int64_t offset, size_t count,
+    size_t size)
+{
+	return (offset % 8 == 0 && offset <= mapsize &&
+	    count <= (mapsize - offset) / size);
+}
+
+static const struct mdl_score_checkpoint *
+score_find_checkpoint(const struct mdl_score *score, float position)
+{
+	size_t low, high, middle;
+
+	/* Find the last checkpoint at or before position, or the first. */
+	low = 0;
+	high = score->header->checkpointcount;
+	while (high - low > 1) {
+		middle = low + (high - low) / 2;
+		if (score->checkpoints[middle].time_as_measures <= position)
+			low = middle;
+		else
+			high = middle;
+	}
+
+	return &score->checkpoints[low];
+}
+
+static const struct mdl_score_tempo *
+score_find_tempo(const struct mdl_score *score, float time_as_measures)
+{
+	size_t low, high, middle;
+
+	/* Find the last tempo change at or before time_as_measures. */
+	low = 0;
+	high = score->header->tempocount;
+	while (high - low > 1) {
+		middle = low + (high - low) / 2;
+		if (score->tempos[middle].time_as_measures <=
+		    time_as_measures)
+			low = middle;
+		else
+			high = middle;
+	}
+
+	return &score->tempos[low];
+}
+
+/*
+ * Make the tempo map and the checkpoint index for events.  A checkpoint
+ * can only be placed where the time of events changes, because playback
+ * that starts from some position plays all the events at that position.
+ */
+static int
+score_make_index(const struct timed_midievent *events, size_t eventcount,
+    struct mdl_score_tempo **tempos, size_t *tempocount,
+    struct mdl_score_checkpoint **checkpoints, size_t *checkpointcount)
+{
+	struct mdl_score_checkpoint state;
+	struct mdl_score_tempo *previous, *tempo;
+	size_t i, next_checkpoint;
+
+	*tempocount = 1;
+	for (i = 0; i < eventcount; i++)
+		if (events[i].midiev.evtype == MIDIEV_TEMPOCHANGE)
+			*tempocount += 1;
+
+	if ((*tempos = calloc(*tempocount,
+	    sizeof(struct mdl_score_tempo))) == NULL) {
+		warn("calloc in score_make_index");
+		return 1;
+	}
+
+	*checkpoints = calloc(eventcount / SCORE_CHECKPOINT_INTERVAL + 1,
+	    sizeof(struct mdl_score_checkpoint));
+	if (*checkpoints == NULL) {
+		warn("calloc in score_make_index");
+		free(*tempos);
+		return 1;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.tempo = 120;
+
+	(*tempos)[0].time_as_measures = 0.0;
+	(*tempos)[0].bpm = state.tempo;
+	(*tempos)[0].time = 0.0;
+
+	*tempocount = 1;
+	*checkpointcount = 0;
+	next_checkpoint = 0;
+
+	for (i = 0; i < eventcount; i++) {
+		if (i >= next_checkpoint && (i == 0 ||
+		    events[i-1].time_as_measures <
+		    events[i].time_as_measures)) {
+			state.event = i;
+			state.time_as_measures = events[i].time_as_measures;
+			(*checkpoints)[ (*checkpointcount)++ ] = state;
+			next_checkpoint = i + SCORE_CHECKPOINT_INTERVAL;
+		}
+
+		if (events[i].midiev.evtype == MIDIEV_TEMPOCHANGE) {
+			previous = &(*tempos)[ *tempocount - 1 ];
+			tempo = &(*tempos)[ (*tempocount)++ ];
+			tempo->time_as_measures = events[i].time_as_measures;
+			tempo->bpm = events[i].midiev.u.bpm;
+			tempo->time = previous->time +
+			    (tempo->time_as_measures -
+			    previous->time_as_measures) * (60.0 * 4)
+			    / previous->bpm;
+		}
+
+		score_apply_midievent(&state, &events[i].midiev);
+	}
+
+	return 0;
+}
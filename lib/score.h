@@ -0,0 +1,105 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_SCORE_H
+#define MDL_SCORE_H
+
+#include "compile.h"
+#include "engine.h"
+#include "midi.h"
+
+/*
+ * Precompiled scores are compiled event arrays saved in a file that is
+ * memory mapped for playback, so that playing needs no interpreter and
+ * the file pages are shared through the page cache.  A score file is a
+ * header followed by the events, a tempo map and a checkpoint index, each
+ * at the 8-byte aligned offset the header tells.  Events are stored as
+ * struct timed_midievent and numbers are in host byte order, so score
+ * files can only be played on the kind of host they were compiled on,
+ * which is checked when they are opened.
+ */
+
+#define SCORE_MAGIC		"MDLSCORE"
+#define SCORE_FORMAT_VERSION	2
+#define SCORE_BYTEORDER		0x01020304
+
+/* Checkpoints are at least this many events apart. */
+#define SCORE_CHECKPOINT_INTERVAL	1024
+
+struct mdl_score_header {
+	char		magic[8];
+	u_int32_t	format_version;
+	u_int32_t	byteorder;
+	u_int32_t	eventsize;
+	u_int32_t	eventcount;
+	u_int32_t	tempocount;
+	u_int32_t	checkpointcount;
+	float		song_length;
+	u_int32_t	reserved;
+	u_int64_t	events_offset;
+	u_int64_t	tempos_offset;
+	u_int64_t	checkpoints_offset;
+};
+
+/*
+ * Tempo from time_as_measures onwards, and the time in seconds from the
+ * song start at that point.  The first entry is for the default tempo at
+ * the song start.
+ */
+struct mdl_score_tempo {
+	float	time_as_measures;
+	float	bpm;
+	double	time;
+};
+
+/*
+ * Midi state just before an event.  Notes have the high bit set if they
+ * are on, and the low bits tell their velocity.  The first checkpoint is
+ * at the first event.
+ */
+struct mdl_score_checkpoint {
+	u_int32_t	event;
+	float		time_as_measures;
+	float		tempo;
+	u_int8_t	instrument[MIDI_CHANNEL_COUNT];
+	u_int8_t	volume[MIDI_CHANNEL_COUNT];
+	u_int8_t	notes[MIDI_CHANNEL_COUNT][MIDI_NOTE_COUNT];
+};
+
+#define SCORE_NOTE_ON	0x80
+
+struct mdl_score {
+	void				   *map;
+	size_t				    mapsize;
+	const struct mdl_score_header	   *header;
+	const struct timed_midievent	   *events;
+	const struct mdl_score_tempo	   *tempos;
+	const struct mdl_score_checkpoint  *checkpoints;
+};
+
+__BEGIN_DECLS
+int	_mdl_score_save(const char *, const struct timed_midievent *,
+    size_t);
+int	_mdl_score_load(int, float, struct mdl_compiled *);
+void	_mdl_score_close(struct mdl_score *);
+int	_mdl_score_start(struct mdl_engine *, const struct mdl_score *,
+    float, double);
+double	_mdl_score_time_at(const struct mdl_score *, float);
+__END_DECLS
+
+#endif /* !MDL_SCORE_H */
@@ -0,0 +1,441 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "score.h"
+#include "seqthread.h"
+
+#define SEQTHREAD_EVENTCOUNT	256
+
+#ifdef HAVE_CLOCK_UPTIME
+#define SEQTHREAD_CLOCK		CLOCK_UPTIME
+#else
+#define SEQTHREAD_CLOCK		CLOCK_MONOTONIC
+#endif
+
+/* How often waiting for song end checks for shutdown requests. */
+#define SEQTHREAD_POLL_NS	100000000
+
+static void	seqthread_deadline(const struct seqthread *, double,
+    struct timespec *);
+static void	seqthread_free_song(struct mdl_compiled *);
+static void    *seqthread_loop(void *);
+static double	seqthread_now(void);
+static int	seqthread_play_events(struct seqthread *, double);
+static int	seqthread_start_song(struct seqthread *,
+    struct mdl_compiled *, double);
+
+/*
+ * Start a sequencer thread that plays to a midi device (unless dry_run is
+ * set).  The thread gets its own context, with the settings of ctx.
+ */
+int
+_mdl_seqthread_start(struct mdl_ctx *ctx, struct seqthread *st,
+    enum mididev_type mididev_type, const char *devicepath, int dry_run)
+{
+	pthread_condattr_t condattr;
+	sigset_t blocked_sigmask, old_sigmask;
+	int ret;
+
+	st->next_song = NULL;
+	st->playback_song = NULL;
+	st->dry_run = dry_run;
+	st->ret = 0;
+	st->shutdown = 0;
+	st->song_ended = 0;
+
+	if ((st->ctx = _mdl_ctx_clone(ctx, "seq")) == NULL)
+		return 1;
+
+	if ((st->engine = _mdl_engine_new()) == NULL)
+		goto free_ctx;
+
+	if (!dry_run) {
+		ret = _mdl_midi_open_device(st->ctx, mididev_type,
+		    devicepath);
+		if (ret != 0)
+			goto free_engine;
+	}
+
+	if ((ret = pthread_mutex_init(&st->mtx, NULL)) != 0) {
+		warnx("pthread_mutex_init: %s", strerror(ret));
+		goto close_device;
+	}
+
+	/*
+	 * Timed waits use the same clock as playback, if condition
+	 * variables can use it (CLOCK_UPTIME may not be supported).
+	 */
+	if ((ret = pthread_condattr_init(&condattr)) != 0) {
+		warnx("pthread_condattr_init: %s", strerror(ret));
+		goto destroy_mutex;
+	}
+	st->wait_clock = SEQTHREAD_CLOCK;
+	ret = pthread_condattr_setclock(&condattr, st->wait_clock);
+	if (ret == EINVAL && st->wait_clock != CLOCK_MONOTONIC) {
+		st->wait_clock = CLOCK_MONOTONIC;
+		ret = pthread_condattr_setclock(&condattr, st->wait_clock);
+	}
+	if (ret != 0) {
+		warnx("pthread_condattr_setclock: %s", strerror(ret));
+		(void) pthread_condattr_destroy(&condattr);
+		goto destroy_mutex;
+	}
+	ret = pthread_cond_init(&st->cond, &condattr);
+	(void) pthread_condattr_destroy(&condattr);
+	if (ret != 0) {
+		warnx("pthread_cond_init: %s", strerror(ret));
+		goto destroy_mutex;
+	}
+
+	/* Signals are for the main thread. */
+	if (sigemptyset(&blocked_sigmask) == -1 ||
+	    sigaddset(&blocked_sigmask, SIGINT) == -1 ||
+	    sigaddset(&blocked_sigmask, SIGTERM) == -1) {
+		warn("error setting up sequencer thread signal mask");
+		goto destroy_cond;
+	}
+	ret = pthread_sigmask(SIG_BLOCK, &blocked_sigmask, &old_sigmask);
+	if (ret != 0) {
+		warnx("pthread_sigmask: %s", strerror(ret));
+		goto destroy_cond;
+	}
+
+	ret = pthread_create(&st->thread, NULL, seqthread_loop, st);
+
+	(void) pthread_sigmask(SIG_SETMASK, &old_sigmask, NULL);
+
+	if (ret != 0) {
+		warnx("could not create sequencer thread: %s", strerror(ret));
+		goto destroy_cond;
+	}
+
+	return 0;
+
+destroy_cond:
+	(void) pthread_cond_destroy(&st->cond);
+destroy_mutex:
+	(void) pthread_mutex_destroy(&st->mtx);
+close_device:
+	if (!dry_run)
+		_mdl_midi_close_device(st->ctx);
+free_engine:
+	_mdl_engine_free(st->engine);
+free_ctx:
+	_mdl_ctx_free(st->ctx);
+
+	return 1;
+}
+
+/*
+ * Hand song over to the sequencer thread, which starts playing it
+ * immediately and frees it once it is no longer needed.
+ */
+int
+_mdl_seqthread_play(struct seqthread *st, struct mdl_compiled *song)
+{
+	struct mdl_compiled *skipped_song;
+
+	pthread_mutex_lock(&st->mtx);
+
+	skipped_song = st->next_song;
+	st->next_song = song;
+	st->song_ended = 0;
+
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->mtx);
+
+	if (skipped_song != NULL)
+		seqthread_free_song(skipped_song);
+
+	return 0;
+}
+
+/*
+ * Wait until the song that was handed over last has been played, or until
+ * *shutdown is set by a signal handler.  Returns 1 if the sequencer thread
+ * has stopped because of an error.
+ */
+int
+_mdl_seqthread_wait_song_end(struct seqthread *st,
+    volatile sig_atomic_t *shutdown)
+{
+	struct timespec timeout;
+	int ret;
+
+	pthread_mutex_lock(&st->mtx);
+
+	while (!st->song_ended && !st->shutdown && !*shutdown) {
+		seqthread_deadline(st, SEQTHREAD_POLL_NS / 1e9, &timeout);
+		ret = pthread_cond_timedwait(&st->cond, &st->mtx, &timeout);
+		if (ret != 0 && ret != ETIMEDOUT) {
+			warnx("pthread_cond_timedwait: %s", strerror(ret));
+			break;
+		}
+	}
+
+	ret = st->ret;
+
+	pthread_mutex_unlock(&st->mtx);
+
+	return ret;
+}
+
+/*
+ * Stop the sequencer thread, turning off notes that are playing, and free
+ * everything.  Returns 1 if the sequencer thread had errors.
+ */
+int
+_mdl_seqthread_stop(struct seqthread *st)
+{
+	int ret;
+
+	pthread_mutex_lock(&st->mtx);
+	st->shutdown = 1;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->mtx);
+
+	if ((ret = pthread_join(st->thread, NULL)) != 0) {
+		warnx("pthread_join: %s", strerror(ret));
+		st->ret = 1;
+	}
+
+	if (!st->dry_run)
+		_mdl_midi_close_device(st->ctx);
+
+	if (st->next_song != NULL)
+		seqthread_free_song(st->next_song);
+	if (st->playback_song != NULL)
+		seqthread_free_song(st->playback_song);
+
+	_mdl_engine_free(st->engine);
+	_mdl_ctx_free(st->ctx);
+
+	if ((ret = pthread_cond_destroy(&st->cond)) != 0)
+		warnx("pthread_cond_destroy: %s", strerror(ret));
+	if ((ret = pthread_mutex_destroy(&st->mtx)) != 0)
+		warnx("pthread_mutex_destroy: %s", strerror(ret));
+
+	return st->ret;
+}
+
+/* Set tp to delay seconds from now on the clock of timed waits. */
+static void
+seqthread_deadline(const struct seqthread *st, double delay,
+    struct timespec *tp)
+{
+	int ret;
+
+	ret = clock_gettime(st->wait_clock, tp);
+	assert(ret == 0);
+
+	tp->tv_sec += floor(delay);
+	tp->tv_nsec += (delay - floor(delay)) * 1e9;
+	if (tp->tv_nsec >= 1000000000) {
+		tp->tv_sec += 1;
+		tp->tv_nsec -= 1000000000;
+	}
+}
+
+static void
+seqthread_free_song(struct mdl_compiled *song)
+{
+	_mdl_compiled_free(song);
+	free(song);
+}
+
+/*
+ * The thread holds mtx only to take over songs and to tell about their
+ * state, midi is written and songs are freed without it, so that
+ * _mdl_seqthread_play() never waits for those.
+ */
+static void *
+seqthread_loop(void *arg)
+{
+	struct mdl_compiled *song;
+	struct seqthread *st;
+	struct timespec timeout;
+	double delay, next_time, now;
+	int ended, has_next_time, ret;
+
+	st = arg;
+
+	if (_mdl_ctx_set(st->ctx) != 0) {
+		pthread_mutex_lock(&st->mtx);
+		st->ret = 1;
+		st->shutdown = 1;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->mtx);
+		return NULL;
+	}
+
+	_mdl_log(MDLLOG_PROCESS, 0, "new sequencer thread\n");
+
+	pthread_mutex_lock(&st->mtx);
+
+	while (!st->shutdown) {
+		song = st->next_song;
+		st->next_song = NULL;
+
+		pthread_mutex_unlock(&st->mtx);
+
+		now = seqthread_now();
+		ret = 0;
+		if (song != NULL)
+			ret = seqthread_start_song(st, song, now);
+		if (ret == 0)
+			ret = seqthread_play_events(st, now);
+		ended = (st->playback_song != NULL && !st->engine->playing);
+		has_next_time = _mdl_engine_next_time(st->engine, &next_time);
+
+		pthread_mutex_lock(&st->mtx);
+
+		if (ret != 0) {
+			st->ret = 1;
+			break;
+		}
+
+		/* A song handed over meanwhile has not ended. */
+		if (ended && !st->song_ended && st->next_song == NULL) {
+			_mdl_log(MDLLOG_SEQ, 0, "song has ended\n");
+			st->song_ended = 1;
+			pthread_cond_broadcast(&st->cond);
+		}
+
+		if (st->shutdown || st->next_song != NULL)
+			continue;
+
+		if (has_next_time) {
+			if (st->dry_run)
+				continue;
+			delay = next_time - seqthread_now();
+			if (delay <= 0.0)
+				continue;
+			seqthread_deadline(st, delay, &timeout);
+			ret = pthread_cond_timedwait(&st->cond, &st->mtx,
+			    &timeout);
+		} else {
+			ret = pthread_cond_wait(&st->cond, &st->mtx);
+		}
+		if (ret != 0 && ret != ETIMEDOUT) {
+			warnx("error waiting in sequencer thread: %s",
+			    strerror(ret));
+			st->ret = 1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&st->mtx);
+
+	_mdl_log(MDLLOG_SEQ, 0,
+	    "turning off notes that are currently playing\n");
+
+	now = seqthread_now();
+	ret = (_mdl_engine_stop(st->engine, now) != 0 ||
+	    seqthread_play_events(st, now) != 0);
+
+	pthread_mutex_lock(&st->mtx);
+	if (ret != 0)
+		st->ret = 1;
+	st->shutdown = 1;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->mtx);
+
+	return NULL;
+}
+
+static double
+seqthread_now(void)
+{
+	struct timespec tp;
+	int ret;
+
+	ret = clock_gettime(SEQTHREAD_CLOCK, &tp);
+	assert(ret == 0);
+
+	return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/*
+ * Play the events that are due at now.  With dry_run, there is no need to
+ * wait for events, so all events are played.
+ */
+static int
+seqthread_play_events(struct seqthread *st, double now)
+{
+	struct mdl_engine_event events[SEQTHREAD_EVENTCOUNT];
+	size_t count, i;
+	double until;
+	int ret;
+
+	until = st->dry_run ? HUGE_VAL : now;
+
+	do {
+		count = _mdl_engine_pull(st->engine, until, events,
+		    SEQTHREAD_EVENTCOUNT);
+		for (i = 0; i < count; i++) {
+			ret = _mdl_midi_play_midievent(st->ctx,
+			    &events[i].midiev, 0, st->dry_run);
+			if (ret != 0)
+				return ret;
+		}
+	} while (count == SEQTHREAD_EVENTCOUNT);
+
+	return 0;
+}
+
+/*
+ * Start playing song at now, freeing the song played before it.  If it
+ * can not be started, song is freed and the earlier song keeps playing.
+ */
+static int
+seqthread_start_song(struct seqthread *st, struct mdl_compiled *song,
+    double now)
+{
+	int ret;
+
+	_mdl_log(MDLLOG_SEQ, 0, "received a new playback song\n");
+
+	if (song->score != NULL) {
+		ret = _mdl_score_start(st->engine, song->score,
+		    song->start_position, now);
+	} else {
+		ret = _mdl_engine_start_song(st->engine, song->events,
+		    song->eventcount, 0, now);
+	}
+	if (ret != 0) {
+		warnx("could not start playing a new song");
+		seqthread_free_song(song);
+		return 1;
+	}
+
+	if (st->playback_song != NULL)
+		seqthread_free_song(st->playback_song);
+	st->playback_song = song;
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_SEQTHREAD_H
+#define MDL_SEQTHREAD_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "compile.h"
+#include "context.h"
+#include "engine.h"
+#include "midi.h"
+
+/*
+ * Sequencer that runs as a thread in the calling process, playing songs
+ * compiled with the compile API or mapped from score files through a
+ * playback engine.  Songs are
+ * handed over by pointer, so no pipes or imsg are needed.  Only next_song,
+ * ret, shutdown and song_ended are shared and protected by mtx, the
+ * engine and playback_song belong to the thread.
+ */
+struct seqthread {
+	pthread_t		thread;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	clockid_t		wait_clock;
+	struct mdl_ctx	       *ctx;
+	struct mdl_engine      *engine;
+	struct mdl_compiled    *next_song;
+	struct mdl_compiled    *playback_song;
+	int			dry_run;
+	int			ret;
+	int			shutdown;
+	int			song_ended;
+};
+
+__BEGIN_DECLS
+int	_mdl_seqthread_start(struct mdl_ctx *, struct seqthread *,
+    enum mididev_type, const char *, int);
+int	_mdl_seqthread_play(struct seqthread *, struct mdl_compiled *);
+int	_mdl_seqthread_wait_song_end(struct seqthread *,
+    volatile sig_atomic_t *);
+int	_mdl_seqthread_stop(struct seqthread *);
+__END_DECLS
+
+#endif /* !MDL_SEQTHREAD_H */
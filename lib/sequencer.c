@@ -29,112 +29,248 @@
 #include <imsg.h>
 #include <math.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "channels.h"
+#include "context.h"
 #include "ipc.h"
 #include "midi.h"
+#include "midipack.h"
 #include "sequencer.h"
 
-#define EVENTBLOCKCOUNT		256
+#define EVENTBLOCKSIZE		4096
 
+
+/*
+ * When closing, a channel with at least this many notes on is silenced
+ * with an "all notes off" control change instead of a noteoff for each.
+ */
+#define ALL_NOTES_OFF_MIN	16
+
+/*
+ * Eventstreams are kept packed as they are received (see midipack.h),
+ * one for each track.  Events are checked to be valid before they are
+ * put to a block, and they are not split between blocks.
+ */
 struct eventblock {
 	SIMPLEQ_ENTRY(eventblock) entries;
-	struct timed_midievent events[EVENTBLOCKCOUNT];
-	size_t readcount;
+	size_t		size;
+	u_int8_t	data[EVENTBLOCKSIZE];
 };
 SIMPLEQ_HEAD(eventstream, eventblock);
 
+/* Points to an event in eventstream, and holds it decoded in tmidiev. */
 struct eventpointer {
 	struct eventblock      *block;
-	int			index;
+	size_t			offset;
+	size_t			next_offset;
+	u_int32_t		time_bits;
+	struct timed_midievent	tmidiev;
+};
+
+/*
+ * The track with an empty name is the conductor track, which has the
+ * tempo changes, markers and the song end.  Notes of tracks that are not
+ * audible (because of mute or solo) are not played.
+ */
+struct trackstate {
+	char			name[MIDIPACK_TRACKNAME_MAX + 1];
+	struct eventstream	es;
+	struct eventblock      *last_block;
+	struct eventpointer	current_event;
+	u_int32_t		read_time_bits;
+	u_int64_t		digest;
+	int			audible;
+	int			same;
+};
+
+/* Mute or solo set by client for tracks with name. */
+struct trackmode {
+	char	name[MIDIPACK_TRACKNAME_MAX + 1];
+	int	solo;
 };
 
 TAILQ_HEAD(playback_queue, playback_event);
 struct playback_event {
 	struct timed_midievent		tmidiev;
 	struct timespec			eventtime;
+	struct trackstate	       *track;
 	TAILQ_ENTRY(playback_event)	tq;
 };
 
-struct notestate {
-	struct playback_event	*joinrequest_event;
-	unsigned int		 state    : 1;
-	unsigned int		 velocity : 7;
-};
+enum playback_state { IDLE, READING, PLAYING, FREEING_EVENTSTREAM, };
 
-struct channel_state {
-	struct notestate	notestates[MIDI_NOTE_COUNT];
-	u_int8_t		instrument;
-	u_int8_t		volume;
+/*
+ * Notes that are playing in the song, whether they can be heard or not,
+ * so that they can be started or stopped when a track is muted or
+ * unmuted.  Notes that have a track are set in songnotes_on of the
+ * songstate, see sequencer_set_songnote().
+ */
+struct songnote {
+	struct trackstate      *track;
+	u_int8_t		velocity;
 };
 
-enum playback_state { IDLE, READING, PLAYING, FREEING_EVENTSTREAM, };
-
+/*
+ * Playback goes through tracks in step, next_track having the event that
+ * comes next.  Data read from interpreter is collected to readbuf until
+ * it has whole events.  If replaced_tracks is set, the song being read
+ * has tracks that replace those named in it (each name terminated by
+ * NUL) in the song that is playing.
+ */
 struct songstate {
 	struct channel_state channelstates[MIDI_CHANNEL_COUNT];
-	struct eventstream es;
-	struct eventpointer current_event;
-	struct timespec latest_tempo_change_as_time;
+	struct songnote songnotes[MIDI_CHANNEL_COUNT][MIDI_NOTE_COUNT];
+	u_int32_t songnotes_on[MIDI_CHANNEL_COUNT][NOTE_WORDS];
+	struct trackstate **tracks;
+	size_t trackcount;
+	struct trackstate *next_track, *reading_track;
+	struct timespec latest_tempo_change_as_time, song_end_time;
 	float latest_tempo_change_as_measures, tempo, time_as_measures;
 	int got_song_end, keep_position_when_switched_to, measure_length;
+	u_int8_t readbuf[EVENTBLOCKSIZE];
+	size_t readbuf_size;
+	char *replaced_tracks;
+	size_t replaced_tracks_size;
 	enum playback_state playback_state;
 };
 
+/* Midi events that take the playing song to the state of the next one. */
+struct switch_events {
+	struct midievent	events[CHANNELS_DIFF_EVENTS_MAX];
+	size_t			count;
+};
+
+/*
+ * If switch_pending is set, reading_song is ready and switched to at
+ * switch_position of the playing song, with switch_events prepared.
+ */
 struct sequencer {
+	struct mdl_ctx	       *ctx;
 	int			dry_run;
 	int			interp_fd;
+	int			queued_interp_fd;
+	int			reading_queued_song;
+	int			queued_song_ready;
+	enum song_switch	song_switch;
+	int			switch_pending;
+	float			switch_position;
+	struct switch_events   *switch_events;
 	int			client_socket;
 	int			server_socket;
 	struct songstate	song1;
 	struct songstate	song2;
 	struct songstate       *playback_song;
 	struct songstate       *reading_song;
+	struct trackstate     **retired_tracks;
+	size_t			retired_trackcount;
+	struct trackmode       *trackmodes;
+	size_t			trackmodecount;
 	struct imsgbuf		client_ibuf;
 	struct imsgbuf		server_ibuf;
 };
 
-extern char *_mdl_process_type;
-
 /* If this is set in signal handler, we should shut down. */
 volatile sig_atomic_t	_mdl_shutdown_sequencer = 0;
 
 static int	sequencer_loop(struct sequencer *);
 static int	sequencer_accept_client_socket(struct sequencer *, int);
 static int	sequencer_accept_interp_fd(struct sequencer *, int);
+static int	sequencer_accept_queued_interp_fd(struct sequencer *, int);
+static int	sequencer_accept_replaced_tracks(struct sequencer *,
+    const struct imsg *);
 static int	sequencer_add_to_playback_queue(struct playback_queue *,
-     struct timed_midievent, struct timespec);
+     struct trackstate *, struct timed_midievent, struct timespec);
 static void	sequencer_calculate_timeout(const struct sequencer *,
     const struct timespec *, struct timespec *);
+static void	sequencer_cancel_queued_song(struct sequencer *);
+static void	sequencer_clear_channels(struct songstate *);
 static int	sequencer_clock_gettime(struct timespec *);
 static void	sequencer_close(struct sequencer *);
 static void	sequencer_close_songstate(const struct sequencer *,
     struct songstate *);
+static float	sequencer_current_position(const struct sequencer *,
+    const struct songstate *);
+static void	sequencer_decode_event(struct eventpointer *);
+static struct trackstate *sequencer_find_same_track(struct trackstate **,
+    size_t, const struct trackstate *);
+static void	sequencer_first_event(struct eventpointer *,
+    struct eventstream *);
 static void	sequencer_free_songstate(struct songstate *);
+static int	sequencer_free_tracks(struct songstate *, size_t);
 static int	sequencer_handle_client_events(struct sequencer *);
 static int	sequencer_handle_server_events(struct sequencer *);
 static void	sequencer_handle_signal(int);
-static int	sequencer_init(struct sequencer *, int, int, enum mididev_type,
-    const char *);
+static int	sequencer_init(struct sequencer *, struct mdl_ctx *, int, int,
+    enum mididev_type, const char *);
 static void	sequencer_init_songstate(const struct sequencer *,
     struct songstate *, enum playback_state);
 static int	sequencer_midievent(const struct sequencer *,
     struct songstate *, struct midievent *, int);
+static int	sequencer_new_track(const struct sequencer *,
+    struct songstate *, const char *);
+static void	sequencer_next_event(struct eventpointer *);
+static int	sequencer_note(const struct sequencer *, struct songstate *,
+    enum midievent_type, int, int, int);
+static int	sequencer_plan_switch(struct sequencer *);
 static int	sequencer_play_music(struct sequencer *,
     struct songstate *);
+static int	sequencer_play_note(const struct sequencer *,
+    struct songstate *, struct trackstate *, struct midievent *);
 static int	sequencer_play_playback_queue(struct playback_queue *,
     struct songstate *, const struct sequencer *);
-static ssize_t	sequencer_read_to_eventstream(struct songstate *, int);
+static int	sequencer_predict_channels(const struct songstate *, float,
+    struct channel_state *);
+static int	sequencer_prepare_switch(struct sequencer *);
+static ssize_t	sequencer_read_to_eventstream(const struct sequencer *,
+    struct songstate *, int);
+static int	sequencer_replace_note(const struct sequencer *,
+    struct songstate *, const struct channel_state *, struct trackstate *,
+    struct trackstate *, int, int);
+static int	sequencer_replace_track(const struct sequencer *,
+    struct songstate *, struct songstate *, const char *, float);
+static int	sequencer_replace_tracks(struct sequencer *);
 static int	sequencer_reset_songstate(struct sequencer *,
     struct songstate *);
+static int	sequencer_resolve_same_tracks(const struct sequencer *,
+    struct songstate *, struct songstate *, int);
+static void	sequencer_retire_tracks(struct sequencer *,
+    struct songstate *);
+static void	sequencer_select_next_track(struct songstate *);
+static int	sequencer_send_song_tracks(struct sequencer *);
+static int	sequencer_set_song_switch(struct sequencer *,
+    const struct imsg *);
+static void	sequencer_set_songnote(struct songstate *, int, int,
+    struct trackstate *, int);
+static int	sequencer_set_trackmode(struct sequencer *, enum mdl_event,
+    const struct imsg *);
+static void	sequencer_shadow_playback(struct songstate *);
+static void	sequencer_song_first_event(struct songstate *);
+static void	sequencer_song_next_event(struct songstate *);
 static int	sequencer_start_playing(const struct sequencer *,
-    struct songstate *, struct songstate *);
-static int	sequencer_switch_songs(struct sequencer *);
+    struct songstate *, struct songstate *, const struct timespec *, int);
+static int	sequencer_switch_songs(struct sequencer *,
+    const struct timespec *);
+static int	sequencer_store_event(struct trackstate *,
+    const u_int8_t *, size_t);
+static float	sequencer_switch_boundary(const struct sequencer *,
+    const struct songstate *);
 static void	sequencer_time_for_next_event(struct songstate *ss,
     struct timespec *);
+static void	sequencer_time_for_position(const struct songstate *, float,
+    struct timespec *);
+static int	sequencer_track_is_audible(const struct sequencer *,
+    const char *);
+static int	sequencer_update_audibility(const struct sequencer *,
+    struct songstate *);
+static int	sequencer_update_track_notes(const struct sequencer *,
+    struct songstate *, const struct trackstate *);
 static const char *ss_label(const struct sequencer *, struct songstate *);
 
 static struct timespec
@@ -142,8 +278,8 @@ sequencer_calc_time_since_latest_tempo_change(const struct songstate *,
     float);
 
 static int
-sequencer_init(struct sequencer *seq, int dry_run, int server_socket,
-    enum mididev_type mididev_type, const char *devicepath)
+sequencer_init(struct sequencer *seq, struct mdl_ctx *ctx, int dry_run,
+    int server_socket, enum mididev_type mididev_type, const char *devicepath)
 {
 	sigset_t loop_sigmask;
 
@@ -159,10 +295,28 @@ sequencer_init(struct sequencer *seq, int dry_run, int server_socket,
 		return 1;
 	}
 
+	seq->ctx = ctx;
 	seq->client_socket = -1;
 	seq->dry_run = dry_run;
 	seq->interp_fd = -1;
+	seq->queued_interp_fd = -1;
+	seq->queued_song_ready = 0;
+	seq->reading_queued_song = 0;
+	seq->retired_tracks = NULL;
+	seq->retired_trackcount = 0;
 	seq->server_socket = server_socket;
+	seq->song_switch = SONG_SWITCH_NOW;
+	seq->switch_pending = 0;
+	seq->switch_position = 0.0;
+	seq->trackmodes = NULL;
+	seq->trackmodecount = 0;
+
+	seq->switch_events = malloc(sizeof(struct switch_events));
+	if (seq->switch_events == NULL) {
+		warn("malloc in sequencer_init");
+		return 1;
+	}
+	seq->switch_events->count = 0;
 
 	if (fcntl(seq->server_socket, F_SETFL, O_NONBLOCK) == -1) {
 		warn("could not set server_socket non-blocking");
@@ -170,7 +324,8 @@ sequencer_init(struct sequencer *seq, int dry_run, int server_socket,
 	}
 
 	if (!seq->dry_run) {
-		if (_mdl_midi_open_device(mididev_type, devicepath) != 0)
+		if (_mdl_midi_open_device(seq->ctx, mididev_type,
+		    devicepath) != 0)
 			return 1;
 	}
 
@@ -195,7 +350,7 @@ sequencer_handle_signal(int signo)
 }
 
 int
-_mdl_start_sequencer_process(pid_t *sequencer_pid,
+_mdl_start_sequencer_process(struct mdl_ctx *ctx, pid_t *sequencer_pid,
     struct sequencer_connection *seq_conn, enum mididev_type mididev_type,
     const char *devicepath, int dry_run)
 {
@@ -241,8 +396,8 @@ _mdl_start_sequencer_process(pid_t *sequencer_pid,
 
 		setproctitle("sequencer");
 
-		_mdl_logging_clear();
-		_mdl_process_type = "seq";
+		_mdl_logging_clear(ctx);
+		ctx->process_type = "seq";
 		_mdl_log(MDLLOG_PROCESS, 0, "new sequencer process, pid %d\n",
 		    getpid());
 		/*
@@ -252,8 +407,8 @@ _mdl_start_sequencer_process(pid_t *sequencer_pid,
 		if (close(ss_sp[0]) == -1)
 			warn("error closing first end of ss_sp");
 
-		ret = sequencer_init(&seq, dry_run, ss_sp[1], mididev_type,
-		    devicepath);
+		ret = sequencer_init(&seq, ctx, dry_run, ss_sp[1],
+		    mididev_type, devicepath);
 		if (ret != 0) {
 			warnx("problem initializing sequencer");
 			sequencer_retvalue = 1;
@@ -278,7 +433,7 @@ _mdl_start_sequencer_process(pid_t *sequencer_pid,
 			warn("error flushing streams in sequencer before"
 			       " exit");
 		}
-		_mdl_logging_close();
+		_mdl_ctx_free(ctx);
 		_exit(sequencer_retvalue);
 	}
 
@@ -337,7 +492,7 @@ sequencer_loop(struct sequencer *seq)
 {
 	fd_set readfds;
 	int retvalue, ret, nr;
-	struct timespec eventtime, timeout, *timeout_p;
+	struct timespec eventtime, switchtime, timeout, *timeout_p;
 	sigset_t select_sigmask;
 
 	retvalue = 0;
@@ -354,7 +509,11 @@ sequencer_loop(struct sequencer *seq)
 
 		_mdl_log(MDLLOG_SEQ, 0, "new sequencer loop iteration\n");
 
-		if (seq->client_socket >= 0) {
+		/*
+		 * Write only when there is something to write, as a client
+		 * may have closed its socket already.
+		 */
+		if (seq->client_socket >= 0 && seq->client_ibuf.w.queued > 0) {
 			if (msgbuf_write(&seq->client_ibuf.w) == -1) {
 				if (errno != EAGAIN) {
 					warnx("msgbuf_write error");
@@ -364,6 +523,14 @@ sequencer_loop(struct sequencer *seq)
 			}
 		}
 
+		if (seq->server_socket >= 0 && seq->server_ibuf.w.queued > 0) {
+			if (msgbuf_write(&seq->server_ibuf.w) == -1 &&
+			    errno != EAGAIN) {
+				warnx("msgbuf_write error for server");
+				goto finish;
+			}
+		}
+
 		FD_ZERO(&readfds);
 		if (seq->client_socket >= 0)
 			FD_SET(seq->client_socket, &readfds);
@@ -371,12 +538,27 @@ sequencer_loop(struct sequencer *seq)
 			FD_SET(seq->server_socket, &readfds);
 
 		ret = sequencer_reset_songstate(seq, seq->reading_song);
+		if (ret && seq->interp_fd == -1 &&
+		    seq->queued_interp_fd >= 0 && !seq->queued_song_ready) {
+			/* Start reading the song queued after this one. */
+			seq->interp_fd = seq->queued_interp_fd;
+			seq->queued_interp_fd = -1;
+			seq->reading_queued_song = 1;
+		}
 		if (ret && seq->interp_fd >= 0)
 			FD_SET(seq->interp_fd, &readfds);
 
 		if (seq->playback_song->playback_state == PLAYING) {
 			sequencer_time_for_next_event(seq->playback_song,
 			    &eventtime);
+			if (seq->switch_pending) {
+				sequencer_time_for_position(seq->playback_song,
+				    seq->switch_position, &switchtime);
+				if (switchtime.tv_sec < eventtime.tv_sec ||
+				    (switchtime.tv_sec == eventtime.tv_sec &&
+				    switchtime.tv_nsec < eventtime.tv_nsec))
+					eventtime = switchtime;
+			}
 			sequencer_calculate_timeout(seq, &eventtime, &timeout);
 			timeout_p = &timeout;
 		} else {
@@ -408,6 +590,38 @@ sequencer_loop(struct sequencer *seq)
 				retvalue = 1;
 				goto finish;
 			}
+			/*
+			 * If the next song has been read while this one was
+			 * playing, switch to it so that it starts exactly
+			 * at the boundary prepared for it, or when this one
+			 * ends.
+			 */
+			if (seq->switch_pending &&
+			    seq->playback_song->playback_state == PLAYING) {
+				sequencer_time_for_position(seq->playback_song,
+				    seq->switch_position, &switchtime);
+				sequencer_calculate_timeout(seq, &switchtime,
+				    &timeout);
+				if (timeout.tv_sec == 0 &&
+				    timeout.tv_nsec == 0) {
+					seq->queued_song_ready = 0;
+					ret = sequencer_switch_songs(seq,
+					    &switchtime);
+					if (ret != 0) {
+						retvalue = 1;
+						goto finish;
+					}
+				}
+			} else if (seq->playback_song->playback_state ==
+			    IDLE && seq->queued_song_ready) {
+				seq->queued_song_ready = 0;
+				ret = sequencer_switch_songs(seq,
+				    &seq->playback_song->song_end_time);
+				if (ret != 0) {
+					retvalue = 1;
+					goto finish;
+				}
+			}
 		}
 
 		if (seq->server_socket >= 0 &&
@@ -452,24 +666,55 @@ sequencer_loop(struct sequencer *seq)
 			    "reading eventstream to songstate %s\n",
 			    ss_label(seq, seq->reading_song));
 
-			nr = sequencer_read_to_eventstream(seq->reading_song,
-			    seq->interp_fd);
+			nr = sequencer_read_to_eventstream(seq,
+			    seq->reading_song, seq->interp_fd);
 			if (nr == -1) {
 				retvalue = 1;
 				goto finish;
 			}
-			if (nr == 0) {
+			if (nr == 0 &&
+			    seq->reading_song->replaced_tracks != NULL) {
+				/* Only some tracks of current song change. */
+				if (sequencer_replace_tracks(seq) != 0) {
+					retvalue = 1;
+					goto finish;
+				}
+			} else if (nr == 0 && seq->reading_queued_song &&
+			    seq->playback_song->playback_state == PLAYING) {
+				/*
+				 * Song to play after the current one is
+				 * ready, keep it until the current one ends.
+				 */
+				_mdl_log(MDLLOG_SEQ, 0,
+				    "queued songstate %s is ready\n",
+				    ss_label(seq, seq->reading_song));
+				seq->queued_song_ready = 1;
+			} else if (nr == 0 &&
+			    seq->song_switch != SONG_SWITCH_NOW &&
+			    seq->playback_song->playback_state == PLAYING) {
+				/*
+				 * New song replaces the current one at
+				 * a boundary, prepare for that now.
+				 */
+				if (sequencer_prepare_switch(seq) != 0) {
+					retvalue = 1;
+					goto finish;
+				}
+			} else if (nr == 0) {
 				/*
 				 * We have a new playback stream, great!
 				 * reading_song becomes the playback song.
 				 */
-				if (sequencer_switch_songs(seq) != 0) {
+				if (sequencer_switch_songs(seq, NULL) != 0) {
 					retvalue = 1;
 					goto finish;
 				}
+			}
+			if (nr == 0) {
 				if (close(seq->interp_fd) == -1)
 					warn("closing interpreter pipe");
 				seq->interp_fd = -1;
+				seq->reading_queued_song = 0;
 			}
 		}
 	}
@@ -496,31 +741,21 @@ sequencer_init_songstate(const struct sequencer *seq, struct songstate *ss,
 		"playing",		/* PLAYING */
 		"freeing eventstream",	/* FREEING_EVENTSTREAM */
 	};
-	int c, n;
-	struct notestate *notestate;
-
 	assert(ps == IDLE || ps == READING);
 
-	SIMPLEQ_INIT(&ss->es);
-
 	_mdl_log(MDLLOG_SEQ, 0,
 	    "initializing a new songstate %s to state \"%s\"\n",
 	   ss_label(seq, ss), strings[ps]);
 
-	/* Initialize channelstates. */
-	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
-		ss->channelstates[c].instrument = 0;
-		ss->channelstates[c].volume = 0;
-		for (n = 0; n < MIDI_NOTE_COUNT; n++) {
-			notestate = &ss->channelstates[c].notestates[n];
-			notestate->state = 0;
-			notestate->velocity = 0;
-			notestate->joinrequest_event = NULL;
-		}
-	}
+	sequencer_clear_channels(ss);
 
-	ss->current_event.block = NULL;
-	ss->current_event.index = 0;
+	ss->tracks = NULL;
+	ss->trackcount = 0;
+	ss->next_track = NULL;
+	ss->reading_track = NULL;
+	ss->readbuf_size = 0;
+	ss->replaced_tracks = NULL;
+	ss->replaced_tracks_size = 0;
 	ss->got_song_end = 0;
 	ss->keep_position_when_switched_to = 0;
 	ss->latest_tempo_change_as_measures = 0;
@@ -589,14 +824,128 @@ sequencer_accept_interp_fd(struct sequencer *seq, int new_fd)
 		return 1;
 	}
 
-	if (seq->interp_fd >= 0 && close(seq->interp_fd) == -1)
-		warn("closing old interpreter pipe");
+	if (seq->interp_fd >= 0) {
+		if (close(seq->interp_fd) == -1)
+			warn("closing old interpreter pipe");
+		/* Forget what was read from the old pipe. */
+		if (seq->reading_song->playback_state == READING) {
+			sequencer_free_songstate(seq->reading_song);
+			sequencer_init_songstate(seq, seq->reading_song,
+			    READING);
+		}
+	}
 
 	seq->interp_fd = new_fd;
 
 	return 0;
 }
 
+/*
+ * Accept an interpreter pipe for tracks that replace those named in
+ * imsg in the song that is playing.
+ */
+static int
+sequencer_accept_replaced_tracks(struct sequencer *seq,
+    const struct imsg *imsg)
+{
+	struct songstate *ss;
+	size_t size;
+
+	size = imsg->hdr.len - IMSG_HEADER_SIZE;
+
+	if (_mdl_check_tracknames(imsg->data, size) != 0) {
+		if (imsg->fd >= 0 && close(imsg->fd) == -1)
+			warn("closing interpreter pipe");
+		return 1;
+	}
+
+	if (sequencer_accept_interp_fd(seq, imsg->fd) != 0)
+		return 1;
+
+	ss = seq->reading_song;
+	free(ss->replaced_tracks);
+	ss->replaced_tracks_size = 0;
+
+	if ((ss->replaced_tracks = malloc(size)) == NULL) {
+		warn("malloc in sequencer_accept_replaced_tracks");
+		return 1;
+	}
+	memcpy(ss->replaced_tracks, imsg->data, size);
+	ss->replaced_tracks_size = size;
+
+	return 0;
+}
+
+/*
+ * Accept an interpreter pipe for a song that should be played after the
+ * current one.  If some song is still being read, it is read later.
+ */
+static int
+sequencer_accept_queued_interp_fd(struct sequencer *seq, int new_fd)
+{
+	if (new_fd == -1) {
+		warnx("did not receive an interpreter pipe when expecting it");
+		return 1;
+	}
+
+	if (seq->interp_fd == -1 && !seq->queued_song_ready &&
+	    seq->queued_interp_fd == -1) {
+		if (sequencer_accept_interp_fd(seq, new_fd) != 0)
+			return 1;
+		seq->reading_queued_song = 1;
+		return 0;
+	}
+
+	_mdl_log(MDLLOG_SEQ, 0, "received queued interpreter pipe\n");
+
+	if (fcntl(new_fd, F_SETFL, O_NONBLOCK) == -1) {
+		warn("could not set queued interpreter pipe non-blocking,"
+		    " not accepting it");
+		if (close(new_fd) == -1)
+			warn("closing queued interpreter pipe");
+		return 1;
+	}
+
+	if (seq->queued_interp_fd >= 0 && close(seq->queued_interp_fd) == -1)
+		warn("closing old queued interpreter pipe");
+
+	seq->queued_interp_fd = new_fd;
+
+	return 0;
+}
+
+/* Forget songs queued after the current one. */
+static void
+sequencer_cancel_queued_song(struct sequencer *seq)
+{
+	if (seq->queued_interp_fd >= 0) {
+		if (close(seq->queued_interp_fd) == -1)
+			warn("closing queued interpreter pipe");
+		seq->queued_interp_fd = -1;
+	}
+
+	seq->reading_queued_song = 0;
+
+	if (seq->queued_song_ready) {
+		_mdl_log(MDLLOG_SEQ, 0,
+		    "dropping queued songstate %s\n",
+		    ss_label(seq, seq->reading_song));
+		sequencer_free_songstate(seq->reading_song);
+		sequencer_init_songstate(seq, seq->reading_song, READING);
+		seq->queued_song_ready = 0;
+		seq->switch_pending = 0;
+	}
+}
+
+/* Set channels of ss to the state they have at the start of a song. */
+static void
+sequencer_clear_channels(struct songstate *ss)
+{
+	_mdl_channels_clear(ss->channelstates);
+	memset(ss->songnotes, 0, sizeof(ss->songnotes));
+	memset(ss->songnotes_on, 0, sizeof(ss->songnotes_on));
+}
+
 static void
 sequencer_calculate_timeout(const struct sequencer *seq,
     const struct timespec *eventtime, struct timespec *timeout)
@@ -641,16 +990,104 @@ sequencer_clock_gettime(struct timespec *tp)
 #endif
 }
 
+/*
+ * Position of playback in ss as measures.  This is the current time,
+ * unless the next event is late (as it always is on a dry run).
+ */
+static float
+sequencer_current_position(const struct sequencer *seq,
+    const struct songstate *ss)
+{
+	struct timespec now;
+	double seconds;
+	float next, position;
+	int ret;
+
+	assert(ss->next_track != NULL);
+	next = ss->next_track->current_event.tmidiev.time_as_measures;
+
+	if (seq->dry_run)
+		return next;
+
+	ret = sequencer_clock_gettime(&now);
+	assert(ret == 0);
+
+	seconds = (now.tv_sec - ss->latest_tempo_change_as_time.tv_sec) +
+	    (now.tv_nsec - ss->latest_tempo_change_as_time.tv_nsec) /
+	    1000000000.0;
+	position = ss->latest_tempo_change_as_measures +
+	    seconds * ss->tempo / (240.0 * ss->measure_length);
+
+	return (position < next) ? position : next;
+}
+
+/* Decode the event at ep, which has been checked on read. */
+static void
+sequencer_decode_event(struct eventpointer *ep)
+{
+	ssize_t n;
+
+	n = _mdl_midipack_decode(&ep->block->data[ ep->offset ],
+	    ep->block->size - ep->offset, &ep->time_bits, &ep->tmidiev);
+	assert(n > 0);
+
+	ep->next_offset = ep->offset + n;
+}
+
+/* Point ep to the first event of es, or set ep->block to NULL. */
+static void
+sequencer_first_event(struct eventpointer *ep, struct eventstream *es)
+{
+	ep->block = SIMPLEQ_FIRST(es);
+	ep->offset = 0;
+	ep->time_bits = 0;
+
+	if (ep->block != NULL)
+		sequencer_decode_event(ep);
+}
+
 static void
 sequencer_free_songstate(struct songstate *ss)
+{
+	(void) sequencer_free_tracks(ss, SIZE_MAX);
+
+	free(ss->replaced_tracks);
+	ss->replaced_tracks = NULL;
+	ss->replaced_tracks_size = 0;
+}
+
+/*
+ * Free at most maxblocks eventblocks of ss, and the tracks that have no
+ * more blocks.  Returns 1 if all tracks have been freed.
+ */
+static int
+sequencer_free_tracks(struct songstate *ss, size_t maxblocks)
 {
 	struct eventblock *eb;
+	struct trackstate *track;
+	size_t i;
 
-	while (!SIMPLEQ_EMPTY(&ss->es)) {
-		eb = SIMPLEQ_FIRST(&ss->es);
-		SIMPLEQ_REMOVE_HEAD(&ss->es, entries);
+	i = 0;
+	while (ss->trackcount > 0) {
+		track = ss->tracks[ ss->trackcount - 1 ];
+		if (SIMPLEQ_EMPTY(&track->es)) {
+			free(track);
+			ss->trackcount--;
+			continue;
+		}
+		if (i++ == maxblocks)
+			return 0;
+		eb = SIMPLEQ_FIRST(&track->es);
+		SIMPLEQ_REMOVE_HEAD(&track->es, entries);
 		free(eb);
 	}
+
+	free(ss->tracks);
+	ss->tracks = NULL;
+	ss->next_track = NULL;
+	ss->reading_track = NULL;
+
+	return 1;
 }
 
 static int
@@ -701,11 +1138,26 @@ sequencer_handle_client_events(struct sequencer *seq)
 			retvalue = 1;
 			break;
 		case CLIENTEVENT_NEW_SONG:
+			sequencer_cancel_queued_song(seq);
+			if (sequencer_set_song_switch(seq, &imsg) != 0) {
+				retvalue = 1;
+				break;
+			}
 			ret = sequencer_accept_interp_fd(seq, imsg.fd);
 			if (ret != 0)
 				retvalue = 1;
 			break;
+		case CLIENTEVENT_QUEUE_SONG:
+			ret = sequencer_accept_queued_interp_fd(seq, imsg.fd);
+			if (ret != 0)
+				retvalue = 1;
+			break;
 		case CLIENTEVENT_REPLACE_SONG:
+			sequencer_cancel_queued_song(seq);
+			if (sequencer_set_song_switch(seq, &imsg) != 0) {
+				retvalue = 1;
+				break;
+			}
 			ret = sequencer_accept_interp_fd(seq, imsg.fd);
 			if (ret != 0) {
 				retvalue = 1;
@@ -713,7 +1165,19 @@ sequencer_handle_client_events(struct sequencer *seq)
 			}
 			seq->reading_song->keep_position_when_switched_to = 1;
 			break;
+		case CLIENTEVENT_REPLACE_TRACKS:
+			sequencer_cancel_queued_song(seq);
+			if (sequencer_accept_replaced_tracks(seq, &imsg) != 0)
+				retvalue = 1;
+			break;
+		case CLIENTEVENT_MUTE_TRACK:
+		case CLIENTEVENT_SOLO_TRACK:
+		case CLIENTEVENT_UNMUTE_TRACK:
+			if (sequencer_set_trackmode(seq, event, &imsg) != 0)
+				retvalue = 1;
+			break;
 		case SEQEVENT_SONG_END:
+		case SEQEVENT_SONG_TRACKS:
 			warnx("received a sequencer event from client");
 			retvalue = 1;
 			break;
@@ -780,11 +1244,26 @@ sequencer_handle_server_events(struct sequencer *seq)
 		switch (event) {
 		case CLIENTEVENT_NEW_MUSICFD:
 		case CLIENTEVENT_NEW_SONG:
+		case CLIENTEVENT_QUEUE_SONG:
 		case CLIENTEVENT_REPLACE_SONG:
 			warnx("received a client event from server");
 			retvalue = 1;
 			break;
+		case CLIENTEVENT_REPLACE_TRACKS:
+			/* Server passes these from clients with no music. */
+			sequencer_cancel_queued_song(seq);
+			if (sequencer_accept_replaced_tracks(seq, &imsg) != 0)
+				retvalue = 1;
+			break;
+		case CLIENTEVENT_MUTE_TRACK:
+		case CLIENTEVENT_SOLO_TRACK:
+		case CLIENTEVENT_UNMUTE_TRACK:
+			/* Server passes these from clients with no music. */
+			if (sequencer_set_trackmode(seq, event, &imsg) != 0)
+				retvalue = 1;
+			break;
 		case SEQEVENT_SONG_END:
+		case SEQEVENT_SONG_TRACKS:
 			warnx("received a sequencer event from server");
 			retvalue = 1;
 			break;
@@ -811,10 +1290,75 @@ sequencer_handle_server_events(struct sequencer *seq)
 	return retvalue;
 }
 
+/*
+ * Add a track with name to ss, for the events read after its header.
+ * The conductor track (with an empty name) must be the last one.
+ */
+static int
+sequencer_new_track(const struct sequencer *seq, struct songstate *ss,
+    const char *name)
+{
+	struct trackstate **tracks, *track;
+
+	if (ss->reading_track != NULL && ss->reading_track->name[0] == '\0') {
+		warnx("received a track after the conductor track");
+		return 1;
+	}
+
+	if (name[0] == '\0') {
+		_mdl_log(MDLLOG_MIDISTREAM, 0, "received conductor track\n");
+	} else {
+		_mdl_log(MDLLOG_MIDISTREAM, 0, "received track \"%s\"\n",
+		    name);
+	}
+
+	tracks = reallocarray(ss->tracks, ss->trackcount + 1,
+	    sizeof(struct trackstate *));
+	if (tracks == NULL) {
+		warn("reallocarray in sequencer_new_track");
+		return 1;
+	}
+	ss->tracks = tracks;
+
+	if ((track = malloc(sizeof(struct trackstate))) == NULL) {
+		warn("malloc in sequencer_new_track");
+		return 1;
+	}
+
+	(void) strlcpy(track->name, name, sizeof(track->name));
+	SIMPLEQ_INIT(&track->es);
+	track->last_block = NULL;
+	track->current_event.block = NULL;
+	track->read_time_bits = 0;
+	track->digest = MIDIPACK_DIGEST_INIT;
+	track->audible = sequencer_track_is_audible(seq, name);
+	track->same = 0;
+
+	ss->tracks[ ss->trackcount++ ] = track;
+	ss->reading_track = track;
+
+	return 0;
+}
+
+/* Move ep to the next event, setting ep->block to NULL at the end. */
+static void
+sequencer_next_event(struct eventpointer *ep)
+{
+	ep->offset = ep->next_offset;
+
+	while (ep->block != NULL && ep->offset == ep->block->size) {
+		ep->block = SIMPLEQ_NEXT(ep->block, entries);
+		ep->offset = 0;
+	}
+
+	if (ep->block != NULL)
+		sequencer_decode_event(ep);
+}
+
 static int
 sequencer_play_music(struct sequencer *seq, struct songstate *ss)
 {
-	struct eventpointer *ce;
+	struct trackstate *track;
 	struct timed_midievent *tmidiev;
 	struct midievent *midiev;
 	struct timespec eventtime, time_to_play;
@@ -823,69 +1367,65 @@ sequencer_play_music(struct sequencer *seq, struct songstate *ss)
 
 	/*
 	 * This function constructs a playback queue and then calls
-	 * sequencer_play_playback_queue() to play it.  Current the
-	 * playback queue is used mostly so that note joining can be done.
-	 * This means that all noteon/noteoff-events with the exact same 
-	 * moment of playback should go to the same queue, so that the
-	 * possible noteoff-events that request joining can be joined to
-	 * noteon-events.  Playback queue is emptied and freed always,
-	 * even in case of playback failures.
+	 * sequencer_play_playback_queue() to play it.  Times for all
+	 * events in the queue are computed before any tempo change in it
+	 * takes effect.  Note joins have already been resolved when the
+	 * song was compiled, so events are played as they are.  Playback
+	 * queue is emptied and freed always, even in case of playback
+	 * failures.
 	 */
 
 	retvalue = 0;
 
-	ce = &ss->current_event;
-
 	TAILQ_INIT(&pbq);
 
-	while (ce->block) {
-		while (ce->index < EVENTBLOCKCOUNT) {
-			tmidiev = &ce->block->events[ ce->index ];
-			midiev = &tmidiev->midiev;
-
-			if (midiev->evtype == MIDIEV_SONG_END) {
-				ss->playback_state = IDLE;
-
-				if (seq->client_socket >= 0) {
-					ret = imsg_compose(&seq->client_ibuf,
-					    SEQEVENT_SONG_END, 0, 0, -1, "",
-					    0);
-					if (ret == -1) {
-						warnx("error sending"
-						    " SEQEVENT_SONG_END");
-						retvalue = 1;
-						goto finish;
-					}
-				}
+	while ((track = ss->next_track) != NULL) {
+		tmidiev = &track->current_event.tmidiev;
+		midiev = &tmidiev->midiev;
 
-				goto finish;
+		/* The next song takes over from the switch on. */
+		if (seq->switch_pending &&
+		    tmidiev->time_as_measures >= seq->switch_position)
+			goto finish;
+
+		if (midiev->evtype == MIDIEV_SONG_END) {
+			sequencer_time_for_next_event(ss, &ss->song_end_time);
+			ss->playback_state = IDLE;
+
+			if (seq->client_socket >= 0) {
+				ret = imsg_compose(&seq->client_ibuf,
+				    SEQEVENT_SONG_END, 0, 0, -1, "",
+				    0);
+				if (ret == -1) {
+					warnx("error sending"
+					    " SEQEVENT_SONG_END");
+					retvalue = 1;
+					goto finish;
+				}
 			}
 
-			sequencer_time_for_next_event(ss, &eventtime);
-			sequencer_calculate_timeout(seq, &eventtime,
-			    &time_to_play);
+			goto finish;
+		}
 
-			/*
-			 * If timeout has not been gone to zero,
-			 * it is not our time to play yet.
-			 */
-			if (time_to_play.tv_sec > 0 ||
-			    (time_to_play.tv_sec == 0 &&
-			    time_to_play.tv_nsec > 0))
-				goto finish;
+		sequencer_time_for_next_event(ss, &eventtime);
+		sequencer_calculate_timeout(seq, &eventtime, &time_to_play);
 
-			ret = sequencer_add_to_playback_queue(&pbq, *tmidiev,
-			    eventtime);
-			if (ret != 0) {
-				retvalue = 1;
-				goto finish;
-			}
+		/*
+		 * If timeout has not been gone to zero,
+		 * it is not our time to play yet.
+		 */
+		if (time_to_play.tv_sec > 0 ||
+		    (time_to_play.tv_sec == 0 && time_to_play.tv_nsec > 0))
+			goto finish;
 
-			ce->index += 1;
+		ret = sequencer_add_to_playback_queue(&pbq, track, *tmidiev,
+		    eventtime);
+		if (ret != 0) {
+			retvalue = 1;
+			goto finish;
 		}
 
-		ce->block = SIMPLEQ_NEXT(ce->block, entries);
-		ce->index = 0;
+		sequencer_song_next_event(ss);
 	}
 
 finish:
@@ -896,7 +1436,8 @@ finish:
 
 static int
 sequencer_add_to_playback_queue(struct playback_queue *pbq,
-     struct timed_midievent tmidiev, struct timespec eventtime)
+     struct trackstate *track, struct timed_midievent tmidiev,
+     struct timespec eventtime)
 {
 	struct playback_event *pb_event;
 
@@ -907,6 +1448,7 @@ sequencer_add_to_playback_queue(struct playback_queue *pbq,
 
 	pb_event->eventtime = eventtime;
 	pb_event->tmidiev = tmidiev;
+	pb_event->track = track;
 
 	TAILQ_INSERT_TAIL(pbq, pb_event, tq);
 
@@ -917,52 +1459,15 @@ static int
 sequencer_play_playback_queue(struct playback_queue *pbq,
     struct songstate *ss, const struct sequencer *seq)
 {
-	struct playback_event *p, *q, *joinrequest_event;
+	struct playback_event *p, *q;
 	struct midievent *midiev;
-	u_int8_t channel, note;
 	int ret;
 
 	ret = 0;
 
-	TAILQ_FOREACH_SAFE(p, pbq, tq, q) {
-		midiev = &p->tmidiev.midiev;
-		channel = midiev->u.midinote.channel;
-		note = midiev->u.midinote.note;
-
-		if (midiev->evtype == MIDIEV_NOTEOFF
-		    && midiev->u.midinote.joining) {
-			ss->channelstates[channel].notestates[note]
-			    .joinrequest_event = p;
-		} else if (midiev->evtype == MIDIEV_NOTEON) {
-			joinrequest_event = ss->channelstates[channel]
-			    .notestates[note].joinrequest_event;
-			if (joinrequest_event &&
-			    joinrequest_event->tmidiev.time_as_measures ==
-			    p->tmidiev.time_as_measures) {
-				/*
-				 * There is a noteoff at the exact same time
-				 * that wants a join, so remove the noteoff
-				 * note from the play queue, and the noteon
-				 * midievent as well, so the note simply
-				 * continues on.
-				 */
-				TAILQ_REMOVE(pbq, p, tq);
-				free(p);
-				TAILQ_REMOVE(pbq, joinrequest_event, tq);
-				free(joinrequest_event);
-				ss->channelstates[channel].notestates[note]
-				    .joinrequest_event = NULL;
-			}
-		}
-	}
-
 	TAILQ_FOREACH_SAFE(p, pbq, tq, q) {
 		if (ret == 0) {
 			midiev = &p->tmidiev.midiev;
-			channel = midiev->u.midinote.channel;
-			note = midiev->u.midinote.note;
-			ss->channelstates[channel].notestates[note]
-			    .joinrequest_event = NULL;
 
 			switch (p->tmidiev.midiev.evtype) {
 			case MIDIEV_TEMPOCHANGE:
@@ -973,6 +1478,13 @@ sequencer_play_playback_queue(struct playback_queue *pbq,
 				_mdl_log(MDLLOG_MIDI, 0,
 				    "changing tempo to %.0fbpm\n", ss->tempo);
 				break;
+			case MIDIEV_MARKER:
+				break;
+			case MIDIEV_NOTEOFF:
+			case MIDIEV_NOTEON:
+				ret = sequencer_play_note(seq, ss, p->track,
+				    midiev);
+				break;
 			default:
 				ret = sequencer_midievent(seq, ss, midiev, 0);
 			}
@@ -985,139 +1497,237 @@ sequencer_play_playback_queue(struct playback_queue *pbq,
 	return ret;
 }
 
+/*
+ * Keep track of the note in the song, and play it if its track can be
+ * heard (or if it is a noteoff for a note that is playing).
+ */
 static int
-sequencer_midievent(const struct sequencer *seq, struct songstate *ss,
-    struct midievent *me, int level)
+sequencer_play_note(const struct sequencer *seq, struct songstate *ss,
+    struct trackstate *track, struct midievent *me)
 {
-	struct notestate *nstate;
-	int ret;
+	int c, n;
 
-	if ((ret = _mdl_midi_play_midievent(me, level, seq->dry_run)) != 0)
-		return ret;
+	c = me->u.midinote.channel;
+	n = me->u.midinote.note;
 
-	switch (me->evtype) {
-	case MIDIEV_INSTRUMENT_CHANGE:
-		ss->channelstates[me->u.instr_change.channel].instrument =
-		    me->u.instr_change.code;
-		break;
-	case MIDIEV_NOTEOFF:
-		nstate = &ss->channelstates[me->u.midinote.channel]
-		    .notestates[me->u.midinote.note];
-		nstate->state = 0;
-		nstate->velocity = 0;
-		break;
-	case MIDIEV_NOTEON:
-		nstate = &ss->channelstates[me->u.midinote.channel]
-		    .notestates[me->u.midinote.note];
-		nstate->state = 1;
-		nstate->velocity = me->u.midinote.velocity;
-		break;
-	case MIDIEV_SONG_END:
-	case MIDIEV_TEMPOCHANGE:
-		/* These events should not have come this far. */
-		assert(0);
-		break;
-	case MIDIEV_VOLUMECHANGE:
-		ss->channelstates[me->u.volumechange.channel].volume =
-		    me->u.volumechange.volume;
-		break;
-	default:
-		assert(0);
+	if (me->evtype == MIDIEV_NOTEON) {
+		sequencer_set_songnote(ss, c, n, track,
+		    me->u.midinote.velocity);
+		if (!track->audible)
+			return 0;
+	} else {
+		sequencer_set_songnote(ss, c, n, NULL, 0);
+		if (!_mdl_channel_note_is_on(&ss->channelstates[c], n))
+			return 0;
 	}
 
+	return sequencer_midievent(seq, ss, me, 0);
+}
+
+static int
+sequencer_midievent(const struct sequencer *seq, struct songstate *ss,
+    struct midievent *me, int level)
+{
+	int ret;
+
+	ret = _mdl_midi_play_midievent(seq->ctx, me, level, seq->dry_run);
+	if (ret != 0)
+		return ret;
+
+	_mdl_channels_apply(ss->channelstates, me);
+
 	return 0;
 }
 
-static ssize_t
-sequencer_read_to_eventstream(struct songstate *ss, int fd)
+static int
+sequencer_note(const struct sequencer *seq, struct songstate *ss,
+    enum midievent_type evtype, int c, int n, int velocity)
 {
-	struct eventblock *cur_b, *new_b;
-	ssize_t nr;
-	size_t i;
+	struct midievent note;
 
-	assert(fd >= 0);
-	assert(ss != NULL);
+	note.evtype = evtype;
+	note.u.midinote.channel = c;
+	note.u.midinote.joining = 0;
+	note.u.midinote.note = n;
+	note.u.midinote.velocity = velocity;
 
-	new_b = cur_b = ss->current_event.block;
+	return sequencer_midievent(seq, ss, &note, 0);
+}
 
-	if (cur_b == NULL || cur_b->readcount == sizeof(cur_b->events)) {
-		if ((new_b = malloc(sizeof(struct eventblock))) == NULL) {
-			warn("malloc failure in"
-			    " sequencer_read_to_eventstream");
-			return -1;
-		}
+/* Set note n of channel c in ss to play in track, or to no track. */
+static void
+sequencer_set_songnote(struct songstate *ss, int c, int n,
+    struct trackstate *track, int velocity)
+{
+	ss->songnotes[c][n].track = track;
+	ss->songnotes[c][n].velocity = velocity;
 
-		new_b->readcount = 0;
-	}
+	if (track != NULL)
+		ss->songnotes_on[c][ NOTE_WORD(n) ] |= NOTE_BIT(n);
+	else
+		ss->songnotes_on[c][ NOTE_WORD(n) ] &= ~NOTE_BIT(n);
+}
 
-	nr = read(fd, ((char *) new_b->events + new_b->readcount),
-	    (sizeof(new_b->events) - new_b->readcount));
+/*
+ * Read from interpreter to the tracks of ss.  Each event is checked as
+ * it comes, so that playback needs no checks.  Returns the number of
+ * bytes read, 0 when the whole song has been read, or -1 on error.
+ */
+static ssize_t
+sequencer_read_to_eventstream(const struct sequencer *seq,
+    struct songstate *ss, int fd)
+{
+	char name[MIDIPACK_TRACKNAME_MAX + 1];
+	struct timed_midievent tmidiev;
+	struct trackstate *track;
+	const u_int8_t *buf;
+	u_int64_t digest;
+	float prev_time;
+	size_t offset, size;
+	ssize_t n, nr;
+	int conductor_event;
+
+	assert(fd >= 0);
+	assert(ss != NULL);
+
+	nr = read(fd, &ss->readbuf[ ss->readbuf_size ],
+	    (sizeof(ss->readbuf) - ss->readbuf_size));
 
 	if (nr == -1) {
 		warn("error in reading to eventstream");
-		goto finish;
+		return -1;
 	}
 
 	if (nr == 0) {
 		/* The last event must be SONG_END. */
-		if (!ss->got_song_end) {
+		if (!ss->got_song_end || ss->readbuf_size > 0) {
 			warnx("received music stream which is not complete"
 			    " (last event not SONG_END)");
-			nr = -1;
-			goto finish;
+			return -1;
 		}
-
-		goto finish;
+		return 0;
 	}
 
-	for (i = new_b->readcount / sizeof(struct timed_midievent);
-	    i < (new_b->readcount + nr) / sizeof(struct timed_midievent);
-	    i++) {
+	ss->readbuf_size += nr;
+
+	for (offset = 0; offset < ss->readbuf_size; offset += n) {
 		/* The song end must not come again. */
 		if (ss->got_song_end) {
 			warnx("received music events after song end");
-			nr = -1;
-			goto finish;
+			return -1;
 		}
 
-		if (new_b->events[i].midiev.evtype == MIDIEV_SONG_END)
-			ss->got_song_end = 1;
+		buf = &ss->readbuf[offset];
+		size = ss->readbuf_size - offset;
 
-		_mdl_timed_midievent_log(MDLLOG_MIDISTREAM, "received",
-		    &new_b->events[i], 0);
+		if (buf[0] == MIDIPACK_TRACK_OPCODE) {
+			n = _mdl_midipack_decode_track(buf, size, name);
+			if (n == -1)
+				return -1;
+			if (n == 0)
+				break;
+			if (sequencer_new_track(seq, ss, name) != 0)
+				return -1;
+			continue;
+		}
 
-		if (!_mdl_midi_check_timed_midievent(new_b->events[i],
-		    ss->time_as_measures)) {
-			nr = -1;
-			goto finish;
+		/* The events of this track are those of the playing song. */
+		if (buf[0] == MIDIPACK_SAME_TRACK_OPCODE) {
+			n = _mdl_midipack_decode_same_track(buf, size, name,
+			    &digest);
+			if (n == -1)
+				return -1;
+			if (n == 0)
+				break;
+			if (sequencer_new_track(seq, ss, name) != 0)
+				return -1;
+			ss->reading_track->same = 1;
+			ss->reading_track->digest = digest;
+			/* The conductor track ends the song. */
+			if (name[0] == '\0')
+				ss->got_song_end = 1;
+			continue;
 		}
 
-		ss->current_event.index = i;
-		ss->time_as_measures = new_b->events[i].time_as_measures;
-	}
+		if ((track = ss->reading_track) == NULL) {
+			warnx("received music events without a track");
+			return -1;
+		}
 
-	if (nr > 0)
-		new_b->readcount += nr;
+		if (track->same) {
+			warnx("received music events for an unchanged track");
+			return -1;
+		}
 
-finish:
-	if (new_b != cur_b) {
-		if (new_b->readcount == 0) {
-			free(new_b);
-		} else {
-			SIMPLEQ_INSERT_TAIL(&ss->es, new_b, entries);
-			ss->current_event.block = new_b;
+		memcpy(&prev_time, &track->read_time_bits, sizeof(prev_time));
+
+		n = _mdl_midipack_decode(buf, size, &track->read_time_bits,
+		    &tmidiev);
+		if (n == -1)
+			return -1;
+
+		/* The rest of the event has not been read yet. */
+		if (n == 0)
+			break;
+
+		_mdl_timed_midievent_log(MDLLOG_MIDISTREAM, "received",
+		    &tmidiev, 0);
+
+		conductor_event = (tmidiev.midiev.evtype == MIDIEV_MARKER ||
+		    tmidiev.midiev.evtype == MIDIEV_SONG_END ||
+		    tmidiev.midiev.evtype == MIDIEV_TEMPOCHANGE);
+		if (conductor_event != (track->name[0] == '\0')) {
+			warnx("received an event of type %d in a wrong track",
+			    tmidiev.midiev.evtype);
+			return -1;
 		}
+
+		if (!_mdl_midi_check_timed_midievent(tmidiev, prev_time))
+			return -1;
+
+		if (tmidiev.midiev.evtype == MIDIEV_SONG_END)
+			ss->got_song_end = 1;
+
+		if (sequencer_store_event(track, buf, n) != 0)
+			return -1;
+		track->digest = _mdl_midipack_digest(track->digest, buf, n);
 	}
 
+	/* Keep a partially read event or track header for later. */
+	memmove(ss->readbuf, &ss->readbuf[offset], ss->readbuf_size - offset);
+	ss->readbuf_size -= offset;
+
 	return nr;
 }
 
+/* Append an encoded event of size bytes to the eventstream of track. */
 static int
-sequencer_reset_songstate(struct sequencer *seq, struct songstate *ss)
+sequencer_store_event(struct trackstate *track, const u_int8_t *buf,
+    size_t size)
 {
 	struct eventblock *eb;
-	int i;
 
+	eb = track->last_block;
+
+	if (eb == NULL || sizeof(eb->data) - eb->size < size) {
+		if ((eb = malloc(sizeof(struct eventblock))) == NULL) {
+			warn("malloc failure in sequencer_store_event");
+			return 1;
+		}
+		eb->size = 0;
+		SIMPLEQ_INSERT_TAIL(&track->es, eb, entries);
+		track->last_block = eb;
+	}
+
+	memcpy(&eb->data[ eb->size ], buf, size);
+	eb->size += size;
+
+	return 0;
+}
+
+static int
+sequencer_reset_songstate(struct sequencer *seq, struct songstate *ss)
+{
 	assert(ss->playback_state == FREEING_EVENTSTREAM ||
 	    ss->playback_state == READING);
 
@@ -1131,17 +1741,10 @@ sequencer_reset_songstate(struct sequencer *seq, struct songstate *ss)
 
 	/*
 	 * Do not allow this to go on too long so that
-	 * we do not miss our playback moment.
+	 * we do not miss our playback moment.  If eventstream is empty,
+	 * we can re-init and return true.
 	 */
-	i = 0;
-	while (!SIMPLEQ_EMPTY(&ss->es) && i++ < 64) {
-		eb = SIMPLEQ_FIRST(&ss->es);
-		SIMPLEQ_REMOVE_HEAD(&ss->es, entries);
-		free(eb);
-	}
-
-	/* If eventstream is empty, we can re-init and return true. */
-	if (SIMPLEQ_EMPTY(&ss->es)) {
+	if (sequencer_free_tracks(ss, 64)) {
 		_mdl_log(MDLLOG_SEQ, 0,
 		    "old eventstream freed for songstate %s\n",
 		    ss_label(seq, ss));
@@ -1156,169 +1759,665 @@ sequencer_reset_songstate(struct sequencer *seq, struct songstate *ss)
 	return 0;
 }
 
+/*
+ * Take the events of the unchanged tracks of new_ss from the tracks of
+ * old_ss that have the same name and digest, or copy them if copy is set
+ * (old_ss still plays them).  Server may have made new_ss against the
+ * song that played before old_ss, if it did not yet know of the switch,
+ * so the tracks not in old_ss are copied from the retired tracks.
+ * Nothing is taken unless all of them are found.  Returns 1 if some
+ * track could not be found, -1 on failure.
+ */
 static int
-sequencer_start_playing(const struct sequencer *seq, struct songstate *new_ss,
-    struct songstate *old_ss)
+sequencer_resolve_same_tracks(const struct sequencer *seq,
+    struct songstate *new_ss, struct songstate *old_ss, int copy)
 {
-	struct channel_state old_cs, new_cs;
-	struct notestate old_ns, new_ns;
-	struct eventpointer ce;
-	struct timed_midievent *tmidiev;
-	struct midievent change_instrument, change_volume, note_off, note_on;
-	struct midievent *midiev;
-	struct timespec latest_tempo_change_as_time,
-	    time_since_latest_tempo_change;
-	int instr_changed, retrigger_note, volume_changed, c, n, ret;
+	struct trackstate *new_track, *old_track;
+	struct eventblock *eb;
+	size_t i;
+	int move, retired;
 
-	/*
-	 * Find the event where we should be at at new songstate,
-	 * and do a "shadow playback" to determine what our midi state
-	 * should be.
-	 */
-	SIMPLEQ_FOREACH(ce.block, &new_ss->es, entries) {
-		new_ss->current_event.block = ce.block;
+	for (move = 0; move < 2; move++) {
+		for (i = 0; i < new_ss->trackcount; i++) {
+			new_track = new_ss->tracks[i];
+			if (!new_track->same)
+				continue;
 
-		for (ce.index = 0; ce.index < EVENTBLOCKCOUNT; ce.index++) {
-			new_ss->current_event.index = ce.index;
+			old_track = NULL;
+			if (old_ss->playback_state == IDLE ||
+			    old_ss->playback_state == PLAYING)
+				old_track = sequencer_find_same_track(
+				    old_ss->tracks, old_ss->trackcount,
+				    new_track);
+			retired = 0;
+			if (old_track == NULL) {
+				old_track = sequencer_find_same_track(
+				    seq->retired_tracks,
+				    seq->retired_trackcount, new_track);
+				retired = 1;
+			}
+
+			if (old_track == NULL) {
+				_mdl_log(MDLLOG_SEQ, 0,
+				    "no unchanged track \"%s\"\n",
+				    new_track->name);
+				return 1;
+			}
+			if (!move)
+				continue;
 
-			tmidiev = &ce.block->events[ ce.index ];
-			midiev = &tmidiev->midiev;
+			_mdl_log(MDLLOG_SEQ, 0,
+			    "keeping unchanged track \"%s\"%s\n",
+			    new_track->name,
+			    retired ? " from a retired song" : "");
 
-			if (tmidiev->time_as_measures >=
-			    new_ss->time_as_measures)
-				goto current_event_found;
-			if (midiev->evtype == MIDIEV_SONG_END)
-				goto current_event_found;
+			new_track->same = 0;
 
+			if (copy || retired) {
+				SIMPLEQ_FOREACH(eb, &old_track->es, entries) {
+					if (sequencer_store_event(new_track,
+					    eb->data, eb->size) != 0)
+						return -1;
+				}
+				continue;
+			}
+
+			while ((eb = SIMPLEQ_FIRST(&old_track->es)) != NULL) {
+				SIMPLEQ_REMOVE_HEAD(&old_track->es, entries);
+				SIMPLEQ_INSERT_TAIL(&new_track->es, eb,
+				    entries);
+			}
+			new_track->last_block = old_track->last_block;
+			old_track->last_block = NULL;
+			old_track->current_event.block = NULL;
+		}
+	}
+
+	return 0;
+}
+
+/* Find a track with events that has the name and digest of track. */
+static struct trackstate *
+sequencer_find_same_track(struct trackstate **tracks, size_t trackcount,
+    const struct trackstate *track)
+{
+	size_t i;
+
+	for (i = 0; i < trackcount; i++) {
+		if (!SIMPLEQ_EMPTY(&tracks[i]->es) &&
+		    tracks[i]->digest == track->digest &&
+		    strcmp(tracks[i]->name, track->name) == 0)
+			return tracks[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Keep the tracks of ss (which is to be freed) until the next time the
+ * playing song changes, and give the ones retired before that to ss to be
+ * freed instead.  Only songs sent by server refer to retired tracks.
+ */
+static void
+sequencer_retire_tracks(struct sequencer *seq, struct songstate *ss)
+{
+	struct trackstate **tracks;
+	size_t trackcount;
+
+	assert(ss->playback_state == FREEING_EVENTSTREAM);
+
+	if (seq->server_socket < 0 && seq->retired_trackcount == 0)
+		return;
+
+	tracks = seq->retired_tracks;
+	trackcount = seq->retired_trackcount;
+
+	seq->retired_tracks = ss->tracks;
+	seq->retired_trackcount = ss->trackcount;
+
+	ss->tracks = tracks;
+	ss->trackcount = trackcount;
+	ss->next_track = NULL;
+	ss->reading_track = NULL;
+}
+
+/*
+ * Replace the tracks named in reading_song->replaced_tracks in the song
+ * that is playing with those just read to reading_song, from the current
+ * position on.  The old tracks go to reading_song, to be freed with it.
+ */
+static int
+sequencer_replace_tracks(struct sequencer *seq)
+{
+	struct songstate *new_ss, *ss;
+	const char *end, *name;
+	float position;
+	int ret;
+
+	ss = seq->playback_song;
+	new_ss = seq->reading_song;
+	ret = 0;
+
+	if (ss->playback_state != PLAYING) {
+		_mdl_log(MDLLOG_SEQ, 0,
+		    "no song is playing, dropping replaced tracks\n");
+	} else {
+		position = sequencer_current_position(seq, ss);
+		_mdl_log(MDLLOG_SEQ, 0, "replacing tracks at %.3f\n",
+		    position);
+
+		end = new_ss->replaced_tracks + new_ss->replaced_tracks_size;
+		for (name = new_ss->replaced_tracks; name < end && ret == 0;
+		    name += strlen(name) + 1)
+			ret = sequencer_replace_track(seq, ss, new_ss, name,
+			    position);
+
+		sequencer_select_next_track(ss);
+		if (ret == 0)
+			ret = sequencer_send_song_tracks(seq);
+	}
+
+	free(new_ss->replaced_tracks);
+	new_ss->replaced_tracks = NULL;
+	new_ss->replaced_tracks_size = 0;
+	new_ss->playback_state = FREEING_EVENTSTREAM;
+
+	/* new_ss has the replaced tracks now. */
+	if (ss->playback_state == PLAYING)
+		sequencer_retire_tracks(seq, new_ss);
+
+	return ret;
+}
+
+/*
+ * Swap the track with name in ss for the one in new_ss, or add or remove
+ * it if it is only in one of them.  The events of the new track before
+ * position are not played, but the notes and channel changes they leave
+ * behind are synced to what is playing now.
+ */
+static int
+sequencer_replace_track(const struct sequencer *seq, struct songstate *ss,
+    struct songstate *new_ss, const char *name, float position)
+{
+	struct channel_state shadow[MIDI_CHANNEL_COUNT];
+	int instrument[MIDI_CHANNEL_COUNT], volume[MIDI_CHANNEL_COUNT];
+	struct midievent change, *midiev;
+	struct trackstate **tracks, *new_track, *old_track;
+	size_t new_i, old_i;
+	u_int32_t bits;
+	int c, n, ret, w;
+
+	for (old_i = 0; old_i < ss->trackcount; old_i++)
+		if (strcmp(ss->tracks[old_i]->name, name) == 0)
+			break;
+	for (new_i = 0; new_i < new_ss->trackcount; new_i++)
+		if (strcmp(new_ss->tracks[new_i]->name, name) == 0)
+			break;
+
+	old_track = (old_i < ss->trackcount) ? ss->tracks[old_i] : NULL;
+	new_track = (new_i < new_ss->trackcount) ? new_ss->tracks[new_i]
+						  : NULL;
+
+	if (old_track == NULL && new_track == NULL) {
+		_mdl_log(MDLLOG_SEQ, 0, "no track \"%s\" to replace\n", name);
+		return 0;
+	}
+
+	if (new_track != NULL && new_track->same) {
+		_mdl_log(MDLLOG_SEQ, 0, "track \"%s\" has not changed\n",
+		    name);
+		return 0;
+	}
+
+	/* Make room first, so that nothing fails after the swap. */
+	if (old_track == NULL) {
+		tracks = reallocarray(ss->tracks, ss->trackcount + 1,
+		    sizeof(struct trackstate *));
+		if (tracks == NULL) {
+			warn("reallocarray in sequencer_replace_track");
+			return 1;
+		}
+		ss->tracks = tracks;
+	} else if (new_track == NULL) {
+		tracks = reallocarray(new_ss->tracks, new_ss->trackcount + 1,
+		    sizeof(struct trackstate *));
+		if (tracks == NULL) {
+			warn("reallocarray in sequencer_replace_track");
+			return 1;
+		}
+		new_ss->tracks = tracks;
+	}
+
+	_mdl_log(MDLLOG_SEQ, 0, "replacing track \"%s\"\n", name);
+
+	_mdl_channels_clear(shadow);
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++)
+		instrument[c] = volume[c] = -1;
+
+	/* Go through what the new track would have played so far. */
+	if (new_track != NULL) {
+		for (sequencer_first_event(&new_track->current_event,
+		    &new_track->es);
+		    new_track->current_event.block != NULL;
+		    sequencer_next_event(&new_track->current_event)) {
+			if (new_track->current_event.tmidiev.time_as_measures
+			    >= position)
+				break;
+			midiev = &new_track->current_event.tmidiev.midiev;
 			switch (midiev->evtype) {
 			case MIDIEV_INSTRUMENT_CHANGE:
-				c = midiev->u.instr_change.channel;
-				new_ss->channelstates[c].instrument =
+				instrument[midiev->u.instr_change.channel] =
 				    midiev->u.instr_change.code;
 				break;
-			case MIDIEV_NOTEON:
-				c = midiev->u.midinote.channel;
-				n = midiev->u.midinote.note;
-				new_ss->channelstates[c].notestates[n].state =
-				    1;
-				new_ss->channelstates[c].notestates[n]
-				    .velocity = midiev->u.midinote.velocity;
-				break;
 			case MIDIEV_NOTEOFF:
-				c = midiev->u.midinote.channel;
-				n = midiev->u.midinote.note;
-				new_ss->channelstates[c].notestates[n].state =
-				    0;
-				new_ss->channelstates[c].notestates[n]
-				    .velocity = 0;
-				break;
-			case MIDIEV_SONG_END:
-				/* This has been handled above. */
-				assert(0);
+			case MIDIEV_NOTEON:
+				_mdl_channel_set_note(
+				    &shadow[midiev->u.midinote.channel],
+				    midiev->u.midinote.note,
+				    (midiev->evtype == MIDIEV_NOTEON),
+				    midiev->u.midinote.velocity);
 				break;
-			case MIDIEV_TEMPOCHANGE:
-				new_ss->latest_tempo_change_as_measures =
-				    tmidiev->time_as_measures;
-				new_ss->tempo = midiev->u.bpm;
+			case MIDIEV_VOLUMECHANGE:
+				volume[midiev->u.volumechange.channel] =
+				    midiev->u.volumechange.volume;
 				break;
 			default:
-				assert(0);
+				break;
 			}
 		}
 	}
 
-current_event_found:
-	/*
-	 * Sync playback state
-	 *   (start or turn off notes according to new playback song).
-	 */
+	if (old_track != NULL && new_track != NULL) {
+		ss->tracks[old_i] = new_track;
+		new_ss->tracks[new_i] = old_track;
+	} else if (old_track == NULL) {
+		/* Keep the conductor track last. */
+		ss->tracks[ ss->trackcount ] = ss->tracks[ old_i - 1 ];
+		ss->tracks[ old_i - 1 ] = new_track;
+		ss->trackcount++;
+		new_ss->tracks[new_i] = new_ss->tracks[--new_ss->trackcount];
+	} else {
+		memmove(&ss->tracks[old_i], &ss->tracks[old_i + 1],
+		    (ss->trackcount - old_i - 1) *
+		    sizeof(struct trackstate *));
+		ss->trackcount--;
+		new_ss->tracks[ new_ss->trackcount++ ] = old_track;
+	}
+
 	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
-		old_cs = old_ss->channelstates[c];
-		new_cs = new_ss->channelstates[c];
-
-		instr_changed = (old_cs.instrument != new_cs.instrument);
-		volume_changed = (old_cs.volume != new_cs.volume);
-
-		if (instr_changed) {
-			change_instrument.evtype =
-			    MIDIEV_INSTRUMENT_CHANGE;
-			change_instrument.u.instr_change.channel = c;
-			change_instrument.u.instr_change.code =
-			    new_cs.instrument;
-			ret = sequencer_midievent(seq, old_ss,
-			    &change_instrument, 0);
+		if (instrument[c] >= 0 &&
+		    instrument[c] != ss->channelstates[c].instrument) {
+			change.evtype = MIDIEV_INSTRUMENT_CHANGE;
+			change.u.instr_change.channel = c;
+			change.u.instr_change.code = instrument[c];
+			ret = sequencer_midievent(seq, ss, &change, 0);
 			if (ret != 0)
 				return ret;
 		}
-
-		if (volume_changed) {
-			change_volume.evtype = MIDIEV_VOLUMECHANGE;
-			change_volume.u.volumechange.channel = c;
-			change_volume.u.volumechange.volume =
-			    new_cs.volume;
-			ret = sequencer_midievent(seq, old_ss, &change_volume,
-			    0);
+		if (volume[c] >= 0 &&
+		    volume[c] != ss->channelstates[c].volume) {
+			change.evtype = MIDIEV_VOLUMECHANGE;
+			change.u.volumechange.channel = c;
+			change.u.volumechange.volume = volume[c];
+			ret = sequencer_midievent(seq, ss, &change, 0);
 			if (ret != 0)
 				return ret;
 		}
+	}
 
-		for (n = 0; n < MIDI_NOTE_COUNT; n++) {
-			old_ns = old_cs.notestates[n];
-			new_ns = new_cs.notestates[n];
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+		for (w = 0; w < NOTE_WORDS; w++) {
+			/* Only notes of the old and the new track change. */
+			bits = shadow[c].notes_on[w];
+			if (old_track != NULL)
+				bits |= ss->songnotes_on[c][w];
+			for (; bits != 0; bits &= bits - 1) {
+				n = w * NOTE_WORD_BITS + ffs((int) bits) - 1;
+				ret = sequencer_replace_note(seq, ss,
+				    &shadow[c], old_track, new_track, c, n);
+				if (ret != 0)
+					return ret;
+			}
+		}
+	}
 
-			note_off.evtype = MIDIEV_NOTEOFF;
-			note_off.u.midinote.channel = c;
-			note_off.u.midinote.joining = 0;
-			note_off.u.midinote.note = n;
-			note_off.u.midinote.velocity = 0;
+	return 0;
+}
 
-			note_on.evtype = MIDIEV_NOTEON;
-			note_on.u.midinote.channel = c;
-			note_on.u.midinote.joining = 0;
-			note_on.u.midinote.note = n;
-			note_on.u.midinote.velocity = new_ns.velocity;
+/*
+ * Take note n of channel c in ss from old_track (which may be NULL) to
+ * new_track, whose state at the current position is in shadow.
+ */
+static int
+sequencer_replace_note(const struct sequencer *seq, struct songstate *ss,
+    const struct channel_state *shadow, struct trackstate *old_track,
+    struct trackstate *new_track, int c, int n)
+{
+	int on, ours, ret;
+
+	on = _mdl_channel_note_is_on(&ss->channelstates[c], n);
+	ours = (old_track != NULL && ss->songnotes[c][n].track == old_track);
+
+	if (!_mdl_channel_note_is_on(shadow, n)) {
+		if (!ours)
+			return 0;
+		sequencer_set_songnote(ss, c, n, NULL, 0);
+		if (!on)
+			return 0;
+		return sequencer_note(seq, ss, MIDIEV_NOTEOFF, c, n, 0);
+	}
 
-			/*
-			 * Retrigger note if:
-			 *   1. note is playing on old and new songstate
-			 *     AND
-			 *   2a. instrument has changed
-			 *     OR
-			 *   2b. velocity has changed
-			 */
-			retrigger_note = old_ns.state && new_ns.state &&
-			    ((old_ns.velocity != new_ns.velocity) ||
-			    instr_changed);
+	sequencer_set_songnote(ss, c, n, new_track, shadow->velocities[n]);
 
-			if (retrigger_note) {
-				ret = sequencer_midievent(seq, old_ss,
-				    &note_off, 0);
-				if (ret != 0)
-					return ret;
-				ret = sequencer_midievent(seq, old_ss,
-				    &note_on, 0);
-				if (ret != 0)
-					return ret;
-			} else if (old_ns.state && !new_ns.state) {
-				/* Note is playing, but should no longer be. */
-				ret = sequencer_midievent(seq, old_ss,
-				    &note_off, 0);
-				if (ret != 0)
-					return ret;
-			} else if (!old_ns.state && new_ns.state) {
-				/* Note is not playing, but should be. */
-				ret = sequencer_midievent(seq, old_ss,
-				    &note_on, 0);
-				if (ret != 0)
-					return ret;
+	if (!new_track->audible) {
+		if (!ours || !on)
+			return 0;
+		return sequencer_note(seq, ss, MIDIEV_NOTEOFF, c, n, 0);
+	}
+
+	if (on && ss->channelstates[c].velocities[n] == shadow->velocities[n])
+		return 0;
+	if (on) {
+		ret = sequencer_note(seq, ss, MIDIEV_NOTEOFF, c, n, 0);
+		if (ret != 0)
+			return ret;
+	}
+
+	return sequencer_note(seq, ss, MIDIEV_NOTEON, c, n,
+	    shadow->velocities[n]);
+}
+
+/*
+ * Point next_track of ss to the track with the next event.  Tracks are
+ * few, so looking at all of them is cheap enough.  On ties the earlier
+ * track goes first, as when tracks are merged in midistream.c.
+ */
+static void
+sequencer_select_next_track(struct songstate *ss)
+{
+	struct trackstate *track;
+	size_t i;
+
+	ss->next_track = NULL;
+
+	for (i = 0; i < ss->trackcount; i++) {
+		track = ss->tracks[i];
+		if (track->current_event.block == NULL)
+			continue;
+		if (ss->next_track != NULL &&
+		    _mdl_midi_compare_timed_midievents(
+		    &track->current_event.tmidiev,
+		    &ss->next_track->current_event.tmidiev) >= 0)
+			continue;
+		ss->next_track = track;
+	}
+}
+
+/*
+ * Tell server which tracks the playing song has, so that the next song can
+ * be sent as a patch against it.  If the table does not fit in a message,
+ * an empty one is sent and the next song comes whole.
+ */
+static int
+sequencer_send_song_tracks(struct sequencer *seq)
+{
+	struct songstate *ss;
+	struct trackstate *track;
+	u_int8_t *buf;
+	size_t i, size;
+	int ret;
+
+	if (seq->server_socket < 0)
+		return 0;
+
+	ss = seq->playback_song;
+
+	buf = reallocarray(NULL, ss->trackcount + 1,
+	    MIDIPACK_SAME_HEADER_MAXSIZE);
+	if (buf == NULL) {
+		warn("reallocarray in sequencer_send_song_tracks");
+		return 1;
+	}
+
+	size = 0;
+	for (i = 0; i < ss->trackcount; i++) {
+		track = ss->tracks[i];
+		size += _mdl_midipack_encode_same_track(track->name,
+		    track->digest, &buf[size]);
+	}
+
+	if (size > MAX_IMSGSIZE - IMSG_HEADER_SIZE) {
+		_mdl_log(MDLLOG_SEQ, 0, "too many tracks to send to server\n");
+		size = 0;
+	}
+
+	ret = imsg_compose(&seq->server_ibuf, SEQEVENT_SONG_TRACKS, 0, 0, -1,
+	    buf, size);
+	free(buf);
+	if (ret == -1) {
+		warnx("error sending SEQEVENT_SONG_TRACKS");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Mute, solo or unmute (which also unsolos) the tracks named in imsg, in
+ * the song that is playing and in the one that is read.  Changes in the
+ * playing song take effect immediately.
+ */
+static int
+sequencer_set_trackmode(struct sequencer *seq, enum mdl_event event,
+    const struct imsg *imsg)
+{
+	struct trackmode *trackmodes;
+	const char *name;
+	size_t i, len;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	name = imsg->data;
+
+	if (len < 2 || len > MIDIPACK_TRACKNAME_MAX + 1 ||
+	    strnlen(name, len) != len - 1) {
+		warnx("received an invalid track name");
+		return 1;
+	}
+
+	for (i = 0; i < seq->trackmodecount; i++)
+		if (strcmp(seq->trackmodes[i].name, name) == 0)
+			break;
+
+	switch (event) {
+	case CLIENTEVENT_MUTE_TRACK:
+	case CLIENTEVENT_SOLO_TRACK:
+		_mdl_log(MDLLOG_SEQ, 0, "%s track \"%s\"\n",
+		    (event == CLIENTEVENT_MUTE_TRACK ? "muting" : "soloing"),
+		    name);
+		if (i == seq->trackmodecount) {
+			trackmodes = reallocarray(seq->trackmodes,
+			    seq->trackmodecount + 1, sizeof(struct trackmode));
+			if (trackmodes == NULL) {
+				warn("reallocarray for track modes");
+				return 1;
 			}
+			seq->trackmodes = trackmodes;
+			(void) strlcpy(seq->trackmodes[i].name, name,
+			    sizeof(seq->trackmodes[i].name));
+			seq->trackmodecount++;
+		}
+		seq->trackmodes[i].solo = (event == CLIENTEVENT_SOLO_TRACK);
+		break;
+	case CLIENTEVENT_UNMUTE_TRACK:
+		_mdl_log(MDLLOG_SEQ, 0, "unmuting track \"%s\"\n", name);
+		if (i == seq->trackmodecount)
+			break;
+		seq->trackmodes[i] = seq->trackmodes[ --seq->trackmodecount ];
+		break;
+	default:
+		assert(0);
+	}
+
+	if (sequencer_update_audibility(seq, seq->playback_song) != 0)
+		return 1;
+
+	if (sequencer_update_audibility(seq, seq->reading_song) != 0)
+		return 1;
+
+	/* What is heard at the switch has changed. */
+	return seq->switch_pending ? sequencer_plan_switch(seq) : 0;
+}
+
+/*
+ * Set where the song that comes with imsg replaces the one that is
+ * playing.
+ */
+static int
+sequencer_set_song_switch(struct sequencer *seq, const struct imsg *imsg)
+{
+	enum song_switch song_switch;
+	size_t len;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	song_switch = SONG_SWITCH_NOW;
+
+	if (len == sizeof(song_switch))
+		memcpy(&song_switch, imsg->data, sizeof(song_switch));
+
+	if ((len != 0 && len != sizeof(song_switch)) ||
+	    (song_switch != SONG_SWITCH_NOW &&
+	    song_switch != SONG_SWITCH_MEASURE &&
+	    song_switch != SONG_SWITCH_MARKER)) {
+		warnx("received an invalid song switch");
+		if (imsg->fd >= 0 && close(imsg->fd) == -1)
+			warn("closing interpreter pipe");
+		return 1;
+	}
+
+	seq->song_switch = song_switch;
+
+	return 0;
+}
+
+/* Point each track of ss to its first event. */
+static void
+sequencer_song_first_event(struct songstate *ss)
+{
+	size_t i;
+
+	for (i = 0; i < ss->trackcount; i++)
+		sequencer_first_event(&ss->tracks[i]->current_event,
+		    &ss->tracks[i]->es);
+
+	sequencer_select_next_track(ss);
+}
+
+/* Move past the event of next_track in ss. */
+static void
+sequencer_song_next_event(struct songstate *ss)
+{
+	assert(ss->next_track != NULL);
+
+	sequencer_next_event(&ss->next_track->current_event);
+	sequencer_select_next_track(ss);
+}
+
+/*
+ * Find the event where ss should be at its time_as_measures, and do a
+ * "shadow playback" to determine what its midi state should be.  Notes
+ * of tracks that can not be heard are in the song, but not playing.
+ * This starts from the state of a new song, so it can be done again.
+ */
+static void
+sequencer_shadow_playback(struct songstate *ss)
+{
+	struct trackstate *track;
+	struct timed_midievent *tmidiev;
+	struct midievent *midiev;
+	int c, n;
+
+	sequencer_clear_channels(ss);
+	ss->latest_tempo_change_as_measures = 0;
+	ss->tempo = 120;
 
-			assert(old_ns.state == new_ns.state);
-			assert(old_ns.velocity == new_ns.velocity);
+	for (sequencer_song_first_event(ss);
+	    (track = ss->next_track) != NULL;
+	    sequencer_song_next_event(ss)) {
+		tmidiev = &track->current_event.tmidiev;
+		midiev = &tmidiev->midiev;
+
+		if (tmidiev->time_as_measures >= ss->time_as_measures)
+			return;
+		if (midiev->evtype == MIDIEV_SONG_END)
+			return;
+
+		switch (midiev->evtype) {
+		case MIDIEV_INSTRUMENT_CHANGE:
+			c = midiev->u.instr_change.channel;
+			ss->channelstates[c].instrument =
+			    midiev->u.instr_change.code;
+			break;
+		case MIDIEV_MARKER:
+			break;
+		case MIDIEV_NOTEON:
+			c = midiev->u.midinote.channel;
+			n = midiev->u.midinote.note;
+			sequencer_set_songnote(ss, c, n, track,
+			    midiev->u.midinote.velocity);
+			if (!track->audible)
+				break;
+			_mdl_channel_set_note(&ss->channelstates[c], n, 1,
+			    midiev->u.midinote.velocity);
+			break;
+		case MIDIEV_NOTEOFF:
+			c = midiev->u.midinote.channel;
+			n = midiev->u.midinote.note;
+			sequencer_set_songnote(ss, c, n, NULL, 0);
+			_mdl_channel_set_note(&ss->channelstates[c], n, 0, 0);
+			break;
+		case MIDIEV_SONG_END:
+			/* This has been handled above. */
+			assert(0);
+			break;
+		case MIDIEV_TEMPOCHANGE:
+			ss->latest_tempo_change_as_measures =
+			    tmidiev->time_as_measures;
+			ss->tempo = midiev->u.bpm;
+			break;
+		default:
+			assert(0);
 		}
+	}
+}
+
+/*
+ * Start playing new_ss from its time_as_measures, so that the current
+ * moment is start_time, or now if start_time is NULL.  If prepared is
+ * set, the state of new_ss and the midi events that take old_ss there
+ * have been prepared already (see sequencer_plan_switch()).
+ */
+static int
+sequencer_start_playing(const struct sequencer *seq, struct songstate *new_ss,
+    struct songstate *old_ss, const struct timespec *start_time, int prepared)
+{
+	struct timespec latest_tempo_change_as_time,
+	    time_since_latest_tempo_change;
+	size_t i;
+	int ret;
+
+	if (!prepared) {
+		sequencer_shadow_playback(new_ss);
+		seq->switch_events->count = _mdl_channels_diff(
+		    old_ss->channelstates, new_ss->channelstates,
+		    seq->switch_events->events);
+	}
 
-		assert(old_cs.instrument == new_cs.instrument);
-		assert(old_cs.volume == new_cs.volume);
+	/* Sync playback state (start or turn off notes for new_ss). */
+	for (i = 0; i < seq->switch_events->count; i++) {
+		ret = sequencer_midievent(seq, old_ss,
+		    &seq->switch_events->events[i], 0);
+		if (ret != 0)
+			return ret;
 	}
 
 	/*
@@ -1333,8 +2432,12 @@ current_event_found:
 	    sequencer_calc_time_since_latest_tempo_change(new_ss,
 	    new_ss->time_as_measures);
 
-	ret = sequencer_clock_gettime(&latest_tempo_change_as_time);
-	assert(ret == 0);
+	if (start_time != NULL) {
+		latest_tempo_change_as_time = *start_time;
+	} else {
+		ret = sequencer_clock_gettime(&latest_tempo_change_as_time);
+		assert(ret == 0);
+	}
 
 	latest_tempo_change_as_time.tv_sec -=
 	    time_since_latest_tempo_change.tv_sec;
@@ -1388,12 +2491,196 @@ sequencer_calc_time_since_latest_tempo_change(const struct songstate *ss,
 	return time_since_latest_tempo_change;
 }
 
+/*
+ * Position in the playing song ss where the next song should take over:
+ * the next measure or marker from the current position on, as
+ * seq->song_switch says, but no later than where ss ends.
+ */
+static float
+sequencer_switch_boundary(const struct sequencer *seq,
+    const struct songstate *ss)
+{
+	struct eventpointer ep;
+	float boundary, position;
+
+	position = sequencer_current_position(seq, ss);
+	boundary = -1.0;
+
+	if (seq->song_switch == SONG_SWITCH_MEASURE)
+		boundary = ceilf(position / ss->measure_length) *
+		    ss->measure_length;
+
+	/* Markers and the song end are in the conductor track. */
+	assert(ss->trackcount > 0);
+	ep = ss->tracks[ ss->trackcount - 1 ]->current_event;
+
+	for (; ep.block != NULL; sequencer_next_event(&ep)) {
+		if (ep.tmidiev.midiev.evtype == MIDIEV_SONG_END)
+			break;
+		if (seq->song_switch == SONG_SWITCH_MARKER &&
+		    ep.tmidiev.midiev.evtype == MIDIEV_MARKER &&
+		    ep.tmidiev.time_as_measures >= position)
+			return ep.tmidiev.time_as_measures;
+	}
+
+	assert(ep.block != NULL);
+
+	if (boundary < 0.0 || boundary > ep.tmidiev.time_as_measures)
+		boundary = ep.tmidiev.time_as_measures;
+
+	return boundary;
+}
+
+/*
+ * Prepare to switch to reading_song (which has been read) at a boundary
+ * of the playing song, so that only the midi events prepared here need
+ * to be played there.  Unchanged tracks are copied, as the playing song
+ * still needs them.
+ */
 static int
-sequencer_switch_songs(struct sequencer *seq)
+sequencer_prepare_switch(struct sequencer *seq)
 {
-	struct songstate *old_ss;
 	int ret;
 
+	ret = sequencer_resolve_same_tracks(seq, seq->reading_song,
+	    seq->playback_song, 1);
+	if (ret == -1)
+		return 1;
+	if (ret != 0) {
+		warnx("could not find unchanged tracks of songstate %s"
+		    " in the playing song, not playing it",
+		    ss_label(seq, seq->reading_song));
+		seq->reading_song->playback_state = FREEING_EVENTSTREAM;
+		return 0;
+	}
+
+	seq->switch_position = sequencer_switch_boundary(seq,
+	    seq->playback_song);
+	seq->switch_pending = 1;
+	seq->queued_song_ready = 1;
+
+	_mdl_log(MDLLOG_SEQ, 0, "switching to songstate %s at %.3f\n",
+	    ss_label(seq, seq->reading_song), seq->switch_position);
+
+	return sequencer_plan_switch(seq);
+}
+
+/*
+ * Do the shadow playback of the song to switch to, and prepare the midi
+ * events that take the playing song from its state at the switch to
+ * that of the new song.
+ */
+static int
+sequencer_plan_switch(struct sequencer *seq)
+{
+	struct channel_state channelstates[MIDI_CHANNEL_COUNT];
+	struct songstate *new_ss;
+
+	assert(seq->switch_pending);
+
+	new_ss = seq->reading_song;
+	new_ss->time_as_measures = new_ss->keep_position_when_switched_to
+	    ? seq->switch_position
+	    : 0.0;
+
+	sequencer_shadow_playback(new_ss);
+
+	if (sequencer_predict_channels(seq->playback_song,
+	    seq->switch_position, channelstates) != 0)
+		return 1;
+
+	seq->switch_events->count = _mdl_channels_diff(channelstates,
+	    new_ss->channelstates, seq->switch_events->events);
+
+	_mdl_log(MDLLOG_SEQ, 0,
+	    "prepared %zu midi events for switching songs\n",
+	    seq->switch_events->count);
+
+	return 0;
+}
+
+/*
+ * Predict the channel states of ss at position by going through the
+ * events it plays before that, starting from its current state.
+ */
+static int
+sequencer_predict_channels(const struct songstate *ss, float position,
+    struct channel_state *channelstates)
+{
+	struct eventpointer *eps, *ep;
+	struct midievent *midiev;
+	struct trackstate *track;
+	size_t i;
+
+	memcpy(channelstates, ss->channelstates, sizeof(ss->channelstates));
+
+	eps = reallocarray(NULL, ss->trackcount, sizeof(struct eventpointer));
+	if (eps == NULL) {
+		warn("reallocarray in sequencer_predict_channels");
+		return 1;
+	}
+	for (i = 0; i < ss->trackcount; i++)
+		eps[i] = ss->tracks[i]->current_event;
+
+	for (;;) {
+		/* Events come in the order sequencer_play_music() has. */
+		ep = NULL;
+		track = NULL;
+		for (i = 0; i < ss->trackcount; i++) {
+			if (eps[i].block == NULL)
+				continue;
+			if (ep != NULL && _mdl_midi_compare_timed_midievents(
+			    &eps[i].tmidiev, &ep->tmidiev) >= 0)
+				continue;
+			ep = &eps[i];
+			track = ss->tracks[i];
+		}
+		if (ep == NULL || ep->tmidiev.time_as_measures >= position)
+			break;
+
+		midiev = &ep->tmidiev.midiev;
+		switch (midiev->evtype) {
+		case MIDIEV_NOTEON:
+			if (!track->audible)
+				break;
+			/* FALLTHROUGH */
+		case MIDIEV_INSTRUMENT_CHANGE:
+		case MIDIEV_NOTEOFF:
+		case MIDIEV_VOLUMECHANGE:
+			_mdl_channels_apply(channelstates, midiev);
+			break;
+		default:
+			break;
+		}
+
+		sequencer_next_event(ep);
+	}
+
+	free(eps);
+
+	return 0;
+}
+
+static int
+sequencer_switch_songs(struct sequencer *seq,
+    const struct timespec *start_time)
+{
+	struct songstate *old_ss;
+	int prepared, ret;
+
+	/* A prepared song has its unchanged tracks and state already. */
+	prepared = seq->switch_pending;
+	seq->switch_pending = 0;
+
+	if (!prepared && sequencer_resolve_same_tracks(seq,
+	    seq->reading_song, seq->playback_song, 0) != 0) {
+		warnx("could not find unchanged tracks of songstate %s"
+		    " in the playing song, not playing it",
+		    ss_label(seq, seq->reading_song));
+		seq->reading_song->playback_state = FREEING_EVENTSTREAM;
+		return 0;
+	}
+
 	old_ss             = seq->playback_song;
 	seq->playback_song = seq->reading_song;
 	seq->reading_song  = old_ss;
@@ -1402,38 +2689,46 @@ sequencer_switch_songs(struct sequencer *seq)
 	    "received a new playback stream, playback songstate is now %s\n",
 	    ss_label(seq, seq->playback_song));
 
-	seq->playback_song->time_as_measures =
-	    seq->playback_song->keep_position_when_switched_to
-		? old_ss->time_as_measures
-		: 0.0;
+	if (!prepared) {
+		seq->playback_song->time_as_measures =
+		    seq->playback_song->keep_position_when_switched_to
+			? old_ss->time_as_measures
+			: 0.0;
+	}
 
-	ret = sequencer_start_playing(seq, seq->playback_song, old_ss);
+	ret = sequencer_start_playing(seq, seq->playback_song, old_ss,
+	    start_time, prepared);
 	if (ret != 0)
 		return 1;
 
-	return 0;
+	sequencer_retire_tracks(seq, old_ss);
+
+	return sequencer_send_song_tracks(seq);
 }
 
 static void
 sequencer_time_for_next_event(struct songstate *ss, struct timespec *eventtime)
 {
-	struct timed_midievent next_midievent;
-	struct timespec time_since_latest_tempo_change;
-
 	assert(ss != NULL);
-	assert(ss->current_event.block != NULL);
-	assert(0 <= ss->current_event.index &&
-	    ss->current_event.index < EVENTBLOCKCOUNT);
+	assert(ss->next_track != NULL);
 	assert(ss->latest_tempo_change_as_time.tv_sec > 0 ||
 	    ss->latest_tempo_change_as_time.tv_nsec > 0);
 	assert(ss->playback_state == PLAYING);
 
-	next_midievent =
-	    ss->current_event.block->events[ ss->current_event.index ];
+	sequencer_time_for_position(ss,
+	    ss->next_track->current_event.tmidiev.time_as_measures,
+	    eventtime);
+}
+
+/* Time when ss is at position (as measures), at its current tempo. */
+static void
+sequencer_time_for_position(const struct songstate *ss, float position,
+    struct timespec *eventtime)
+{
+	struct timespec time_since_latest_tempo_change;
 
 	time_since_latest_tempo_change =
-	    sequencer_calc_time_since_latest_tempo_change(ss,
-	    next_midievent.time_as_measures);
+	    sequencer_calc_time_since_latest_tempo_change(ss, position);
 
 	eventtime->tv_sec = time_since_latest_tempo_change.tv_sec +
 	    ss->latest_tempo_change_as_time.tv_sec;
@@ -1446,17 +2741,125 @@ sequencer_time_for_next_event(struct songstate *ss, struct timespec *eventtime)
 	}
 }
 
+/*
+ * A track can be heard unless it has been muted, or some other track
+ * has been soloed.
+ */
+static int
+sequencer_track_is_audible(const struct sequencer *seq, const char *name)
+{
+	const struct trackmode *trackmode;
+	size_t i;
+	int soloing;
+
+	trackmode = NULL;
+	soloing = 0;
+
+	for (i = 0; i < seq->trackmodecount; i++) {
+		if (seq->trackmodes[i].solo)
+			soloing = 1;
+		if (strcmp(seq->trackmodes[i].name, name) == 0)
+			trackmode = &seq->trackmodes[i];
+	}
+
+	if (trackmode != NULL)
+		return trackmode->solo;
+
+	return !soloing;
+}
+
+/*
+ * Update which tracks of ss can be heard.  If ss is playing, notes of
+ * tracks that became silent are turned off, and notes of tracks that
+ * became audible are turned on.
+ */
+static int
+sequencer_update_audibility(const struct sequencer *seq,
+    struct songstate *ss)
+{
+	struct trackstate *track;
+	size_t i;
+	int audible, ret;
+
+	for (i = 0; i < ss->trackcount; i++) {
+		track = ss->tracks[i];
+		if (track->name[0] == '\0')
+			continue;
+
+		audible = sequencer_track_is_audible(seq, track->name);
+		if (audible == track->audible)
+			continue;
+		track->audible = audible;
+
+		if (ss->playback_state != PLAYING)
+			continue;
+
+		if ((ret = sequencer_update_track_notes(seq, ss, track)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Turn the notes of track in ss on or off, as its audibility says. */
+static int
+sequencer_update_track_notes(const struct sequencer *seq,
+    struct songstate *ss, const struct trackstate *track)
+{
+	struct channel_state *cs;
+	struct midievent note;
+	struct songnote *songnote;
+	u_int32_t bits;
+	int c, n, ret, w;
+
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+		cs = &ss->channelstates[c];
+		for (w = 0; w < NOTE_WORDS; w++) {
+			for (bits = ss->songnotes_on[c][w]; bits != 0;
+			    bits &= bits - 1) {
+				n = w * NOTE_WORD_BITS + ffs((int) bits) - 1;
+				songnote = &ss->songnotes[c][n];
+				if (songnote->track != track ||
+				    _mdl_channel_note_is_on(cs, n) ==
+				    track->audible)
+					continue;
+				note.evtype = track->audible ? MIDIEV_NOTEON
+							     : MIDIEV_NOTEOFF;
+				note.u.midinote.channel = c;
+				note.u.midinote.joining = 0;
+				note.u.midinote.note = n;
+				note.u.midinote.velocity =
+				    track->audible ? songnote->velocity : 0;
+				ret = sequencer_midievent(seq, ss, &note, 0);
+				if (ret != 0)
+					return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
 static void
 sequencer_close(struct sequencer *seq)
 {
 	if (seq->interp_fd >= 0 && close(seq->interp_fd) == -1)
 		warn("closing interpreter pipe");
+	if (seq->queued_interp_fd >= 0 && close(seq->queued_interp_fd) == -1)
+		warn("closing queued interpreter pipe");
 
 	sequencer_close_songstate(seq, seq->playback_song);
 
 	sequencer_free_songstate(seq->playback_song);
 	sequencer_free_songstate(seq->reading_song);
 
+	/* Free the retired tracks through reading_song as well. */
+	seq->reading_song->playback_state = FREEING_EVENTSTREAM;
+	sequencer_retire_tracks(seq, seq->reading_song);
+	sequencer_free_songstate(seq->reading_song);
+	free(seq->switch_events);
+	free(seq->trackmodes);
+
 	if (seq->client_socket >= 0) {
 		if (imsg_flush(&seq->client_ibuf) == -1)
 			warnx("error flushing imsg buffers to client");
@@ -1473,21 +2876,49 @@ sequencer_close(struct sequencer *seq)
 	if (seq->dry_run)
 		return;
 
-	_mdl_midi_close_device();
+	_mdl_midi_close_device(seq->ctx);
 }
 
 static void
 sequencer_close_songstate(const struct sequencer *seq, struct songstate *ss)
 {
+	struct channel_state *cs;
 	struct midievent note_off;
-	int c, n, ret;
+	u_int32_t bits;
+	int c, n, notecount, ret, w;
 
 	_mdl_log(MDLLOG_SEQ, 0,
 	    "turning off notes that are currently playing\n");
 
-	for (c = 0; c < MIDI_CHANNEL_COUNT; c++)
-		for (n = 0; n < MIDI_NOTE_COUNT; n++)
-			if (ss->channelstates[c].notestates[n].state) {
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+		cs = &ss->channelstates[c];
+
+		notecount = 0;
+		for (w = 0; w < NOTE_WORDS; w++)
+			for (bits = cs->notes_on[w]; bits != 0;
+			    bits &= bits - 1)
+				notecount++;
+		if (notecount == 0)
+			continue;
+
+		if (notecount >= ALL_NOTES_OFF_MIN) {
+			_mdl_log(MDLLOG_SEQ, 1,
+			    "channel=%d has %d notes playing,"
+			    " turning all off\n", c, notecount);
+			ret = _mdl_midi_all_notes_off(seq->ctx, c, 2,
+			    seq->dry_run);
+			if (ret != 0)
+				warnx("error in turning off notes on"
+				    " channel %d", c);
+			memset(cs->notes_on, 0, sizeof(cs->notes_on));
+			memset(cs->velocities, 0, sizeof(cs->velocities));
+			continue;
+		}
+
+		for (w = 0; w < NOTE_WORDS; w++) {
+			for (bits = cs->notes_on[w]; bits != 0;
+			    bits &= bits - 1) {
+				n = w * NOTE_WORD_BITS + ffs((int) bits) - 1;
 				_mdl_log(MDLLOG_SEQ, 1,
 				    "channel=%d has note=%d playing,"
 				    " turning it off\n", c, n);
@@ -1501,6 +2932,12 @@ sequencer_close_songstate(const struct sequencer *seq, struct songstate *ss)
 					warnx("error in turning off note"
 					    " %d on channel %d", n, c);
 			}
+		}
+	}
+
+	/* Muted tracks are not playing their notes anymore either. */
+	memset(ss->songnotes, 0, sizeof(ss->songnotes));
+	memset(ss->songnotes_on, 0, sizeof(ss->songnotes_on));
 }
 
 static const char *
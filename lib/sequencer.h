@@ -25,6 +25,7 @@
 
 #include <imsg.h>
 
+#include "context.h"
 #include "midi.h"
 
 struct sequencer_connection {
@@ -37,8 +38,8 @@ __BEGIN_DECLS
 int	_mdl_disconnect_sequencer_connection(struct sequencer_connection *);
 int	_mdl_disconnect_sequencer_process(pid_t,
     struct sequencer_connection *);
-int	_mdl_start_sequencer_process(pid_t *, struct sequencer_connection *,
-    enum mididev_type, const char *, int);
+int	_mdl_start_sequencer_process(struct mdl_ctx *, pid_t *,
+    struct sequencer_connection *, enum mididev_type, const char *, int);
 __END_DECLS
 
 #endif /* !MDL_SEQUENCER_H */
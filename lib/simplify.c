@@ -0,0 +1,186 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "midi.h"
+#include "musicexpr.h"
+#include "simplify.h"
+#include "util.h"
+
+static int	is_empty(const struct musicexpr *);
+static void	prune_note(struct musicexpr *, int, int);
+static void	simplify(struct musicexpr *, int, int);
+static void	simplify_melist(struct musicexpr *, int, int);
+static void	splice_melist(struct musicexpr *, struct musicexpr *);
+
+/*
+ * Simplify a music expression after relative->absolute conversion, so that
+ * flattening has less to clone and sort.  Empty expressions are removed
+ * from sequences and simultences, nested sequences and simultences are
+ * merged, single item sequences and simultences are replaced by the item,
+ * nested scaled expressions are composed, and notes that would be skipped
+ * when making a midistream are replaced by rests.
+ */
+void
+_mdl_musicexpr_simplify(struct musicexpr *me, int level)
+{
+	_mdl_log(MDLLOG_EXPRCONV, level, "simplifying music expression\n");
+
+	simplify(me, 0, level+1);
+}
+
+static void
+simplify(struct musicexpr *me, int is_scaled, int level)
+{
+	struct musicexpr *p, *subexpr;
+	struct musicexpr_iter iter;
+
+	/* These should have been handled in previous phases. */
+	assert(me->me_type != ME_TYPE_FUNCTION);
+	assert(me->me_type != ME_TYPE_RELDRUM);
+	assert(me->me_type != ME_TYPE_RELNOTE);
+	assert(me->me_type != ME_TYPE_RELSIMULTENCE);
+
+	switch (me->me_type) {
+	case ME_TYPE_ABSDRUM:
+	case ME_TYPE_ABSNOTE:
+		prune_note(me, is_scaled, level);
+		break;
+	case ME_TYPE_CHORD:
+		/* Chords must contain an absnote, so leave these as is. */
+		break;
+	case ME_TYPE_SCALEDEXPR:
+		simplify(me->u.scaledexpr.me, 1, level+1);
+
+		/*
+		 * Scaling to some length and then scaling the result to
+		 * another length is the same as scaling to the latter length.
+		 */
+		while (me->u.scaledexpr.me->me_type == ME_TYPE_SCALEDEXPR) {
+			subexpr = me->u.scaledexpr.me;
+			me->u.scaledexpr.me = subexpr->u.scaledexpr.me;
+			_mdl_musicexpr_release(subexpr);
+		}
+		break;
+	case ME_TYPE_SEQUENCE:
+	case ME_TYPE_SIMULTENCE:
+		simplify_melist(me, is_scaled, level);
+		break;
+	default:
+		iter = _mdl_musicexpr_iter_new(me);
+		while ((p = _mdl_musicexpr_iter_next(&iter)) != NULL)
+			simplify(p, is_scaled, level+1);
+	}
+}
+
+static void
+simplify_melist(struct musicexpr *me, int is_scaled, int level)
+{
+	struct musicexpr *p, *q;
+
+	assert(me->me_type == ME_TYPE_SEQUENCE ||
+	    me->me_type == ME_TYPE_SIMULTENCE);
+
+	TAILQ_FOREACH_SAFE(p, &me->u.melist, tq, q) {
+		simplify(p, is_scaled, level+1);
+
+		if (is_empty(p)) {
+			TAILQ_REMOVE(&me->u.melist, p, tq);
+			_mdl_musicexpr_free(p, level+1);
+		} else if (p->me_type == me->me_type) {
+			/* Sequences in sequences and simultences in
+			 * simultences can be merged to the upper level. */
+			splice_melist(me, p);
+		}
+	}
+
+	p = TAILQ_FIRST(&me->u.melist);
+	if (p != NULL && TAILQ_NEXT(p, tq) == NULL) {
+		TAILQ_REMOVE(&me->u.melist, p, tq);
+		_mdl_musicexpr_replace(me, p, MDLLOG_EXPRCONV, level);
+		_mdl_musicexpr_release(p);
+	}
+}
+
+static int
+is_empty(const struct musicexpr *me)
+{
+	switch (me->me_type) {
+	case ME_TYPE_EMPTY:
+		return 1;
+	case ME_TYPE_SEQUENCE:
+	case ME_TYPE_SIMULTENCE:
+		return TAILQ_EMPTY(&me->u.melist);
+	default:
+		;
+	}
+
+	return 0;
+}
+
+/*
+ * Move items of subexpr (in melist of me) to melist of me, in place of
+ * subexpr, and free subexpr.
+ */
+static void
+splice_melist(struct musicexpr *me, struct musicexpr *subexpr)
+{
+	struct musicexpr *p;
+
+	while ((p = TAILQ_FIRST(&subexpr->u.melist)) != NULL) {
+		TAILQ_REMOVE(&subexpr->u.melist, p, tq);
+		TAILQ_INSERT_BEFORE(subexpr, p, tq);
+	}
+
+	TAILQ_REMOVE(&me->u.melist, subexpr, tq);
+	_mdl_musicexpr_release(subexpr);
+}
+
+/*
+ * Replace notes that would not be played with rests of the same length.
+ * Length can be checked only outside scaled expressions, because scaling
+ * may make a short note longer.
+ */
+static void
+prune_note(struct musicexpr *me, int is_scaled, int level)
+{
+	float length;
+	int note;
+
+	if (me->me_type == ME_TYPE_ABSDRUM) {
+		note = me->u.absdrum.note;
+		length = me->u.absdrum.length;
+	} else {
+		assert(me->me_type == ME_TYPE_ABSNOTE);
+		note = me->u.absnote.note;
+		length = me->u.absnote.length;
+	}
+
+	if (0 <= note && note < MIDI_NOTE_COUNT &&
+	    (is_scaled || length >= MINIMUM_MUSICEXPR_LENGTH))
+		return;
+
+	_mdl_musicexpr_log(me, MDLLOG_EXPRCONV, level, "pruning ");
+
+	me->me_type = ME_TYPE_REST;
+	me->u.rest.length = length;
+}
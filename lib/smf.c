@@ -0,0 +1,347 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smf.h"
+#include "util.h"
+
+#define SMF_META_END_OF_TRACK	0x2f
+#define SMF_META_EVENT		0xff
+#define SMF_META_TEMPO		0x51
+
+/* Track 0 for tempo changes, and a track for each midi channel. */
+#define SMF_MAX_TRACKS		(1 + MIDI_CHANNEL_COUNT)
+
+struct smf_track {
+	u_int8_t       *data;
+	size_t		length;
+	size_t		size;
+	u_int32_t	tick;
+	u_int8_t	running_status;
+	u_int8_t	header[8];
+};
+
+static int	smf_add_bytes(struct smf_track *, const u_int8_t *, size_t);
+static int	smf_add_event(struct smf_track *, u_int32_t,
+    const u_int8_t *, size_t);
+static int	smf_add_meta_event(struct smf_track *, u_int32_t, u_int8_t,
+    const u_int8_t *, u_int8_t);
+static int	smf_add_tempo(struct smf_track *, u_int32_t, float);
+static int	smf_make_channel_track(struct smf_track *,
+    const struct timed_midievent *, size_t, int, u_int32_t);
+static int	smf_make_tempo_track(struct smf_track *,
+    const struct timed_midievent *, size_t, u_int32_t);
+static int	smf_ticks(float, u_int32_t *);
+static void	smf_put_be32(u_int8_t *, u_int32_t);
+
+/*
+ * Save events (sorted and ending with MIDIEV_SONG_END, as compiled) to a
+ * Standard MIDI File at path, with _mdl_save_file().  Returns 0 on
+ * success and 1 on failure.
+ */
+int
+_mdl_smf_save(const char *path, const struct timed_midievent *events,
+    size_t eventcount)
+{
+	struct smf_track tracks[SMF_MAX_TRACKS];
+	struct iovec iov[1 + 2 * SMF_MAX_TRACKS];
+	u_int8_t header[14];
+	const struct midievent *midiev;
+	u_int32_t song_end;
+	size_t i;
+	int c, channel, channel_used[MIDI_CHANNEL_COUNT], ret, trackcount;
+
+	assert(eventcount > 0);
+	assert(events[ eventcount - 1 ].midiev.evtype == MIDIEV_SONG_END);
+
+	if (smf_ticks(events[ eventcount - 1 ].time_as_measures,
+	    &song_end) != 0)
+		return 1;
+
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++)
+		channel_used[c] = 0;
+
+	for (i = 0; i < eventcount; i++) {
+		midiev = &events[i].midiev;
+		switch (midiev->evtype) {
+		case MIDIEV_INSTRUMENT_CHANGE:
+			channel = midiev->u.instr_change.channel;
+			break;
+		case MIDIEV_NOTEOFF:
+		case MIDIEV_NOTEON:
+			channel = midiev->u.midinote.channel;
+			break;
+		case MIDIEV_VOLUMECHANGE:
+			channel = midiev->u.volumechange.channel;
+			break;
+		default:
+			continue;
+		}
+		channel_used[channel] = 1;
+	}
+
+	memset(tracks, 0, sizeof(tracks));
+	ret = 1;
+
+	if (smf_make_tempo_track(&tracks[0], events, eventcount, song_end)
+	    != 0)
+		goto finish;
+
+	trackcount = 1;
+	for (c = 0; c < MIDI_CHANNEL_COUNT; c++) {
+		if (!channel_used[c])
+			continue;
+		if (smf_make_channel_track(&tracks[trackcount], events,
+		    eventcount, c, song_end) != 0)
+			goto finish;
+		trackcount++;
+	}
+
+	memcpy(header, "MThd", 4);
+	smf_put_be32(&header[4], 6);
+	header[8] = 0;			/* format 1 */
+	header[9] = 1;
+	header[10] = 0;
+	header[11] = trackcount;
+	header[12] = SMF_TICKS_PER_QUARTER >> 8;
+	header[13] = SMF_TICKS_PER_QUARTER & 0xff;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+
+	for (c = 0; c < trackcount; c++) {
+		memcpy(tracks[c].header, "MTrk", 4);
+		smf_put_be32(&tracks[c].header[4], tracks[c].length);
+		iov[1 + 2*c].iov_base = tracks[c].header;
+		iov[1 + 2*c].iov_len = sizeof(tracks[c].header);
+		iov[2 + 2*c].iov_base = tracks[c].data;
+		iov[2 + 2*c].iov_len = tracks[c].length;
+	}
+
+	ret = _mdl_save_file(path, iov, 1 + 2 * trackcount);
+	if (ret == 0)
+		_mdl_log(MDLLOG_SONG, 0, "saved a midi file with %d tracks"
+		    " to %s\n", trackcount, path);
+
+finish:
+	for (c = 0; c < SMF_MAX_TRACKS; c++)
+		free(tracks[c].data);
+
+	return ret;
+}
+
+static int
+smf_add_bytes(struct smf_track *track, const u_int8_t *bytes, size_t count)
+{
+	u_int8_t *new_data;
+	size_t new_size;
+
+	if (track->length + count > track->size) {
+		new_size = (track->size > 0) ? 2 * track->size : 1024;
+		while (new_size < track->length + count)
+			new_size *= 2;
+		if ((new_data = realloc(track->data, new_size)) == NULL) {
+			warn("realloc in smf_add_bytes");
+			return 1;
+		}
+		track->data = new_data;
+		track->size = new_size;
+	}
+
+	memcpy(&track->data[ track->length ], bytes, count);
+	track->length += count;
+
+	return 0;
+}
+
+/*
+ * Add a midi or meta event at tick, after the delta time from the
+ * previous event.  The status byte is left out when it is the same as in
+ * the previous midi event (running status).
+ */
+static int
+smf_add_event(struct smf_track *track, u_int32_t tick,
+    const u_int8_t *event, size_t size)
+{
+	u_int8_t vlq[4];
+	u_int32_t delta;
+	int i, n;
+
+	assert(tick >= track->tick && tick <= SMF_VLQ_MAX);
+
+	delta = tick - track->tick;
+	track->tick = tick;
+
+	n = 0;
+	do {
+		vlq[n++] = delta & 0x7f;
+		delta >>= 7;
+	} while (delta > 0);
+
+	/* Most significant bits come first, with the continuation bit. */
+	for (i = n - 1; i >= 0; i--) {
+		vlq[i] |= (i > 0) ? 0x80 : 0;
+		if (smf_add_bytes(track, &vlq[i], 1) != 0)
+			return 1;
+	}
+
+	if (event[0] == SMF_META_EVENT) {
+		track->running_status = 0;
+	} else if (event[0] == track->running_status) {
+		event++;
+		size--;
+	} else {
+		track->running_status = event[0];
+	}
+
+	return smf_add_bytes(track, event, size);
+}
+
+static int
+smf_add_meta_event(struct smf_track *track, u_int32_t tick, u_int8_t type,
+    const u_int8_t *data, u_int8_t size)
+{
+	u_int8_t event[3 + 255];
+
+	event[0] = SMF_META_EVENT;
+	event[1] = type;
+	event[2] = size;
+	if (size > 0)
+		memcpy(&event[3], data, size);
+
+	return smf_add_event(track, tick, event, 3 + size);
+}
+
+static int
+smf_add_tempo(struct smf_track *track, u_int32_t tick, float bpm)
+{
+	u_int8_t tempo[3];
+	u_int32_t usecs_per_quarter;
+
+	/* Tempos slower than about 3.6 bpm do not fit in. */
+	usecs_per_quarter = MIN(60000000.0 / bpm, 0xffffff);
+
+	tempo[0] = usecs_per_quarter >> 16;
+	tempo[1] = (usecs_per_quarter >> 8) & 0xff;
+	tempo[2] = usecs_per_quarter & 0xff;
+
+	return smf_add_meta_event(track, tick, SMF_META_TEMPO, tempo,
+	    sizeof(tempo));
+}
+
+static int
+smf_make_channel_track(struct smf_track *track,
+    const struct timed_midievent *events, size_t eventcount, int channel,
+    u_int32_t song_end)
+{
+	u_int8_t midievent[MIDI_EVENT_MAXSIZE];
+	const struct midievent *midiev;
+	u_int32_t tick;
+	size_t i, size;
+	int ev_channel;
+
+	for (i = 0; i < eventcount; i++) {
+		midiev = &events[i].midiev;
+
+		switch (midiev->evtype) {
+		case MIDIEV_INSTRUMENT_CHANGE:
+			ev_channel = midiev->u.instr_change.channel;
+			break;
+		case MIDIEV_NOTEOFF:
+		case MIDIEV_NOTEON:
+			ev_channel = midiev->u.midinote.channel;
+			break;
+		case MIDIEV_VOLUMECHANGE:
+			ev_channel = midiev->u.volumechange.channel;
+			break;
+		default:
+			continue;
+		}
+
+		if (ev_channel != channel)
+			continue;
+
+		if (smf_ticks(events[i].time_as_measures, &tick) != 0)
+			return 1;
+
+		size = _mdl_midi_encode_midievent(midiev, midievent);
+		if (smf_add_event(track, tick, midievent, size) != 0)
+			return 1;
+	}
+
+	return smf_add_meta_event(track, song_end, SMF_META_END_OF_TRACK,
+	    NULL, 0);
+}
+
+static int
+smf_make_tempo_track(struct smf_track *track,
+    const struct timed_midievent *events, size_t eventcount,
+    u_int32_t song_end)
+{
+	u_int32_t tick;
+	size_t i;
+
+	/* Playback starts with the default tempo of mdl. */
+	if (smf_add_tempo(track, 0, 120) != 0)
+		return 1;
+
+	for (i = 0; i < eventcount; i++) {
+		if (events[i].midiev.evtype != MIDIEV_TEMPOCHANGE)
+			continue;
+		if (smf_ticks(events[i].time_as_measures, &tick) != 0 ||
+		    smf_add_tempo(track, tick, events[i].midiev.u.bpm) != 0)
+			return 1;
+	}
+
+	return smf_add_meta_event(track, song_end, SMF_META_END_OF_TRACK,
+	    NULL, 0);
+}
+
+/* Convert a time in measures (whole notes) to ticks. */
+static int
+smf_ticks(float time_as_measures, u_int32_t *tick)
+{
+	double ticks;
+
+	ticks = nearbyint(time_as_measures * 4.0 * SMF_TICKS_PER_QUARTER);
+	if (ticks > SMF_VLQ_MAX) {
+		warnx("song is too long for a midi file");
+		return 1;
+	}
+
+	*tick = ticks;
+
+	return 0;
+}
+
+static void
+smf_put_be32(u_int8_t *p, u_int32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
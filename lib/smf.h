@@ -0,0 +1,39 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_SMF_H
+#define MDL_SMF_H
+
+#include "midi.h"
+
+/*
+ * Standard MIDI File export of compiled events.  Files are format 1, with
+ * tempo changes in the first track and the events of each midi channel
+ * in a track of their own.
+ */
+
+#define SMF_TICKS_PER_QUARTER	960
+
+/* Largest value of a variable-length quantity. */
+#define SMF_VLQ_MAX		0x0fffffff
+
+__BEGIN_DECLS
+int	_mdl_smf_save(const char *, const struct timed_midievent *, size_t);
+__END_DECLS
+
+#endif /* !MDL_SMF_H */
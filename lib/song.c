@@ -18,6 +18,7 @@
 
 #include <assert.h>
 #include <err.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -28,7 +29,8 @@
 #include "util.h"
 
 static int
-connect_tracks_to_song(struct song *, struct musicexpr *, int);
+apply_functions_and_connect_tracks(struct song *, struct musicexpr *, int);
+static int	index_tracks(struct song *);
 
 struct song *
 _mdl_song_new(void)
@@ -41,6 +43,8 @@ _mdl_song_new(void)
 	}
 
 	SLIST_INIT(&song->tracklist);
+	song->tracks = NULL;
+	song->trackcount = 0;
 
 	return song;
 }
@@ -50,8 +54,12 @@ _mdl_song_setup_tracks(struct song *song, struct musicexpr *me, int level)
 {
 	struct track *track;
 
-	if (connect_tracks_to_song(song, me, level) != 0) {
-		warnx("could not connect tracks to song");
+	/*
+	 * Functions are applied in the same walk that connects tracks,
+	 * so that the expression tree is traversed only once here.
+	 */
+	if (apply_functions_and_connect_tracks(song, me, level) != 0) {
+		warnx("could not apply functions and connect tracks to song");
 		return 1;
 	}
 
@@ -71,18 +79,29 @@ _mdl_song_setup_tracks(struct song *song, struct musicexpr *me, int level)
 	}
 	song->default_drumtrack = track;
 
-	return 0;
+	return index_tracks(song);
 }
 
 static int
-connect_tracks_to_song(struct song *song, struct musicexpr *me, int level)
+apply_functions_and_connect_tracks(struct song *song, struct musicexpr *me,
+    int level)
 {
 	struct musicexpr *p;
 	struct musicexpr_iter iter;
 	struct track *tmp_track, *track;
 	int ret;
 
-	assert(me->me_type != ME_TYPE_FUNCTION);
+	/*
+	 * Functions are replaced with expressions that have no
+	 * subexpressions, so there is nothing more to traverse.
+	 */
+	if (me->me_type == ME_TYPE_FUNCTION) {
+		if (_mdl_functions_apply(me, level) != 0) {
+			warnx("problem applying functions");
+			return 1;
+		}
+		return 0;
+	}
 
 	ret = 0;
 	level += 1;
@@ -96,19 +115,56 @@ connect_tracks_to_song(struct song *song, struct musicexpr *me, int level)
 		me->u.ontrack.track = track;
 		free(tmp_track->name);
 		free(tmp_track);
-		return connect_tracks_to_song(song, me->u.ontrack.me, level);
+		return apply_functions_and_connect_tracks(song,
+		    me->u.ontrack.me, level);
 	}
 
 	/* Traverse the subexpressions. */
 	iter = _mdl_musicexpr_iter_new(me);
 	while ((p = _mdl_musicexpr_iter_next(&iter)) != NULL) {
-		if ((ret = connect_tracks_to_song(song, p, level)) != 0)
+		ret = apply_functions_and_connect_tracks(song, p, level);
+		if (ret != 0)
 			return ret;
 	}
 
 	return 0;
 }
 
+/*
+ * Number the tracks of song and collect them to song->tracks, so that
+ * compiled events can refer to tracks with small indices.
+ */
+static int
+index_tracks(struct song *song)
+{
+	struct track *track;
+	size_t i;
+
+	song->trackcount = 0;
+	SLIST_FOREACH(track, &song->tracklist, sl)
+		song->trackcount++;
+
+	if (song->trackcount > UINT32_MAX) {
+		warnx("too many tracks in song");
+		return 1;
+	}
+
+	song->tracks = reallocarray(NULL, song->trackcount,
+	    sizeof(struct track *));
+	if (song->tracks == NULL) {
+		warn("reallocarray in index_tracks");
+		return 1;
+	}
+
+	i = 0;
+	SLIST_FOREACH(track, &song->tracklist, sl) {
+		track->index = i;
+		song->tracks[i++] = track;
+	}
+
+	return 0;
+}
+
 void
 _mdl_song_free(struct song *song)
 {
@@ -120,6 +176,7 @@ _mdl_song_free(struct song *song)
 		free(p);
 	}
 
+	free(song->tracks);
 	free(song);
 }
 
@@ -26,6 +26,8 @@ SLIST_HEAD(tracklist, track);
 
 struct song {
 	struct tracklist	tracklist;
+	struct track	      **tracks;
+	size_t			trackcount;
 	struct track	       *default_drumtrack;
 	struct track	       *default_tonedtrack;
 };
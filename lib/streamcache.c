@@ -0,0 +1,210 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midipack.h"
+#include "streamcache.h"
+#include "util.h"
+
+static void		streamcache_evict(struct streamcache *, size_t);
+static struct streamcache_entry *
+			streamcache_find(struct streamcache *, u_int64_t,
+    const char *, size_t);
+static void		streamcache_free_entry(struct streamcache_entry *);
+static u_int64_t	streamcache_hash(const char *, size_t);
+
+void
+_mdl_streamcache_init(struct streamcache *cache, size_t max_size)
+{
+	TAILQ_INIT(&cache->entries);
+	cache->size = 0;
+	cache->max_size = max_size;
+}
+
+void
+_mdl_streamcache_free(struct streamcache *cache)
+{
+	streamcache_evict(cache, 0);
+	assert(TAILQ_EMPTY(&cache->entries));
+	assert(cache->size == 0);
+}
+
+/*
+ * Add a stream compiled from source to cache.  Cache takes ownership of
+ * source and stream in any case.  Returns 0 if the stream was added.
+ */
+int
+_mdl_streamcache_insert(struct streamcache *cache, char *source,
+    size_t source_size, char *stream, size_t stream_size)
+{
+	struct streamcache_entry *entry, *old_entry;
+	size_t entry_size;
+
+	entry_size = source_size + stream_size;
+	if (entry_size < source_size || entry_size > cache->max_size) {
+		_mdl_log(MDLLOG_CACHE, 0,
+		    "stream is too large for cache (%zu bytes)\n",
+		    entry_size);
+		free(source);
+		free(stream);
+		return 1;
+	}
+
+	if ((entry = malloc(sizeof(struct streamcache_entry))) == NULL) {
+		warn("malloc in _mdl_streamcache_insert");
+		free(source);
+		free(stream);
+		return 1;
+	}
+
+	entry->hash = streamcache_hash(source, source_size);
+	entry->source = source;
+	entry->source_size = source_size;
+	entry->stream = stream;
+	entry->stream_size = stream_size;
+	entry->in_cache = 1;
+	entry->refcount = 0;
+
+	/* Same source may have been compiled twice, keep the latest. */
+	old_entry = streamcache_find(cache, entry->hash, source, source_size);
+	if (old_entry != NULL) {
+		TAILQ_REMOVE(&cache->entries, old_entry, tq);
+		cache->size -= old_entry->source_size +
+		    old_entry->stream_size;
+		old_entry->in_cache = 0;
+		if (old_entry->refcount == 0)
+			streamcache_free_entry(old_entry);
+	}
+
+	streamcache_evict(cache, cache->max_size - entry_size);
+
+	TAILQ_INSERT_HEAD(&cache->entries, entry, tq);
+	cache->size += entry_size;
+
+	_mdl_log(MDLLOG_CACHE, 0,
+	    "added a stream of %zu bytes to cache, cache size is %zu\n",
+	    stream_size, cache->size);
+
+	return 0;
+}
+
+/*
+ * Find the stream compiled from source, or NULL if there is none.
+ * Caller must release the returned entry.
+ */
+struct streamcache_entry *
+_mdl_streamcache_lookup(struct streamcache *cache, const char *source,
+    size_t source_size)
+{
+	struct streamcache_entry *entry;
+
+	entry = streamcache_find(cache, streamcache_hash(source, source_size),
+	    source, source_size);
+	if (entry == NULL) {
+		_mdl_log(MDLLOG_CACHE, 0, "no cached stream found\n");
+		return NULL;
+	}
+
+	/* Most recently used entries are kept first. */
+	TAILQ_REMOVE(&cache->entries, entry, tq);
+	TAILQ_INSERT_HEAD(&cache->entries, entry, tq);
+	entry->refcount += 1;
+
+	_mdl_log(MDLLOG_CACHE, 0, "found a cached stream\n");
+
+	return entry;
+}
+
+void
+_mdl_streamcache_release(struct streamcache_entry *entry)
+{
+	assert(entry->refcount > 0);
+
+	entry->refcount -= 1;
+	if (entry->refcount == 0 && !entry->in_cache)
+		streamcache_free_entry(entry);
+}
+
+/* Evict least recently used entries until cache size is at most size. */
+static void
+streamcache_evict(struct streamcache *cache, size_t size)
+{
+	struct streamcache_entry *entry;
+
+	while (cache->size > size) {
+		entry = TAILQ_LAST(&cache->entries, streamcache_entries);
+		assert(entry != NULL);
+
+		_mdl_log(MDLLOG_CACHE, 0,
+		    "evicting a stream of %zu bytes from cache\n",
+		    entry->stream_size);
+
+		TAILQ_REMOVE(&cache->entries, entry, tq);
+		cache->size -= entry->source_size + entry->stream_size;
+		entry->in_cache = 0;
+		if (entry->refcount == 0)
+			streamcache_free_entry(entry);
+	}
+}
+
+static struct streamcache_entry *
+streamcache_find(struct streamcache *cache, u_int64_t hash,
+    const char *source, size_t source_size)
+{
+	struct streamcache_entry *entry;
+
+	TAILQ_FOREACH(entry, &cache->entries, tq) {
+		if (entry->hash == hash && entry->source_size == source_size &&
+		    memcmp(entry->source, source, source_size) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void
+streamcache_free_entry(struct streamcache_entry *entry)
+{
+	assert(!entry->in_cache);
+	assert(entry->refcount == 0);
+
+	free(entry->source);
+	free(entry->stream);
+	free(entry);
+}
+
+/*
+ * Hash of compiler version and source, with the same digest as for
+ * tracks.  Sources are compared in full on lookup, so this only needs to
+ * spread entries.
+ */
+static u_int64_t
+streamcache_hash(const char *source, size_t source_size)
+{
+	u_int64_t hash;
+
+	hash = _mdl_midipack_digest(MIDIPACK_DIGEST_INIT,
+	    (const u_int8_t *) MDL_VERSION, strlen(MDL_VERSION));
+
+	return _mdl_midipack_digest(hash, (const u_int8_t *) source,
+	    source_size);
+}
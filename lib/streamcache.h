@@ -0,0 +1,61 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2016 Juha Erkkil <je@turnipsi.no-ip.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MDL_STREAMCACHE_H
+#define MDL_STREAMCACHE_H
+
+#include <sys/queue.h>
+#include <sys/types.h>
+
+/*
+ * Cache of midi event streams (as sent to sequencer) keyed by the music
+ * source they were compiled from.  Entries are kept in least recently
+ * used order and evicted when the total size goes over max_size.
+ * Entries returned by _mdl_streamcache_lookup() stay valid until they
+ * are released with _mdl_streamcache_release(), even if evicted.
+ */
+struct streamcache_entry {
+	TAILQ_ENTRY(streamcache_entry)	tq;
+	u_int64_t			hash;
+	char			       *source;
+	size_t				source_size;
+	char			       *stream;
+	size_t				stream_size;
+	int				in_cache;
+	int				refcount;
+};
+
+TAILQ_HEAD(streamcache_entries, streamcache_entry);
+
+struct streamcache {
+	struct streamcache_entries	entries;
+	size_t				size;
+	size_t				max_size;
+};
+
+__BEGIN_DECLS
+void	_mdl_streamcache_init(struct streamcache *, size_t);
+void	_mdl_streamcache_free(struct streamcache *);
+int	_mdl_streamcache_insert(struct streamcache *, char *, size_t, char *,
+    size_t);
+struct streamcache_entry *
+	_mdl_streamcache_lookup(struct streamcache *, const char *, size_t);
+void	_mdl_streamcache_release(struct streamcache_entry *);
+__END_DECLS
+
+#endif /* !MDL_STREAMCACHE_H */
@@ -64,6 +64,7 @@ _mdl_track_new(enum instrument_type type, const char *trackname)
 	}
 	assert(track->instrument != NULL);
 
+	track->index = 0;
 	track->volume = TRACK_DEFAULT_VOLUME;
 
 	return track;
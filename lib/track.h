@@ -31,6 +31,7 @@ struct track {
 	char		       *name;
 	int			autoallocate_channel;
 	int			midichannel;
+	u_int32_t		index;		/* in song->tracks */
 	u_int8_t		volume;
 	SLIST_ENTRY(track)	sl;
 };
@@ -17,37 +17,36 @@
  */
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "context.h"
 #include "midi.h"
 #include "midistream.h"
 #include "musicexpr.h"
 #include "util.h"
 
 #define DEFAULT_SLOTCOUNT 1024
-#define INDENTLEVELS 128
 
-extern char *_mdl_process_type;
 extern char *__progname;
 
-struct {
-	int initialized;
-	u_int32_t opts;
-	struct {
-		char *msg;
-		enum logtype type;
-	} messages[INDENTLEVELS];
-} logstate = { 0, 0, {} };
+static int	stream_resize(struct mdl_stream *, size_t);
 
 static const char *logtype_strings[] = {
+	"cache",	/* MDLLOG_CACHE                  */
 	"clock",	/* MDLLOG_CLOCK                  */
 	"exprconv",	/* MDLLOG_EXPRCONV               */
 	"functions",	/* MDLLOG_FUNC                   */
@@ -63,30 +62,17 @@ static const char *logtype_strings[] = {
 	"song",		/* MDLLOG_SONG                   */
 };
 
-void
-_mdl_logging_init(void)
-{
-	int i;
-
-	assert(MDLLOG_TYPECOUNT <= 32);
-
-	logstate.opts = 0;
-
-	for (i = 0; i < INDENTLEVELS; i++)
-		logstate.messages[i].msg = NULL;
-
-	logstate.initialized = 1;
-}
-
 int
-_mdl_logging_setopts(char *optstring)
+_mdl_logging_setopts(struct mdl_ctx *ctx, char *optstring)
 {
+	struct logstate *logstate;
 	char *opt;
 	int found, logtype, loglevel;
 
-	assert(logstate.initialized);
+	assert(MDLLOG_TYPECOUNT <= 32);
 
-	logstate.opts = 0;
+	logstate = &ctx->logstate;
+	logstate->opts = 0;
 
 	for (;;) {
 		if ((opt = strsep(&optstring, ",")) == NULL)
@@ -97,14 +83,14 @@ _mdl_logging_setopts(char *optstring)
 		if (strcmp(opt, "all") == 0) {
 			for (logtype = 0; logtype < MDLLOG_TYPECOUNT;
 			    logtype++) {
-				logstate.opts |= (1 << logtype);
+				logstate->opts |= (1 << logtype);
 			}
 			continue;
 		}
 
 		for (logtype = 0; logtype < MDLLOG_TYPECOUNT; logtype++) {
 			if (strcmp(opt, logtype_strings[logtype]) == 0) {
-				logstate.opts |= (1 << logtype);
+				logstate->opts |= (1 << logtype);
 				found = 1;
 				break;
 			}
@@ -120,24 +106,25 @@ _mdl_logging_setopts(char *optstring)
 		}
 
 		if (loglevel >= 1) {
-			logstate.opts |= (1 << MDLLOG_PARSING)
+			logstate->opts |= (1 << MDLLOG_PARSING)
 			    | (1 << MDLLOG_PROCESS);
 		}
 
 		if (loglevel >= 2) {
-			logstate.opts |= (1 << MDLLOG_FUNC)
+			logstate->opts |= (1 << MDLLOG_FUNC)
 			    | (1 << MDLLOG_RELATIVE)
 			    | (1 << MDLLOG_SONG);
 		}
 
 		if (loglevel >= 3) {
-			logstate.opts |= (1 << MDLLOG_MIDI)
+			logstate->opts |= (1 << MDLLOG_CACHE)
+			    | (1 << MDLLOG_MIDI)
 			    | (1 << MDLLOG_MIDISTREAM)
 			    | (1 << MDLLOG_SEQ);
 		}
 
 		if (loglevel >= 4) {
-			logstate.opts |= (1 << MDLLOG_CLOCK)
+			logstate->opts |= (1 << MDLLOG_CLOCK)
 			    | (1 << MDLLOG_EXPRCONV)
 			    | (1 << MDLLOG_JOINS)
 			    | (1 << MDLLOG_IPC)
@@ -149,96 +136,162 @@ _mdl_logging_setopts(char *optstring)
 }
 
 void
-_mdl_logging_clear(void)
+_mdl_logging_clear(struct mdl_ctx *ctx)
 {
+	struct logstate *logstate;
 	int i;
 
-	assert(logstate.initialized);
+	logstate = &ctx->logstate;
 
 	for (i = 0; i < INDENTLEVELS; i++)
-		if (logstate.messages[i].msg != NULL) {
-			free(logstate.messages[i].msg);
-			logstate.messages[i].msg = NULL;
+		if (logstate->messages[i].msg != NULL) {
+			free(logstate->messages[i].msg);
+			logstate->messages[i].msg = NULL;
 		}
 }
 
-void
-_mdl_logging_close(void)
-{
-	assert(logstate.initialized);
-
-	_mdl_logging_clear();
-
-	logstate.initialized = 0;
-	logstate.opts = 0;
-}
-
 int
 _mdl_log_checkopt(enum logtype logtype)
 {
+	struct mdl_ctx *ctx;
+
 	assert(logtype < MDLLOG_TYPECOUNT);
 
-	return (logstate.opts & (1 << logtype));
+	/* Without a context there is nowhere to log to. */
+	if ((ctx = _mdl_ctx_get()) == NULL)
+		return 0;
+
+	return (ctx->logstate.opts & (1 << logtype));
 }
 
 void
 _mdl_log(enum logtype logtype, int level, const char *fmt, ...)
 {
+	struct mdl_ctx *ctx;
+	struct logstate *logstate;
 	va_list va;
+	FILE *out;
 	int padding_length, ret, i;
 
-	assert(logstate.initialized);
-
 	assert(logtype < MDLLOG_TYPECOUNT);
 	assert(level >= 0);
 
+	/*
+	 * Nothing could be printed without a context or with logging off,
+	 * so do not keep the message either.
+	 */
+	if ((ctx = _mdl_ctx_get()) == NULL || ctx->logstate.opts == 0)
+		return;
+
 	if (level >= INDENTLEVELS) {
 		warnx("maximum indentlevel reached: %d (maximum is %d)",
 		    level, INDENTLEVELS);
 		return;
 	}
 
-	if (logstate.messages[level].msg != NULL) {
-		free(logstate.messages[level].msg);
-		logstate.messages[level].msg = NULL;
+	logstate = &ctx->logstate;
+
+	pthread_mutex_lock(&ctx->log_mtx);
+
+	if (logstate->messages[level].msg != NULL) {
+		free(logstate->messages[level].msg);
+		logstate->messages[level].msg = NULL;
 	}
 
 	va_start(va, fmt);
-	ret = vasprintf(&logstate.messages[level].msg, fmt, va);
+	ret = vasprintf(&logstate->messages[level].msg, fmt, va);
 	va_end(va);
 	if (ret == -1) {
 		warnx("vasprintf error in _mdl_log");
-		logstate.messages[level].msg = NULL;
-		return;
+		logstate->messages[level].msg = NULL;
+		goto out;
 	}
 
-	logstate.messages[level].type = logtype;
+	logstate->messages[level].type = logtype;
 
-	if (((1 << logtype) & logstate.opts) == 0)
-		return;
+	if (((1 << logtype) & logstate->opts) == 0)
+		goto out;
+
+	out = (ctx->logfile != NULL) ? ctx->logfile : stdout;
 
 	for (i = 0; i <= level; i++) {
-		if (logstate.messages[i].msg != NULL) {
+		if (logstate->messages[i].msg != NULL) {
 			padding_length = sizeof("exprcloning") +
-			    sizeof("interp") - strlen(_mdl_process_type) - 1;
+			    sizeof("interp") - strlen(ctx->process_type) - 1;
 			assert(padding_length >= 0);
-			ret = printf("%s.%s.%-*s: %*s%s", __progname,
-			    _mdl_process_type, padding_length,
-			    logtype_strings[ logstate.messages[i].type ],
-			    (2 * i), "", logstate.messages[i].msg);
+			ret = fprintf(out, "%s.%s.%-*s: %*s%s", __progname,
+			    ctx->process_type, padding_length,
+			    logtype_strings[ logstate->messages[i].type ],
+			    (2 * i), "", logstate->messages[i].msg);
 			if (ret < 0) {
-				warnx("printf error in _mdl_log");
+				warnx("fprintf error in _mdl_log");
 				break;
 			}
 		}
 	}
 
 	for (i = 0; i < INDENTLEVELS; i++) {
-		if (logstate.messages[i].msg != NULL) {
-			free(logstate.messages[i].msg);
-			logstate.messages[i].msg = NULL;
+		if (logstate->messages[i].msg != NULL) {
+			free(logstate->messages[i].msg);
+			logstate->messages[i].msg = NULL;
 		}
 	}
+
+out:
+	pthread_mutex_unlock(&ctx->log_mtx);
+}
+
+/*
+ * Report an error in music, like warnx(3), or collect it into the context
+ * diagnostics if the caller wants those.
+ */
+void
+_mdl_warnx(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	_mdl_vwarnx(fmt, va);
+	va_end(va);
+}
+
+void
+_mdl_vwarnx(const char *fmt, va_list va)
+{
+	struct mdl_ctx *ctx;
+	char *msg, *new_diagnostics;
+	size_t msglen;
+
+	ctx = _mdl_ctx_get();
+	if (ctx == NULL || !ctx->collect_diagnostics) {
+		vwarnx(fmt, va);
+		return;
+	}
+
+	if (vasprintf(&msg, fmt, va) == -1) {
+		warnx("vasprintf error in _mdl_vwarnx");
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->log_mtx);
+
+	msglen = strlen(msg);
+	new_diagnostics = realloc(ctx->diagnostics,
+	    ctx->diagnostics_length + msglen + 2);
+	if (new_diagnostics == NULL) {
+		warn("realloc in _mdl_vwarnx");
+		goto out;
+	}
+
+	memcpy(new_diagnostics + ctx->diagnostics_length, msg, msglen);
+	ctx->diagnostics_length += msglen;
+	new_diagnostics[ ctx->diagnostics_length++ ] = '\n';
+	new_diagnostics[ ctx->diagnostics_length ] = '\0';
+	ctx->diagnostics = new_diagnostics;
+
+out:
+	pthread_mutex_unlock(&ctx->log_mtx);
+	free(msg);
 }
 
 struct mdl_stream *
@@ -292,49 +345,37 @@ _mdl_stream_new(enum streamtype s_type)
 int
 _mdl_stream_increment(struct mdl_stream *s)
 {
-	void *new_items;
-
 	s->count += 1;
 	if (s->count == s->slotcount) {
 		_mdl_log(MDLLOG_MIDISTREAM, 0,
 		    "mdl_stream now contains %d items\n", s->count);
-		s->slotcount *= 2;
-		switch (s->s_type) {
-		case MIDIEVENTS:
-			new_items = reallocarray(s->u.timed_midievents,
-			    s->slotcount, sizeof(struct timed_midievent));
-			if (new_items == NULL) {
-				warn("reallocarray in _mdl_stream_increment");
-				return 1;
-			}
-			s->u.timed_midievents = new_items;
-			break;
-		case MIDISTREAMEVENTS:
-			new_items = reallocarray(s->u.midistreamevents,
-			    s->slotcount, sizeof(struct midistreamevent));
-			if (new_items == NULL) {
-				warn("reallocarray in _mdl_stream_increment");
-				return 1;
-			}
-			s->u.midistreamevents = new_items;
-			break;
-		case OFFSETEXPRS:
-			new_items = reallocarray(s->u.mexprs, s->slotcount,
-			    sizeof(struct offsetexpr));
-			if (new_items == NULL) {
-				warn("reallocarray in _mdl_stream_increment");
-				return 1;
-			}
-			s->u.mexprs = new_items;
-			break;
-		default:
-			assert(0);
-		}
+		if (stream_resize(s, 2 * s->slotcount) != 0)
+			return 1;
 	}
 
 	return 0;
 }
 
+/*
+ * Make room for count more items in s, so that a stream whose size is
+ * known in advance is allocated only once and its items are never copied
+ * by _mdl_stream_increment().
+ */
+int
+_mdl_stream_reserve(struct mdl_stream *s, size_t count)
+{
+	if (count >= SIZE_MAX - s->count) {
+		warnx("mdl_stream size overflow");
+		return 1;
+	}
+
+	/* The slot after the last item must be free as well. */
+	if (s->count + count < s->slotcount)
+		return 0;
+
+	return stream_resize(s, s->count + count + 1);
+}
+
 void
 _mdl_stream_free(struct mdl_stream *s)
 {
@@ -355,6 +396,47 @@ _mdl_stream_free(struct mdl_stream *s)
 	free(s);
 }
 
+static int
+stream_resize(struct mdl_stream *s, size_t slotcount)
+{
+	void *new_items;
+
+	assert(slotcount > s->count);
+
+	switch (s->s_type) {
+	case MIDIEVENTS:
+		new_items = reallocarray(s->u.timed_midievents, slotcount,
+		    sizeof(struct timed_midievent));
+		if (new_items != NULL)
+			s->u.timed_midievents = new_items;
+		break;
+	case MIDISTREAMEVENTS:
+		new_items = reallocarray(s->u.midistreamevents, slotcount,
+		    sizeof(struct midistreamevent));
+		if (new_items != NULL)
+			s->u.midistreamevents = new_items;
+		break;
+	case OFFSETEXPRS:
+		new_items = reallocarray(s->u.mexprs, slotcount,
+		    sizeof(struct offsetexpr));
+		if (new_items != NULL)
+			s->u.mexprs = new_items;
+		break;
+	default:
+		assert(0);
+		return 1;
+	}
+
+	if (new_items == NULL) {
+		warn("reallocarray in stream_resize");
+		return 1;
+	}
+
+	s->slotcount = slotcount;
+
+	return 0;
+}
+
 void __dead
 _mdl_unimplemented(void)
 {
@@ -362,6 +444,79 @@ _mdl_unimplemented(void)
 	abort();
 }
 
+/*
+ * Save the contents of iov to a file at path.  The contents are written
+ * to a temporary file that is then renamed to path, so that readers never
+ * see a partial file and those that have the old file mapped are not
+ * affected.  Returns 0 on success and 1 on failure.
+ */
+int
+_mdl_save_file(const char *path, const struct iovec *iov, int iovcnt)
+{
+	char tmppath[PATH_MAX];
+	const char *p;
+	size_t left;
+	ssize_t nw;
+	mode_t mask;
+	int fd, i, ret;
+
+	ret = snprintf(tmppath, sizeof(tmppath), "%s.XXXXXXXXXX", path);
+	if (ret == -1 || (size_t)ret >= sizeof(tmppath)) {
+		warnx("file path %s is too long", path);
+		return 1;
+	}
+
+	if ((fd = mkstemp(tmppath)) == -1) {
+		warn("could not create %s", tmppath);
+		return 1;
+	}
+
+	/* mkstemp() creates files only the owner can read. */
+	mask = umask(0);
+	(void) umask(mask);
+	if (fchmod(fd, 0666 & ~mask) == -1) {
+		warn("fchmod %s", tmppath);
+		goto remove;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		left = iov[i].iov_len;
+		while (left > 0) {
+			if ((nw = write(fd, p, left)) == -1) {
+				if (errno == EINTR)
+					continue;
+				warn("writing %s", tmppath);
+				goto remove;
+			}
+			p += nw;
+			left -= nw;
+		}
+	}
+
+	ret = close(fd);
+	fd = -1;
+	if (ret == -1) {
+		warn("closing %s", tmppath);
+		goto remove;
+	}
+
+	if (rename(tmppath, path) == -1) {
+		warn("could not rename %s to %s", tmppath, path);
+		goto remove;
+	}
+
+	return 0;
+
+remove:
+	if (fd != -1 && close(fd) == -1)
+		warn("closing %s", tmppath);
+	if (unlink(tmppath) == -1)
+		warn("removing %s", tmppath);
+
+	return 1;
+}
+
 int
 _mdl_show_version(void)
 {
@@ -19,6 +19,7 @@
 #ifndef MDL_UTIL_H
 #define MDL_UTIL_H
 
+#include <stdarg.h>
 #include <unistd.h>
 
 /* XXX maybe belongs somewhere else */
@@ -35,8 +36,13 @@
 
 #define UNUSED(x)	(void)(x)
 
+#define INDENTLEVELS	128
+
+struct iovec;
+
 /* There should not be more than 32 different MDLLOG_* types. */
 enum logtype {
+	MDLLOG_CACHE,
 	MDLLOG_CLOCK,
 	MDLLOG_EXPRCONV,
 	MDLLOG_FUNC,
@@ -53,6 +59,16 @@ enum logtype {
 	MDLLOG_TYPECOUNT,	/* not a logtype */
 };
 
+struct logstate {
+	u_int32_t opts;
+	struct {
+		char *msg;
+		enum logtype type;
+	} messages[INDENTLEVELS];
+};
+
+struct mdl_ctx;
+
 struct mdl_stream {
 	size_t count, slotcount;
 	enum streamtype {
@@ -69,17 +85,19 @@ struct mdl_stream {
 
 __BEGIN_DECLS
 void	_mdl_log(enum logtype, int, const char *, ...);
-void	_mdl_logging_init(void);
-void	_mdl_logging_clear(void);
-int	_mdl_logging_setopts(char *);
-void	_mdl_logging_close(void);
+void	_mdl_logging_clear(struct mdl_ctx *);
+int	_mdl_logging_setopts(struct mdl_ctx *, char *);
 int	_mdl_log_checkopt(enum logtype);
+void	_mdl_warnx(const char *, ...);
+void	_mdl_vwarnx(const char *, va_list);
 
 struct mdl_stream      *_mdl_stream_new(enum streamtype);
 int			_mdl_stream_increment(struct mdl_stream *);
+int			_mdl_stream_reserve(struct mdl_stream *, size_t);
 void			_mdl_stream_free(struct mdl_stream *);
 void __dead		_mdl_unimplemented(void);
 
+int	_mdl_save_file(const char *, const struct iovec *, int);
 int	_mdl_show_version(void);
 int	_mdl_wait_for_subprocess(const char *, int);
 
@@ -19,40 +19,82 @@
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <imsg.h>
+#include <math.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "compile.h"
+#include "context.h"
 #include "interpreter.h"
 #include "ipc.h"
 #include "midi.h"
+#include "midipack.h"
+#include "midistream.h"
+#include "score.h"
+#include "seqthread.h"
+#include "smf.h"
 #include "sequencer.h"
 #include "util.h"
 
 #define MAX_MUSICFILES 65536
 
+#define MUSICFILE_SUFFIX ".mdl"
+
 struct musicfile {
 	char   *path;
 	int	fd;
 };
 
+/*
+ * If replaced_tracks is set, the music file replaces only the tracks
+ * named in it (each name terminated by NUL) in the song that is playing.
+ * Otherwise song_switch tells where a new song replaces the playing one.
+ */
+/*
+ * With a server, interpreted counts the music files sent to server and
+ * piped the interpreter pipes it has sent back, which come in the same
+ * order.
+ */
 struct musicfiles {
 	struct musicfile       *files;
 	size_t			count;
 	size_t			current;
+	size_t			interpreted;
+	size_t			piped;
 	int			all_done;
+	char		       *replaced_tracks;
+	size_t			replaced_tracks_size;
+	enum song_switch	song_switch;
+};
+
+struct batch_job {
+	char		       *musicfile;
+	char		       *outputfile;
+	pid_t			pid;
+	struct timespec		start;
+};
+
+struct batch {
+	struct batch_job       *jobs;
+	size_t			count;
+	size_t			size;
 };
 
 struct server_connection {
@@ -61,6 +103,12 @@ struct server_connection {
 	struct imsgbuf	ibuf;
 };
 
+/* Mute, solo or unmute for a track, sent to sequencer before songs. */
+struct trackcommand {
+	enum mdl_event	event;
+	const char     *track;
+};
+
 #ifdef HAVE_MALLOC_OPTIONS
 extern char	*malloc_options;
 #endif /* HAVE_MALLOC_OPTIONS */
@@ -70,8 +118,15 @@ volatile sig_atomic_t mdl_shutdown_client = 0;
 
 extern int loglevel;
 
-char *_mdl_process_type;
+static struct mdl_ctx *mdl_ctx;
 
+static int	add_replaced_track(struct musicfiles *, const char *);
+static int	batch_add_job(struct batch *, const char *, const char *);
+static int	batch_add_path(struct batch *, const char *, const char *);
+static double	batch_elapsed(const struct timespec *);
+static int	batch_musicfile_filter(const struct dirent *);
+static int	compile_batch(const char *, char **, size_t);
+static int	compile_to_file(const char *, char **, size_t);
 static int	establish_sequencer_connection(struct server_connection *,
     struct sequencer_connection *);
 static int	establish_server_connection(struct server_connection *, int);
@@ -80,31 +135,44 @@ static int	enqueue_song(struct server_connection *,
 static int	open_musicfiles(struct musicfiles *, char **, size_t);
 static int	handle_musicfiles(struct server_connection *,
     struct sequencer_connection *, struct musicfiles *);
+static int	has_midifile_suffix(const char *);
 static int	handle_server_events(struct server_connection *,
-    struct sequencer_connection *);
+    struct sequencer_connection *, struct musicfiles *);
 static int	mdl_handle_interpreter_process(struct interpreter_handler *,
     struct sequencer_connection *, struct musicfiles *);
 static int	mdl_handle_sequencer_events(struct server_connection *,
     struct sequencer_connection *, struct musicfiles *,
     struct interpreter_handler *);
 static void	mdl_handle_signal(int);
+static int	play_musicfiles_in_threads(enum mididev_type, char *, int,
+    int, float, char **, size_t);
+static void	print_diagnostics(char *);
+static int	queue_next_musicfile(struct server_connection *,
+    struct musicfiles *);
 static int	replace_server_with_client_conn(struct sequencer_connection *);
+static int	send_musicfile(struct server_connection *,
+    struct musicfiles *, enum mdl_event);
+static int	send_trackcommands(struct imsgbuf *,
+    const struct trackcommand *, size_t);
 
 static void __dead mdl_usage(void);
 
 static void __dead
 mdl_usage(void)
 {
-	(void) fprintf(stderr, "usage: mdl [-nv] [-d debuglevel] [-f device]"
-	    " [-m MIDI-interface] [file ...]\n");
+	(void) fprintf(stderr, "usage: mdl [-nptv] [-B suffix] [-b measure]"
+	    " [-d debuglevel] [-f device] [-j threads] [-M track]"
+	    " [-m MIDI-interface] [-o outputfile] [-q boundary] [-R track]"
+	    " [-S track] [-U track] [file ...]\n");
 	exit(1);
 }
 
 static void
 mdl_handle_signal(int signo)
 {
-	assert(signo == SIGINT || signo == SIGTERM);
+	assert(signo == SIGCHLD || signo == SIGINT || signo == SIGTERM);
 
+	/* SIGCHLD only interrupts pselect() so interpreters get reaped. */
 	if (signo == SIGINT || signo == SIGTERM)
 		mdl_shutdown_client = 1;
 }
@@ -115,53 +183,111 @@ main(int argc, char *argv[])
 	struct sequencer_connection seq_conn;
 	struct server_connection server_conn;
 	pid_t sequencer_pid;
-	char *devicepath;
+	char *batch_suffix, *devicepath, *end, *outputpath;
+	const char *errstr;
 	char **musicfilepaths;
 	struct musicfiles musicfiles;
-	int cflag, nflag, sflag;
+	struct trackcommand *trackcommands;
+	size_t trackcommandcount;
+	float start_position;
+	int bflag, cflag, nflag, pflag, sflag, tflag;
 	int ch, connect_to_server, force_server_connection;
-	int musicfilecount, ret, sequencer_connection_established;
+	int compile_threads, musicfilecount, ret;
+	int sequencer_connection_established;
 	int server_connection_established;
+	int trackcommands_only;
 	enum mididev_type mididev_type;
 
 #ifdef HAVE_MALLOC_OPTIONS
 	malloc_options = (char *) "AFGJPS";
 #endif /* HAVE_MALLOC_OPTIONS */
 
-	_mdl_process_type = "main";
-
+	bflag = 0;
 	cflag = 0;
 	nflag = 0;
+	pflag = 0;
 	sflag = 0;
+	tflag = 0;
 
 	connect_to_server = 1;
 	force_server_connection = 0;
 
+	batch_suffix = NULL;
 	devicepath = NULL;
 	mididev_type = DEFAULT_MIDIDEV_TYPE;
+	outputpath = NULL;
 	sequencer_pid = 0;
+	start_position = 0.0;
 
 	/* Use all pledge promises needed by sndio (except for "audio" which
-	 * I think is sio_* specific), plus "proc", "recvfd" and "sendfd". */
-	ret = pledge("cpath dns inet proc recvfd rpath sendfd stdio unix"
-	    " wpath", NULL);
+	 * I think is sio_* specific), plus "proc", "recvfd" and "sendfd",
+	 * and "fattr" for saving score files. */
+	ret = pledge("cpath dns fattr inet proc recvfd rpath sendfd stdio"
+	    " unix wpath", NULL);
 	if (ret == -1)
 		err(1, "pledge");
 
-	_mdl_logging_init();
+	if ((mdl_ctx = _mdl_ctx_new("main")) == NULL)
+		errx(1, "could not create library context");
+	if (_mdl_ctx_set(mdl_ctx) != 0)
+		errx(1, "could not set library context");
+
+	/* There can not be more track commands than arguments. */
+	trackcommands = calloc(argc, sizeof(struct trackcommand));
+	if (trackcommands == NULL)
+		err(1, "calloc");
+	trackcommandcount = 0;
 
-	while ((ch = getopt(argc, argv, "cd:f:m:nsv")) != -1) {
+	musicfiles.replaced_tracks = NULL;
+	musicfiles.replaced_tracks_size = 0;
+	musicfiles.song_switch = SONG_SWITCH_NOW;
+
+	while ((ch = getopt(argc, argv, "B:b:cd:f:j:M:m:no:pq:R:S:stU:v"))
+	    != -1) {
 		switch (ch) {
+		case 'B':
+			batch_suffix = optarg;
+			break;
+		case 'b':
+			bflag = 1;
+			start_position = strtof(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' ||
+			    !isfinite(start_position) || start_position < 0.0)
+				errx(1, "invalid starting measure: %s",
+				    optarg);
+			break;
 		case 'c':
 			cflag = 1;
 			break;
 		case 'd':
-			if (_mdl_logging_setopts(optarg) == -1)
+			if (_mdl_logging_setopts(mdl_ctx, optarg) == -1)
 				errx(1, "error in setting logging opts");
 			break;
 		case 'f':
 			devicepath = optarg;
 			break;
+		case 'j':
+			compile_threads = strtonum(optarg, 1,
+			    MAX_COMPILE_THREADS, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of threads is %s: %s", errstr,
+				    optarg);
+			_mdl_midistream_set_compile_threads(mdl_ctx,
+			    compile_threads);
+			break;
+		case 'M':
+		case 'S':
+		case 'U':
+			if (*optarg == '\0' ||
+			    strlen(optarg) > MIDIPACK_TRACKNAME_MAX)
+				errx(1, "invalid track name: %s", optarg);
+			trackcommands[trackcommandcount].event =
+			    (ch == 'M') ? CLIENTEVENT_MUTE_TRACK :
+			    (ch == 'S') ? CLIENTEVENT_SOLO_TRACK :
+					  CLIENTEVENT_UNMUTE_TRACK;
+			trackcommands[trackcommandcount].track = optarg;
+			trackcommandcount++;
+			break;
 		case 'm':
 			mididev_type = _mdl_midi_get_mididev_type(optarg);
 			if (mididev_type == MIDIDEV_NONE)
@@ -171,9 +297,35 @@ main(int argc, char *argv[])
 			nflag = 1;
 			sflag = 1;	/* -n implies -s */
 			break;
+		case 'o':
+			outputpath = optarg;
+			break;
+		case 'p':
+			pflag = 1;
+			tflag = 1;	/* -p implies -t */
+			sflag = 1;
+			break;
+		case 'q':
+			if (strcmp(optarg, "measure") == 0) {
+				musicfiles.song_switch = SONG_SWITCH_MEASURE;
+			} else if (strcmp(optarg, "marker") == 0) {
+				musicfiles.song_switch = SONG_SWITCH_MARKER;
+			} else {
+				errx(1, "invalid song switch boundary: %s",
+				    optarg);
+			}
+			break;
+		case 'R':
+			if (add_replaced_track(&musicfiles, optarg) != 0)
+				exit(1);
+			break;
 		case 's':
 			sflag = 1;
 			break;
+		case 't':
+			tflag = 1;
+			sflag = 1;	/* -t implies -s */
+			break;
 		case 'v':
 			if (_mdl_show_version() != 0)
 				exit(1);
@@ -189,6 +341,42 @@ main(int argc, char *argv[])
 
 	if (cflag && sflag)
 		errx(1, "-c and -s options are mutually exclusive");
+	if (bflag && !pflag)
+		errx(1, "-b option can only be used with -p");
+	if (outputpath != NULL && (cflag || sflag))
+		errx(1, "-o option can not be used with options that play"
+		    " music");
+	if (batch_suffix != NULL &&
+	    strcmp(batch_suffix, MUSICFILE_SUFFIX + 1) == 0)
+		errx(1, "-B option can not use the suffix of music files");
+	if (batch_suffix != NULL && (cflag || sflag || outputpath != NULL))
+		errx(1, "-B option can not be used with -o or options that"
+		    " play music");
+	if (trackcommandcount > 0 &&
+	    (tflag || outputpath != NULL || batch_suffix != NULL))
+		errx(1, "-M, -S and -U options can not be used with -B, -o,"
+		    " -p or -t");
+	if (musicfiles.song_switch != SONG_SWITCH_NOW &&
+	    (tflag || outputpath != NULL || batch_suffix != NULL ||
+	    musicfiles.replaced_tracks != NULL))
+		errx(1, "-q option can not be used with -B, -o, -p, -R or"
+		    " -t");
+	if (musicfiles.replaced_tracks != NULL) {
+		/* Tracks are replaced in the song that mdld is playing. */
+		if (sflag || outputpath != NULL || batch_suffix != NULL)
+			errx(1, "-R option can not be used with -B, -n,"
+			    " -o, -p, -s or -t");
+		if (argc > 1)
+			errx(1, "-R option can be used with only one file");
+		force_server_connection = 1;
+	}
+	if (trackcommandcount > 0 && argc == 0) {
+		/* Only track commands, for a song that mdld is playing. */
+		if (sflag)
+			errx(1, "-M, -S and -U options need a server when no"
+			    " files are given");
+		force_server_connection = 1;
+	}
 	if (cflag)
 		force_server_connection = 1;
 	if (sflag)
@@ -199,6 +387,28 @@ main(int argc, char *argv[])
 	musicfilecount = argc;
 	musicfilepaths = argv;
 
+	if (outputpath != NULL) {
+		ret = compile_to_file(outputpath, musicfilepaths,
+		    musicfilecount);
+		_mdl_ctx_free(mdl_ctx);
+		return ret;
+	}
+
+	if (batch_suffix != NULL) {
+		ret = compile_batch(batch_suffix, musicfilepaths,
+		    musicfilecount);
+		_mdl_ctx_free(mdl_ctx);
+		return ret;
+	}
+
+	if (tflag) {
+		ret = play_musicfiles_in_threads(mididev_type, devicepath,
+		    nflag, pflag, start_position, musicfilepaths,
+		    musicfilecount);
+		_mdl_ctx_free(mdl_ctx);
+		return ret;
+	}
+
 	sequencer_connection_established = 0;
 	server_connection_established = 0;
 	if (connect_to_server) {
@@ -221,8 +431,8 @@ main(int argc, char *argv[])
 	if (!sequencer_connection_established) {
 		if (force_server_connection)
 			errx(1, "forced a server connection, but it failed");
-		ret = _mdl_start_sequencer_process(&sequencer_pid, &seq_conn,
-		    mididev_type, devicepath, nflag);
+		ret = _mdl_start_sequencer_process(mdl_ctx, &sequencer_pid,
+		    &seq_conn, mididev_type, devicepath, nflag);
 		if (ret != 0)
 			errx(1, "error in starting up sequencer");
 		if (replace_server_with_client_conn(&seq_conn) != 0)
@@ -230,6 +440,35 @@ main(int argc, char *argv[])
 			    " connection");
 	}
 
+	/*
+	 * Without music, or with only tracks that replace those of the
+	 * song that is playing, track commands go through server, so that
+	 * this client does not take the place of the one that plays music.
+	 */
+	trackcommands_only = (trackcommandcount > 0 && musicfilecount == 0 &&
+	    musicfiles.replaced_tracks == NULL);
+	assert(!trackcommands_only || server_connection_established);
+
+	if (trackcommandcount > 0) {
+		ret = send_trackcommands(
+		    ((trackcommands_only || musicfiles.replaced_tracks != NULL)
+		    ? &server_conn.ibuf : &seq_conn.ibuf),
+		    trackcommands, trackcommandcount);
+		if (ret != 0)
+			errx(1, "error in sending track commands to"
+			    " sequencer");
+	}
+	free(trackcommands);
+
+	if (trackcommands_only) {
+		imsg_clear(&server_conn.ibuf);
+		if (close(server_conn.socket) == -1)
+			warn("closing server connection");
+		ret = _mdl_disconnect_sequencer_connection(&seq_conn);
+		_mdl_ctx_free(mdl_ctx);
+		return ret;
+	}
+
 	/*
 	 * Now that sequencer has been forked, we can drop all sndio related
 	 * pledges, plus "recvfd" only used by sequencer.
@@ -263,12 +502,456 @@ main(int argc, char *argv[])
 	}
 
 	free(musicfiles.files);
+	free(musicfiles.replaced_tracks);
 
-	_mdl_logging_close();
+	_mdl_ctx_free(mdl_ctx);
 
 	return 0;
 }
 
+/*
+ * Compile each music file to a file with the same name, but with suffix
+ * in place of MUSICFILE_SUFFIX, using a compiler process per file and as
+ * many processes at a time as there are processors.  Directories are
+ * replaced by the music files in them.  The time each compile took and
+ * whether it failed is reported as processes finish.  Returns 1 if any
+ * file could not be compiled.
+ */
+static int
+compile_batch(const char *suffix, char **paths, size_t pathcount)
+{
+	struct batch batch;
+	struct batch_job *job;
+	struct timespec start;
+	size_t failed, i, next, running;
+	long workers;
+	pid_t pid;
+	int ok, ret, status;
+
+	if (pathcount == 0) {
+		warnx("no music files to compile");
+		return 1;
+	}
+
+	if (pledge("cpath fattr proc rpath stdio wpath", NULL) == -1)
+		err(1, "pledge");
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &start);
+	assert(ret == 0);
+
+	batch.jobs = NULL;
+	batch.count = 0;
+	batch.size = 0;
+
+	for (i = 0; i < pathcount; i++) {
+		if (batch_add_path(&batch, paths[i], suffix) != 0) {
+			ret = 1;
+			goto finish;
+		}
+	}
+
+	if ((workers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		workers = 1;
+
+	_mdl_log(MDLLOG_PROCESS, 0, "compiling %zu files with %ld processes\n",
+	    batch.count, workers);
+
+	signal(SIGINT,  mdl_handle_signal);
+	signal(SIGTERM, mdl_handle_signal);
+
+	failed = 0;
+	next = 0;
+	running = 0;
+	ret = 0;
+
+	while (next < batch.count || running > 0) {
+		while (running < (size_t)workers && next < batch.count &&
+		    !mdl_shutdown_client) {
+			job = &batch.jobs[next++];
+			ret = clock_gettime(CLOCK_MONOTONIC, &job->start);
+			assert(ret == 0);
+			/* Do not let children output what was buffered. */
+			(void) fflush(NULL);
+			if ((job->pid = fork()) == -1) {
+				warn("could not fork a compiler process for"
+				    " %s", job->musicfile);
+				failed++;
+				(void) printf("%-6s %8.3fs  %s -> %s\n",
+				    "FAILED", batch_elapsed(&job->start),
+				    job->musicfile, job->outputfile);
+				continue;
+			}
+			if (job->pid == 0) {
+				ret = compile_to_file(job->outputfile,
+				    &job->musicfile, 1);
+				_exit(ret);
+			}
+			running++;
+		}
+
+		if (running == 0)
+			break;
+
+		if ((pid = waitpid(WAIT_ANY, &status, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("waiting for compiler processes");
+			ret = 1;
+			goto finish;
+		}
+
+		for (i = 0; i < next; i++)
+			if (batch.jobs[i].pid == pid)
+				break;
+		if (i == next)
+			continue;
+
+		job = &batch.jobs[i];
+		job->pid = -1;
+		running--;
+
+		ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		if (!ok)
+			failed++;
+
+		(void) printf("%-6s %8.3fs  %s -> %s\n",
+		    (ok ? "ok" : "FAILED"), batch_elapsed(&job->start),
+		    job->musicfile, job->outputfile);
+	}
+
+	if (next < batch.count)
+		failed += batch.count - next;
+
+	(void) printf("compiled %zu files, %zu failed, in %.3f seconds\n",
+	    batch.count, failed, batch_elapsed(&start));
+
+	ret = (failed > 0);
+
+finish:
+	for (i = 0; i < batch.count; i++) {
+		free(batch.jobs[i].musicfile);
+		free(batch.jobs[i].outputfile);
+	}
+	free(batch.jobs);
+
+	return ret;
+}
+
+static int
+batch_add_job(struct batch *batch, const char *musicfile,
+    const char *suffix)
+{
+	struct batch_job *job, *new_jobs;
+	size_t baselen, len, new_size;
+
+	if (batch->count == batch->size) {
+		new_size = (batch->size > 0) ? 2 * batch->size : 64;
+		new_jobs = reallocarray(batch->jobs, new_size,
+		    sizeof(struct batch_job));
+		if (new_jobs == NULL) {
+			warn("reallocarray in batch_add_job");
+			return 1;
+		}
+		batch->jobs = new_jobs;
+		batch->size = new_size;
+	}
+
+	len = strlen(musicfile);
+	baselen = len;
+	if (len > strlen(MUSICFILE_SUFFIX) && strcmp(musicfile + len -
+	    strlen(MUSICFILE_SUFFIX), MUSICFILE_SUFFIX) == 0)
+		baselen -= strlen(MUSICFILE_SUFFIX);
+
+	job = &batch->jobs[ batch->count ];
+	job->pid = -1;
+
+	if ((job->musicfile = strdup(musicfile)) == NULL) {
+		warn("strdup in batch_add_job");
+		return 1;
+	}
+	if (asprintf(&job->outputfile, "%.*s.%s", (int)baselen, musicfile,
+	    suffix) == -1) {
+		warn("asprintf in batch_add_job");
+		free(job->musicfile);
+		return 1;
+	}
+
+	/* Saving the output would replace the music file. */
+	if (strcmp(job->outputfile, job->musicfile) == 0) {
+		warnx("output file for %s is the file itself", musicfile);
+		free(job->musicfile);
+		free(job->outputfile);
+		return 1;
+	}
+
+	batch->count++;
+
+	return 0;
+}
+
+/* Add path, or the music files in it if it is a directory. */
+static int
+batch_add_path(struct batch *batch, const char *path, const char *suffix)
+{
+	struct dirent **entries;
+	struct stat sb;
+	char *musicfile;
+	int count, i, ret;
+
+	if (stat(path, &sb) == -1) {
+		warn("could not stat %s", path);
+		return 1;
+	}
+
+	if (!S_ISDIR(sb.st_mode))
+		return batch_add_job(batch, path, suffix);
+
+	if ((count = scandir(path, &entries, batch_musicfile_filter,
+	    alphasort)) == -1) {
+		warn("could not read directory %s", path);
+		return 1;
+	}
+
+	ret = 0;
+	for (i = 0; i < count; i++) {
+		if (ret == 0) {
+			if (asprintf(&musicfile, "%s/%s", path,
+			    entries[i]->d_name) == -1) {
+				warn("asprintf in batch_add_path");
+				ret = 1;
+			} else {
+				ret = batch_add_job(batch, musicfile, suffix);
+				free(musicfile);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+
+	return ret;
+}
+
+static double
+batch_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	int ret;
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &now);
+	assert(ret == 0);
+
+	return (now.tv_sec - start->tv_sec) +
+	    (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+batch_musicfile_filter(const struct dirent *entry)
+{
+	size_t len;
+
+	len = strlen(entry->d_name);
+
+	return (len > strlen(MUSICFILE_SUFFIX) &&
+	    strcmp(entry->d_name + len - strlen(MUSICFILE_SUFFIX),
+	    MUSICFILE_SUFFIX) == 0 && entry->d_name[0] != '.');
+}
+
+/*
+ * Compile a music file in this process and save it as a score file that
+ * can be played with the -p option, or as a Standard MIDI File if the
+ * name of the output file suggests that.  Music is not played, so this is
+ * as fast as compiling is.
+ */
+static int
+compile_to_file(const char *outputpath, char **musicfilepaths,
+    size_t musicfilecount)
+{
+	struct musicfiles musicfiles;
+	struct mdl_compiled song;
+	int ret;
+
+	if (musicfilecount > 1) {
+		warnx("only one music file can be compiled to a file");
+		return 1;
+	}
+
+	if (pledge("cpath fattr rpath stdio wpath", NULL) == -1)
+		err(1, "pledge");
+
+	if (open_musicfiles(&musicfiles, musicfilepaths, musicfilecount)
+	    != 0) {
+		warnx("error in opening musicfiles");
+		return 1;
+	}
+
+	ret = _mdl_compile_fd(mdl_ctx, musicfiles.files[0].fd, &song);
+	if (close(musicfiles.files[0].fd) == -1)
+		warn("closing musicfile %s", musicfiles.files[0].path);
+
+	print_diagnostics(song.diagnostics);
+
+	if (ret != 0) {
+		warnx("could not compile %s", musicfiles.files[0].path);
+	} else {
+		if (has_midifile_suffix(outputpath)) {
+			ret = _mdl_smf_save(outputpath, song.events,
+			    song.eventcount);
+		} else {
+			ret = _mdl_score_save(outputpath, song.events,
+			    song.eventcount);
+		}
+		if (ret != 0)
+			warnx("could not save music to %s", outputpath);
+	}
+
+	_mdl_compiled_free(&song);
+	free(musicfiles.files);
+
+	return ret;
+}
+
+/*
+ * Play musicfiles without any subprocesses: music is compiled in the main
+ * thread and handed over by pointer to a sequencer thread.  With
+ * play_scores, musicfiles are score files that are mapped into memory
+ * instead, and played from start_position.
+ */
+static int
+play_musicfiles_in_threads(enum mididev_type mididev_type, char *devicepath,
+    int dry_run, int play_scores, float start_position,
+    char **musicfilepaths, size_t musicfilecount)
+{
+	struct seqthread seqthread;
+	struct musicfiles musicfiles;
+	struct mdl_compiled *song;
+	struct mdl_ctx *interp_ctx;
+	size_t i;
+	int ret, retvalue;
+
+	retvalue = 0;
+
+	if ((interp_ctx = _mdl_ctx_clone(mdl_ctx, "interp")) == NULL) {
+		warnx("could not create interpreter context");
+		return 1;
+	}
+
+	ret = _mdl_seqthread_start(mdl_ctx, &seqthread, mididev_type,
+	    devicepath, dry_run);
+	if (ret != 0) {
+		warnx("error in starting up sequencer thread");
+		_mdl_ctx_free(interp_ctx);
+		return 1;
+	}
+
+	/* Sequencer has opened the midi device, we can drop sndio pledges. */
+	if (pledge("rpath stdio", NULL) == -1)
+		err(1, "pledge");
+
+	ret = open_musicfiles(&musicfiles, musicfilepaths, musicfilecount);
+	if (ret != 0) {
+		warnx("error in opening musicfiles");
+		retvalue = 1;
+		goto finish;
+	}
+
+	if (pledge("stdio", NULL) == -1)
+		err(1, "pledge");
+
+	signal(SIGINT,  mdl_handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, mdl_handle_signal);
+
+	for (i = 0; i < musicfiles.count; i++) {
+		if (mdl_shutdown_client)
+			break;
+
+		_mdl_log(MDLLOG_SONG, 0, "starting to play %s\n",
+		    musicfiles.files[i].path);
+
+		if ((song = malloc(sizeof(struct mdl_compiled))) == NULL) {
+			warn("malloc");
+			retvalue = 1;
+			break;
+		}
+
+		if (play_scores) {
+			ret = _mdl_score_load(musicfiles.files[i].fd,
+			    start_position, song);
+		} else {
+			ret = _mdl_compile_fd(interp_ctx,
+			    musicfiles.files[i].fd, song);
+		}
+		if (close(musicfiles.files[i].fd) == -1)
+			warn("closing musicfile %s", musicfiles.files[i].path);
+		musicfiles.files[i].fd = -1;
+
+		print_diagnostics(song->diagnostics);
+
+		if (ret != 0) {
+			warnx("could not %s %s",
+			    (play_scores ? "load score" : "compile"),
+			    musicfiles.files[i].path);
+			_mdl_compiled_free(song);
+			free(song);
+			continue;
+		}
+
+		if (_mdl_seqthread_play(&seqthread, song) != 0 ||
+		    _mdl_seqthread_wait_song_end(&seqthread,
+		    &mdl_shutdown_client) != 0) {
+			warnx("error in sequencer thread");
+			retvalue = 1;
+			break;
+		}
+
+		_mdl_log(MDLLOG_SONG, 0, "finished playing %s\n",
+		    musicfiles.files[i].path);
+	}
+
+	for (i = 0; i < musicfiles.count; i++) {
+		if (musicfiles.files[i].fd == -1)
+			continue;
+		if (close(musicfiles.files[i].fd) == -1)
+			warn("error closing %s", musicfiles.files[i].path);
+	}
+	free(musicfiles.files);
+
+finish:
+	if (_mdl_seqthread_stop(&seqthread) != 0) {
+		warnx("error when stopping sequencer thread");
+		retvalue = 1;
+	}
+
+	_mdl_ctx_free(interp_ctx);
+
+	return retvalue;
+}
+
+static int
+has_midifile_suffix(const char *path)
+{
+	const char *suffix;
+
+	if ((suffix = strrchr(path, '.')) == NULL)
+		return 0;
+
+	return (strcasecmp(suffix, ".mid") == 0 ||
+	    strcasecmp(suffix, ".midi") == 0);
+}
+
+static void
+print_diagnostics(char *diagnostics)
+{
+	char *line, *next_line;
+
+	for (line = diagnostics; line != NULL && *line != '\0';
+	    line = next_line) {
+		if ((next_line = strchr(line, '\n')) != NULL)
+			*next_line++ = '\0';
+		warnx("%s", line);
+	}
+}
+
 static int
 establish_sequencer_connection(struct server_connection *server_conn,
     struct sequencer_connection *seq_conn)
@@ -392,10 +1075,12 @@ open_musicfiles(struct musicfiles *musicfiles, char **musicfilepaths,
 		tmp_musicfiles.count += 1;
 	}
 
-	musicfiles->all_done = 0;
-	musicfiles->count    = tmp_musicfiles.count;
-	musicfiles->current  = 0;
-	musicfiles->files    = tmp_musicfiles.files;
+	musicfiles->all_done    = 0;
+	musicfiles->count       = tmp_musicfiles.count;
+	musicfiles->current     = 0;
+	musicfiles->files       = tmp_musicfiles.files;
+	musicfiles->interpreted = 0;
+	musicfiles->piped       = 0;
 
 	return 0;
 
@@ -443,6 +1128,7 @@ handle_musicfiles(struct server_connection *server_conn,
 		}
 	}
 
+	signal(SIGCHLD, mdl_handle_signal);
 	signal(SIGINT,  mdl_handle_signal);
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGTERM, mdl_handle_signal);
@@ -530,7 +1216,7 @@ handle_musicfiles(struct server_connection *server_conn,
 
 			if (FD_ISSET(server_conn->socket, &readfds)) {
 				ret = handle_server_events(server_conn,
-				    seq_conn);
+				    seq_conn, musicfiles);
 				if (ret != 0) {
 					warnx("error handling server events");
 					retvalue = 1;
@@ -574,8 +1260,15 @@ handle_musicfiles(struct server_connection *server_conn,
 			warn("waiting for interpreter");
 	}
 
-	if (server_conn != NULL)
+	if (server_conn != NULL) {
+		/* Server should get the replaced tracks before we go. */
+		if (retvalue == 0 && musicfiles->replaced_tracks != NULL &&
+		    imsg_flush(&server_conn->ibuf) == -1) {
+			warnx("error in sending tracks to server");
+			retvalue = 1;
+		}
 		imsg_clear(&server_conn->ibuf);
+	}
 
 	return retvalue;
 }
@@ -584,6 +1277,8 @@ static int
 mdl_handle_interpreter_process(struct interpreter_handler *interp,
     struct sequencer_connection *seq_conn, struct musicfiles *musicfiles)
 {
+	struct musicfile *mf;
+	enum mdl_event event;
 	int ret, status;
 	pid_t pid;
 
@@ -602,23 +1297,40 @@ mdl_handle_interpreter_process(struct interpreter_handler *interp,
 		interp->is_active = 0;
 	}
 
-	if (interp->is_active || interp->next_musicfile_fd == -1)
+	if (interp->is_active)
+		return 0;
+
+	/*
+	 * Interpret the song after the current one while the current one
+	 * is playing, so that sequencer can switch to it without a gap.
+	 */
+	if (interp->next_musicfile_fd == -1 &&
+	    musicfiles->interpreted == musicfiles->current + 1 &&
+	    musicfiles->interpreted < musicfiles->count) {
+		interp->next_musicfile_fd =
+		    musicfiles->files[ musicfiles->interpreted ].fd;
+	}
+
+	if (interp->next_musicfile_fd == -1)
 		return 0;
 
 	/* Start a new interpreter process. */
 
-	ret = _mdl_interpreter_start_process(&interp->process,
+	ret = _mdl_interpreter_start_process(mdl_ctx, &interp->process,
 	    interp->next_musicfile_fd, seq_conn->socket);
 
-	assert(musicfiles->current < musicfiles->count);
-	assert(interp->next_musicfile_fd
-	    == musicfiles->files[ musicfiles->current ].fd);
-	if (close(interp->next_musicfile_fd) == -1) {
-		warn("closing musicfile %s",
-		    musicfiles->files[ musicfiles->current ].path);
-	}
+	assert(musicfiles->interpreted < musicfiles->count);
+	mf = &musicfiles->files[ musicfiles->interpreted ];
+	assert(interp->next_musicfile_fd == mf->fd);
+	if (close(interp->next_musicfile_fd) == -1)
+		warn("closing musicfile %s", mf->path);
 	interp->next_musicfile_fd = -1;
-	musicfiles->files[ musicfiles->current ].fd = -1;
+	mf->fd = -1;
+
+	event = (musicfiles->interpreted == musicfiles->current)
+	    ? CLIENTEVENT_NEW_SONG
+	    : CLIENTEVENT_QUEUE_SONG;
+	musicfiles->interpreted += 1;
 
 	if (ret != 0) {
 		warnx("could not start interpreter process");
@@ -629,8 +1341,16 @@ mdl_handle_interpreter_process(struct interpreter_handler *interp,
 
 	_mdl_log(MDLLOG_IPC, 0, "sending interpreter pipe to sequencer\n");
 
-	ret = imsg_compose(&seq_conn->ibuf, CLIENTEVENT_NEW_SONG, 0, 0,
-	    interp->process.sequencer_read_pipe, "", 0);
+	/* Sequencer switches songs immediately when given no boundary. */
+	if (event == CLIENTEVENT_NEW_SONG &&
+	    musicfiles->song_switch != SONG_SWITCH_NOW) {
+		ret = imsg_compose(&seq_conn->ibuf, event, 0, 0,
+		    interp->process.sequencer_read_pipe,
+		    &musicfiles->song_switch, sizeof(enum song_switch));
+	} else {
+		ret = imsg_compose(&seq_conn->ibuf, event, 0, 0,
+		    interp->process.sequencer_read_pipe, "", 0);
+	}
 	if (ret == -1) {
 		warnx("sending interpreter pipe to sequencer");
 		return 1;
@@ -678,7 +1398,12 @@ mdl_handle_sequencer_events(struct server_connection *server_conn,
 		switch (event) {
 		case CLIENTEVENT_NEW_MUSICFD:
 		case CLIENTEVENT_NEW_SONG:
+		case CLIENTEVENT_QUEUE_SONG:
 		case CLIENTEVENT_REPLACE_SONG:
+		case CLIENTEVENT_REPLACE_TRACKS:
+		case CLIENTEVENT_MUTE_TRACK:
+		case CLIENTEVENT_SOLO_TRACK:
+		case CLIENTEVENT_UNMUTE_TRACK:
 			warnx("received a client event on client from"
 			    " sequencer, this should not happen");
 			retvalue = 1;
@@ -692,6 +1417,11 @@ mdl_handle_sequencer_events(struct server_connection *server_conn,
 				retvalue = 1;
 			}
 			break;
+		case SEQEVENT_SONG_TRACKS:
+			warnx("received song tracks on client from"
+			    " sequencer, this should not happen");
+			retvalue = 1;
+			break;
 		case SERVEREVENT_NEW_CLIENT:
 		case SERVEREVENT_NEW_INTERPRETER:
 			warnx("received a server event on client from"
@@ -719,7 +1449,6 @@ enqueue_song(struct server_connection *server_conn,
     int enqueue_next)
 {
 	struct musicfile *mf;
-	int ret;
 
 	if (enqueue_next)
 		musicfiles->current += 1;
@@ -733,16 +1462,16 @@ enqueue_song(struct server_connection *server_conn,
 
 	_mdl_log(MDLLOG_SONG, 0, "starting to play %s\n", mf->path);
 
-	if (server_conn != NULL) {
-		ret = imsg_compose(&server_conn->ibuf,
-		    CLIENTEVENT_NEW_MUSICFD, 0, 0, mf->fd, "", 0);
-		if (ret == -1) {
-			warnx("error sending a music file descriptor"
-			    " to server");
-			return 1;
-		}
-		server_conn->pending_writes = 1;
-		mf->fd = -1;
+	if (server_conn != NULL &&
+	    musicfiles->current < musicfiles->interpreted) {
+		/* Song has been sent ahead and queued to sequencer. */
+		return queue_next_musicfile(server_conn, musicfiles);
+	} else if (server_conn != NULL) {
+		assert(musicfiles->current == musicfiles->interpreted);
+		return send_musicfile(server_conn, musicfiles,
+		    CLIENTEVENT_NEW_MUSICFD);
+	} else if (musicfiles->current < musicfiles->interpreted) {
+		/* Song has been interpreted ahead and queued to sequencer. */
 	} else {
 		if (interp->next_musicfile_fd >= 0 &&
 		    close(interp->next_musicfile_fd) == -1)
@@ -755,7 +1484,7 @@ enqueue_song(struct server_connection *server_conn,
 
 static int
 handle_server_events(struct server_connection *server_conn,
-    struct sequencer_connection *seq_conn)
+    struct sequencer_connection *seq_conn, struct musicfiles *musicfiles)
 {
 	struct imsg imsg;
 	enum mdl_event event;
@@ -782,12 +1511,18 @@ handle_server_events(struct server_connection *server_conn,
 		switch (event) {
 		case CLIENTEVENT_NEW_MUSICFD:
 		case CLIENTEVENT_NEW_SONG:
+		case CLIENTEVENT_QUEUE_SONG:
 		case CLIENTEVENT_REPLACE_SONG:
+		case CLIENTEVENT_REPLACE_TRACKS:
+		case CLIENTEVENT_MUTE_TRACK:
+		case CLIENTEVENT_SOLO_TRACK:
+		case CLIENTEVENT_UNMUTE_TRACK:
 			warnx("received a client event on client from"
 			    " server, this should not happen");
 			retvalue = 1;
 			break;
 		case SEQEVENT_SONG_END:
+		case SEQEVENT_SONG_TRACKS:
 			warnx("received a sequencer event on client from"
 			    " server, this should not happen");
 			retvalue = 1;
@@ -807,8 +1542,34 @@ handle_server_events(struct server_connection *server_conn,
 			    " (for sequencer) from server\n");
 			_mdl_log(MDLLOG_IPC, 0, "sending interpreter pipe to"
 			    " server\n");
-			ret = imsg_compose(&seq_conn->ibuf,
-			    CLIENTEVENT_NEW_SONG, 0, 0, imsg.fd, "", 0);
+			if (musicfiles->replaced_tracks != NULL) {
+				/*
+				 * This goes back through server, as this
+				 * client was not given to sequencer.
+				 */
+				ret = imsg_compose(&server_conn->ibuf,
+				    CLIENTEVENT_REPLACE_TRACKS, 0, 0, imsg.fd,
+				    musicfiles->replaced_tracks,
+				    musicfiles->replaced_tracks_size);
+				server_conn->pending_writes = 1;
+				/* The song that is playing goes on. */
+				musicfiles->all_done = 1;
+			} else if (musicfiles->piped > musicfiles->current) {
+				/* Interpreted ahead, to play after current. */
+				ret = imsg_compose(&seq_conn->ibuf,
+				    CLIENTEVENT_QUEUE_SONG, 0, 0, imsg.fd, "",
+				    0);
+			} else if (musicfiles->song_switch !=
+			    SONG_SWITCH_NOW) {
+				ret = imsg_compose(&seq_conn->ibuf,
+				    CLIENTEVENT_NEW_SONG, 0, 0, imsg.fd,
+				    &musicfiles->song_switch,
+				    sizeof(enum song_switch));
+			} else {
+				ret = imsg_compose(&seq_conn->ibuf,
+				    CLIENTEVENT_NEW_SONG, 0, 0, imsg.fd, "",
+				    0);
+			}
 			if (ret == -1) {
 				warnx("could not send interpreter pipe to"
 				    " sequencer");
@@ -817,6 +1578,10 @@ handle_server_events(struct server_connection *server_conn,
 				retvalue = 1;
 			}
 			seq_conn->pending_writes = 1;
+			musicfiles->piped += 1;
+			if (retvalue == 0 &&
+			    queue_next_musicfile(server_conn, musicfiles) != 0)
+				retvalue = 1;
 			break;
 		default:
 			warnx("received an unknown event from server");
@@ -831,6 +1596,52 @@ handle_server_events(struct server_connection *server_conn,
 	return retvalue;
 }
 
+/*
+ * Send the music file after the current one to server once the current
+ * one has been passed to sequencer, so that it is interpreted while the
+ * current one plays and sequencer can switch to it without a gap.
+ */
+static int
+queue_next_musicfile(struct server_connection *server_conn,
+    struct musicfiles *musicfiles)
+{
+	if (musicfiles->replaced_tracks != NULL ||
+	    musicfiles->interpreted != musicfiles->current + 1 ||
+	    musicfiles->interpreted >= musicfiles->count ||
+	    musicfiles->piped < musicfiles->interpreted)
+		return 0;
+
+	return send_musicfile(server_conn, musicfiles, CLIENTEVENT_QUEUE_SONG);
+}
+
+/*
+ * Send the next music file that has not been sent to server, with event
+ * CLIENTEVENT_NEW_MUSICFD to play it now, or CLIENTEVENT_QUEUE_SONG to
+ * play it after the current one.
+ */
+static int
+send_musicfile(struct server_connection *server_conn,
+    struct musicfiles *musicfiles, enum mdl_event event)
+{
+	struct musicfile *mf;
+	int ret;
+
+	assert(musicfiles->interpreted < musicfiles->count);
+	mf = &musicfiles->files[ musicfiles->interpreted ];
+
+	ret = imsg_compose(&server_conn->ibuf, event, 0, 0, mf->fd,
+	    musicfiles->replaced_tracks, musicfiles->replaced_tracks_size);
+	if (ret == -1) {
+		warnx("error sending a music file descriptor to server");
+		return 1;
+	}
+	server_conn->pending_writes = 1;
+	mf->fd = -1;
+	musicfiles->interpreted += 1;
+
+	return 0;
+}
+
 static int
 replace_server_with_client_conn(struct sequencer_connection *seq_conn)
 {
@@ -865,3 +1676,75 @@ replace_server_with_client_conn(struct sequencer_connection *seq_conn)
 
 	return 0;
 }
+
+/*
+ * Send track commands to sequencer, on a blocking sequencer or server
+ * connection before any songs, so that they apply to those as well.
+ */
+static int
+send_trackcommands(struct imsgbuf *ibuf,
+    const struct trackcommand *trackcommands, size_t count)
+{
+	size_t i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		_mdl_log(MDLLOG_IPC, 0, "sending track command for \"%s\""
+		    " to sequencer\n", trackcommands[i].track);
+		ret = imsg_compose(ibuf, trackcommands[i].event,
+		    0, 0, -1, trackcommands[i].track,
+		    strlen(trackcommands[i].track) + 1);
+		if (ret == -1) {
+			warnx("error composing a track command");
+			return 1;
+		}
+	}
+
+	if (imsg_flush(ibuf) == -1) {
+		warnx("error sending track commands to sequencer");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Add name to the tracks that the music file replaces, unless it is
+ * there already.  All names must fit in one message.
+ */
+static int
+add_replaced_track(struct musicfiles *musicfiles, const char *name)
+{
+	const char *p, *end;
+	char *names;
+	size_t len, size;
+
+	len = strlen(name);
+	if (len == 0 || len > MIDIPACK_TRACKNAME_MAX) {
+		warnx("invalid track name: %s", name);
+		return 1;
+	}
+
+	size = musicfiles->replaced_tracks_size;
+	end = musicfiles->replaced_tracks + size;
+	for (p = musicfiles->replaced_tracks; p < end; p += strlen(p) + 1)
+		if (strcmp(p, name) == 0)
+			return 0;
+
+	if (size + len + 1 > MAX_IMSGSIZE - IMSG_HEADER_SIZE - sizeof(int)) {
+		warnx("too many tracks to replace");
+		return 1;
+	}
+
+	if ((names = realloc(musicfiles->replaced_tracks,
+	    size + len + 1)) == NULL) {
+		warn("realloc in add_replaced_track");
+		return 1;
+	}
+
+	memcpy(names + size, name, len + 1);
+	musicfiles->replaced_tracks = names;
+	musicfiles->replaced_tracks_size = size + len + 1;
+
+	return 0;
+}
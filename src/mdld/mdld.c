@@ -37,38 +37,123 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "context.h"
 #include "interpreter.h"
 #include "ipc.h"
 #include "midi.h"
+#include "midipack.h"
 #include "sequencer.h"
+#include "streamcache.h"
 #include "util.h"
 
+/*
+ * seq_socket is the sequencer end of the client <-> sequencer connection,
+ * passed to sequencer when the client sends its first music file, so
+ * that clients which only send track commands do not take the place of
+ * the client that plays music.
+ */
 struct client_connection {
 	TAILQ_ENTRY(client_connection)	tq;
 	struct imsgbuf			ibuf;
 	int				pending_writes;
+	int				seq_socket;
 	int				socket;
 };
 
 TAILQ_HEAD(clientlist, client_connection);
 
+/* How many forked interpreters wait for music files. */
+#define WARM_INTERPRETERS	2
+
+/* Memory for music sources and midi streams compiled from them. */
+#define STREAMCACHE_SIZE	(64 * 1024 * 1024)
+
+/*
+ * If source is set, the interpreter returns its midi stream through
+ * process.control_socket, and the stream is cached once it is complete.
+ */
+struct interpreter_worker {
+	TAILQ_ENTRY(interpreter_worker)	tq;
+	struct interpreter_process	process;
+	char			       *source;
+	size_t				source_size;
+	char			       *stream;
+	size_t				stream_size;
+	size_t				stream_bufsize;
+	int				exited;
+	int				terminated;
+};
+
+TAILQ_HEAD(workerlist, interpreter_worker);
+
+/*
+ * Writes a cached midi stream to a pipe that goes to sequencer, or a
+ * patch of it if patch is not NULL.
+ */
+struct stream_writer {
+	TAILQ_ENTRY(stream_writer)	tq;
+	struct streamcache_entry       *entry;
+	u_int8_t		       *patch;
+	size_t				patch_size;
+	size_t				offset;
+	int				fd;
+};
+
+TAILQ_HEAD(writerlist, stream_writer);
+
+/*
+ * Interpreters in "idle" have been forked and wait for a music file,
+ * those in "busy" are interpreting or finishing.  song_tracks has the
+ * tracks of the song that sequencer plays (from SEQEVENT_SONG_TRACKS),
+ * and new songs are sent to sequencer as patches against them.
+ */
+struct interpreter_pool {
+	struct workerlist		idle;
+	struct workerlist		busy;
+	size_t				idle_count;
+	struct sequencer_connection    *seq_conn;
+	struct streamcache		cache;
+	struct writerlist		writers;
+	u_int8_t		       *song_tracks;
+	size_t				song_tracks_size;
+};
+
 #ifdef HAVE_MALLOC_OPTIONS
 extern char	*malloc_options;
 #endif /* HAVE_MALLOC_OPTIONS */
 
 static int	setup_socketdir(const char *);
 static int	accept_new_client_connection(struct client_connection **,
-    struct sequencer_connection *, int);
-static void	drop_client(struct client_connection *, struct clientlist *,
-    struct interpreter_handler *);
+    int);
+static void	drop_client(struct client_connection *, struct clientlist *);
+static void	drop_stream_writer(struct interpreter_pool *,
+    struct stream_writer *);
+static int	fill_interpreter_pool(struct interpreter_pool *);
+static void	finish_interpreter_stream(struct interpreter_pool *,
+    struct interpreter_worker *, int);
+static void	free_interpreter_pool(struct interpreter_pool *);
+static void	handle_stream_io(struct interpreter_pool *, fd_set *,
+    fd_set *);
+static char    *read_musicfile_source(int, size_t *);
+static void	read_interpreter_stream(struct interpreter_pool *,
+    struct interpreter_worker *);
+static int	send_cached_stream(struct client_connection *,
+    struct interpreter_pool *, struct streamcache_entry *, int);
+static void	write_cached_stream(struct interpreter_pool *,
+    struct stream_writer *);
 static int	handle_client_events(struct client_connection *,
-    struct interpreter_handler *, struct clientlist *);
+    struct interpreter_pool *, struct clientlist *);
 static int	handle_musicfd_event(struct client_connection *,
-    struct interpreter_handler *, int);
-static int	handle_connections(struct sequencer_connection *, int);
-static int	mdld_handle_interpreter_process(struct interpreter_handler *,
+    struct interpreter_pool *, int, const char *, size_t, int);
+static int	handle_replace_tracks_event(struct sequencer_connection *,
+    int, const char *, size_t);
+static int	handle_trackmode_event(struct sequencer_connection *,
+    enum mdl_event, const char *, size_t);
+static int	pass_client_to_sequencer(struct client_connection *,
     struct sequencer_connection *);
-static int	mdld_handle_sequencer_events(struct sequencer_connection *);
+static int	handle_connections(struct sequencer_connection *, int);
+static int	mdld_handle_interpreter_processes(struct interpreter_pool *);
+static int	mdld_handle_sequencer_events(struct interpreter_pool *);
 static void	mdld_handle_signal(int);
 static int	setup_server_socket(const char *);
 
@@ -79,7 +164,7 @@ volatile sig_atomic_t mdld_shutdown_server = 0;
 
 extern int loglevel;
 
-char *_mdl_process_type;
+static struct mdl_ctx *mdld_ctx;
 
 static void __dead
 mdld_usage(void)
@@ -112,8 +197,6 @@ main(int argc, char *argv[])
 	malloc_options = (char *) "AFGJPS";
 #endif /* HAVE_MALLOC_OPTIONS */
 
-	_mdl_process_type = "server";
-
 	devicepath = NULL;
 	exitstatus = 0;
 	mididev_type = DEFAULT_MIDIDEV_TYPE;
@@ -126,12 +209,15 @@ main(int argc, char *argv[])
 	    NULL) == -1)
 		err(1, "pledge");
 
-	_mdl_logging_init();
+	if ((mdld_ctx = _mdl_ctx_new("server")) == NULL)
+		errx(1, "could not create library context");
+	if (_mdl_ctx_set(mdld_ctx) != 0)
+		errx(1, "could not set library context");
 
 	while ((ch = getopt(argc, argv, "d:f:m:v")) != -1) {
 		switch (ch) {
 		case 'd':
-			if (_mdl_logging_setopts(optarg) == -1)
+			if (_mdl_logging_setopts(mdld_ctx, optarg) == -1)
 				errx(1, "error in setting logging opts");
 			break;
 		case 'f':
@@ -174,8 +260,8 @@ main(int argc, char *argv[])
 		goto finish;
 	}
 
-	ret = _mdl_start_sequencer_process(&sequencer_pid, &seq_conn,
-	    mididev_type, devicepath, 0);
+	ret = _mdl_start_sequencer_process(mdld_ctx, &sequencer_pid,
+	    &seq_conn, mididev_type, devicepath, 0);
 	if (ret != 0) {
 		warnx("error in starting up sequencer");
 		exitstatus = 1;
@@ -212,7 +298,7 @@ finish:
 			warnx("error in disconnecting to sequencer process");
 	}
 
-	_mdl_logging_close();
+	_mdl_ctx_free(mdld_ctx);
 
 	return exitstatus;
 }
@@ -273,16 +359,23 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 {
 	struct client_connection *client_conn, *cc_tmp;
 	struct clientlist clients;
-	struct interpreter_handler interp;
+	struct interpreter_pool pool;
+	struct interpreter_worker *worker;
+	struct stream_writer *writer;
 	fd_set readfds, writefds;
 	sigset_t loop_sigmask, select_sigmask;
-	int ret, retvalue, status;
+	int pending_writes, ret, retvalue;
 
 	retvalue = 0;
 
-	interp.client_conn = NULL;
-	interp.is_active = 0;
-	interp.next_musicfile_fd = -1;
+	TAILQ_INIT(&pool.idle);
+	TAILQ_INIT(&pool.busy);
+	pool.idle_count = 0;
+	pool.seq_conn = seq_conn;
+	_mdl_streamcache_init(&pool.cache, STREAMCACHE_SIZE);
+	TAILQ_INIT(&pool.writers);
+	pool.song_tracks = NULL;
+	pool.song_tracks_size = 0;
 
 	TAILQ_INIT(&clients);
 
@@ -309,8 +402,8 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 		if (mdld_shutdown_server)
 			break;
 
-		if (mdld_handle_interpreter_process(&interp, seq_conn) != 0) {
-			warnx("error handling interpreter process");
+		if (mdld_handle_interpreter_processes(&pool) != 0) {
+			warnx("error handling interpreter processes");
 			retvalue = 1;
 			break;
 
@@ -321,13 +414,42 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 		FD_SET(server_socket, &readfds);
 		FD_SET(seq_conn->socket, &readfds);
 
+		pending_writes = seq_conn->pending_writes;
 		if (seq_conn->pending_writes)
 			FD_SET(seq_conn->socket, &writefds);
 
 		TAILQ_FOREACH(client_conn, &clients, tq) {
 			FD_SET(client_conn->socket, &readfds);
-			if (client_conn->pending_writes)
+			if (client_conn->pending_writes) {
 				FD_SET(client_conn->socket, &writefds);
+				pending_writes = 1;
+			}
+		}
+
+		TAILQ_FOREACH(worker, &pool.busy, tq) {
+			if (worker->process.control_socket >= 0)
+				FD_SET(worker->process.control_socket,
+				    &readfds);
+		}
+
+		TAILQ_FOREACH(writer, &pool.writers, tq) {
+			FD_SET(writer->fd, &writefds);
+			pending_writes = 1;
+		}
+
+		/*
+		 * Fork new interpreters only when there is nothing to send,
+		 * so that a music file that was just passed to an interpreter
+		 * does not have to wait for this.  This also keeps
+		 * descriptors in write queues and stream pipes (which must
+		 * get closed for sequencer to see the stream end) away from
+		 * new interpreters.
+		 */
+		if (!pending_writes &&
+		    fill_interpreter_pool(&pool) != 0) {
+			warnx("error in starting new interpreters");
+			retvalue = 1;
+			break;
 		}
 
 		ret = pselect(FD_SETSIZE, &readfds, &writefds, NULL, NULL,
@@ -340,10 +462,12 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 			break;
 		}
 
+		handle_stream_io(&pool, &readfds, &writefds);
+
 		/* Handle sequencer connection. */
 
 		if (FD_ISSET(seq_conn->socket, &readfds)) {
-			ret = mdld_handle_sequencer_events(seq_conn);
+			ret = mdld_handle_sequencer_events(&pool);
 			if (ret != 0) {
 				warnx("error handling sequencer events");
 				retvalue = 1;
@@ -369,7 +493,7 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 		TAILQ_FOREACH_SAFE(client_conn, &clients, tq, cc_tmp) {
 			if (FD_ISSET(client_conn->socket, &readfds)) {
 				ret = handle_client_events(client_conn,
-				    &interp, &clients);
+				    &pool, &clients);
 				if (ret != 0)
 					warnx("error handling client events");
 				/*
@@ -385,8 +509,7 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 						continue;
 					warnx("error in sending messages to"
 					    " client, dropping client");
-					drop_client(client_conn, &clients,
-					    &interp);
+					drop_client(client_conn, &clients);
 				} else {
 					client_conn->pending_writes = 0;
 				}
@@ -397,7 +520,7 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 
 		if (FD_ISSET(server_socket, &readfds)) {
 			ret = accept_new_client_connection(&client_conn,
-			    seq_conn, server_socket);
+			    server_socket);
 			if (ret != 0) {
 				warnx("error in accepting new client");
 				continue;
@@ -408,104 +531,452 @@ handle_connections(struct sequencer_connection *seq_conn, int server_socket)
 
 	/* Drop all clients. */
 	TAILQ_FOREACH_SAFE(client_conn, &clients, tq, cc_tmp)
-		drop_client(client_conn, &clients, &interp);
-
-	/* Exit the interpreter process. */
+		drop_client(client_conn, &clients);
 
-	if (interp.next_musicfile_fd >= 0 &&
-	    close(interp.next_musicfile_fd) == -1)
-		warn("closing next musicfile descriptor");
-
-	if (interp.is_active) {
-		if (kill(interp.process.pid, SIGTERM) == -1) {
-			warn("error killing the current interpreter");
-		} else {
-			_mdl_log(MDLLOG_IPC, 0,
-			    "sent SIGTERM to interpreter process\n");
-			if (waitpid(interp.process.pid, &status, 0) == -1)
-				warn("waiting for interpreter");
-		}
-	}
+	/* Exit the interpreter processes. */
+	free_interpreter_pool(&pool);
 
 	return retvalue;
 }
 
 static int
-mdld_handle_interpreter_process(struct interpreter_handler *interp,
-    struct sequencer_connection *seq_conn)
+mdld_handle_interpreter_processes(struct interpreter_pool *pool)
 {
-	int ret, status;
+	struct interpreter_worker *worker, *tmp_worker;
+	int status;
 	pid_t pid;
 
-	if (interp->is_active) {
-		pid = waitpid(interp->process.pid, &status, WNOHANG);
+	TAILQ_FOREACH_SAFE(worker, &pool->busy, tq, tmp_worker) {
+		if (!worker->exited) {
+			pid = waitpid(worker->process.pid, &status, WNOHANG);
+			if (pid == -1) {
+				warn("waiting for interpreter process");
+				return 1;
+			}
+			if (pid == 0)
+				continue;
+
+			_mdl_log(MDLLOG_IPC, 0,
+			    "interpreter (pid %d) has finished\n",
+			    worker->process.pid);
+			worker->exited = 1;
+		}
+
+		/* The returned midi stream may still be unread. */
+		if (worker->process.control_socket >= 0)
+			continue;
+
+		TAILQ_REMOVE(&pool->busy, worker, tq);
+		free(worker);
+	}
+
+	/* Idle interpreters should not exit, but in case they do... */
+	TAILQ_FOREACH_SAFE(worker, &pool->idle, tq, tmp_worker) {
+		pid = waitpid(worker->process.pid, &status, WNOHANG);
 		if (pid == -1) {
 			warn("waiting for interpreter process");
 			return 1;
 		}
 		if (pid == 0)
-			return 0;
+			continue;
+
+		warnx("idle interpreter (pid %d) exited unexpectedly",
+		    worker->process.pid);
+
+		if (close(worker->process.control_socket) == -1)
+			warn("closing interpreter control socket");
+		if (close(worker->process.sequencer_read_pipe) == -1)
+			warn("closing interpreter pipe");
+		TAILQ_REMOVE(&pool->idle, worker, tq);
+		pool->idle_count -= 1;
+		free(worker);
+	}
+
+	return 0;
+}
+
+static int
+fill_interpreter_pool(struct interpreter_pool *pool)
+{
+	struct interpreter_worker *worker;
+	int ret;
 
-		_mdl_log(MDLLOG_IPC, 0, "interpreter (pid %d) has finished\n",
-		    interp->process.pid);
+	while (pool->idle_count < WARM_INTERPRETERS) {
+		worker = malloc(sizeof(struct interpreter_worker));
+		if (worker == NULL) {
+			warn("malloc in fill_interpreter_pool");
+			return 1;
+		}
 
-		interp->is_active = 0;
+		ret = _mdl_interpreter_start_worker(mdld_ctx, &worker->process,
+		    pool->seq_conn->socket);
+		if (ret != 0) {
+			warnx("could not start interpreter process");
+			free(worker);
+			return 1;
+		}
+
+		_mdl_log(MDLLOG_IPC, 0,
+		    "started an idle interpreter (pid %d)\n",
+		    worker->process.pid);
+
+		worker->source = NULL;
+		worker->source_size = 0;
+		worker->stream = NULL;
+		worker->stream_size = 0;
+		worker->stream_bufsize = 0;
+		worker->exited = 0;
+		worker->terminated = 0;
+		TAILQ_INSERT_TAIL(&pool->idle, worker, tq);
+		pool->idle_count += 1;
 	}
 
-	if (interp->is_active || interp->next_musicfile_fd == -1)
-		return 0;
+	return 0;
+}
 
-	if (interp->client_conn == NULL) {
-		/*
-		 * The client connection that requested a new interpreter
-		 * process has been dropped, so nothing to do except close
-		 * the remaining file descriptor.
-		 */
-		if (close(interp->next_musicfile_fd) == -1)
-			warn("closing musicfile descriptor");
-		interp->next_musicfile_fd = -1;
-		return 0;
+static void
+free_interpreter_pool(struct interpreter_pool *pool)
+{
+	struct interpreter_worker *worker;
+	struct stream_writer *writer;
+	int status;
+
+	while ((writer = TAILQ_FIRST(&pool->writers)) != NULL)
+		drop_stream_writer(pool, writer);
+
+	while ((worker = TAILQ_FIRST(&pool->idle)) != NULL) {
+		/* Idle interpreters exit when control socket is closed. */
+		if (close(worker->process.control_socket) == -1)
+			warn("closing interpreter control socket");
+		worker->process.control_socket = -1;
+		if (close(worker->process.sequencer_read_pipe) == -1)
+			warn("closing interpreter pipe");
+		worker->terminated = 1;
+		TAILQ_REMOVE(&pool->idle, worker, tq);
+		TAILQ_INSERT_TAIL(&pool->busy, worker, tq);
+	}
+	pool->idle_count = 0;
+
+	while ((worker = TAILQ_FIRST(&pool->busy)) != NULL) {
+		if (!worker->terminated) {
+			if (kill(worker->process.pid, SIGTERM) == -1 &&
+			    errno != ESRCH) {
+				/* ESRCH is returned for some zombies. */
+				warn("error killing interpreter");
+			} else {
+				_mdl_log(MDLLOG_IPC, 0,
+				    "sent SIGTERM to interpreter process\n");
+			}
+		}
+		if (worker->process.control_socket >= 0)
+			finish_interpreter_stream(pool, worker, 0);
+		if (!worker->exited &&
+		    waitpid(worker->process.pid, &status, 0) == -1)
+			warn("waiting for interpreter");
+		TAILQ_REMOVE(&pool->busy, worker, tq);
+		free(worker);
 	}
 
-	/* Start a new interpreter process. */
+	_mdl_streamcache_free(&pool->cache);
 
-	ret = _mdl_interpreter_start_process(&interp->process,
-	    interp->next_musicfile_fd, seq_conn->socket);
-	if (close(interp->next_musicfile_fd) == -1)
-		warn("closing musicfile descriptor");
-	interp->next_musicfile_fd = -1;
-	if (ret != 0) {
-		warnx("could not start interpreter process");
+	free(pool->song_tracks);
+	pool->song_tracks = NULL;
+	pool->song_tracks_size = 0;
+}
+
+static void
+handle_stream_io(struct interpreter_pool *pool, fd_set *readfds,
+    fd_set *writefds)
+{
+	struct interpreter_worker *worker;
+	struct stream_writer *writer, *tmp_writer;
+
+	TAILQ_FOREACH(worker, &pool->busy, tq) {
+		if (worker->process.control_socket >= 0 &&
+		    FD_ISSET(worker->process.control_socket, readfds))
+			read_interpreter_stream(pool, worker);
+	}
+
+	TAILQ_FOREACH_SAFE(writer, &pool->writers, tq, tmp_writer) {
+		if (FD_ISSET(writer->fd, writefds))
+			write_cached_stream(pool, writer);
+	}
+}
+
+/*
+ * Read music source from fd, if it is a regular file that could be
+ * cached, and leave the file offset where it was.  Returns NULL if the
+ * source should not be cached.
+ */
+static char *
+read_musicfile_source(int fd, size_t *source_size)
+{
+	struct stat sb;
+	char *source;
+	off_t offset;
+	size_t size;
+	ssize_t nr;
+
+	if (fstat(fd, &sb) == -1) {
+		warn("fstat on music file");
+		return NULL;
+	}
+
+	if (!S_ISREG(sb.st_mode) || sb.st_size > STREAMCACHE_SIZE / 2)
+		return NULL;
+
+	if ((offset = lseek(fd, 0, SEEK_CUR)) == -1) {
+		warn("lseek on music file");
+		return NULL;
+	}
+
+	/* Add one byte so that we notice if file has grown. */
+	size = sb.st_size + 1;
+	if ((source = malloc(size)) == NULL) {
+		warn("malloc in read_musicfile_source");
+		return NULL;
+	}
+
+	*source_size = 0;
+	nr = 0;
+	while (*source_size < size) {
+		nr = read(fd, source + *source_size, size - *source_size);
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("reading music file");
+			break;
+		}
+		if (nr == 0)
+			break;
+		*source_size += nr;
+	}
+
+	if (lseek(fd, offset, SEEK_SET) == -1) {
+		warn("lseek on music file");
+		free(source);
+		/* Music file is not useful any more. */
+		return NULL;
+	}
+
+	if (nr == -1 || *source_size == size) {
+		free(source);
+		return NULL;
+	}
+
+	return source;
+}
+
+static void
+read_interpreter_stream(struct interpreter_pool *pool,
+    struct interpreter_worker *worker)
+{
+	char *new_stream;
+	size_t new_bufsize;
+	ssize_t nr;
+
+	if (worker->stream_size == worker->stream_bufsize) {
+		new_bufsize = (worker->stream_bufsize == 0)
+		    ? 64 * MIDIPACK_EVENT_MAXSIZE
+		    : 2 * worker->stream_bufsize;
+		if (new_bufsize > STREAMCACHE_SIZE) {
+			_mdl_log(MDLLOG_CACHE, 0,
+			    "midi stream is too large for cache\n");
+			finish_interpreter_stream(pool, worker, 0);
+			return;
+		}
+		new_stream = realloc(worker->stream, new_bufsize);
+		if (new_stream == NULL) {
+			warn("realloc in read_interpreter_stream");
+			finish_interpreter_stream(pool, worker, 0);
+			return;
+		}
+		worker->stream = new_stream;
+		worker->stream_bufsize = new_bufsize;
+	}
+
+	nr = read(worker->process.control_socket,
+	    worker->stream + worker->stream_size,
+	    worker->stream_bufsize - worker->stream_size);
+	if (nr == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		warn("reading midi stream from interpreter");
+		finish_interpreter_stream(pool, worker, 0);
+		return;
+	}
+
+	if (nr == 0) {
+		finish_interpreter_stream(pool, worker, 1);
+		return;
+	}
+
+	worker->stream_size += nr;
+}
+
+/*
+ * Stop reading the midi stream from interpreter, and if it should be
+ * cached and is complete, put it to cache.
+ */
+static void
+finish_interpreter_stream(struct interpreter_pool *pool,
+    struct interpreter_worker *worker, int cache_it)
+{
+	if (close(worker->process.control_socket) == -1)
+		warn("closing interpreter control socket");
+	worker->process.control_socket = -1;
+
+	/* Interpreter may have been terminated before it finished. */
+	if (!_mdl_midipack_is_complete((u_int8_t *) worker->stream,
+	    worker->stream_size))
+		cache_it = 0;
+
+	if (cache_it) {
+		(void) _mdl_streamcache_insert(&pool->cache, worker->source,
+		    worker->source_size, worker->stream, worker->stream_size);
+	} else {
+		free(worker->source);
+		free(worker->stream);
+	}
+
+	worker->source = NULL;
+	worker->stream = NULL;
+	worker->stream_size = 0;
+	worker->stream_bufsize = 0;
+}
+
+/*
+ * Send a pipe to client (for sequencer) and write a cached stream to it,
+ * as an interpreter would.  A queued song is written whole, as it may be
+ * played after some other song than the one playing now.
+ */
+static int
+send_cached_stream(struct client_connection *client_conn,
+    struct interpreter_pool *pool, struct streamcache_entry *entry,
+    int queued)
+{
+	struct stream_writer *writer;
+	int stream_pipe[2];
+	int ret;
+
+	if ((writer = malloc(sizeof(struct stream_writer))) == NULL) {
+		warn("malloc in send_cached_stream");
+		_mdl_streamcache_release(entry);
+		return 1;
+	}
+	writer->patch = NULL;
+	writer->patch_size = 0;
+
+	if (pipe(stream_pipe) == -1) {
+		warn("could not setup pipe for cached stream");
+		_mdl_streamcache_release(entry);
+		free(writer);
 		return 1;
 	}
 
-	interp->is_active = 1;
+	if (fcntl(stream_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+		warn("could not set cached stream pipe non-blocking");
+		goto error;
+	}
+
+	/* The whole stream does just as well if there is no patch. */
+	if (pool->song_tracks != NULL && !queued)
+		writer->patch = _mdl_midipack_patch(
+		    (const u_int8_t *) entry->stream, entry->stream_size,
+		    pool->song_tracks, pool->song_tracks_size,
+		    &writer->patch_size, 0);
 
 	_mdl_log(MDLLOG_IPC, 0,
-	    "sending interpreter pipe to client (for sequencer)\n");
+	    "sending cached stream pipe to client (for sequencer)\n");
 
-	ret = imsg_compose(&interp->client_conn->ibuf,
-	    SERVEREVENT_NEW_INTERPRETER, 0, 0,
-	    interp->process.sequencer_read_pipe, "", 0);
+	ret = imsg_compose(&client_conn->ibuf, SERVEREVENT_NEW_INTERPRETER,
+	    0, 0, stream_pipe[0], "", 0);
 	if (ret == -1) {
-		warnx("sending interpreter pipe to client (for sequencer)");
-		return 1;
+		warnx("sending cached stream pipe to client (for sequencer)");
+		goto error;
 	}
+	client_conn->pending_writes = 1;
 
-	interp->client_conn->pending_writes = 1;
-
-	/*
-	 * Client should now pass the sequencer read pipe to sequencer
-	 * through its own client <-> sequencer communication socket.
-	 */
+	writer->entry = entry;
+	writer->fd = stream_pipe[1];
+	writer->offset = 0;
+	TAILQ_INSERT_TAIL(&pool->writers, writer, tq);
 
 	return 0;
+
+error:
+	if (close(stream_pipe[0]) == -1)
+		warn("closing cached stream pipe");
+	if (close(stream_pipe[1]) == -1)
+		warn("closing cached stream pipe");
+	_mdl_streamcache_release(entry);
+	free(writer->patch);
+	free(writer);
+
+	return 1;
+}
+
+static void
+write_cached_stream(struct interpreter_pool *pool,
+    struct stream_writer *writer)
+{
+	const u_int8_t *stream;
+	size_t size;
+	ssize_t nw;
+
+	if (writer->patch != NULL) {
+		stream = writer->patch;
+		size = writer->patch_size;
+	} else {
+		stream = (const u_int8_t *) writer->entry->stream;
+		size = writer->entry->stream_size;
+	}
+
+	nw = write(writer->fd, stream + writer->offset,
+	    size - writer->offset);
+	if (nw == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		/* Sequencer may have moved on to some other song. */
+		_mdl_log(MDLLOG_CACHE, 0, "could not write cached stream\n");
+		drop_stream_writer(pool, writer);
+		return;
+	}
+
+	writer->offset += nw;
+	if (writer->offset == size) {
+		_mdl_log(MDLLOG_CACHE, 0, "wrote cached stream\n");
+		drop_stream_writer(pool, writer);
+	}
 }
 
+static void
+drop_stream_writer(struct interpreter_pool *pool,
+    struct stream_writer *writer)
+{
+	if (close(writer->fd) == -1)
+		warn("closing cached stream pipe");
+	_mdl_streamcache_release(writer->entry);
+	TAILQ_REMOVE(&pool->writers, writer, tq);
+	free(writer->patch);
+	free(writer);
+}
+
+/*
+ * Sequencer tells only which tracks the song it plays has, anything else
+ * should not happen.
+ */
 static int
-mdld_handle_sequencer_events(struct sequencer_connection *seq_conn)
+mdld_handle_sequencer_events(struct interpreter_pool *pool)
 {
+	struct sequencer_connection *seq_conn;
+	struct imsg imsg;
+	u_int8_t *song_tracks;
+	size_t size;
 	ssize_t nr;
+	int retvalue;
+
+	seq_conn = pool->seq_conn;
 
 	if ((nr = imsg_read(&seq_conn->ibuf)) == -1) {
 		if (errno == EAGAIN)
@@ -519,31 +990,67 @@ mdld_handle_sequencer_events(struct sequencer_connection *seq_conn)
 		return 1;
 	}
 
-	warnx("received sequencer events on server, this should not happen");
+	retvalue = 0;
 
-	return 1;
+	while (retvalue == 0) {
+		if ((nr = imsg_get(&seq_conn->ibuf, &imsg)) == -1) {
+			warnx("error in imsg_get for sequencer connection");
+			return 1;
+		}
+		if (nr == 0)
+			break;
+
+		if (imsg.hdr.type != SEQEVENT_SONG_TRACKS) {
+			warnx("received sequencer events on server, this"
+			    " should not happen");
+			imsg_free(&imsg);
+			return 1;
+		}
+
+		size = imsg.hdr.len - IMSG_HEADER_SIZE;
+		song_tracks = NULL;
+		if (size > 0 && (song_tracks = malloc(size)) == NULL) {
+			warn("malloc in mdld_handle_sequencer_events");
+			retvalue = 1;
+		} else if (size > 0) {
+			memcpy(song_tracks, imsg.data, size);
+		}
+
+		_mdl_log(MDLLOG_IPC, 0,
+		    "received %zu bytes of song tracks from sequencer\n",
+		    size);
+
+		free(pool->song_tracks);
+		pool->song_tracks = song_tracks;
+		pool->song_tracks_size = (song_tracks != NULL) ? size : 0;
+
+		imsg_free(&imsg);
+	}
+
+	return retvalue;
 }
 
 static void
-drop_client(struct client_connection *client_conn, struct clientlist *clients,
-    struct interpreter_handler *interp)
+drop_client(struct client_connection *client_conn, struct clientlist *clients)
 {
-	if (interp->client_conn == client_conn)
-		interp->client_conn = NULL;
-
 	imsg_clear(&client_conn->ibuf);
 	if (close(client_conn->socket) == -1)
 		warn("error closing client connection");
+	if (client_conn->seq_socket >= 0 &&
+	    close(client_conn->seq_socket) == -1)
+		warn("error closing client <-> sequencer connection");
 	TAILQ_REMOVE(clients, client_conn, tq);
 	free(client_conn);
 }
 
 static int
 handle_client_events(struct client_connection *client_conn,
-    struct interpreter_handler *interp, struct clientlist *clients)
+    struct interpreter_pool *pool, struct clientlist *clients)
 {
 	enum mdl_event event;
 	struct imsg imsg;
+	const char *data;
+	size_t data_size;
 	ssize_t nr;
 	int ret, retvalue;
 
@@ -551,66 +1058,235 @@ handle_client_events(struct client_connection *client_conn,
 		if (errno == EAGAIN)
 			return 0;
 		warnx("error in imsg_read");
-		drop_client(client_conn, clients, interp);
+		drop_client(client_conn, clients);
 		return 1;
 	}
 
 	if (nr == 0) {
-		drop_client(client_conn, clients, interp);
+		drop_client(client_conn, clients);
 		return 0;
 	}
 
-	if ((nr = imsg_get(&client_conn->ibuf, &imsg)) == -1) {
-		warnx("error in imsg_get, dropping client");
-		drop_client(client_conn, clients, interp);
+	retvalue = 0;
+
+	/* A client may send several events before it disconnects. */
+	for (;;) {
+		if ((nr = imsg_get(&client_conn->ibuf, &imsg)) == -1) {
+			warnx("error in imsg_get, dropping client");
+			drop_client(client_conn, clients);
+			return 1;
+		}
+		if (nr == 0)
+			break;
+
+		data_size = imsg.hdr.len - IMSG_HEADER_SIZE;
+		data = (data_size > 0) ? imsg.data : NULL;
+
+		event = imsg.hdr.type;
+		switch (event) {
+		case CLIENTEVENT_NEW_MUSICFD:
+			/*
+			 * Names of tracks to replace may come with the
+			 * music file.  Such a client plays no music of its
+			 * own, so it does not take the place of the one
+			 * that does.
+			 */
+			ret = 0;
+			if (data == NULL)
+				ret = pass_client_to_sequencer(client_conn,
+				    pool->seq_conn);
+			if (ret == 0)
+				ret = handle_musicfd_event(client_conn, pool,
+				    imsg.fd, data, data_size, 0);
+			else if (imsg.fd >= 0 && close(imsg.fd) == -1)
+				warn("closing musicfile descriptor");
+			if (ret != 0) {
+				warnx("error handling CLIENTEVENT_NEW_MUSICFD"
+				    " event");
+				retvalue = 1;
+			}
+			break;
+		case CLIENTEVENT_QUEUE_SONG:
+			/* Music file for the song after the current one. */
+			ret = pass_client_to_sequencer(client_conn,
+			    pool->seq_conn);
+			if (ret == 0)
+				ret = handle_musicfd_event(client_conn, pool,
+				    imsg.fd, NULL, 0, 1);
+			else if (imsg.fd >= 0 && close(imsg.fd) == -1)
+				warn("closing musicfile descriptor");
+			if (ret != 0) {
+				warnx("error handling CLIENTEVENT_QUEUE_SONG"
+				    " event");
+				retvalue = 1;
+			}
+			break;
+		case CLIENTEVENT_NEW_SONG:
+			warnx("server received a new song event from client");
+			retvalue = 1;
+			break;
+		case CLIENTEVENT_REPLACE_SONG:
+			warnx("server received a replace song event from"
+			    " client");
+			retvalue = 1;
+			break;
+		case CLIENTEVENT_REPLACE_TRACKS:
+			ret = handle_replace_tracks_event(pool->seq_conn,
+			    imsg.fd, data, data_size);
+			if (ret != 0) {
+				warnx("error handling a replace tracks event");
+				retvalue = 1;
+			}
+			break;
+		case CLIENTEVENT_MUTE_TRACK:
+		case CLIENTEVENT_SOLO_TRACK:
+		case CLIENTEVENT_UNMUTE_TRACK:
+			ret = handle_trackmode_event(pool->seq_conn, event,
+			    data, data_size);
+			if (ret != 0) {
+				warnx("error handling a track mode event");
+				retvalue = 1;
+			}
+			break;
+		case SEQEVENT_SONG_END:
+		case SEQEVENT_SONG_TRACKS:
+			warnx("server received a sequencer event from client");
+			retvalue = 1;
+			break;
+		case SERVEREVENT_NEW_CLIENT:
+		case SERVEREVENT_NEW_INTERPRETER:
+			warnx("server received a server event from client");
+			retvalue = 1;
+			break;
+		default:
+			warnx("unknown event received from client");
+			retvalue = 1;
+		}
+
+		imsg_free(&imsg);
+	}
+
+	return retvalue;
+}
+
+/*
+ * Pass a track mode event to sequencer.  Clients send these to server
+ * when they have no music to play, so that sequencer keeps sending
+ * events such as SEQEVENT_SONG_END to the client that plays music.
+ */
+static int
+handle_trackmode_event(struct sequencer_connection *seq_conn,
+    enum mdl_event event, const char *track, size_t track_size)
+{
+	int ret;
+
+	if (_mdl_check_tracknames(track, track_size) != 0)
+		return 1;
+	if (strlen(track) + 1 != track_size) {
+		warnx("received more than one track name");
 		return 1;
 	}
 
-	if (nr == 0)
-		return 0;
+	_mdl_log(MDLLOG_IPC, 0,
+	    "passing track command for \"%s\" to sequencer\n", track);
 
-	retvalue = 0;
+	ret = imsg_compose(&seq_conn->ibuf, event, 0, 0, -1, track,
+	    track_size);
+	if (ret == -1) {
+		warnx("error sending track command to sequencer");
+		return 1;
+	}
+	seq_conn->pending_writes = 1;
 
-	event = imsg.hdr.type;
-	switch (event) {
-	case CLIENTEVENT_NEW_MUSICFD:
-		ret = handle_musicfd_event(client_conn, interp, imsg.fd);
-		if (ret != 0) {
-			warnx("error handling CLIENTEVENT_NEW_MUSICFD event");
-			retvalue = 1;
-		}
-		break;
-	case CLIENTEVENT_NEW_SONG:
-		warnx("server received a new song event from client");
-		retvalue = 1;
-		break;
-	case CLIENTEVENT_REPLACE_SONG:
-		warnx("server received a replace song event from client");
-		retvalue = 1;
-		break;
-	case SEQEVENT_SONG_END:
-		warnx("server received a sequencer event from client");
-		retvalue = 1;
-		break;
-	case SERVEREVENT_NEW_CLIENT:
-	case SERVEREVENT_NEW_INTERPRETER:
-		warnx("server received a server event from client");
-		retvalue = 1;
-		break;
-	default:
-		warnx("unknown event received from client");
-		retvalue = 1;
+	return 0;
+}
+
+/*
+ * Pass the interpreter pipe for tracks that replace those of the playing
+ * song to sequencer.  These come through server for the same reason as
+ * track mode events.
+ */
+static int
+handle_replace_tracks_event(struct sequencer_connection *seq_conn,
+    int interp_fd, const char *tracks, size_t tracks_size)
+{
+	int ret;
+
+	if (interp_fd == -1) {
+		warnx("no interpreter pipe received when expected");
+		return 1;
 	}
 
-	imsg_free(&imsg);
+	if (_mdl_check_tracknames(tracks, tracks_size) != 0) {
+		if (close(interp_fd) == -1)
+			warn("closing interpreter pipe");
+		return 1;
+	}
 
-	return retvalue;
+	_mdl_log(MDLLOG_IPC, 0,
+	    "passing interpreter pipe for replaced tracks to sequencer\n");
+
+	ret = imsg_compose(&seq_conn->ibuf, CLIENTEVENT_REPLACE_TRACKS, 0, 0,
+	    interp_fd, tracks, tracks_size);
+	if (ret == -1) {
+		warnx("error sending replaced tracks to sequencer");
+		if (close(interp_fd) == -1)
+			warn("closing interpreter pipe");
+		return 1;
+	}
+	seq_conn->pending_writes = 1;
+
+	return 0;
+}
+
+/*
+ * Give sequencer the client end of the client <-> sequencer connection,
+ * unless it has been given already.  Sequencer then takes music from
+ * this client and tells it when songs end.
+ */
+static int
+pass_client_to_sequencer(struct client_connection *client_conn,
+    struct sequencer_connection *seq_conn)
+{
+	int ret;
+
+	if (client_conn->seq_socket == -1)
+		return 0;
+
+	_mdl_log(MDLLOG_IPC, 0,
+	    "sending client-sequencer socket to sequencer\n");
+
+	ret = imsg_compose(&seq_conn->ibuf, SERVEREVENT_NEW_CLIENT, 0, 0,
+	    client_conn->seq_socket, "", 0);
+	if (ret == -1) {
+		warnx("error sending client-sequencer socket to sequencer");
+		return 1;
+	}
+	client_conn->seq_socket = -1;
+	seq_conn->pending_writes = 1;
+
+	return 0;
 }
 
+/*
+ * Pass musicfile_fd to an interpreter, or send its stream from cache.  If
+ * tracks is not NULL, interpreter should send only the tracks named in it
+ * to sequencer.  If queued is set, the song plays after the current one,
+ * so music that is being sent to sequencer is still wanted, and the song
+ * is not sent as a patch against the current one.
+ */
 static int
 handle_musicfd_event(struct client_connection *client_conn,
-    struct interpreter_handler *interp, int musicfile_fd)
+    struct interpreter_pool *pool, int musicfile_fd, const char *tracks,
+    size_t tracks_size, int queued)
 {
+	struct interpreter_worker *worker;
+	struct stream_writer *writer;
+	struct streamcache_entry *entry;
+	char *source;
+	size_t source_size;
+	int ret, retvalue;
+
 	if (musicfile_fd == -1) {
 		warnx("no music descriptor received when expected");
 		return 1;
@@ -618,28 +1294,117 @@ handle_musicfd_event(struct client_connection *client_conn,
 
 	_mdl_log(MDLLOG_IPC, 0, "received a new musicfile descriptor\n");
 
-	if (interp->is_active) {
-		if (kill(interp->process.pid, SIGTERM) == -1) {
+	if (tracks != NULL &&
+	    _mdl_check_tracknames(tracks, tracks_size) != 0) {
+		if (close(musicfile_fd) == -1)
+			warn("closing musicfile descriptor");
+		return 1;
+	}
+
+	retvalue = 0;
+
+	/* Music from the previous interpreter is no longer wanted. */
+	TAILQ_FOREACH(worker, &pool->busy, tq) {
+		if (queued || worker->terminated)
+			continue;
+		if (kill(worker->process.pid, SIGTERM) == -1 &&
+		    errno != ESRCH) {
 			warn("error killing the current interpreter");
-			return 1;
+			retvalue = 1;
+			goto finish;
 		}
 		_mdl_log(MDLLOG_IPC, 0,
 		    "sent SIGTERM to interpreter process\n");
+		worker->terminated = 1;
 	}
+	while (!queued && (writer = TAILQ_FIRST(&pool->writers)) != NULL)
+		drop_stream_writer(pool, writer);
 
-	if (interp->next_musicfile_fd >= 0 &&
-	    close(interp->next_musicfile_fd) == -1)
-		warn("closing previous next musicfile descriptor");
+	/*
+	 * Music that has been interpreted before needs no interpreter.
+	 * Tracks are replaced because music has changed, so those are not
+	 * looked up, but the whole song is cached as usual.
+	 */
+	source = read_musicfile_source(musicfile_fd, &source_size);
+	if (source != NULL && tracks == NULL) {
+		entry = _mdl_streamcache_lookup(&pool->cache, source,
+		    source_size);
+		if (entry != NULL) {
+			free(source);
+			retvalue = send_cached_stream(client_conn, pool,
+			    entry, queued);
+			goto finish;
+		}
+	}
 
-	interp->client_conn = client_conn;
-	interp->next_musicfile_fd = musicfile_fd;
+	/* Normally there is an idle interpreter, but fork one if not. */
+	if (pool->idle_count == 0 && fill_interpreter_pool(pool) != 0) {
+		free(source);
+		retvalue = 1;
+		goto finish;
+	}
 
-	return 0;
+	worker = TAILQ_FIRST(&pool->idle);
+	assert(worker != NULL);
+	TAILQ_REMOVE(&pool->idle, worker, tq);
+	pool->idle_count -= 1;
+	TAILQ_INSERT_TAIL(&pool->busy, worker, tq);
+
+	ret = _mdl_interpreter_send_musicfile(&worker->process, musicfile_fd,
+	    (source != NULL), tracks, tracks_size,
+	    (queued ? NULL : pool->song_tracks),
+	    (queued ? 0 : pool->song_tracks_size));
+	if (ret != 0) {
+		warnx("could not pass music file to interpreter");
+		if (close(worker->process.sequencer_read_pipe) == -1)
+			warn("closing interpreter pipe");
+		free(source);
+		retvalue = 1;
+		goto finish;
+	}
+
+	if (source != NULL) {
+		/* Interpreter returns the midi stream for caching. */
+		worker->source = source;
+		worker->source_size = source_size;
+		if (fcntl(worker->process.control_socket, F_SETFL,
+		    O_NONBLOCK) == -1) {
+			warn("could not set interpreter control socket"
+			    " non-blocking");
+			finish_interpreter_stream(pool, worker, 0);
+		}
+	}
+
+	_mdl_log(MDLLOG_IPC, 0,
+	    "sending interpreter pipe to client (for sequencer)\n");
+
+	ret = imsg_compose(&client_conn->ibuf, SERVEREVENT_NEW_INTERPRETER,
+	    0, 0, worker->process.sequencer_read_pipe, "", 0);
+	if (ret == -1) {
+		warnx("sending interpreter pipe to client (for sequencer)");
+		if (close(worker->process.sequencer_read_pipe) == -1)
+			warn("closing interpreter pipe");
+		retvalue = 1;
+		goto finish;
+	}
+
+	client_conn->pending_writes = 1;
+
+	/*
+	 * Client should now pass the sequencer read pipe to sequencer
+	 * through its own client <-> sequencer communication socket.
+	 */
+
+finish:
+	if (close(musicfile_fd) == -1)
+		warn("closing musicfile descriptor");
+
+	return retvalue;
 }
 
 static int
 accept_new_client_connection(struct client_connection **new_client_conn,
-    struct sequencer_connection *seq_conn, int server_socket)
+    int server_socket)
 {
 	struct client_connection *client_conn;
 	struct sockaddr_storage socket_addr;
@@ -686,14 +1451,9 @@ accept_new_client_connection(struct client_connection **new_client_conn,
 	cs_sp[0] = -1;
 	client_conn->pending_writes = 1;
 
-	ret = imsg_compose(&seq_conn->ibuf, SERVEREVENT_NEW_CLIENT, 0, 0,
-	    cs_sp[1], "", 0);
-	if (ret == -1) {
-		warnx("error sending client-sequencer socket to sequencer");
-		goto error;
-	}
+	/* Sequencer gets its end with the first music file of client. */
+	client_conn->seq_socket = cs_sp[1];
 	cs_sp[1] = -1;
-	seq_conn->pending_writes = 1;
 
 	*new_client_conn = client_conn;
 